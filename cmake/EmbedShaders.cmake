@@ -0,0 +1,25 @@
+# Compiles shader sources into the binary as string literals, so it no longer depends on the
+# working directory. The header is regenerated whenever one of the shaders changes.
+function(EmbedShaders TARGET HEADER)
+    set(generatedDir ${CMAKE_CURRENT_BINARY_DIR}/generated)
+    set(inputs "")
+
+    foreach(SHADER ${ARGN})
+        list(APPEND inputs ${CMAKE_CURRENT_SOURCE_DIR}/${SHADER})
+    endforeach()
+
+    # A list would be split into separate arguments of the command
+    string(REPLACE ";" "|" inputArgument "${inputs}")
+
+    add_custom_command(
+        OUTPUT ${generatedDir}/${HEADER}
+        COMMAND ${CMAKE_COMMAND} -DOUTPUT=${generatedDir}/${HEADER} -DSHADERS=${inputArgument} -P ${CMAKE_DIR}/GenerateShaderHeader.cmake
+        DEPENDS ${inputs} ${CMAKE_DIR}/GenerateShaderHeader.cmake
+        COMMENT "Embedding shaders into ${HEADER}"
+        VERBATIM
+    )
+
+    target_sources(${TARGET} PRIVATE ${generatedDir}/${HEADER})
+    target_include_directories(${TARGET} PRIVATE ${generatedDir})
+    target_compile_definitions(${TARGET} PRIVATE VORONOIABLE_EMBEDDED_SHADERS)
+endfunction()
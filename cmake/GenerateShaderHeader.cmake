@@ -0,0 +1,18 @@
+# Script run by EmbedShaders at build time:
+#   cmake -DOUTPUT=<header> -DSHADERS=<shader>|<shader>... -P GenerateShaderHeader.cmake
+string(REPLACE "|" ";" shaders "${SHADERS}")
+
+set(content "// Generated by cmake/GenerateShaderHeader.cmake, edit the shaders instead\n#pragma once\n\n")
+string(APPEND content "struct EmbeddedShader {\n    const char * name;\n    const char * source;\n};\n\n")
+string(APPEND content "const EmbeddedShader embeddedShaders[] = {\n")
+
+foreach(SHADER ${shaders})
+    get_filename_component(name ${SHADER} NAME)
+    file(READ ${SHADER} source)
+
+    string(APPEND content "    { \"${name}\", R\"shader_source(${source})shader_source\" },\n")
+endforeach()
+
+string(APPEND content "};\n")
+
+file(WRITE ${OUTPUT} "${content}")
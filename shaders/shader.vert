@@ -5,9 +5,12 @@ layout (location = 1) in vec3 inputColor;
 
 layout (location = 1) out vec3 colorOutput;
 
+uniform vec2 viewCenter;
+uniform vec2 viewScale;
+
 void main()
 {
-    gl_Position = vec4(aPos.x, aPos.y, 1.0, 1.0);
+    gl_Position = vec4((aPos - viewCenter) * viewScale, 1.0, 1.0);
 
     colorOutput.x = inputColor.x;
     colorOutput.y = inputColor.y;
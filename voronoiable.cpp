@@ -5,1071 +5,10516 @@
 #include <string>
 #include <limits>
 #include <optional>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <csignal>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <unordered_map>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <cassert>
 
-
-struct Color {
-    GLfloat r;
-    GLfloat g;
-    GLfloat b;
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VORONOIABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef VORONOIABLE_PROFILING
+#include <map>
+#include <memory>
+#include <new>
+#endif
+
+#ifdef VORONOIABLE_EMBEDDED_SHADERS
+#include "embedded_shaders.h"
+#endif
+
+
+// Per-stage timers and counters, compiled in with -DENABLE_PROFILING=ON.
+// Without it every PROFILE_* macro expands to nothing.
+#ifdef VORONOIABLE_PROFILING
+
+enum class ProfileCounter : size_t {
+    PointInTriangleTests,
+    LineIntersectionTests,
+    TriangleIntersectionTests,
+    RejectedVoronoiTriangles,
+    Allocations,
+    AllocatedBytes,
+    Count
 };
 
 
-struct PointData {
-    GLfloat x;
-    GLfloat y;
+const char * const profileCounterNames[] = {
+    "point in triangle tests",
+    "line intersection tests",
+    "triangle intersection tests",
+    "rejected voronoi triangles",
+    "allocations",
+    "allocated bytes",
 };
 
 
-struct Point {
-    PointData pointData;
-    Color color;
-};
+static_assert(sizeof(profileCounterNames) / sizeof(profileCounterNames[0]) == (size_t)ProfileCounter::Count);
 
 
-struct TriangleData {
-    PointData pd1;
-    PointData pd2;
-    PointData pd3;
+// Plain atomics so that they can be bumped from operator new before anything else is initialized
+std::atomic<uint64_t> profileCounters[(size_t)ProfileCounter::Count] = {};
+
+
+struct ProfileEvent {
+    const char * name;
+    uint64_t startNs;
+    uint64_t durationNs;
 };
 
 
-struct Triangle {
-    TriangleData triangleData;
-    Color color;
+struct ProfileThreadBuffer {
+    uint32_t threadId;
+    std::vector<ProfileEvent> events;
 };
 
 
-struct LineEq {
-    union {
-		GLfloat a;
-        GLfloat x;
-    };
-    GLfloat b;
-    bool isVertical = false;
+struct Profiler {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::mutex buffersMutex;
+    std::vector<std::unique_ptr<ProfileThreadBuffer>> buffers;
 };
 
 
-bool FloatsEqual(const GLfloat & f1, const GLfloat & f2) {
-    const auto constexpr epsilon = std::numeric_limits<GLfloat>().epsilon();
+Profiler& GetProfiler() {
+    static Profiler profiler;
 
-    return std::fabs(f1 - f2) < epsilon * 3;
+    return profiler;
 }
 
 
-bool FloatsBiggerOrEqual(const GLfloat & f1, const GLfloat & f2) {
-    return f1 > f2 || FloatsEqual(f1, f2);
+uint64_t ProfileNowNs() {
+    const auto elapsed = std::chrono::steady_clock::now() - GetProfiler().start;
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
 }
 
 
-bool FloatsLessOrEqual(const GLfloat & f1, const GLfloat & f2) {
-    return f1 < f2 || FloatsEqual(f1, f2);
-}
+ProfileThreadBuffer& GetProfileThreadBuffer() {
+    // Buffers are owned by the profiler so events survive the thread that recorded them
+    thread_local ProfileThreadBuffer* buffer = nullptr;
 
+    if (buffer == nullptr) {
+        Profiler& profiler = GetProfiler();
+        std::lock_guard<std::mutex> lock(profiler.buffersMutex);
 
-bool PointsDataEqual(const PointData & pd1, const PointData & pd2) {
-    /*
-    std::cout << "points data equal " << '\n';
-    std::cout << "p1 x: " << pd1.x << " y: " << pd1.y << '\n';
-    std::cout << "p2 x: " << pd2.x << " y: " << pd2.y << '\n';
-    std::cout << "output " << FloatsEqual(pd1.x, pd2.x) << " " << FloatsEqual(pd1.y, pd2.y) << " " << (FloatsEqual(pd1.x, pd2.x) && FloatsEqual(pd1.y, pd2.y)) <<std::endl;
-    */
+        profiler.buffers.push_back(std::make_unique<ProfileThreadBuffer>());
+        buffer = profiler.buffers.back().get();
+        buffer->threadId = (uint32_t)profiler.buffers.size();
+        buffer->events.reserve(4096);
+    }
 
-    return FloatsEqual(pd1.x, pd2.x) && FloatsEqual(pd1.y, pd2.y);
+    return *buffer;
 }
 
 
-GLfloat CalculateDistance(const PointData& pd1, const PointData& pd2) {
-    return std::sqrtf(std::powf(pd1.x - pd2.x, 2) + std::powf(pd1.y - pd2.y, 2));
+void AddProfileCount(const ProfileCounter counter, const uint64_t amount) {
+    profileCounters[(size_t)counter].fetch_add(amount, std::memory_order_relaxed);
 }
 
 
-LineEq GetLineEquation(const PointData & p1, const PointData & p2){
-    LineEq output = {};
+struct ProfileScope {
+    const char * name;
+    uint64_t startNs;
 
-    if (FloatsEqual(p1.x, p2.x)) {
-        output.isVertical = true;
-        output.x = p1.x;
-        return output;
-    }
+    explicit ProfileScope(const char * scopeName) : name(scopeName), startNs(ProfileNowNs()) {}
 
-    output.a = (p1.y - p2.y) / (p1.x - p2.x);
-    output.b = p1.y - output.a * p1.x;
+    ~ProfileScope() {
+        const uint64_t endNs = ProfileNowNs();
 
-    return output;
-}
+        GetProfileThreadBuffer().events.push_back({ name, startNs, endNs - startNs });
+    }
 
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
 
-PointData GetIntersectionPoint(const LineEq& le1, const LineEq& le2) {
-    PointData output = {};
 
-    if (le1.isVertical) {
-        output.x = le1.x;
-		output.y = output.x * le2.a + le2.b;
-    }
-    else if (le2.isVertical) {
-        output.x = le2.x;
-		output.y = output.x * le1.a + le1.b;
-    }
-    else {
-		output.x = (le2.b - le1.b) / (le1.a - le2.a);
-		output.y = output.x * le1.a + le1.b;
+void* operator new(std::size_t size) {
+    AddProfileCount(ProfileCounter::Allocations, 1);
+    AddProfileCount(ProfileCounter::AllocatedBytes, size);
+
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
     }
 
-    return output;
+    throw std::bad_alloc();
 }
 
 
-LineEq GetPerpendicularLine(const LineEq& lineEq, const PointData& intersectionPoint) {
-    LineEq perpendicularLine = {};
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
 
-    if (lineEq.isVertical) {
-        perpendicularLine.a = 0;
-        perpendicularLine.b = intersectionPoint.y;
-    }
-    else if (FloatsEqual(lineEq.a, 0.0f)) {
-        perpendicularLine.isVertical = true;
-        perpendicularLine.x = intersectionPoint.x;
-    }
-    else {
-		perpendicularLine.a = -1.0f / lineEq.a;
-		perpendicularLine.b = intersectionPoint.y - intersectionPoint.x * perpendicularLine.a;
-    }
 
-    return perpendicularLine;
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
 }
 
 
-GLfloat CalculatePointToLineDistance(const PointData & pointData, const LineEq & lineEquation) {
-    const auto perpendicularLine = GetPerpendicularLine(lineEquation, pointData);
+void WriteJsonString(FILE* file, const char * text) {
+    fputc('"', file);
 
-    const PointData intersectionPoint = GetIntersectionPoint(lineEquation, perpendicularLine);
+    for (const char * c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', file);
+        fputc(*c, file);
+    }
 
-    return CalculateDistance(pointData, intersectionPoint);
+    fputc('"', file);
 }
 
 
-GLfloat GetTriangleArea(const PointData & p1, const PointData & p2, const PointData & p3) {
-    const LineEq line = GetLineEquation(p1, p2);
+// Writes everything recorded so far in the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+// Call it once worker threads have finished, buffers are not synchronized with writers.
+bool WriteProfileTrace(const char * fileName) {
+    FILE* file = fopen(fileName, "w");
 
-    const GLfloat a = CalculateDistance(p1, p2);
+    if (file == nullptr) {
+        fprintf(stderr, "failed to open trace file: %s\n", fileName);
+        return false;
+    }
 
-    const GLfloat h = CalculatePointToLineDistance(p3, line);
+    Profiler& profiler = GetProfiler();
+    std::lock_guard<std::mutex> lock(profiler.buffersMutex);
 
-    return (a * h) / 2.0f;
-}
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
 
+    bool first = true;
+    uint64_t lastNs = 0;
 
-PointData CalculateCenterOfGravity(const std::vector<PointData> & points) {
-    PointData sum = {0, 0};
+    for (const auto& buffer : profiler.buffers) {
+        for (const auto& event : buffer->events) {
+            fprintf(file, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"name\":", first ? "" : ",\n", buffer->threadId);
+            WriteJsonString(file, event.name);
+            fprintf(file, ",\"ts\":%.3f,\"dur\":%.3f}", event.startNs / 1000.0, event.durationNs / 1000.0);
 
-    for (const auto& point : points) {
-		sum.x += point.x;
-		sum.y += point.y;
+            lastNs = std::max(lastNs, event.startNs + event.durationNs);
+            first = false;
+        }
     }
 
-    return {
-        sum.x / (float)points.size(),
-        sum.y / (float)points.size(),
-    };
-}
+    for (size_t i = 0; i < (size_t)ProfileCounter::Count; i++) {
+        fprintf(file, "%s{\"ph\":\"C\",\"pid\":1,\"tid\":0,\"name\":", first ? "" : ",\n");
+        WriteJsonString(file, profileCounterNames[i]);
+        fprintf(file, ",\"ts\":%.3f,\"args\":{\"value\":%llu}}", lastNs / 1000.0, (unsigned long long)profileCounters[i].load());
 
+        first = false;
+    }
 
-bool IsPointInsideTriangle(const TriangleData& triangleData, const PointData& pointData) {
-    GLfloat wholeArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, triangleData.pd3);
+    fprintf(file, "\n]}\n");
+    fclose(file);
 
-    GLfloat firstArea = GetTriangleArea(pointData, triangleData.pd2, triangleData.pd3);
-    GLfloat secondArea = GetTriangleArea(triangleData.pd1, pointData, triangleData.pd3);
-    GLfloat thirdArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, pointData);
+    return true;
+}
 
-    bool doesPointLayOnTheEdge = FloatsEqual(firstArea, 0) || FloatsEqual(secondArea, 0) || FloatsEqual(thirdArea, 0);
 
-    bool result = !doesPointLayOnTheEdge && FloatsEqual(wholeArea, firstArea + secondArea + thirdArea);
+void PrintProfileSummary(FILE* file) {
+    struct StageStats {
+        uint64_t calls = 0;
+        uint64_t totalNs = 0;
+        uint64_t minNs = std::numeric_limits<uint64_t>::max();
+        uint64_t maxNs = 0;
+    };
 
-    return result;
-}
+    std::map<std::string, StageStats> stages = {};
+
+    {
+        Profiler& profiler = GetProfiler();
+        std::lock_guard<std::mutex> lock(profiler.buffersMutex);
 
+        for (const auto& buffer : profiler.buffers) {
+            for (const auto& event : buffer->events) {
+                StageStats& stats = stages[event.name];
 
-bool IsPointInsideTriangleOrOnTheEdge(const TriangleData& triangleData, const PointData& pointData) {
-    GLfloat wholeArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, triangleData.pd3);
+                stats.calls++;
+                stats.totalNs += event.durationNs;
+                stats.minNs = std::min(stats.minNs, event.durationNs);
+                stats.maxNs = std::max(stats.maxNs, event.durationNs);
+            }
+        }
+    }
 
-    GLfloat firstArea = GetTriangleArea(pointData, triangleData.pd2, triangleData.pd3);
-    GLfloat secondArea = GetTriangleArea(triangleData.pd1, pointData, triangleData.pd3);
-    GLfloat thirdArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, pointData);
+    fprintf(file, "%-32s %10s %12s %12s %12s %12s\n", "stage", "calls", "total ms", "mean ms", "min ms", "max ms");
+
+    for (const auto& [name, stats] : stages) {
+        fprintf(
+            file,
+            "%-32s %10llu %12.3f %12.3f %12.3f %12.3f\n",
+            name.c_str(),
+            (unsigned long long)stats.calls,
+            stats.totalNs / 1e6,
+            stats.totalNs / 1e6 / stats.calls,
+            stats.minNs / 1e6,
+            stats.maxNs / 1e6
+        );
+    }
 
-    bool result = FloatsEqual(wholeArea, firstArea + secondArea + thirdArea);
+    fprintf(file, "\n%-32s %10s\n", "counter", "value");
 
-    return result;
+    for (size_t i = 0; i < (size_t)ProfileCounter::Count; i++) {
+        fprintf(file, "%-32s %10llu\n", profileCounterNames[i], (unsigned long long)profileCounters[i].load());
+    }
 }
- 
 
-void PrintTrianglesData(const std::vector<TriangleData>& triangles) {
-    for (const auto& triangle : triangles) {
-        std::cout << "triangle" << std::endl;
 
-		std::cout << "p1 x: " << triangle.pd1.x << " y: " << triangle.pd1.y << " | ";
-		std::cout << "p2 x: " << triangle.pd2.x << " y: " << triangle.pd2.y << " | ";
-		std::cout << "p3 x: " << triangle.pd3.x << " y: " << triangle.pd3.y << " | ";
+// Writes the trace and the summary once main returns, from whichever mode it returns
+struct ProfileReport {
+    const char * traceFile;
+
+    explicit ProfileReport(const char * fileName) : traceFile(fileName) {}
 
-        std::cout << "" << std::endl;
+    ~ProfileReport() {
+        WriteProfileTrace(traceFile);
+        PrintProfileSummary(stdout);
     }
-}
- 
 
-void PrintTriangles(const std::vector<Triangle>& triangles) {
-    for (const auto& triangle : triangles) {
-        std::cout << "triangle" << std::endl;
+    ProfileReport(const ProfileReport&) = delete;
+    ProfileReport& operator=(const ProfileReport&) = delete;
+};
 
-		std::cout << "p1 x: " << triangle.triangleData.pd1.x << " y: " << triangle.triangleData.pd1.y << " | ";
-		std::cout << "p2 x: " << triangle.triangleData.pd2.x << " y: " << triangle.triangleData.pd2.y << " | ";
-		std::cout << "p3 x: " << triangle.triangleData.pd3.x << " y: " << triangle.triangleData.pd3.y << " | ";
 
-        std::cout << "" << std::endl;
-    }
-}
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_COUNT(counter) AddProfileCount(ProfileCounter::counter, 1)
+#define PROFILE_COUNT_ADD(counter, amount) AddProfileCount(ProfileCounter::counter, (amount))
+#define PROFILE_REPORT_ON_EXIT(traceFile) ProfileReport profileReport(traceFile)
 
+#else
 
-bool DoLinesIntersect(
-    const PointData& l1p1,
-    const PointData& l1p2,
-    const PointData& l2p1,
-    const PointData& l2p2
-) {
-    LineEq lineEq1 = GetLineEquation(l1p1, l1p2);
-    LineEq lineEq2 = GetLineEquation(l2p1, l2p2);
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_COUNT(counter) ((void)0)
+#define PROFILE_COUNT_ADD(counter, amount) ((void)0)
+#define PROFILE_REPORT_ON_EXIT(traceFile) ((void)0)
 
-    if (FloatsEqual(lineEq1.a, lineEq2.a)) {
-        if (FloatsEqual(lineEq1.b, lineEq2.b)) {
-            return true;
-        }
-        else {
-            return false;
-        }
-    }
+#endif
 
-    PointData intersectionPoint = GetIntersectionPoint(lineEq1, lineEq2);
 
-    GLfloat x1_first = std::fmin(l1p1.x, l1p2.x);
-    GLfloat x1_second = std::fmax(l1p1.x, l1p2.x);
+// Leveled logger. Callers format into a slot of a lock-free ring buffer and a background thread
+// does the actual writing, so logging never blocks on I/O. Levels above VORONOIABLE_LOG_MAX_LEVEL
+// (-DENABLE_DEBUG_LOGGING=ON raises it to trace) are compiled out, the rest are filtered at runtime
+// by the level taken from the VORONOIABLE_LOG_LEVEL environment variable (info by default).
+enum class LogLevel : int {
+    Error,
+    Warning,
+    Info,
+    Debug,
+    Trace
+};
 
-    GLfloat x2_first = std::fmin(l2p1.x, l2p2.x);
-    GLfloat x2_second = std::fmax(l2p1.x, l2p2.x);
 
-    bool isOnTheFirstLine = FloatsBiggerOrEqual(intersectionPoint.x, x1_first) && FloatsLessOrEqual(intersectionPoint.x, x1_second);
-    bool isOnTheSecondLine = FloatsBiggerOrEqual(intersectionPoint.x, x2_first) && FloatsLessOrEqual(intersectionPoint.x, x2_second);
+#ifndef VORONOIABLE_LOG_MAX_LEVEL
+#define VORONOIABLE_LOG_MAX_LEVEL 2
+#endif
 
-    bool isOneOfThePoints = PointsDataEqual(intersectionPoint, l1p1) ||
-        PointsDataEqual(intersectionPoint, l1p2) ||
-        PointsDataEqual(intersectionPoint, l2p1) ||
-        PointsDataEqual(intersectionPoint, l2p2);
 
-    // if the intersection point is one of the input points, they DO NOT intersect
+const char * const logLevelNames[] = { "error", "warning", "info", "debug", "trace" };
 
-    return  isOnTheFirstLine && isOnTheSecondLine && !isOneOfThePoints;
-}
 
+struct LogMessage {
+    std::atomic<size_t> sequence;
+    uint64_t timeNs;
+    LogLevel level;
+    char text[244];
+};
 
-bool DoTrianglesIntersect(const TriangleData& t1, const TriangleData& t2) {
-    const std::vector<PointData> points1 = {t1.pd1, t1.pd2, t1.pd3};
-    const std::vector<PointData> points2 = {t2.pd1, t2.pd2, t2.pd3};
 
-    for (const auto& point : points1) {
-        if (IsPointInsideTriangle(t2, point)) return true;
-    }
+struct Logger {
+    // Bounded MPSC queue (Vyukov): a slot is writable when sequence == position and readable when
+    // sequence == position + 1. When the writer falls behind callers yield for a while and then
+    // drop the message rather than block.
+    static constexpr size_t capacity = 4096;
 
-    for (const auto& point : points2) {
-        if (IsPointInsideTriangle(t1, point)) return true;
-    }
+    LogMessage messages[capacity];
 
-    const std::vector<std::pair<PointData, PointData>> linesT1 = {
-        {t1.pd1, t1.pd2},
-        {t1.pd2, t1.pd3},
-        {t1.pd3, t1.pd1}
-    };
+    alignas(64) std::atomic<size_t> enqueuePosition = 0;
+    alignas(64) size_t dequeuePosition = 0;
 
-    const std::vector<std::pair<PointData, PointData>> linesT2 = {
-        {t2.pd1, t2.pd2},
-        {t2.pd2, t2.pd3},
-        {t2.pd3, t2.pd1}
-    };
+    std::atomic<int> level = (int)LogLevel::Info;
+    std::atomic<uint64_t> droppedMessages = 0;
+    std::atomic<bool> running = false;
 
-    uint32_t linesIntersecting = 0;
+    std::once_flag startFlag;
+    std::thread writer;
+    FILE* output = stderr;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-    for (const auto& line1 : linesT1) {
-        for (const auto& line2 : linesT2) {
-            if (DoLinesIntersect(line1.first, line1.second, line2.first, line1.second)) {
-                linesIntersecting++;
-            }
+    Logger() {
+        for (size_t i = 0; i < capacity; i++) {
+            messages[i].sequence.store(i, std::memory_order_relaxed);
         }
     }
+};
 
-    return linesIntersecting >= 3;
-}
-std::optional<TriangleData> FindBestTriangle(
-    const PointData& point,
-    const std::vector<PointData>& points,
-    const std::vector<TriangleData>& currentTriangles
-) {
-    GLfloat initialArea = 2 * 2;
-    GLfloat currentBestArea = initialArea;
 
-    std::pair<PointData, PointData> currentBest = {};
+static_assert((Logger::capacity & (Logger::capacity - 1)) == 0, "logger capacity has to be a power of two");
 
-    for (size_t i = 0; i < points.size(); i++) {
 
-        size_t point_1_index = i;
-        size_t point_2_index = i == points.size() - 1 ? 0 : i + 1;
+Logger& GetLogger() {
+    static Logger logger;
 
-        const PointData& currentP1 = points[point_1_index];
-        const PointData& currentP2 = points[point_2_index];
+    return logger;
+}
 
-        bool intersect = false;
 
-        for (const auto& triangle : currentTriangles) {
-            if (DoTrianglesIntersect(triangle, { point, currentP1, currentP2 })) {
-                intersect = true;
-            }
-        }
+std::optional<LogLevel> ParseLogLevel(const char * name) {
+    for (int i = 0; i <= (int)LogLevel::Trace; i++) {
+        if (strcmp(name, logLevelNames[i]) == 0) return (LogLevel)i;
+    }
+
+    return std::nullopt;
+}
 
-        if (intersect) continue;
 
-        GLfloat area = GetTriangleArea(point, currentP1, currentP2);
+bool IsLogLevelEnabled(const LogLevel level) {
+    return (int)level <= VORONOIABLE_LOG_MAX_LEVEL && (int)level <= GetLogger().level.load(std::memory_order_relaxed);
+}
 
-        if (area < currentBestArea) {
-            currentBestArea = area;
-            currentBest.first = currentP1;
-            currentBest.second = currentP2;
-        }
-    }
 
-    if (!FloatsEqual(currentBestArea, initialArea)) {
-        return std::make_optional<TriangleData>({
-            point,
-            currentBest.first,
-            currentBest.second
-        });
+void SetLogLevel(const LogLevel level) {
+    if ((int)level > VORONOIABLE_LOG_MAX_LEVEL) {
+        fprintf(stderr, "log level %s is compiled out, rebuild with -DENABLE_DEBUG_LOGGING=ON\n", logLevelNames[(int)level]);
     }
 
-    return std::nullopt;
+    GetLogger().level.store((int)level, std::memory_order_relaxed);
 }
 
 
-std::vector<TriangleData> ExtractTriangles(const std::vector<Point> & points) {
-	std::vector<Point> pointsCopy(points);
+// Moves everything queued so far to the output, returns the number of messages written
+size_t DrainLogMessages(Logger& logger) {
+    char batch[16384];
+    size_t batchSize = 0;
+    size_t written = 0;
 
-    // easier version - triangles
+    while (true) {
+        LogMessage& message = logger.messages[logger.dequeuePosition & (Logger::capacity - 1)];
 
-    // for every point find best two points to create triangle
+        if (message.sequence.load(std::memory_order_acquire) != logger.dequeuePosition + 1) break;
 
-    std::vector<PointData> pointsData = {};
+        char line[320];
+        const int length = snprintf(
+            line,
+            sizeof(line),
+            "[%9.3f] [%s] %s\n",
+            message.timeNs / 1e9,
+            logLevelNames[(int)message.level],
+            message.text
+        );
 
-    for (const Point& point : pointsCopy) {
-        pointsData.push_back(point.pointData);
-    }
+        message.sequence.store(logger.dequeuePosition + Logger::capacity, std::memory_order_release);
+        logger.dequeuePosition++;
+        written++;
 
-    std::vector<TriangleData> triangles = {};
+        const size_t lineSize = std::min((size_t)std::max(length, 0), sizeof(line) - 1);
 
-    std::optional<TriangleData> triangle = {};
+        if (batchSize + lineSize > sizeof(batch)) {
+            fwrite(batch, 1, batchSize, logger.output);
+            batchSize = 0;
+        }
 
-    for (size_t i = 0; i < pointsData.size(); i++) {
-        const auto& point = pointsData[i];
+        memcpy(batch + batchSize, line, lineSize);
+        batchSize += lineSize;
+    }
 
-		std::vector<PointData> otherPoints = pointsData;
-		otherPoints.erase(otherPoints.begin() + i);
+    if (batchSize > 0) {
+        fwrite(batch, 1, batchSize, logger.output);
+        fflush(logger.output);
+    }
 
-        do {
-			triangle = FindBestTriangle(point, otherPoints, triangles);
+    return written;
+}
 
-            if (triangle.has_value()) {
-                triangles.push_back(triangle.value());
 
-            }
-        } while (triangle.has_value());
+void RunLogWriter(Logger* logger) {
+    while (logger->running.load(std::memory_order_acquire)) {
+        if (DrainLogMessages(*logger) == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
     }
 
-    return triangles;
+    DrainLogMessages(*logger);
 }
 
 
-PointData GetCenterOfLine(const PointData& p1, const PointData& p2) {
-    return { (p1.x + p2.x) / 2.0f, (p1.y + p2.y) / 2.0f};
-}
+void StopLogger() {
+    Logger& logger = GetLogger();
 
+    if (logger.running.exchange(false)) {
+        logger.writer.join();
+    }
 
-std::vector<TriangleData> ExtractSmallerTriangles(const std::vector<TriangleData>& input) {
-    std::vector<TriangleData> output = {};
+    const uint64_t dropped = logger.droppedMessages.exchange(0);
 
-    for (const auto& triangle : input) {
+    if (dropped > 0) {
+        fprintf(logger.output, "[%s] %llu log messages dropped, the writer could not keep up\n", logLevelNames[(int)LogLevel::Warning], (unsigned long long)dropped);
+    }
+}
+
+
+void StartLogger(Logger& logger) {
+    std::call_once(logger.startFlag, [&logger]() {
+        if (const char * levelName = getenv("VORONOIABLE_LOG_LEVEL")) {
+            if (const auto level = ParseLogLevel(levelName)) {
+                SetLogLevel(level.value());
+            }
+            else {
+                fprintf(stderr, "unknown VORONOIABLE_LOG_LEVEL: %s\n", levelName);
+            }
+        }
+
+        logger.running.store(true, std::memory_order_release);
+        logger.writer = std::thread(RunLogWriter, &logger);
+
+        atexit(StopLogger);
+    });
+}
+
+
+void LogV(const LogLevel level, const char * format, va_list args) {
+    Logger& logger = GetLogger();
+
+    StartLogger(logger);
+
+    size_t position = logger.enqueuePosition.load(std::memory_order_relaxed);
+    LogMessage* message = nullptr;
+    uint32_t retries = 0;
+
+    while (true) {
+        LogMessage& candidate = logger.messages[position & (Logger::capacity - 1)];
+        const intptr_t difference = (intptr_t)candidate.sequence.load(std::memory_order_acquire) - (intptr_t)position;
+
+        if (difference == 0) {
+            if (logger.enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                message = &candidate;
+                break;
+            }
+        }
+        else if (difference < 0) {
+            if (++retries > 1000) {
+                logger.droppedMessages.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            std::this_thread::yield();
+            position = logger.enqueuePosition.load(std::memory_order_relaxed);
+        }
+        else {
+            position = logger.enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    message->timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - logger.start).count();
+    message->level = level;
+    vsnprintf(message->text, sizeof(message->text), format, args);
+
+    message->sequence.store(position + 1, std::memory_order_release);
+}
+
+
+void Log(const LogLevel level, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    LogV(level, format, args);
+    va_end(args);
+}
+
+
+// Arguments are only evaluated when the level is enabled
+#define LOG(level, ...) do { if (IsLogLevelEnabled(level)) Log(level, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) LOG(LogLevel::Error, __VA_ARGS__)
+#define LOG_WARNING(...) LOG(LogLevel::Warning, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LogLevel::Info, __VA_ARGS__)
+
+#if VORONOIABLE_LOG_MAX_LEVEL >= 3
+#define LOG_DEBUG(...) LOG(LogLevel::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if VORONOIABLE_LOG_MAX_LEVEL >= 4
+#define LOG_TRACE(...) LOG(LogLevel::Trace, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#endif
+
+
+unsigned& GetWorkerCountSetting() {
+    static unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+
+    return workerCount;
+}
+
+
+unsigned GetWorkerCount() {
+    return GetWorkerCountSetting();
+}
+
+
+void SetWorkerCount(const unsigned workerCount) {
+    GetWorkerCountSetting() = std::max(1u, workerCount);
+}
+
+
+// Set on threads running a ParallelFor body
+thread_local bool insideParallelFor = false;
+
+
+// Splits [0, count) into one contiguous range per worker and runs body(begin, end, workerIndex) on
+// each of them, the calling thread takes the first range. Small inputs and calls from inside
+// another ParallelFor run inline, so a batch of jobs can be spread over the workers as a whole.
+template <typename F>
+void ParallelFor(const size_t count, const F& body, const size_t minimumPerWorker = 4096) {
+    const size_t workerCount = std::min<size_t>(GetWorkerCount(), std::max<size_t>(1, count / std::max<size_t>(1, minimumPerWorker)));
+
+    if (workerCount <= 1 || insideParallelFor) {
+        body((size_t)0, count, (size_t)0);
+        return;
+    }
+
+    std::vector<std::thread> workers = {};
+    workers.reserve(workerCount - 1);
+
+    for (size_t worker = 1; worker < workerCount; worker++) {
+        workers.emplace_back([&body, count, workerCount, worker]() {
+            insideParallelFor = true;
+            body(count * worker / workerCount, count * (worker + 1) / workerCount, worker);
+        });
+    }
+
+    insideParallelFor = true;
+    body((size_t)0, count / workerCount, (size_t)0);
+    insideParallelFor = false;
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+
+double GetSecondsSince(const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+struct Color {
+    GLfloat r;
+    GLfloat g;
+    GLfloat b;
+};
+
+
+struct PointData {
+    GLfloat x;
+    GLfloat y;
+};
+
+
+struct Point {
+    PointData pointData;
+    Color color;
+};
+
+
+struct TriangleData {
+    PointData pd1;
+    PointData pd2;
+    PointData pd3;
+};
+
+
+struct Triangle {
+    TriangleData triangleData;
+    Color color;
+};
+
+
+struct LineEq {
+    union {
+		GLfloat a;
+        GLfloat x;
+    };
+    GLfloat b;
+    bool isVertical = false;
+};
+
+
+bool FloatsEqual(const GLfloat & f1, const GLfloat & f2) {
+    const auto constexpr epsilon = std::numeric_limits<GLfloat>().epsilon();
+
+    return std::fabs(f1 - f2) < epsilon * 3;
+}
+
+
+bool FloatsBiggerOrEqual(const GLfloat & f1, const GLfloat & f2) {
+    return f1 > f2 || FloatsEqual(f1, f2);
+}
+
+
+bool FloatsLessOrEqual(const GLfloat & f1, const GLfloat & f2) {
+    return f1 < f2 || FloatsEqual(f1, f2);
+}
+
+
+bool PointsDataEqual(const PointData & pd1, const PointData & pd2) {
+    /*
+    std::cout << "points data equal " << '\n';
+    std::cout << "p1 x: " << pd1.x << " y: " << pd1.y << '\n';
+    std::cout << "p2 x: " << pd2.x << " y: " << pd2.y << '\n';
+    std::cout << "output " << FloatsEqual(pd1.x, pd2.x) << " " << FloatsEqual(pd1.y, pd2.y) << " " << (FloatsEqual(pd1.x, pd2.x) && FloatsEqual(pd1.y, pd2.y)) <<std::endl;
+    */
+
+    return FloatsEqual(pd1.x, pd2.x) && FloatsEqual(pd1.y, pd2.y);
+}
+
+
+// Distance policies of the nearest-site searches. Compare orders sites like the distance does and
+// is whatever is cheapest to get, so Euclidean comparisons never take a square root, Distance turns
+// it back into the distance. Bound is the smallest Compare value of a site that is at least gap away
+// along one axis, ring searches stop on it.
+enum class DistanceMetric {
+    Euclidean,
+    Manhattan,
+    Chebyshev,
+    Anisotropic
+};
+
+
+struct EuclideanMetric {
+    GLfloat Compare(const GLfloat dx, const GLfloat dy) const { return dx * dx + dy * dy; }
+    GLfloat Bound(const GLfloat gap) const { return gap * gap; }
+    GLfloat Distance(const GLfloat compared) const { return std::sqrt(compared); }
+
+#ifdef VORONOIABLE_SSE2
+    __m128 Compare(const __m128 dx, const __m128 dy) const { return _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)); }
+#endif
+};
+
+
+struct ManhattanMetric {
+    GLfloat Compare(const GLfloat dx, const GLfloat dy) const { return std::fabs(dx) + std::fabs(dy); }
+    GLfloat Bound(const GLfloat gap) const { return gap; }
+    GLfloat Distance(const GLfloat compared) const { return compared; }
+
+#ifdef VORONOIABLE_SSE2
+    __m128 Compare(const __m128 dx, const __m128 dy) const {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        return _mm_add_ps(_mm_andnot_ps(sign, dx), _mm_andnot_ps(sign, dy));
+    }
+#endif
+};
+
+
+struct ChebyshevMetric {
+    GLfloat Compare(const GLfloat dx, const GLfloat dy) const { return std::max(std::fabs(dx), std::fabs(dy)); }
+    GLfloat Bound(const GLfloat gap) const { return gap; }
+    GLfloat Distance(const GLfloat compared) const { return compared; }
+
+#ifdef VORONOIABLE_SSE2
+    __m128 Compare(const __m128 dx, const __m128 dy) const {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        return _mm_max_ps(_mm_andnot_ps(sign, dx), _mm_andnot_ps(sign, dy));
+    }
+#endif
+};
+
+
+// Euclidean distance with the axes weighted, squared like EuclideanMetric
+struct AnisotropicMetric {
+    GLfloat weightX = 1.0f;
+    GLfloat weightY = 1.0f;
+
+    GLfloat Compare(const GLfloat dx, const GLfloat dy) const { return weightX * dx * dx + weightY * dy * dy; }
+    GLfloat Bound(const GLfloat gap) const { return std::min(weightX, weightY) * gap * gap; }
+    GLfloat Distance(const GLfloat compared) const { return std::sqrt(compared); }
+
+#ifdef VORONOIABLE_SSE2
+    __m128 Compare(const __m128 dx, const __m128 dy) const {
+        return _mm_add_ps(_mm_mul_ps(_mm_set1_ps(weightX), _mm_mul_ps(dx, dx)), _mm_mul_ps(_mm_set1_ps(weightY), _mm_mul_ps(dy, dy)));
+    }
+#endif
+};
+
+
+// Runs body with the policy of a metric chosen at run time, every policy gets its own instantiation
+template <typename F>
+auto WithDistanceMetric(const DistanceMetric metric, const PointData& weights, const F& body) {
+    switch (metric) {
+        case DistanceMetric::Manhattan: return body(ManhattanMetric{});
+        case DistanceMetric::Chebyshev: return body(ChebyshevMetric{});
+        case DistanceMetric::Anisotropic: return body(AnisotropicMetric{ weights.x, weights.y });
+        default: return body(EuclideanMetric{});
+    }
+}
+
+
+GLfloat CalculateDistance(const PointData& pd1, const PointData& pd2) {
+    return std::sqrt(EuclideanMetric{}.Compare(pd1.x - pd2.x, pd1.y - pd2.y));
+}
+
+
+LineEq GetLineEquation(const PointData & p1, const PointData & p2){
+    LineEq output = {};
+
+    if (FloatsEqual(p1.x, p2.x)) {
+        output.isVertical = true;
+        output.x = p1.x;
+        return output;
+    }
+
+    output.a = (p1.y - p2.y) / (p1.x - p2.x);
+    output.b = p1.y - output.a * p1.x;
+
+    return output;
+}
+
+
+PointData GetIntersectionPoint(const LineEq& le1, const LineEq& le2) {
+    PointData output = {};
+
+    if (le1.isVertical) {
+        output.x = le1.x;
+		output.y = output.x * le2.a + le2.b;
+    }
+    else if (le2.isVertical) {
+        output.x = le2.x;
+		output.y = output.x * le1.a + le1.b;
+    }
+    else {
+		output.x = (le2.b - le1.b) / (le1.a - le2.a);
+		output.y = output.x * le1.a + le1.b;
+    }
+
+    return output;
+}
+
+
+LineEq GetPerpendicularLine(const LineEq& lineEq, const PointData& intersectionPoint) {
+    LineEq perpendicularLine = {};
+
+    if (lineEq.isVertical) {
+        perpendicularLine.a = 0;
+        perpendicularLine.b = intersectionPoint.y;
+    }
+    else if (FloatsEqual(lineEq.a, 0.0f)) {
+        perpendicularLine.isVertical = true;
+        perpendicularLine.x = intersectionPoint.x;
+    }
+    else {
+		perpendicularLine.a = -1.0f / lineEq.a;
+		perpendicularLine.b = intersectionPoint.y - intersectionPoint.x * perpendicularLine.a;
+    }
+
+    return perpendicularLine;
+}
+
+
+GLfloat CalculatePointToLineDistance(const PointData & pointData, const LineEq & lineEquation) {
+    const auto perpendicularLine = GetPerpendicularLine(lineEquation, pointData);
+
+    const PointData intersectionPoint = GetIntersectionPoint(lineEquation, perpendicularLine);
+
+    return CalculateDistance(pointData, intersectionPoint);
+}
+
+
+GLfloat GetTriangleArea(const PointData & p1, const PointData & p2, const PointData & p3) {
+    const LineEq line = GetLineEquation(p1, p2);
+
+    const GLfloat a = CalculateDistance(p1, p2);
+
+    const GLfloat h = CalculatePointToLineDistance(p3, line);
+
+    return (a * h) / 2.0f;
+}
+
+
+PointData CalculateCenterOfGravity(const std::vector<PointData> & points) {
+    PointData sum = {0, 0};
+
+    for (const auto& point : points) {
+		sum.x += point.x;
+		sum.y += point.y;
+    }
+
+    return {
+        sum.x / (float)points.size(),
+        sum.y / (float)points.size(),
+    };
+}
+
+
+bool IsPointInsideTriangle(const TriangleData& triangleData, const PointData& pointData) {
+    PROFILE_COUNT(PointInTriangleTests);
+
+    GLfloat wholeArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, triangleData.pd3);
+
+    GLfloat firstArea = GetTriangleArea(pointData, triangleData.pd2, triangleData.pd3);
+    GLfloat secondArea = GetTriangleArea(triangleData.pd1, pointData, triangleData.pd3);
+    GLfloat thirdArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, pointData);
+
+    bool doesPointLayOnTheEdge = FloatsEqual(firstArea, 0) || FloatsEqual(secondArea, 0) || FloatsEqual(thirdArea, 0);
+
+    bool result = !doesPointLayOnTheEdge && FloatsEqual(wholeArea, firstArea + secondArea + thirdArea);
+
+    return result;
+}
+
+
+bool IsPointInsideTriangleOrOnTheEdge(const TriangleData& triangleData, const PointData& pointData) {
+    PROFILE_COUNT(PointInTriangleTests);
+
+    GLfloat wholeArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, triangleData.pd3);
+
+    GLfloat firstArea = GetTriangleArea(pointData, triangleData.pd2, triangleData.pd3);
+    GLfloat secondArea = GetTriangleArea(triangleData.pd1, pointData, triangleData.pd3);
+    GLfloat thirdArea = GetTriangleArea(triangleData.pd1, triangleData.pd2, pointData);
+
+    bool result = FloatsEqual(wholeArea, firstArea + secondArea + thirdArea);
+
+    return result;
+}
+ 
+
+// Dumps are one message per element so they can be grepped and parsed back, and cost a single
+// level check when the level is off
+void LogTrianglesData(const LogLevel level, const char * label, const std::vector<TriangleData>& triangles) {
+    if (!IsLogLevelEnabled(level)) return;
+
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const auto& triangle = triangles[i];
+
+        Log(
+            level,
+            "%s[%zu] p1=(%g, %g) p2=(%g, %g) p3=(%g, %g)",
+            label,
+            i,
+            triangle.pd1.x, triangle.pd1.y,
+            triangle.pd2.x, triangle.pd2.y,
+            triangle.pd3.x, triangle.pd3.y
+        );
+    }
+}
+
+
+void LogTriangles(const LogLevel level, const char * label, const std::vector<Triangle>& triangles) {
+    if (!IsLogLevelEnabled(level)) return;
+
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const auto& triangle = triangles[i];
+
+        Log(
+            level,
+            "%s[%zu] p1=(%g, %g) p2=(%g, %g) p3=(%g, %g) color=(%g, %g, %g)",
+            label,
+            i,
+            triangle.triangleData.pd1.x, triangle.triangleData.pd1.y,
+            triangle.triangleData.pd2.x, triangle.triangleData.pd2.y,
+            triangle.triangleData.pd3.x, triangle.triangleData.pd3.y,
+            triangle.color.r, triangle.color.g, triangle.color.b
+        );
+    }
+}
+
+
+void LogPointsData(const LogLevel level, const char * label, const std::vector<PointData>& points) {
+    if (!IsLogLevelEnabled(level)) return;
+
+    for (size_t i = 0; i < points.size(); i++) {
+        Log(level, "%s[%zu] x=%g y=%g", label, i, points[i].x, points[i].y);
+    }
+}
+
+
+void LogLineEquations(const LogLevel level, const char * label, const std::vector<LineEq>& lines) {
+    if (!IsLogLevelEnabled(level)) return;
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (lines[i].isVertical) {
+            Log(level, "%s[%zu] x=%g", label, i, lines[i].x);
+        }
+        else {
+            Log(level, "%s[%zu] a=%g b=%g", label, i, lines[i].a, lines[i].b);
+        }
+    }
+}
+
+
+bool DoLinesIntersect(
+    const PointData& l1p1,
+    const PointData& l1p2,
+    const PointData& l2p1,
+    const PointData& l2p2
+) {
+    PROFILE_COUNT(LineIntersectionTests);
+
+    LineEq lineEq1 = GetLineEquation(l1p1, l1p2);
+    LineEq lineEq2 = GetLineEquation(l2p1, l2p2);
+
+    if (FloatsEqual(lineEq1.a, lineEq2.a)) {
+        if (FloatsEqual(lineEq1.b, lineEq2.b)) {
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+
+    PointData intersectionPoint = GetIntersectionPoint(lineEq1, lineEq2);
+
+    GLfloat x1_first = std::fmin(l1p1.x, l1p2.x);
+    GLfloat x1_second = std::fmax(l1p1.x, l1p2.x);
+
+    GLfloat x2_first = std::fmin(l2p1.x, l2p2.x);
+    GLfloat x2_second = std::fmax(l2p1.x, l2p2.x);
+
+    bool isOnTheFirstLine = FloatsBiggerOrEqual(intersectionPoint.x, x1_first) && FloatsLessOrEqual(intersectionPoint.x, x1_second);
+    bool isOnTheSecondLine = FloatsBiggerOrEqual(intersectionPoint.x, x2_first) && FloatsLessOrEqual(intersectionPoint.x, x2_second);
+
+    bool isOneOfThePoints = PointsDataEqual(intersectionPoint, l1p1) ||
+        PointsDataEqual(intersectionPoint, l1p2) ||
+        PointsDataEqual(intersectionPoint, l2p1) ||
+        PointsDataEqual(intersectionPoint, l2p2);
+
+    // if the intersection point is one of the input points, they DO NOT intersect
+
+    return  isOnTheFirstLine && isOnTheSecondLine && !isOneOfThePoints;
+}
+
+
+// Separating axis test on the six edge normals. Triangles that only touch along an edge or at a
+// corner do not intersect. A flat triangle is the segment between its outer corners, two of them on
+// one line intersect where the segments overlap, and the same corners always intersect, otherwise
+// FindBestTriangle would pick one flat triangle forever.
+bool DoTrianglesIntersect(const TriangleData& t1, const TriangleData& t2) {
+    PROFILE_COUNT(TriangleIntersectionTests);
+
+    const PointData corners[2][3] = { { t1.pd1, t1.pd2, t1.pd3 }, { t2.pd1, t2.pd2, t2.pd3 } };
+
+    const auto hasCorner = [&](const PointData& corner) {
+        return PointsDataEqual(corner, t2.pd1) || PointsDataEqual(corner, t2.pd2) || PointsDataEqual(corner, t2.pd3);
+    };
+
+    if (hasCorner(t1.pd1) && hasCorner(t1.pd2) && hasCorner(t1.pd3)) return true;
+
+    // The FloatsEqual tolerance as a distance
+    const double tolerance = std::numeric_limits<GLfloat>::epsilon() * 3.0;
+
+    // Longest edge of each triangle and whether the third corner lies on it, the height over the
+    // longest edge is the area over its length
+    int longest[2] = { 0, 0 };
+    double lengths[2] = { 0.0, 0.0 };
+    bool flat[2] = { false, false };
+
+    for (int owner = 0; owner < 2; owner++) {
+        const PointData* c = corners[owner];
+
+        for (int edge = 0; edge < 3; edge++) {
+            const double dx = (double)c[(edge + 1) % 3].x - c[edge].x;
+            const double dy = (double)c[(edge + 1) % 3].y - c[edge].y;
+
+            if (dx * dx + dy * dy > lengths[owner]) {
+                lengths[owner] = dx * dx + dy * dy;
+                longest[owner] = edge;
+            }
+        }
+
+        const double cross = ((double)c[1].x - c[0].x) * ((double)c[2].y - c[0].y) - ((double)c[1].y - c[0].y) * ((double)c[2].x - c[0].x);
+
+        flat[owner] = cross * cross <= tolerance * tolerance * lengths[owner];
+    }
+
+    if (flat[0] && flat[1]) {
+        lengths[0] = std::sqrt(lengths[0]);
+        lengths[1] = std::sqrt(lengths[1]);
+
+        if (lengths[0] <= tolerance || lengths[1] <= tolerance) return false;
+
+        const PointData& origin = corners[0][longest[0]];
+        const PointData& end = corners[0][(longest[0] + 1) % 3];
+        const double ux = (end.x - (double)origin.x) / lengths[0];
+        const double uy = (end.y - (double)origin.y) / lengths[0];
+
+        bool collinear = true;
+        double min1 = 0.0;
+        double max1 = lengths[0];
+        double min2 = std::numeric_limits<double>::max();
+        double max2 = std::numeric_limits<double>::lowest();
+
+        for (int k = 0; k < 3; k++) {
+            const double dx = (double)corners[1][k].x - origin.x;
+            const double dy = (double)corners[1][k].y - origin.y;
+
+            collinear = collinear && std::fabs(dx * uy - dy * ux) <= tolerance;
+            min2 = std::min(min2, dx * ux + dy * uy);
+            max2 = std::max(max2, dx * ux + dy * uy);
+        }
+
+        if (collinear) return std::min(max1, max2) - std::max(min1, min2) > tolerance;
+    }
+
+    for (int owner = 0; owner < 2; owner++) {
+        for (int edge = 0; edge < 3; edge++) {
+            const PointData& a = corners[owner][edge];
+            const PointData& b = corners[owner][(edge + 1) % 3];
+            const double nx = (double)a.y - b.y;
+            const double ny = (double)b.x - a.x;
+            const double length = std::sqrt(nx * nx + ny * ny);
+
+            // Corners on top of each other have no normal
+            if (length <= tolerance) continue;
+
+            double min1 = std::numeric_limits<double>::max();
+            double max1 = std::numeric_limits<double>::lowest();
+            double min2 = std::numeric_limits<double>::max();
+            double max2 = std::numeric_limits<double>::lowest();
+
+            for (int k = 0; k < 3; k++) {
+                const double p1 = nx * corners[0][k].x + ny * corners[0][k].y;
+                const double p2 = nx * corners[1][k].x + ny * corners[1][k].y;
+
+                min1 = std::min(min1, p1);
+                max1 = std::max(max1, p1);
+                min2 = std::min(min2, p2);
+                max2 = std::max(max2, p2);
+            }
+
+            if (max1 <= min2 + tolerance * length || max2 <= min1 + tolerance * length) return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Broad phase of the overlap tests: accepted triangles are binned into every cell their bounding box
+// touches, so a candidate is only tested against the triangles in the cells under its own box
+struct TriangleGrid {
+    GLfloat minX;
+    GLfloat minY;
+    GLfloat cellSize;
+    size_t resolution;
+    std::vector<std::vector<uint32_t>> cells;
+    std::vector<TriangleData> triangles;
+    std::vector<uint32_t> stamps;   // last query that tested each triangle, one can sit in many cells
+    uint32_t query = 0;
+};
+
+
+// About one cell per site over the bounding box of the sites, triangles reaching outside it end up
+// in the border cells
+TriangleGrid CreateTriangleGrid(const std::vector<PointData>& points) {
+    TriangleGrid grid = {};
+
+    GLfloat maxX = std::numeric_limits<GLfloat>::lowest();
+    GLfloat maxY = std::numeric_limits<GLfloat>::lowest();
+    grid.minX = std::numeric_limits<GLfloat>::max();
+    grid.minY = std::numeric_limits<GLfloat>::max();
+
+    for (const auto& point : points) {
+        grid.minX = std::min(grid.minX, point.x);
+        grid.minY = std::min(grid.minY, point.y);
+        maxX = std::max(maxX, point.x);
+        maxY = std::max(maxY, point.y);
+    }
+
+    if (points.empty()) grid.minX = grid.minY = maxX = maxY = 0.0f;
+
+    grid.resolution = std::clamp<size_t>((size_t)std::ceil(std::sqrt((double)points.size())), 1, 1024);
+    grid.cellSize = std::max(std::max(maxX - grid.minX, maxY - grid.minY) / grid.resolution, std::numeric_limits<GLfloat>::min());
+    grid.cells.resize(grid.resolution * grid.resolution);
+
+    return grid;
+}
+
+
+// Cell range [x0, x1] x [y0, y1] under the bounding box of the triangle
+void GetTriangleGridRange(const TriangleGrid& grid, const TriangleData& triangle, size_t range[4]) {
+    const auto cell = [&](const GLfloat value, const GLfloat minValue) {
+        return (size_t)std::clamp<long long>((long long)std::floor((value - minValue) / grid.cellSize), 0, (long long)grid.resolution - 1);
+    };
+
+    range[0] = cell(std::min({ triangle.pd1.x, triangle.pd2.x, triangle.pd3.x }), grid.minX);
+    range[1] = cell(std::max({ triangle.pd1.x, triangle.pd2.x, triangle.pd3.x }), grid.minX);
+    range[2] = cell(std::min({ triangle.pd1.y, triangle.pd2.y, triangle.pd3.y }), grid.minY);
+    range[3] = cell(std::max({ triangle.pd1.y, triangle.pd2.y, triangle.pd3.y }), grid.minY);
+}
+
+
+void AddGridTriangle(TriangleGrid& grid, const TriangleData& triangle) {
+    size_t range[4];
+    GetTriangleGridRange(grid, triangle, range);
+
+    for (size_t y = range[2]; y <= range[3]; y++) {
+        for (size_t x = range[0]; x <= range[1]; x++) {
+            grid.cells[y * grid.resolution + x].push_back((uint32_t)grid.triangles.size());
+        }
+    }
+
+    grid.triangles.push_back(triangle);
+    grid.stamps.push_back(grid.query);
+}
+
+
+bool DoesTriangleOverlapGrid(TriangleGrid& grid, const TriangleData& triangle) {
+    size_t range[4];
+    GetTriangleGridRange(grid, triangle, range);
+
+    // Big candidates over a sparse grid would visit more empty cells than there are triangles
+    if ((range[1] - range[0] + 1) * (range[3] - range[2] + 1) >= grid.triangles.size()) {
+        for (const auto& accepted : grid.triangles) {
+            if (DoTrianglesIntersect(accepted, triangle)) return true;
+        }
+
+        return false;
+    }
+
+    grid.query++;
+
+    for (size_t y = range[2]; y <= range[3]; y++) {
+        for (size_t x = range[0]; x <= range[1]; x++) {
+            for (const uint32_t index : grid.cells[y * grid.resolution + x]) {
+                if (grid.stamps[index] == grid.query) continue;
+
+                grid.stamps[index] = grid.query;
+
+                if (DoTrianglesIntersect(grid.triangles[index], triangle)) return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+std::optional<TriangleData> FindBestTriangle(
+    const PointData& point,
+    const std::vector<PointData>& points,
+    TriangleGrid& currentTriangles
+) {
+    GLfloat initialArea = 2 * 2;
+    GLfloat currentBestArea = initialArea;
+
+    std::pair<PointData, PointData> currentBest = {};
+
+    for (size_t i = 0; i < points.size(); i++) {
+
+        size_t point_1_index = i;
+        size_t point_2_index = i == points.size() - 1 ? 0 : i + 1;
+
+        const PointData& currentP1 = points[point_1_index];
+        const PointData& currentP2 = points[point_2_index];
+
+        if (DoesTriangleOverlapGrid(currentTriangles, { point, currentP1, currentP2 })) continue;
+
+        GLfloat area = GetTriangleArea(point, currentP1, currentP2);
+
+        if (area < currentBestArea) {
+            currentBestArea = area;
+            currentBest.first = currentP1;
+            currentBest.second = currentP2;
+        }
+    }
+
+    if (!FloatsEqual(currentBestArea, initialArea)) {
+        return std::make_optional<TriangleData>({
+            point,
+            currentBest.first,
+            currentBest.second
+        });
+    }
+
+    return std::nullopt;
+}
+
+
+std::vector<TriangleData> ExtractTriangles(const std::vector<Point> & points) {
+    PROFILE_SCOPE("triangulation");
+
+	std::vector<Point> pointsCopy(points);
+
+    // easier version - triangles
+
+    // for every point find best two points to create triangle
+
+    std::vector<PointData> pointsData = {};
+
+    for (const Point& point : pointsCopy) {
+        pointsData.push_back(point.pointData);
+    }
+
+    std::vector<TriangleData> triangles = {};
+    TriangleGrid grid = CreateTriangleGrid(pointsData);
+
+    std::optional<TriangleData> triangle = {};
+
+    for (size_t i = 0; i < pointsData.size(); i++) {
+        const auto& point = pointsData[i];
+
+		std::vector<PointData> otherPoints = pointsData;
+		otherPoints.erase(otherPoints.begin() + i);
+
+        do {
+			triangle = FindBestTriangle(point, otherPoints, grid);
+
+            if (triangle.has_value()) {
+                triangles.push_back(triangle.value());
+                AddGridTriangle(grid, triangle.value());
+
+            }
+        } while (triangle.has_value());
+    }
+
+    return triangles;
+}
+
+
+PointData GetCenterOfLine(const PointData& p1, const PointData& p2) {
+    return { (p1.x + p2.x) / 2.0f, (p1.y + p2.y) / 2.0f};
+}
+
+
+std::vector<TriangleData> ExtractSmallerTriangles(const std::vector<TriangleData>& input) {
+    PROFILE_SCOPE("subdivision");
+
+    std::vector<TriangleData> output = {};
+
+    for (const auto& triangle : input) {
         const auto center = CalculateCenterOfGravity({ triangle.pd1, triangle.pd2, triangle.pd3 });
 
-        const auto center12 = GetCenterOfLine(triangle.pd1, triangle.pd2);
-        output.push_back({triangle.pd1, center12, center});
-        output.push_back({center12, triangle.pd2, center});
+        const auto center12 = GetCenterOfLine(triangle.pd1, triangle.pd2);
+        output.push_back({triangle.pd1, center12, center});
+        output.push_back({center12, triangle.pd2, center});
+
+        const auto center23 = GetCenterOfLine(triangle.pd2, triangle.pd3);
+        output.push_back({triangle.pd2, center23, center});
+        output.push_back({center23, triangle.pd3, center});
+
+        const auto center31 = GetCenterOfLine(triangle.pd3, triangle.pd1);
+        output.push_back({triangle.pd3, center31, center});
+        output.push_back({center31, triangle.pd1, center});
+    }
+
+    return output;
+}
+
+
+struct Camera {
+    GLfloat centerX = 0.0f;
+    GLfloat centerY = 0.0f;
+    GLfloat zoom = 1.0f;
+};
+
+
+struct ViewRect {
+    GLfloat minX;
+    GLfloat minY;
+    GLfloat maxX;
+    GLfloat maxY;
+};
+
+
+// Everything the GLFW callbacks need, reachable through the window user pointer
+struct ViewerState {
+    Camera camera = {};
+    double pendingScroll = 0.0;
+    bool dragging = false;
+    double dragX = 0.0;
+    double dragY = 0.0;
+    bool rebuildKeyDown = false;
+    bool rebuildRequested = false;
+};
+
+
+ViewRect GetVisibleRect(const Camera& camera) {
+    const GLfloat halfExtent = 1.0f / camera.zoom;
+
+    return {
+        camera.centerX - halfExtent,
+        camera.centerY - halfExtent,
+        camera.centerX + halfExtent,
+        camera.centerY + halfExtent
+    };
+}
+
+
+bool DoRectsOverlap(const ViewRect& r1, const ViewRect& r2) {
+    return r1.minX <= r2.maxX && r2.minX <= r1.maxX && r1.minY <= r2.maxY && r2.minY <= r1.maxY;
+}
+
+
+// Zooms so that the world point under the given normalized device position stays in place
+void ZoomCamera(Camera& camera, const GLfloat factor, const GLfloat anchorX, const GLfloat anchorY) {
+    const GLfloat worldX = camera.centerX + anchorX / camera.zoom;
+    const GLfloat worldY = camera.centerY + anchorY / camera.zoom;
+
+    camera.zoom = std::clamp(camera.zoom * factor, 0.25f, 1e5f);
+    camera.centerX = worldX - anchorX / camera.zoom;
+    camera.centerY = worldY - anchorY / camera.zoom;
+}
+
+
+void GetCursorDevicePosition(GLFWwindow* window, GLfloat& x, GLfloat& y) {
+    double cursorX = 0.0;
+    double cursorY = 0.0;
+    int width = 1;
+    int height = 1;
+
+    glfwGetCursorPos(window, &cursorX, &cursorY);
+    glfwGetWindowSize(window, &width, &height);
+
+    x = (GLfloat)(cursorX / std::max(width, 1) * 2.0 - 1.0);
+    y = (GLfloat)(1.0 - cursorY / std::max(height, 1) * 2.0);
+}
+
+
+void ProcessInput(GLFWwindow* window, ViewerState& state, const double frameSeconds)
+{
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    Camera& camera = state.camera;
+
+    // Keyboard pans half a screen per second whatever the zoom
+    const GLfloat pan = (GLfloat)frameSeconds / camera.zoom;
+
+    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) camera.centerX -= pan;
+    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) camera.centerX += pan;
+    if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) camera.centerY -= pan;
+    if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) camera.centerY += pan;
+    if (glfwGetKey(window, GLFW_KEY_EQUAL) == GLFW_PRESS) ZoomCamera(camera, (GLfloat)std::exp(2.0 * frameSeconds), 0.0f, 0.0f);
+    if (glfwGetKey(window, GLFW_KEY_MINUS) == GLFW_PRESS) ZoomCamera(camera, (GLfloat)std::exp(-2.0 * frameSeconds), 0.0f, 0.0f);
+
+    // One rebuild per key press, not one per frame while it is held
+    const bool rebuildKeyDown = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
+
+    if (rebuildKeyDown && !state.rebuildKeyDown) state.rebuildRequested = true;
+    state.rebuildKeyDown = rebuildKeyDown;
+
+    GLfloat cursorX = 0.0f;
+    GLfloat cursorY = 0.0f;
+    GetCursorDevicePosition(window, cursorX, cursorY);
+
+    if (state.pendingScroll != 0.0) {
+        ZoomCamera(camera, (GLfloat)std::pow(1.2, state.pendingScroll), cursorX, cursorY);
+        state.pendingScroll = 0.0;
+    }
+
+    if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+        if (state.dragging) {
+            camera.centerX -= (GLfloat)(cursorX - state.dragX) / camera.zoom;
+            camera.centerY -= (GLfloat)(cursorY - state.dragY) / camera.zoom;
+        }
+
+        state.dragging = true;
+        state.dragX = cursorX;
+        state.dragY = cursorY;
+    }
+    else {
+        state.dragging = false;
+    }
+}
+
+
+enum class ColorMode {
+    Hashed,
+    Palette,
+    GraphColored
+};
+
+
+struct ColorOptions {
+    uint64_t seed = 0x766f726f6e6f69ull;
+    ColorMode mode = ColorMode::Hashed;
+};
+
+
+// Marks a site that has not been given a colour yet, see FillMissingSiteColors
+const GLfloat missingColorComponent = -1.0f;
+
+
+const Color colorPalette[] = {
+    { 0.902f, 0.098f, 0.294f },
+    { 0.235f, 0.706f, 0.294f },
+    { 1.000f, 0.882f, 0.098f },
+    { 0.263f, 0.388f, 0.847f },
+    { 0.961f, 0.510f, 0.192f },
+    { 0.569f, 0.118f, 0.706f },
+    { 0.259f, 0.831f, 0.957f },
+    { 0.941f, 0.196f, 0.902f },
+    { 0.749f, 0.937f, 0.271f },
+    { 0.980f, 0.745f, 0.831f },
+    { 0.275f, 0.600f, 0.565f },
+    { 0.863f, 0.745f, 1.000f },
+    { 0.604f, 0.388f, 0.141f },
+    { 1.000f, 0.980f, 0.784f },
+    { 0.502f, 0.000f, 0.000f },
+    { 0.667f, 1.000f, 0.765f },
+};
+
+
+const size_t colorPaletteSize = sizeof(colorPalette) / sizeof(colorPalette[0]);
+
+
+// splitmix64 finalizer, a cheap bijective mix with full avalanche
+uint64_t MixBits(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+
+    return value;
+}
+
+
+// Counter based: the colour only depends on the seed and the site id, so it is reproducible and can
+// be computed for any subset of sites in any order
+Color CreateSiteColor(const uint64_t seed, const uint64_t siteId) {
+    const uint64_t hash = MixBits(seed ^ MixBits(siteId + 0x9e3779b97f4a7c15ull));
+
+    return {
+        ((hash >> 48) & 0xFFFF) / 65535.0f,
+        ((hash >> 32) & 0xFFFF) / 65535.0f,
+        ((hash >> 16) & 0xFFFF) / 65535.0f
+    };
+}
+
+
+Color GetPaletteColor(const uint64_t seed, const uint64_t colorIndex) {
+    if (colorIndex < colorPaletteSize) {
+        // Rotating instead of hashing keeps different indices on different palette entries
+        return colorPalette[(colorIndex + MixBits(seed)) % colorPaletteSize];
+    }
+
+    return CreateSiteColor(seed, colorIndex);
+}
+
+
+Color CreateSiteColor(const ColorOptions& options, const uint64_t siteId) {
+    if (options.mode == ColorMode::Hashed) {
+        return CreateSiteColor(options.seed, siteId);
+    }
+
+    return colorPalette[MixBits(options.seed ^ MixBits(siteId)) % colorPaletteSize];
+}
+
+
+GLuint CompileShader(const char * name, const std::string& source, GLenum shaderType) {
+    PROFILE_SCOPE("shader compilation");
+
+    const char * contentRaw = source.c_str();
+
+    GLuint shader = glCreateShader(shaderType);
+    glShaderSource(shader, 1, &contentRaw, NULL);
+    glCompileShader(shader);
+
+    GLint compiledSuccessfully;
+    char infoLog[512];
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiledSuccessfully);
+
+    if (compiledSuccessfully != GL_TRUE) {
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        fprintf(stderr, "Shader: %s compilation failed, details: %s\n", name, infoLog);
+        exit(1);
+    }
+
+    return shader;
+}
+
+
+GLuint CreateShaderProgram(const std::vector<GLuint>& shaders, const bool retrievable = false) {
+    GLuint shaderProgram = glCreateProgram();
+
+    for (const auto shader : shaders) {
+		glAttachShader(shaderProgram, shader);
+    }
+
+    if (retrievable) {
+        glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+	glLinkProgram(shaderProgram);
+
+	int compiledSuccessfully;
+	char infoLog[512];
+
+	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &compiledSuccessfully);
+	if (!compiledSuccessfully) {
+		glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
+		fprintf(stderr, "Program linking failed, info: %s\n", infoLog);
+		exit(1);
+	}
+
+    for (const auto shader : shaders) {
+		glDeleteShader(shader);
+    }
+
+    return shaderProgram;
+}
+
+
+// Sources come from the binary unless a directory is given, builds without the generated header
+// read them from shaders/ like before
+std::optional<std::string> LoadShaderSource(const char * name, const std::optional<std::string>& directory) {
+#ifdef VORONOIABLE_EMBEDDED_SHADERS
+    if (!directory.has_value()) {
+        for (const auto& shader : embeddedShaders) {
+            if (strcmp(shader.name, name) == 0) return std::string(shader.source);
+        }
+
+        LOG_ERROR("no embedded shader named %s", name);
+        return std::nullopt;
+    }
+#endif
+
+    const std::string fileName = directory.value_or("shaders") + "/" + name;
+    std::ifstream ifs(fileName, std::ifstream::in | std::ifstream::binary);
+
+    if (!ifs.is_open()) {
+        LOG_ERROR("failed to open shader file %s", fileName.c_str());
+        return std::nullopt;
+    }
+
+    return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+
+// A program is a vertex and a fragment shader plus defines inserted after their #version lines.
+// Render paths share the sources and only pay for the variants they actually draw with.
+struct ShaderVariant {
+    const char * vertex;
+    const char * fragment;
+    std::vector<std::string> defines;
+};
+
+
+// Linked programs are kept per variant and, where the driver can hand them out, stored on disk with
+// glGetProgramBinary. The file name hashes the driver strings together with the final sources, so
+// a driver update or an edited shader simply misses.
+struct ShaderCache {
+    std::optional<std::string> sourceDirectory;
+    std::optional<std::string> binaryDirectory;     // no disk cache when empty or unsupported
+    std::string driver;
+    bool binariesSupported = false;
+    std::unordered_map<std::string, GLuint> programs;
+    size_t compiledPrograms = 0;
+    size_t loadedPrograms = 0;
+    double seconds = 0.0;
+};
+
+
+const uint32_t programBinaryMagic = 0x42505256;     // "VRPB" little endian
+
+
+struct ProgramBinaryHeader {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t key;
+};
+
+
+ShaderCache CreateShaderCache(const std::optional<std::string>& sourceDirectory, const std::optional<std::string>& binaryDirectory) {
+    ShaderCache cache = {};
+    cache.sourceDirectory = sourceDirectory;
+    cache.binaryDirectory = binaryDirectory;
+
+    for (const GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION }) {
+        const GLubyte* value = glGetString(name);
+
+        cache.driver += value != nullptr ? (const char *)value : "?";
+        cache.driver.push_back('\n');
+    }
+
+    GLint formatCount = 0;
+
+    // The loader is generated for 3.3, the core 4.1 entry points come with the extension
+    if (GLAD_GL_ARB_get_program_binary) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    }
+
+    cache.binariesSupported = formatCount > 0;
+
+    if (cache.binaryDirectory.has_value() && !cache.binariesSupported) {
+        LOG_INFO("the driver offers no program binary formats, shaders are compiled on every launch");
+    }
+
+    return cache;
+}
+
+
+// FNV-1a, only has to tell cache entries apart
+uint64_t HashBytes(const std::string& bytes, uint64_t hash = 0xcbf29ce484222325ull) {
+    for (const char c : bytes) {
+        hash = (hash ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+std::string InsertShaderDefines(const std::string& source, const std::vector<std::string>& defines) {
+    if (defines.empty()) return source;
+
+    std::string block = "";
+
+    for (const auto& define : defines) {
+        block += "#define " + define + "\n";
+    }
+
+    // #version has to stay the first line
+    const size_t version = source.find("#version");
+    const size_t lineEnd = version == std::string::npos ? std::string::npos : source.find('\n', version);
+
+    if (lineEnd == std::string::npos) return block + source;
+
+    return source.substr(0, lineEnd + 1) + block + source.substr(lineEnd + 1);
+}
+
+
+std::optional<GLuint> LoadProgramBinary(const std::string& fileName, const uint64_t key) {
+    std::ifstream ifs(fileName, std::ifstream::in | std::ifstream::binary);
+    ProgramBinaryHeader header = {};
+
+    if (!ifs.is_open() || !ifs.read((char *)&header, sizeof(header)) || header.magic != programBinaryMagic || header.key != key) {
+        return std::nullopt;
+    }
+
+    const std::string binary{ std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>() };
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), (GLsizei)binary.size());
+
+    // Drivers reject binaries of other versions here, which just means compiling again
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+
+    if (linked != GL_TRUE) {
+        glDeleteProgram(program);
+        return std::nullopt;
+    }
+
+    return program;
+}
+
+
+void SaveProgramBinary(const std::string& directory, const std::string& fileName, const GLuint program, const uint64_t key) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+
+    if (length <= 0) return;
+
+    std::string binary((size_t)length, '\0');
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    // Written aside and renamed, so a concurrent launch never reads half a file
+    const std::string temporaryName = fileName + ".tmp";
+    std::ofstream ofs(temporaryName, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    const ProgramBinaryHeader header = { programBinaryMagic, format, key };
+
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write(binary.data(), length);
+    ofs.close();
+
+    if (!ofs) {
+        LOG_WARNING("could not write the program binary %s", temporaryName.c_str());
+        std::filesystem::remove(temporaryName, error);
+        return;
+    }
+
+    std::filesystem::rename(temporaryName, fileName, error);
+
+    if (error) LOG_WARNING("could not store the program binary %s: %s", fileName.c_str(), error.message().c_str());
+}
+
+
+GLuint GetShaderProgram(ShaderCache& cache, const ShaderVariant& variant) {
+    std::string name = std::string(variant.vertex) + "+" + variant.fragment;
+
+    for (const auto& define : variant.defines) {
+        name += " " + define;
+    }
+
+    const auto found = cache.programs.find(name);
+
+    if (found != cache.programs.end()) return found->second;
+
+    PROFILE_SCOPE("shader program");
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto vertexSource = LoadShaderSource(variant.vertex, cache.sourceDirectory);
+    const auto fragmentSource = LoadShaderSource(variant.fragment, cache.sourceDirectory);
+
+    if (!vertexSource.has_value() || !fragmentSource.has_value()) {
+        exit(1);
+    }
+
+    const std::string vertex = InsertShaderDefines(vertexSource.value(), variant.defines);
+    const std::string fragment = InsertShaderDefines(fragmentSource.value(), variant.defines);
+
+    const bool useBinaries = cache.binariesSupported && cache.binaryDirectory.has_value() && !cache.binaryDirectory->empty();
+    const uint64_t key = HashBytes(fragment, HashBytes(vertex, HashBytes(cache.driver)));
+    char keyText[17];
+    snprintf(keyText, sizeof(keyText), "%016llx", (unsigned long long)key);
+    const std::string fileName = useBinaries ? cache.binaryDirectory.value() + "/" + keyText + ".bin" : "";
+
+    std::optional<GLuint> program = useBinaries ? LoadProgramBinary(fileName, key) : std::nullopt;
+
+    if (program.has_value()) {
+        cache.loadedPrograms++;
+    }
+    else {
+        program = CreateShaderProgram({
+            CompileShader(variant.vertex, vertex, GL_VERTEX_SHADER),
+            CompileShader(variant.fragment, fragment, GL_FRAGMENT_SHADER)
+        }, useBinaries);
+
+        cache.compiledPrograms++;
+
+        if (useBinaries) SaveProgramBinary(cache.binaryDirectory.value(), fileName, program.value(), key);
+    }
+
+    cache.seconds += GetSecondsSince(start);
+    cache.programs[name] = program.value();
+
+    return program.value();
+}
+
+
+void DeleteShaderCache(ShaderCache& cache) {
+    for (const auto& [name, program] : cache.programs) {
+        glDeleteProgram(program);
+    }
+
+    cache.programs.clear();
+}
+
+
+void AddPoint(std::vector<Point>& points, const GLfloat x, const GLfloat y) {
+    points.push_back({x, y, missingColorComponent, missingColorComponent, missingColorComponent});
+}
+
+
+void FillMissingSiteColors(std::vector<Point>& points, const ColorOptions& options) {
+    PROFILE_SCOPE("colour assignment");
+
+    ParallelFor(points.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            if (points[i].color.r == missingColorComponent) {
+                points[i].color = CreateSiteColor(options, i);
+            }
+        }
+    }, 1 << 16);
+}
+
+
+// Compressed adjacency lists: the neighbours of site i are neighbours[offsets[i]..offsets[i + 1])
+struct SiteAdjacency {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> neighbours;
+};
+
+
+SiteAdjacency CreateSiteAdjacency(const size_t siteCount, std::vector<std::pair<uint32_t, uint32_t>>& edges) {
+    SiteAdjacency adjacency = {};
+    adjacency.offsets.assign(siteCount + 1, 0);
+
+    for (auto& edge : edges) {
+        if (edge.first > edge.second) std::swap(edge.first, edge.second);
+    }
+
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    for (const auto& edge : edges) {
+        adjacency.offsets[edge.first + 1]++;
+        adjacency.offsets[edge.second + 1]++;
+    }
+
+    for (size_t i = 0; i < siteCount; i++) {
+        adjacency.offsets[i + 1] += adjacency.offsets[i];
+    }
+
+    adjacency.neighbours.resize(adjacency.offsets.back());
+    std::vector<uint32_t> fill(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+
+    for (const auto& edge : edges) {
+        adjacency.neighbours[fill[edge.first]++] = edge.second;
+        adjacency.neighbours[fill[edge.second]++] = edge.first;
+    }
+
+    return adjacency;
+}
+
+
+// Greedy colouring in smallest-last order (Matula & Beck), so neighbouring cells never share a
+// colour. Planar adjacency needs at most 6 colours this way, all of them palette entries.
+std::vector<uint32_t> ColorSiteGraph(const SiteAdjacency& adjacency) {
+    const size_t siteCount = adjacency.offsets.size() - 1;
+
+    std::vector<uint32_t> degrees(siteCount);
+    std::vector<std::vector<uint32_t>> buckets = {};
+    std::vector<bool> removed(siteCount, false);
+    std::vector<uint32_t> removalOrder = {};
+    removalOrder.reserve(siteCount);
+
+    for (size_t i = 0; i < siteCount; i++) {
+        degrees[i] = adjacency.offsets[i + 1] - adjacency.offsets[i];
+
+        if (degrees[i] >= buckets.size()) buckets.resize(degrees[i] + 1);
+        buckets[degrees[i]].push_back((uint32_t)i);
+    }
+
+    // Buckets keep stale entries, an entry is only valid if its degree still matches
+    size_t minimumDegree = 0;
+
+    while (removalOrder.size() < siteCount) {
+        while (buckets[minimumDegree].empty()) minimumDegree++;
+
+        const uint32_t site = buckets[minimumDegree].back();
+        buckets[minimumDegree].pop_back();
+
+        if (removed[site] || degrees[site] != minimumDegree) continue;
+
+        removed[site] = true;
+        removalOrder.push_back(site);
+
+        for (uint32_t i = adjacency.offsets[site]; i < adjacency.offsets[site + 1]; i++) {
+            const uint32_t neighbour = adjacency.neighbours[i];
+
+            if (removed[neighbour]) continue;
+
+            degrees[neighbour]--;
+            buckets[degrees[neighbour]].push_back(neighbour);
+        }
+
+        minimumDegree = minimumDegree > 0 ? minimumDegree - 1 : 0;
+    }
+
+    const uint32_t uncolored = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> colors(siteCount, uncolored);
+    std::vector<uint32_t> usedBy = {};
+
+    for (auto site = removalOrder.rbegin(); site != removalOrder.rend(); site++) {
+        for (uint32_t i = adjacency.offsets[*site]; i < adjacency.offsets[*site + 1]; i++) {
+            const uint32_t neighbourColor = colors[adjacency.neighbours[i]];
+
+            if (neighbourColor == uncolored) continue;
+            if (neighbourColor >= usedBy.size()) usedBy.resize(neighbourColor + 1, uncolored);
+
+            usedBy[neighbourColor] = *site;
+        }
+
+        uint32_t color = 0;
+        while (color < usedBy.size() && usedBy[color] == *site) color++;
+
+        colors[*site] = color;
+    }
+
+    return colors;
+}
+
+
+void ApplyGraphColoring(std::vector<Point>& points, const SiteAdjacency& adjacency, const ColorOptions& options) {
+    PROFILE_SCOPE("colour assignment");
+
+    const auto colors = ColorSiteGraph(adjacency);
+
+    for (size_t i = 0; i < points.size(); i++) {
+        points[i].color = GetPaletteColor(options.seed, colors[i]);
+    }
+}
+
+
+struct MappedFile {
+    const char * data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+};
+
+
+void UnmapFile(MappedFile& mappedFile) {
+#ifdef _WIN32
+    if (mappedFile.data != nullptr) UnmapViewOfFile(mappedFile.data);
+    if (mappedFile.mapping != nullptr) CloseHandle(mappedFile.mapping);
+    if (mappedFile.file != INVALID_HANDLE_VALUE) CloseHandle(mappedFile.file);
+#else
+    if (mappedFile.data != nullptr) munmap((void *)mappedFile.data, mappedFile.size);
+    if (mappedFile.descriptor >= 0) close(mappedFile.descriptor);
+#endif
+
+    mappedFile = {};
+}
+
+
+std::optional<MappedFile> MapFile(const char * fileName) {
+    MappedFile mappedFile = {};
+
+#ifdef _WIN32
+    mappedFile.file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    LARGE_INTEGER fileSize = {};
+
+    if (mappedFile.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(mappedFile.file, &fileSize)) {
+        UnmapFile(mappedFile);
+        return std::nullopt;
+    }
+
+    mappedFile.size = (size_t)fileSize.QuadPart;
+
+    if (mappedFile.size > 0) {
+        mappedFile.mapping = CreateFileMappingA(mappedFile.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        mappedFile.data = mappedFile.mapping != nullptr ? (const char *)MapViewOfFile(mappedFile.mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+        if (mappedFile.data == nullptr) {
+            UnmapFile(mappedFile);
+            return std::nullopt;
+        }
+    }
+#else
+    mappedFile.descriptor = open(fileName, O_RDONLY);
+
+    struct stat fileStat = {};
+
+    if (mappedFile.descriptor < 0 || fstat(mappedFile.descriptor, &fileStat) != 0) {
+        UnmapFile(mappedFile);
+        return std::nullopt;
+    }
+
+    mappedFile.size = (size_t)fileStat.st_size;
+
+    if (mappedFile.size > 0) {
+        void* data = mmap(nullptr, mappedFile.size, PROT_READ, MAP_PRIVATE, mappedFile.descriptor, 0);
+
+        if (data == MAP_FAILED) {
+            UnmapFile(mappedFile);
+            return std::nullopt;
+        }
+
+        madvise(data, mappedFile.size, MADV_SEQUENTIAL);
+        mappedFile.data = (const char *)data;
+    }
+#endif
+
+    return mappedFile;
+}
+
+
+enum class SiteFileFormat {
+    Auto,
+    Csv,
+    Float32
+};
+
+
+// Maps file coordinates to the coordinates the sites ended up with
+struct SiteTransform {
+    double centerX = 0.0;
+    double centerY = 0.0;
+    double scale = 1.0;
+};
+
+
+struct SiteLoadStats {
+    size_t sites = 0;
+    size_t skippedRecords = 0;
+    size_t bytes = 0;
+    double seconds = 0.0;
+    SiteTransform transform = {};
+};
+
+
+const char * SkipSiteSeparators(const char * c, const char * end) {
+    while (c < end && (*c == ',' || *c == ';' || *c == ' ' || *c == '\t' || *c == '\r')) c++;
+
+    return c;
+}
+
+
+std::optional<GLfloat> ParseSiteCoordinate(const char *& c, const char * end) {
+    if (c < end && *c == '+') c++;
+
+    GLfloat value = 0.0f;
+    const auto result = std::from_chars(c, end, value);
+
+    if (result.ec != std::errc() || !std::isfinite(value)) return std::nullopt;
+
+    c = result.ptr;
+
+    return value;
+}
+
+
+std::optional<Color> ParseSiteColor(const char * c, const char * end) {
+    if (c < end && *c == '#') {
+        c += 1;
+    }
+    else if (end - c >= 2 && c[0] == '0' && (c[1] == 'x' || c[1] == 'X')) {
+        c += 2;
+    }
+    else {
+        return std::nullopt;
+    }
+
+    uint32_t rgb = 0;
+    const auto result = std::from_chars(c, end, rgb, 16);
+
+    if (result.ec != std::errc() || result.ptr - c != 6) return std::nullopt;
+
+    return Color{
+        ((rgb >> 16) & 0xFF) / 255.0f,
+        ((rgb >> 8) & 0xFF) / 255.0f,
+        (rgb & 0xFF) / 255.0f
+    };
+}
+
+
+// One site per line: x, y, an optional colour column (#RRGGBB or 0xRRGGBB) and an optional value
+// for interpolation. Commas, semicolons and whitespace all separate columns, lines that do not
+// start with two numbers (headers, comments) are skipped.
+std::optional<Point> ParseCsvSite(const char * c, const char * end, GLfloat& value) {
+    c = SkipSiteSeparators(c, end);
+
+    const auto x = ParseSiteCoordinate(c, end);
+    if (!x.has_value()) return std::nullopt;
+
+    c = SkipSiteSeparators(c, end);
+
+    const auto y = ParseSiteCoordinate(c, end);
+    if (!y.has_value()) return std::nullopt;
+
+    c = SkipSiteSeparators(c, end);
+
+    const auto color = ParseSiteColor(c, end);
+
+    if (color.has_value()) {
+        while (c < end && *c != ',' && *c != ';' && *c != ' ' && *c != '\t' && *c != '\r') c++;
+        c = SkipSiteSeparators(c, end);
+    }
+
+    value = ParseSiteCoordinate(c, end).value_or(0.0f);
+
+    return Point{
+        { x.value(), y.value() },
+        color.value_or(Color{ missingColorComponent, missingColorComponent, missingColorComponent })
+    };
+}
+
+
+struct ParsedSiteChunk {
+    std::vector<Point> sites;
+    std::vector<GLfloat> values;
+    size_t skippedRecords = 0;
+};
+
+
+void AppendParsedChunks(std::vector<Point>& points, std::vector<GLfloat>* values, std::vector<ParsedSiteChunk>& chunks, SiteLoadStats& stats) {
+    std::vector<size_t> offsets(chunks.size() + 1, points.size());
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        offsets[i + 1] = offsets[i] + chunks[i].sites.size();
+        stats.skippedRecords += chunks[i].skippedRecords;
+    }
+
+    points.resize(offsets.back());
+    if (values != nullptr) values->resize(offsets.back(), 0.0f);
+
+    ParallelFor(chunks.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            std::copy(chunks[i].sites.begin(), chunks[i].sites.end(), points.begin() + offsets[i]);
+            chunks[i].sites = {};
+
+            if (values != nullptr) {
+                std::copy(chunks[i].values.begin(), chunks[i].values.end(), values->begin() + offsets[i]);
+            }
+
+            chunks[i].values = {};
+        }
+    }, 1);
+}
+
+
+void ParseCsvSites(const MappedFile& file, std::vector<Point>& points, std::vector<GLfloat>* values, SiteLoadStats& stats) {
+    const char * const data = file.data;
+    const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(GetWorkerCount() * 4, file.size / (1 << 16)));
+
+    // Chunk boundaries are moved forward to the next line start, so every line belongs to exactly one chunk
+    std::vector<size_t> boundaries(chunkCount + 1, file.size);
+    boundaries[0] = 0;
+
+    for (size_t i = 1; i < chunkCount; i++) {
+        const char * newLine = (const char *)memchr(data + file.size * i / chunkCount, '\n', file.size - file.size * i / chunkCount);
+        boundaries[i] = newLine != nullptr ? (size_t)(newLine - data) + 1 : file.size;
+    }
+
+    std::vector<ParsedSiteChunk> chunks(chunkCount);
+
+    ParallelFor(chunkCount, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            ParsedSiteChunk& chunk = chunks[i];
+            const char * c = data + std::min(boundaries[i], boundaries[i + 1]);
+            const char * const chunkEnd = data + boundaries[i + 1];
+
+            chunk.sites.reserve((chunkEnd - c) / 16);
+            if (values != nullptr) chunk.values.reserve((chunkEnd - c) / 16);
+
+            while (c < chunkEnd) {
+                const char * lineEnd = (const char *)memchr(c, '\n', chunkEnd - c);
+                if (lineEnd == nullptr) lineEnd = chunkEnd;
+
+                const bool isHeader = c == data;
+                GLfloat value = 0.0f;
+
+                if (const auto site = ParseCsvSite(c, lineEnd, value)) {
+                    chunk.sites.push_back(site.value());
+                    if (values != nullptr) chunk.values.push_back(value);
+                }
+                else if (!isHeader && SkipSiteSeparators(c, lineEnd) != lineEnd) {
+                    chunk.skippedRecords++;
+                }
+
+                c = lineEnd + 1;
+            }
+        }
+    }, 1);
+
+    AppendParsedChunks(points, values, chunks, stats);
+}
+
+
+// Raw little-endian float32 x, y pairs without any header
+void ParseFloat32Sites(const MappedFile& file, std::vector<Point>& points, SiteLoadStats& stats) {
+    const size_t recordSize = 2 * sizeof(float);
+    const size_t recordCount = file.size / recordSize;
+
+    if (file.size % recordSize != 0) {
+        LOG_WARNING("float32 site file has %zu trailing bytes, ignoring them", file.size % recordSize);
+        stats.skippedRecords++;
+    }
+
+    const uint16_t endiannessProbe = 1;
+    const bool isLittleEndian = *(const uint8_t *)&endiannessProbe == 1;
+
+    const size_t offset = points.size();
+    points.resize(offset + recordCount);
+
+    std::vector<size_t> nonFinitePerWorker(GetWorkerCount(), 0);
+
+    ParallelFor(recordCount, [&](size_t begin, size_t end, size_t worker) {
+        for (size_t i = begin; i < end; i++) {
+            uint8_t record[2 * sizeof(float)];
+            memcpy(record, file.data + i * recordSize, recordSize);
+
+            if (!isLittleEndian) {
+                std::reverse(record, record + sizeof(float));
+                std::reverse(record + sizeof(float), record + recordSize);
+            }
+
+            Point& point = points[offset + i];
+            memcpy(&point.pointData.x, record, sizeof(float));
+            memcpy(&point.pointData.y, record + sizeof(float), sizeof(float));
+            point.color = { missingColorComponent, missingColorComponent, missingColorComponent };
+
+            if (!std::isfinite(point.pointData.x) || !std::isfinite(point.pointData.y)) {
+                nonFinitePerWorker[worker]++;
+            }
+        }
+    });
+
+    size_t nonFinite = 0;
+    for (const size_t count : nonFinitePerWorker) nonFinite += count;
+
+    if (nonFinite > 0) {
+        const auto removed = std::remove_if(points.begin() + offset, points.end(), [](const Point& point) {
+            return !std::isfinite(point.pointData.x) || !std::isfinite(point.pointData.y);
+        });
+
+        points.erase(removed, points.end());
+        stats.skippedRecords += nonFinite;
+    }
+}
+
+
+// Uniformly scales and centers points[begin, end) into [-1, 1]², keeping the aspect ratio
+SiteTransform NormalizeSites(std::vector<Point>& points, const size_t begin, const size_t end) {
+    if (begin >= end) return {};
+
+    struct Bounds {
+        GLfloat minX = std::numeric_limits<GLfloat>::max();
+        GLfloat minY = std::numeric_limits<GLfloat>::max();
+        GLfloat maxX = std::numeric_limits<GLfloat>::lowest();
+        GLfloat maxY = std::numeric_limits<GLfloat>::lowest();
+    };
+
+    std::vector<Bounds> boundsPerWorker(GetWorkerCount());
+
+    ParallelFor(end - begin, [&](size_t first, size_t last, size_t worker) {
+        Bounds& bounds = boundsPerWorker[worker];
+
+        for (size_t i = begin + first; i < begin + last; i++) {
+            bounds.minX = std::min(bounds.minX, points[i].pointData.x);
+            bounds.minY = std::min(bounds.minY, points[i].pointData.y);
+            bounds.maxX = std::max(bounds.maxX, points[i].pointData.x);
+            bounds.maxY = std::max(bounds.maxY, points[i].pointData.y);
+        }
+    });
+
+    Bounds bounds = {};
+
+    for (const auto& workerBounds : boundsPerWorker) {
+        bounds.minX = std::min(bounds.minX, workerBounds.minX);
+        bounds.minY = std::min(bounds.minY, workerBounds.minY);
+        bounds.maxX = std::max(bounds.maxX, workerBounds.maxX);
+        bounds.maxY = std::max(bounds.maxY, workerBounds.maxY);
+    }
+
+    const double extent = std::max(bounds.maxX - bounds.minX, bounds.maxY - bounds.minY);
+    const double scale = extent > 0.0 ? 2.0 / extent : 1.0;
+    const double centerX = ((double)bounds.minX + bounds.maxX) / 2.0;
+    const double centerY = ((double)bounds.minY + bounds.maxY) / 2.0;
+
+    ParallelFor(end - begin, [&](size_t first, size_t last, size_t) {
+        for (size_t i = begin + first; i < begin + last; i++) {
+            points[i].pointData.x = (GLfloat)std::clamp((points[i].pointData.x - centerX) * scale, -1.0, 1.0);
+            points[i].pointData.y = (GLfloat)std::clamp((points[i].pointData.y - centerY) * scale, -1.0, 1.0);
+        }
+    });
+
+    return { centerX, centerY, scale };
+}
+
+
+SiteFileFormat DetectSiteFileFormat(const char * fileName) {
+    const auto extension = std::filesystem::path(fileName).extension().string();
+
+    if (extension == ".bin" || extension == ".f32" || extension == ".raw") return SiteFileFormat::Float32;
+
+    return SiteFileFormat::Csv;
+}
+
+
+// Appends the sites of a CSV or raw float32 file to points, parsing it in parallel straight from a
+// memory mapping. Sites without a colour column are left for FillMissingSiteColors. When values is
+// given it is kept parallel to points, sites without a value column get 0.
+std::optional<SiteLoadStats> LoadSites(
+    const char * fileName,
+    SiteFileFormat format,
+    const bool normalize,
+    std::vector<Point>& points,
+    std::vector<GLfloat>* values = nullptr
+) {
+    PROFILE_SCOPE("site loading");
+
+    const auto start = std::chrono::steady_clock::now();
+
+    auto file = MapFile(fileName);
+
+    if (!file.has_value()) {
+        LOG_ERROR("failed to open site file: %s", fileName);
+        return std::nullopt;
+    }
+
+    if (format == SiteFileFormat::Auto) {
+        format = DetectSiteFileFormat(fileName);
+    }
+
+    SiteLoadStats stats = {};
+    stats.bytes = file->size;
+
+    const size_t firstSite = points.size();
+
+    if (values != nullptr) values->resize(firstSite, 0.0f);
+
+    if (format == SiteFileFormat::Float32) {
+        ParseFloat32Sites(file.value(), points, stats);
+    }
+    else {
+        ParseCsvSites(file.value(), points, values, stats);
+    }
+
+    if (values != nullptr) values->resize(points.size(), 0.0f);
+
+    UnmapFile(file.value());
+
+    if (normalize) {
+        stats.transform = NormalizeSites(points, firstSite, points.size());
+    }
+
+    stats.sites = points.size() - firstSite;
+    stats.seconds = GetSecondsSince(start);
+
+    if (stats.skippedRecords > 0) {
+        LOG_WARNING("%s: skipped %zu records that are not sites", fileName, stats.skippedRecords);
+    }
+
+    LOG_INFO(
+        "loaded %zu sites from %s in %.1f ms (%.1f MB/s, %.2f M sites/s)",
+        stats.sites,
+        fileName,
+        stats.seconds * 1e3,
+        stats.bytes / 1e6 / std::max(stats.seconds, 1e-9),
+        stats.sites / 1e6 / std::max(stats.seconds, 1e-9)
+    );
+
+    return stats;
+}
+
+
+std::vector<Triangle> CreateTrianglesFromPoints(const std::vector<Point> & points) {
+    std::vector<Triangle> triangles = {};
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const Point & point = points[i];
+        Triangle triangle1 = {};
+
+        triangle1.triangleData.pd1.x = point.pointData.x - 0.05;
+        triangle1.triangleData.pd1.y = point.pointData.y;
+        triangle1.triangleData.pd2.x = point.pointData.x - 0.1;
+        triangle1.triangleData.pd2.y = point.pointData.y;
+        triangle1.triangleData.pd3.x = point.pointData.x - 0.075;
+        triangle1.triangleData.pd3.y = point.pointData.y - 0.05;
+
+        triangle1.color = CreateSiteColor(ColorOptions{}, i);
+        triangles.push_back(triangle1);
+    }
+
+    return triangles;
+}
+
+
+void InitializePointsAttribPointers() {
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Point), (void *)0);
+
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Point), (void *)sizeof(PointData));
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+}
+
+
+// 8 bytes instead of the 20 of a Point: the position in 16 bit steps over the mesh bounds and the
+// colour in 8 bits per channel, both read back as normalized attributes
+struct CompactPoint {
+    uint16_t x;
+    uint16_t y;
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+};
+
+
+void InitializeCompactPointsAttribPointers() {
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CompactPoint), (void *)offsetof(CompactPoint, x));
+
+    glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(CompactPoint), (void *)offsetof(CompactPoint, r));
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+}
+
+
+std::vector<Point> TransformTrianglesIntoPoints(const std::vector<Triangle> & triangles) {
+    std::vector<Point> output;
+
+    for (const auto & triangle : triangles) {
+        Point point1 = {};
+        Point point2 = {};
+        Point point3 = {};
+
+        point1.pointData = triangle.triangleData.pd1;
+        point1.color = triangle.color;
+
+        point2.pointData = triangle.triangleData.pd2;
+        point2.color = triangle.color;
+
+        point3.pointData = triangle.triangleData.pd3;
+        point3.color = triangle.color;
+
+        output.push_back(point1);
+        output.push_back(point2);
+        output.push_back(point3);
+    }
+
+    return output;
+}
+
+
+// A contiguous range of the mesh vertex buffer covering one spatial bucket
+struct DrawChunk {
+    GLint first;
+    GLsizei count;
+    ViewRect bounds;
+};
+
+
+struct MeshLevel {
+    std::vector<DrawChunk> chunks;
+    size_t triangleCount;
+};
+
+
+// Level 0 is the diagram itself, every next level merges cells into a grid of half the resolution.
+// The vertices of all levels live in one buffer that is uploaded once.
+struct RenderMesh {
+    std::vector<Point> vertices;
+    std::vector<CompactPoint> compactVertices;  // replaces vertices once the mesh is compacted
+    std::vector<MeshLevel> levels;
+    ViewRect bounds;
+};
+
+
+const size_t trianglesPerChunk = 4096;
+
+
+ViewRect GetTrianglesBounds(const std::vector<Triangle>& triangles) {
+    ViewRect bounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    if (triangles.empty()) return bounds;
+
+    bounds = { triangles[0].triangleData.pd1.x, triangles[0].triangleData.pd1.y, triangles[0].triangleData.pd1.x, triangles[0].triangleData.pd1.y };
+
+    for (const auto& triangle : triangles) {
+        for (const auto& corner : { triangle.triangleData.pd1, triangle.triangleData.pd2, triangle.triangleData.pd3 }) {
+            bounds.minX = std::min(bounds.minX, corner.x);
+            bounds.minY = std::min(bounds.minY, corner.y);
+            bounds.maxX = std::max(bounds.maxX, corner.x);
+            bounds.maxY = std::max(bounds.maxY, corner.y);
+        }
+    }
+
+    return bounds;
+}
+
+
+size_t GetGridCell(const GLfloat value, const GLfloat minValue, const GLfloat maxValue, const size_t resolution) {
+    const GLfloat extent = std::max(maxValue - minValue, std::numeric_limits<GLfloat>::min());
+    const long long cell = (long long)((value - minValue) / extent * resolution);
+
+    return (size_t)std::clamp<long long>(cell, 0, (long long)resolution - 1);
+}
+
+
+// Buckets the triangles by centroid into a grid sized for about trianglesPerChunk triangles per
+// bucket and appends them bucket after bucket, so every bucket is one draw range
+MeshLevel AppendChunkedLevel(const std::vector<Triangle>& triangles, const ViewRect& bounds, std::vector<Point>& vertices) {
+    const size_t resolution = std::clamp<size_t>((size_t)std::sqrt((double)triangles.size() / trianglesPerChunk), 1, 256);
+
+    std::vector<uint32_t> buckets(triangles.size());
+    std::vector<size_t> bucketOffsets(resolution * resolution + 1, 0);
+
+    ParallelFor(triangles.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const auto& data = triangles[i].triangleData;
+            const GLfloat x = (data.pd1.x + data.pd2.x + data.pd3.x) / 3.0f;
+            const GLfloat y = (data.pd1.y + data.pd2.y + data.pd3.y) / 3.0f;
+
+            buckets[i] = (uint32_t)(GetGridCell(y, bounds.minY, bounds.maxY, resolution) * resolution + GetGridCell(x, bounds.minX, bounds.maxX, resolution));
+        }
+    });
+
+    for (const uint32_t bucket : buckets) {
+        bucketOffsets[bucket + 1]++;
+    }
+
+    for (size_t i = 0; i + 1 < bucketOffsets.size(); i++) {
+        bucketOffsets[i + 1] += bucketOffsets[i];
+    }
+
+    std::vector<uint32_t> order(triangles.size());
+    std::vector<size_t> fill(bucketOffsets.begin(), bucketOffsets.end() - 1);
+
+    for (size_t i = 0; i < triangles.size(); i++) {
+        order[fill[buckets[i]]++] = (uint32_t)i;
+    }
+
+    MeshLevel level = {};
+    level.triangleCount = triangles.size();
+
+    const size_t firstVertex = vertices.size();
+    vertices.resize(firstVertex + triangles.size() * 3);
+
+    for (size_t bucket = 0; bucket + 1 < bucketOffsets.size(); bucket++) {
+        if (bucketOffsets[bucket] == bucketOffsets[bucket + 1]) continue;
+
+        DrawChunk chunk = {};
+        chunk.first = (GLint)(firstVertex + bucketOffsets[bucket] * 3);
+        chunk.count = (GLsizei)((bucketOffsets[bucket + 1] - bucketOffsets[bucket]) * 3);
+        chunk.bounds = { std::numeric_limits<GLfloat>::max(), std::numeric_limits<GLfloat>::max(), std::numeric_limits<GLfloat>::lowest(), std::numeric_limits<GLfloat>::lowest() };
+
+        for (size_t i = bucketOffsets[bucket]; i < bucketOffsets[bucket + 1]; i++) {
+            const Triangle& triangle = triangles[order[i]];
+            const PointData corners[] = { triangle.triangleData.pd1, triangle.triangleData.pd2, triangle.triangleData.pd3 };
+
+            for (size_t corner = 0; corner < 3; corner++) {
+                vertices[firstVertex + i * 3 + corner] = { corners[corner], triangle.color };
+
+                chunk.bounds.minX = std::min(chunk.bounds.minX, corners[corner].x);
+                chunk.bounds.minY = std::min(chunk.bounds.minY, corners[corner].y);
+                chunk.bounds.maxX = std::max(chunk.bounds.maxX, corners[corner].x);
+                chunk.bounds.maxY = std::max(chunk.bounds.maxY, corners[corner].y);
+            }
+        }
+
+        level.chunks.push_back(chunk);
+    }
+
+    return level;
+}
+
+
+// Every grid cell keeps the colour of the biggest triangle whose centroid falls into it, weights
+// are the covered area and decide which child wins when cells are merged
+struct LodGrid {
+    size_t resolution;
+    std::vector<Color> colors;
+    std::vector<GLfloat> weights;
+};
+
+
+LodGrid CreateLodGrid(const std::vector<Triangle>& triangles, const ViewRect& bounds, const size_t resolution) {
+    LodGrid grid = { resolution, std::vector<Color>(resolution * resolution), std::vector<GLfloat>(resolution * resolution, 0.0f) };
+    std::vector<GLfloat> bestArea(resolution * resolution, 0.0f);
+
+    for (const auto& triangle : triangles) {
+        const auto& data = triangle.triangleData;
+        const GLfloat area = std::fabs((data.pd2.x - data.pd1.x) * (data.pd3.y - data.pd1.y) - (data.pd3.x - data.pd1.x) * (data.pd2.y - data.pd1.y)) / 2.0f;
+        const GLfloat x = (data.pd1.x + data.pd2.x + data.pd3.x) / 3.0f;
+        const GLfloat y = (data.pd1.y + data.pd2.y + data.pd3.y) / 3.0f;
+
+        const size_t cell = GetGridCell(y, bounds.minY, bounds.maxY, resolution) * resolution + GetGridCell(x, bounds.minX, bounds.maxX, resolution);
+
+        grid.weights[cell] += area;
+
+        if (area >= bestArea[cell]) {
+            bestArea[cell] = area;
+            grid.colors[cell] = triangle.color;
+        }
+    }
+
+    // Cells smaller than the triangles around them get no centroid, borrow a neighbour's colour
+    for (int pass = 0; pass < 4; pass++) {
+        const auto weights = grid.weights;
+
+        for (size_t y = 0; y < resolution; y++) {
+            for (size_t x = 0; x < resolution; x++) {
+                const size_t cell = y * resolution + x;
+
+                if (weights[cell] > 0.0f) continue;
+
+                const std::pair<long long, long long> neighbours[] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+                for (const auto& [dx, dy] : neighbours) {
+                    const long long nx = (long long)x + dx;
+                    const long long ny = (long long)y + dy;
+
+                    if (nx < 0 || ny < 0 || nx >= (long long)resolution || ny >= (long long)resolution) continue;
+
+                    const size_t neighbour = (size_t)ny * resolution + (size_t)nx;
+
+                    if (weights[neighbour] > 0.0f) {
+                        grid.colors[cell] = grid.colors[neighbour];
+                        grid.weights[cell] = std::numeric_limits<GLfloat>::min();
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return grid;
+}
+
+
+LodGrid MergeLodGrid(const LodGrid& grid) {
+    const size_t resolution = grid.resolution / 2;
+    LodGrid merged = { resolution, std::vector<Color>(resolution * resolution), std::vector<GLfloat>(resolution * resolution, 0.0f) };
+
+    for (size_t y = 0; y < resolution; y++) {
+        for (size_t x = 0; x < resolution; x++) {
+            const size_t cell = y * resolution + x;
+            GLfloat bestWeight = 0.0f;
+
+            for (size_t child = 0; child < 4; child++) {
+                const size_t childCell = (y * 2 + child / 2) * grid.resolution + x * 2 + child % 2;
+
+                merged.weights[cell] += grid.weights[childCell];
+
+                if (grid.weights[childCell] > bestWeight) {
+                    bestWeight = grid.weights[childCell];
+                    merged.colors[cell] = grid.colors[childCell];
+                }
+            }
+        }
+    }
+
+    return merged;
+}
+
+
+bool ColorsEqual(const Color& c1, const Color& c2) {
+    return c1.r == c2.r && c1.g == c2.g && c1.b == c2.b;
+}
+
+
+// Runs of equally coloured cells in a row become a single quad
+std::vector<Triangle> CreateLodTriangles(const LodGrid& grid, const ViewRect& bounds) {
+    std::vector<Triangle> triangles = {};
+
+    const GLfloat cellWidth = (bounds.maxX - bounds.minX) / grid.resolution;
+    const GLfloat cellHeight = (bounds.maxY - bounds.minY) / grid.resolution;
+
+    for (size_t y = 0; y < grid.resolution; y++) {
+        size_t x = 0;
+
+        while (x < grid.resolution) {
+            const size_t runStart = x;
+            const size_t cell = y * grid.resolution + x;
+
+            x++;
+
+            if (grid.weights[cell] <= 0.0f) continue;
+
+            while (x < grid.resolution && grid.weights[y * grid.resolution + x] > 0.0f && ColorsEqual(grid.colors[y * grid.resolution + x], grid.colors[cell])) {
+                x++;
+            }
+
+            const GLfloat x1 = bounds.minX + runStart * cellWidth;
+            const GLfloat x2 = bounds.minX + x * cellWidth;
+            const GLfloat y1 = bounds.minY + y * cellHeight;
+            const GLfloat y2 = bounds.minY + (y + 1) * cellHeight;
+
+            triangles.push_back({ { { x1, y1 }, { x2, y1 }, { x2, y2 } }, grid.colors[cell] });
+            triangles.push_back({ { { x1, y1 }, { x2, y2 }, { x1, y2 } }, grid.colors[cell] });
+        }
+    }
+
+    return triangles;
+}
+
+
+RenderMesh BuildRenderMesh(const std::vector<Triangle>& triangles) {
+    PROFILE_SCOPE("render mesh");
+
+    RenderMesh mesh = {};
+    mesh.bounds = GetTrianglesBounds(triangles);
+    mesh.vertices.reserve(triangles.size() * 3 * 3 / 2);
+    mesh.levels.push_back(AppendChunkedLevel(triangles, mesh.bounds, mesh.vertices));
+
+    // The finest grid has at least four triangles per cell, coarser ones halve it down to 32x32
+    size_t resolution = 32;
+    while ((resolution * 2) * (resolution * 2) * 4 <= triangles.size()) resolution *= 2;
+
+    if (resolution * resolution * 4 > triangles.size()) return mesh;
+
+    LodGrid grid = CreateLodGrid(triangles, mesh.bounds, resolution);
+
+    while (true) {
+        mesh.levels.push_back(AppendChunkedLevel(CreateLodTriangles(grid, mesh.bounds), mesh.bounds, mesh.vertices));
+
+        if (grid.resolution <= 32) break;
+
+        grid = MergeLodGrid(grid);
+    }
+
+    LOG_INFO("render mesh: %zu levels, %zu vertices", mesh.levels.size(), mesh.vertices.size());
+
+    return mesh;
+}
+
+
+// Positions become 16 bit fractions of the mesh bounds, the shader gets them back through the view
+// uniforms of GetCompactViewUniforms. The largest rounding error is logged, a step is 1/65535 of the
+// bounds which stays well below a cell of even the biggest diagrams at full zoom.
+void CompactRenderMesh(RenderMesh& mesh) {
+    PROFILE_SCOPE("compact render mesh");
+
+    const double width = std::max<double>(mesh.bounds.maxX - mesh.bounds.minX, std::numeric_limits<GLfloat>::min());
+    const double height = std::max<double>(mesh.bounds.maxY - mesh.bounds.minY, std::numeric_limits<GLfloat>::min());
+
+    const auto quantize = [](const double value) { return (uint16_t)std::lround(std::clamp(value, 0.0, 1.0) * 65535.0); };
+    const auto quantizeColor = [](const GLfloat value) { return (uint8_t)std::lround(std::clamp(value, 0.0f, 1.0f) * 255.0f); };
+
+    mesh.compactVertices.resize(mesh.vertices.size());
+
+    std::vector<double> positionErrors(GetWorkerCount(), 0.0);
+    std::vector<double> colorErrors(GetWorkerCount(), 0.0);
+
+    ParallelFor(mesh.vertices.size(), [&](size_t begin, size_t end, size_t worker) {
+        for (size_t i = begin; i < end; i++) {
+            const Point& point = mesh.vertices[i];
+            CompactPoint& compact = mesh.compactVertices[i];
+
+            compact.x = quantize((point.pointData.x - mesh.bounds.minX) / width);
+            compact.y = quantize((point.pointData.y - mesh.bounds.minY) / height);
+            compact.r = quantizeColor(point.color.r);
+            compact.g = quantizeColor(point.color.g);
+            compact.b = quantizeColor(point.color.b);
+            compact.a = 255;
+
+            const double dx = mesh.bounds.minX + compact.x / 65535.0 * width - point.pointData.x;
+            const double dy = mesh.bounds.minY + compact.y / 65535.0 * height - point.pointData.y;
+
+            positionErrors[worker] = std::max({ positionErrors[worker], std::fabs(dx), std::fabs(dy) });
+            colorErrors[worker] = std::max({
+                colorErrors[worker],
+                std::fabs(compact.r / 255.0 - point.color.r),
+                std::fabs(compact.g / 255.0 - point.color.g),
+                std::fabs(compact.b / 255.0 - point.color.b)
+            });
+        }
+    });
+
+    const size_t floatBytes = mesh.vertices.size() * sizeof(Point);
+    std::vector<Point>().swap(mesh.vertices);
+
+    LOG_INFO(
+        "compacted %zu vertices from %.1f MB to %.1f MB, position error up to %.3g (%.3g of the bounds), colour error up to %.3g",
+        mesh.compactVertices.size(),
+        floatBytes / 1e6,
+        mesh.compactVertices.size() * sizeof(CompactPoint) / 1e6,
+        *std::max_element(positionErrors.begin(), positionErrors.end()),
+        *std::max_element(positionErrors.begin(), positionErrors.end()) / std::max(width, height),
+        *std::max_element(colorErrors.begin(), colorErrors.end())
+    );
+}
+
+
+// (bounds.min + a * extent - center) * zoom rewritten as (a - center') * scale' for the [0,1] positions of a compact mesh
+void GetCompactViewUniforms(const RenderMesh& mesh, const Camera& camera, GLfloat center[2], GLfloat scale[2]) {
+    const GLfloat width = std::max(mesh.bounds.maxX - mesh.bounds.minX, std::numeric_limits<GLfloat>::min());
+    const GLfloat height = std::max(mesh.bounds.maxY - mesh.bounds.minY, std::numeric_limits<GLfloat>::min());
+
+    center[0] = (camera.centerX - mesh.bounds.minX) / width;
+    center[1] = (camera.centerY - mesh.bounds.minY) / height;
+    scale[0] = camera.zoom * width;
+    scale[1] = camera.zoom * height;
+}
+
+
+void UploadRenderMesh(const RenderMesh& mesh) {
+    if (!mesh.compactVertices.empty()) {
+        glBufferData(GL_ARRAY_BUFFER, mesh.compactVertices.size() * sizeof(CompactPoint), mesh.compactVertices.data(), GL_STATIC_DRAW);
+    }
+    else {
+        glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(Point), mesh.vertices.data(), GL_STATIC_DRAW);
+    }
+}
+
+
+size_t CountVisibleTriangles(const MeshLevel& level, const ViewRect& view) {
+    size_t count = 0;
+
+    for (const auto& chunk : level.chunks) {
+        if (DoRectsOverlap(chunk.bounds, view)) count += chunk.count / 3;
+    }
+
+    return count;
+}
+
+
+// The finest level whose visible part fits the triangle budget, which keeps the frame time flat
+// whatever the diagram size and zoom
+size_t SelectMeshLevel(const RenderMesh& mesh, const ViewRect& view, const size_t triangleBudget) {
+    for (size_t i = 0; i < mesh.levels.size(); i++) {
+        if (CountVisibleTriangles(mesh.levels[i], view) <= triangleBudget) return i;
+    }
+
+    return mesh.levels.size() - 1;
+}
+
+
+void DrawMeshLevel(const MeshLevel& level, const ViewRect& view, std::vector<GLint>& firsts, std::vector<GLsizei>& counts) {
+    firsts.clear();
+    counts.clear();
+
+    for (const auto& chunk : level.chunks) {
+        if (!DoRectsOverlap(chunk.bounds, view)) continue;
+
+        // Neighbouring buckets are neighbours in the buffer too, so most visible rows collapse into one range
+        if (!firsts.empty() && firsts.back() + counts.back() == chunk.first) {
+            counts.back() += chunk.count;
+        }
+        else {
+            firsts.push_back(chunk.first);
+            counts.push_back(chunk.count);
+        }
+    }
+
+    if (!firsts.empty()) {
+        glMultiDrawArrays(GL_TRIANGLES, firsts.data(), counts.data(), (GLsizei)firsts.size());
+    }
+}
+
+
+bool WriteScreenshot(const char * fileName, const int width, const int height) {
+    std::vector<uint8_t> pixels((size_t)width * height * 3);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    FILE* file = fopen(fileName, "wb");
+
+    if (file == nullptr) {
+        LOG_ERROR("failed to open screenshot file: %s", fileName);
+        return false;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+    // OpenGL rows go bottom up
+    for (int y = height - 1; y >= 0; y--) {
+        fwrite(pixels.data() + (size_t)y * width * 3, 1, (size_t)width * 3, file);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+
+// Frame times of a window session. Counts and totals cover every frame, the percentiles the most
+// recent ones, so a session left open does not grow.
+const size_t frameStatsWindow = 4096;
+
+
+struct FrameStats {
+    size_t count = 0;
+    double totalSeconds = 0.0;
+    double maxSeconds = 0.0;
+    std::vector<double> recentSeconds;  // ring buffer, frame i is at i % frameStatsWindow
+};
+
+
+void AddFrameTime(FrameStats& stats, const double seconds) {
+    if (stats.recentSeconds.size() < frameStatsWindow) stats.recentSeconds.push_back(seconds);
+    else stats.recentSeconds[stats.count % frameStatsWindow] = seconds;
+
+    stats.count++;
+    stats.totalSeconds += seconds;
+    stats.maxSeconds = std::max(stats.maxSeconds, seconds);
+}
+
+
+void LogFrameStats(const FrameStats& stats) {
+    if (stats.count == 0) return;
+
+    std::vector<double> sorted = stats.recentSeconds;
+    std::sort(sorted.begin(), sorted.end());
+
+    LOG_INFO(
+        "%zu frames: mean %.3f ms, max %.3f ms, median %.3f ms and p95 %.3f ms of the last %zu",
+        stats.count,
+        stats.totalSeconds / stats.count * 1e3,
+        stats.maxSeconds * 1e3,
+        sorted[sorted.size() / 2] * 1e3,
+        sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)] * 1e3,
+        sorted.size()
+    );
+}
+
+
+// Ties go to the later site
+template <typename Metric = EuclideanMetric>
+Point GetNearestPoint(const std::vector<Point>& points, const PointData& ref, const Metric& metric = {}) {
+    assert(points.size() > 0);
+
+    size_t best = 0;
+    GLfloat bestDistance = std::numeric_limits<GLfloat>::infinity();
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const GLfloat distance = metric.Compare(points[i].pointData.x - ref.x, points[i].pointData.y - ref.y);
+
+        if (distance <= bestDistance) {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+
+    return points[best];
+}
+
+
+std::vector<Triangle> AddColorsToTriangles(const std::vector<TriangleData>& trianglesData, const std::vector<Point>& points) {
+    PROFILE_SCOPE("colour assignment");
+
+    std::vector<Triangle> output = {};
+
+    for (const auto& triangleData : trianglesData) {
+        const auto centerOfGravity = CalculateCenterOfGravity({ triangleData.pd1, triangleData.pd2, triangleData.pd3 });
+
+        const auto point = GetNearestPoint(points, centerOfGravity);
+
+        output.push_back({ triangleData, point.color });
+    }
+
+    return output;
+}
+
+
+LineEq GetPerpendicularLineFromCenter(const PointData& firstPoint, const PointData& secondPoint) {
+    const auto lineEq = GetLineEquation(firstPoint, secondPoint);
+
+    const PointData middlePoint = GetCenterOfLine(firstPoint, secondPoint);
+
+    return GetPerpendicularLine(lineEq, middlePoint);
+}
+
+
+std::vector<LineEq> GetLinesBetween(const std::vector<Point>& points) {
+    std::vector<LineEq> linesBetween = {};
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const auto& firstPoint = points[i];
+
+        for (size_t j = i + 1; j < points.size(); j++) {
+			const auto& secondPoint = points[j];
+
+            linesBetween.push_back(GetPerpendicularLineFromCenter(firstPoint.pointData, secondPoint.pointData));
+        }
+    }
+
+    return linesBetween;
+}
+
+
+std::vector<PointData> GetAllCentersOfLines(const std::vector<Point>& points) {
+    std::vector<PointData> output = {};
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const auto& firstPoint = points[i];
+
+        for (size_t j = 0; j < points.size(); j++) {
+            if (j == i) continue;
+
+			const auto& secondPoint = points[j];
+
+            output.push_back(GetCenterOfLine(firstPoint.pointData, secondPoint.pointData));
+        }
+    }
+
+    return output;
+}
+
+
+std::vector<PointData> GetAllIntersectionPoints(const std::vector<LineEq>& lines) {
+    std::vector<PointData> intersectionPoints = {};
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        const auto& firstLine = lines[i];
+
+        for (size_t j = i + 1; j < lines.size(); j++) {
+			const auto& secondLine = lines[j];
+
+            intersectionPoints.push_back(GetIntersectionPoint(firstLine, secondLine));
+        }
+    }
+
+    return intersectionPoints;
+}
+
+
+bool CouldVoronoiTriangleBeAdded(
+    const TriangleData& triangle,
+    const std::vector<Point>& points,
+    const std::vector<PointData>& intersectionPoints,
+    TriangleGrid& triangles
+) {
+    for (const auto& point : points) {
+        if (IsPointInsideTriangleOrOnTheEdge(triangle, point.pointData)) return false;
+    }
+
+    for (const auto& point : intersectionPoints) {
+        if (IsPointInsideTriangleOrOnTheEdge(triangle, point)) return false;
+    }
+
+    return !DoesTriangleOverlapGrid(triangles, triangle);
+}
+
+
+template <typename T, typename F>
+bool DoesVectorContainElement(
+    const std::vector<T>& elements,
+    const T& element,
+    const F&& areElementsEqual
+) {
+    for (const T& curElement : elements) {
+        if (areElementsEqual(curElement, element)) return true;
+    }
+
+    return false;
+}
+
+
+std::vector<PointData> FilterBadIntersectionPoints(
+    const std::vector<PointData>& intersectionPoints,
+    const std::vector<PointData>& points
+) {
+    std::vector<PointData> output = {};
+
+    for (const auto& intersectionPoint : intersectionPoints) {
+        if (
+            !DoesVectorContainElement(output, intersectionPoint, PointsDataEqual) &&
+            !DoesVectorContainElement(points, intersectionPoint, PointsDataEqual) &&
+            FloatsBiggerOrEqual(intersectionPoint.x, -1.0f) &&
+            FloatsLessOrEqual(intersectionPoint.x, 1.0f) &&
+            FloatsBiggerOrEqual(intersectionPoint.y, -1.0f) &&
+            FloatsLessOrEqual(intersectionPoint.y, 1.0f)
+        ) {
+            output.push_back(intersectionPoint);
+        }
+    }
+
+    return output;
+}
+
+
+std::vector<PointData> ExtractPointDatas(const std::vector<Point>& points) {
+    std::vector<PointData> output = {};
+
+    for (const auto& point : points) {
+        output.push_back(point.pointData);
+    }
+
+    return output;
+}
+
+
+std::vector<Triangle> ExtractTriangles1(const std::vector<Point>& points) {
+    const auto triangles = ExtractTriangles(points);
+
+    LOG_DEBUG("triangulation: %zu triangles", triangles.size());
+    LogTrianglesData(LogLevel::Trace, "triangle", triangles);
+
+    const auto smallerTriangles = ExtractSmallerTriangles(triangles);
+
+    LOG_DEBUG("subdivision: %zu triangles", smallerTriangles.size());
+    LogTrianglesData(LogLevel::Trace, "smaller triangle", smallerTriangles);
+
+    // const std::vector<Triangle> trianglesToDraw = CreateTrianglesFromPoints(points);
+
+    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(smallerTriangles, points);
+
+    return trianglesToDraw;
+}
+
+
+std::vector<Triangle> ExtractTriangles2(const std::vector<Point>& points) {
+    PROFILE_SCOPE("triangulation");
+
+    const auto linesBetween = GetLinesBetween(points);
+
+    LOG_DEBUG("%zu lines between points", linesBetween.size());
+    LogLineEquations(LogLevel::Trace, "line between", linesBetween);
+
+    const auto allIntersectionPoints = GetAllIntersectionPoints(linesBetween);
+
+    const auto centersOfLines = GetAllCentersOfLines(points);
+
+    const auto pointsData = ExtractPointDatas(points);
+
+    const auto intersectionPoints = FilterBadIntersectionPoints(allIntersectionPoints, pointsData);
+
+    LOG_DEBUG("%zu intersection points", intersectionPoints.size());
+    LogPointsData(LogLevel::Trace, "intersection point", intersectionPoints);
+
+    std::vector<PointData> allPoints = {};
+    allPoints.insert(allPoints.end(), allIntersectionPoints.begin(), allIntersectionPoints.end());
+    allPoints.insert(allPoints.end(), centersOfLines.begin(), centersOfLines.end());
+
+    std::vector<Triangle> triangles = {};
+    TriangleGrid grid = CreateTriangleGrid(pointsData);
+
+    for (const auto& point : points) {
+        for (const auto& intersectionPoint : intersectionPoints) {
+			for (const auto& centerPoint : centersOfLines) {
+                const Triangle triangle = {point.pointData, intersectionPoint, centerPoint, point.color};
+
+                if (CouldVoronoiTriangleBeAdded(triangle.triangleData, points, allPoints, grid)) {
+                    triangles.push_back(triangle);
+                    AddGridTriangle(grid, triangle.triangleData);
+                }
+                else {
+                    PROFILE_COUNT(RejectedVoronoiTriangles);
+                }
+			}
+        }
+    }
+
+    return triangles;
+}
+
+
+std::pair<PointData, PointData> GetSmallerPair(
+    const std::pair<PointData, PointData>&& firstPair,
+    const std::pair<PointData, PointData>&& secondPair
+) {
+    const auto firstSize = CalculateDistance(firstPair.first, firstPair.second);
+    const auto secondSize = CalculateDistance(secondPair.first, secondPair.second);
+
+    if (firstSize < secondSize) return firstPair;
+
+    return secondPair;
+}
+
+
+std::pair<PointData, PointData> GetLongestLine(
+    const std::vector<std::pair<PointData, PointData>>& lines
+) {
+    assert(lines.size() > 0);
+
+    GLfloat currentBestDistance = 0.0f;
+    auto currentBest = lines[0];
+
+    for (const auto& line : lines) {
+        const auto distance = CalculateDistance(line.first, line.second);
+
+        if (distance > currentBestDistance) {
+            currentBestDistance = distance;
+            currentBest = line;
+        }
+    }
+
+    return currentBest;
+}
+
+
+size_t GetLongestLineIndex(
+    const std::vector<std::pair<PointData, PointData>>& lines
+) {
+    assert(lines.size() > 0);
+
+    GLfloat currentBestDistance = 0.0f;
+    size_t currentBest = 0;
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        const auto line = lines[i];
+
+        const auto distance = CalculateDistance(line.first, line.second);
+
+        if (distance > currentBestDistance) {
+            currentBestDistance = distance;
+            currentBest = i;
+        }
+    }
+
+    return currentBest;
+}
+
+
+std::vector<Triangle> ExtractTriangles3(const std::vector<Point>& points) {
+    const auto bigTriangles = ExtractTriangles(points);
+
+    PROFILE_SCOPE("subdivision");
+
+    std::vector<TriangleData> trianglesData = {};
+
+    for (const auto& bigTriangle : bigTriangles) {
+        const auto p1p2Center = GetCenterOfLine(bigTriangle.pd1, bigTriangle.pd2);
+        const auto p2p3Center = GetCenterOfLine(bigTriangle.pd2, bigTriangle.pd3);
+        const auto p3p1Center = GetCenterOfLine(bigTriangle.pd3, bigTriangle.pd1);
+
+        trianglesData.push_back({bigTriangle.pd1, p1p2Center, p3p1Center});
+
+        trianglesData.push_back({bigTriangle.pd2, p1p2Center, p2p3Center});
+
+        trianglesData.push_back({bigTriangle.pd3, p2p3Center, p3p1Center});
+    }
+
+    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(trianglesData, points);
+
+    return trianglesToDraw;
+}
+
+
+std::vector<TriangleData> PerformExtractTriangles4MumboJumbo(const std::vector<TriangleData>& bigTriangles) {
+    PROFILE_SCOPE("subdivision");
+
+    std::vector<TriangleData> trianglesData = {};
+
+    for (const auto& bigTriangle : bigTriangles) {
+        const auto p1p2Center = GetCenterOfLine(bigTriangle.pd1, bigTriangle.pd2);
+        const auto p2p3Center = GetCenterOfLine(bigTriangle.pd2, bigTriangle.pd3);
+        const auto p3p1Center = GetCenterOfLine(bigTriangle.pd3, bigTriangle.pd1);
+
+        const auto p1p2Line = GetLineEquation(bigTriangle.pd1, bigTriangle.pd2);
+        const auto p2p3Line = GetLineEquation(bigTriangle.pd2, bigTriangle.pd3);
+        const auto p3p1Line = GetLineEquation(bigTriangle.pd3, bigTriangle.pd1);
+
+        const auto p1p2PerpendicularLine = GetPerpendicularLineFromCenter(bigTriangle.pd1, bigTriangle.pd2);
+        const auto p2p3PerpendicularLine = GetPerpendicularLineFromCenter(bigTriangle.pd2, bigTriangle.pd3);
+        const auto p3p1PerpendicularLine = GetPerpendicularLineFromCenter(bigTriangle.pd3, bigTriangle.pd1);
+
+        const auto p1IntersectionPoint = GetIntersectionPoint(p1p2PerpendicularLine, p3p1PerpendicularLine);
+        const auto p2IntersectionPoint = GetIntersectionPoint(p1p2PerpendicularLine, p2p3PerpendicularLine);
+        const auto p3IntersectionPoint = GetIntersectionPoint(p2p3PerpendicularLine, p3p1PerpendicularLine);
+
+        /*
+        assert(PointsDataEqual(p1IntersectionPoint, p2IntersectionPoint));
+        assert(PointsDataEqual(p2IntersectionPoint, p3IntersectionPoint));
+        assert(PointsDataEqual(p3IntersectionPoint, p1IntersectionPoint));
+        */
+
+        const auto triangleCircleCenter = p1IntersectionPoint;
+
+        // variant 1 -> acute triangle
+        // variant 2 -> right triangle triangle
+        // variant 3 -> obtuse triangle
+        if (IsPointInsideTriangle(bigTriangle, triangleCircleCenter)) {
+			trianglesData.push_back({bigTriangle.pd1, p1p2Center, triangleCircleCenter});
+			trianglesData.push_back({bigTriangle.pd1, triangleCircleCenter, p3p1Center});
+
+			trianglesData.push_back({bigTriangle.pd2, p1p2Center, triangleCircleCenter});
+			trianglesData.push_back({bigTriangle.pd2, triangleCircleCenter, p2p3Center});
+
+			trianglesData.push_back({bigTriangle.pd3, p2p3Center, triangleCircleCenter});
+			trianglesData.push_back({bigTriangle.pd3, triangleCircleCenter, p3p1Center});
+        }
+        else if (IsPointInsideTriangleOrOnTheEdge(bigTriangle, triangleCircleCenter)) {
+            const std::vector<std::pair<PointData, PointData>> lines = {
+                {bigTriangle.pd1, bigTriangle.pd2},
+                {bigTriangle.pd2, bigTriangle.pd3},
+                {bigTriangle.pd3, bigTriangle.pd1}
+            };
+
+            const auto longestLineIndex = GetLongestLineIndex(lines);
+
+            switch (longestLineIndex) {
+            case 0:
+                trianglesData.push_back({bigTriangle.pd3, p2p3Center, triangleCircleCenter});
+                trianglesData.push_back({bigTriangle.pd3, p3p1Center, triangleCircleCenter});
+
+                trianglesData.push_back({bigTriangle.pd1, p3p1Center, triangleCircleCenter});
+                trianglesData.push_back({bigTriangle.pd2, p2p3Center, triangleCircleCenter});
+                break;
+            case 1:
+                trianglesData.push_back({bigTriangle.pd1, p1p2Center, triangleCircleCenter});
+                trianglesData.push_back({bigTriangle.pd1, p3p1Center, triangleCircleCenter});
+
+                trianglesData.push_back({bigTriangle.pd3, p3p1Center, triangleCircleCenter});
+                trianglesData.push_back({bigTriangle.pd2, p1p2Center, triangleCircleCenter});
+                break;
+            case 2:
+                trianglesData.push_back({bigTriangle.pd2, p1p2Center, triangleCircleCenter});
+                trianglesData.push_back({bigTriangle.pd2, p2p3Center, triangleCircleCenter});
+
+                trianglesData.push_back({bigTriangle.pd1, p1p2Center, triangleCircleCenter});
+                trianglesData.push_back({bigTriangle.pd3, p2p3Center, triangleCircleCenter});
+                break;
+            default:
+                exit(1);
+            }
+        }
+        else {
+            const std::vector<std::pair<PointData, PointData>> lines = {
+                {bigTriangle.pd1, bigTriangle.pd2},
+                {bigTriangle.pd2, bigTriangle.pd3},
+                {bigTriangle.pd3, bigTriangle.pd1}
+            };
+
+            const auto longestLineIndex = GetLongestLineIndex(lines);
+
+            switch (longestLineIndex) {
+            case 0:
+                const auto p1p2IntersectionWithp2p3CenterLine = GetIntersectionPoint(p1p2Line, p2p3PerpendicularLine);
+                const auto p1p2IntersectionWithp3p1CenterLine = GetIntersectionPoint(p1p2Line, p3p1PerpendicularLine);
+
+                trianglesData.push_back({ bigTriangle.pd1, p1p2IntersectionWithp3p1CenterLine, p3p1Center });
+                trianglesData.push_back({ bigTriangle.pd2, p1p2IntersectionWithp2p3CenterLine, p2p3Center });
+
+                trianglesData.push_back({bigTriangle.pd3, p2p3Center, p1p2IntersectionWithp2p3CenterLine});
+                trianglesData.push_back({bigTriangle.pd3, p3p1Center, p1p2IntersectionWithp3p1CenterLine});
+
+                trianglesData.push_back({bigTriangle.pd3, p1p2IntersectionWithp2p3CenterLine, p1p2IntersectionWithp3p1CenterLine});
+                break;
+            case 1:
+                const auto p2p3IntersectionWithp1p2CenterLine = GetIntersectionPoint(p2p3Line, p1p2PerpendicularLine);
+                const auto p2p3IntersectionWithp3p1CenterLine = GetIntersectionPoint(p2p3Line, p3p1PerpendicularLine);
+
+                trianglesData.push_back({ bigTriangle.pd2, p2p3IntersectionWithp1p2CenterLine, p1p2Center });
+                trianglesData.push_back({ bigTriangle.pd3, p2p3IntersectionWithp3p1CenterLine, p3p1Center });
+
+                trianglesData.push_back({bigTriangle.pd1, p1p2Center, p2p3IntersectionWithp1p2CenterLine});
+                trianglesData.push_back({bigTriangle.pd1, p3p1Center, p2p3IntersectionWithp3p1CenterLine});
+
+                trianglesData.push_back({bigTriangle.pd1, p2p3IntersectionWithp1p2CenterLine, p2p3IntersectionWithp3p1CenterLine});
+                break;
+            case 2:
+                const auto p3p1IntersectionWithp1p2CenterLine = GetIntersectionPoint(p3p1Line, p1p2PerpendicularLine);
+                const auto p3p1IntersectionWithp2p3CenterLine = GetIntersectionPoint(p3p1Line, p2p3PerpendicularLine);
+
+                trianglesData.push_back({ bigTriangle.pd1, p3p1IntersectionWithp1p2CenterLine, p1p2Center });
+                trianglesData.push_back({ bigTriangle.pd3, p3p1IntersectionWithp2p3CenterLine, p2p3Center });
+
+                trianglesData.push_back({bigTriangle.pd2, p1p2Center, p3p1IntersectionWithp1p2CenterLine});
+                trianglesData.push_back({bigTriangle.pd2, p2p3Center, p3p1IntersectionWithp2p3CenterLine});
+
+                trianglesData.push_back({bigTriangle.pd2, p3p1IntersectionWithp1p2CenterLine, p3p1IntersectionWithp2p3CenterLine});
+                break;
+            default:
+                exit(1);
+            }
+        }
+    }
+
+    return trianglesData;
+}
+
+
+std::vector<Triangle> ExtractTriangles4(const std::vector<Point>& points) {
+    const auto bigTriangles = ExtractTriangles(points);
+
+    const auto trianglesData = PerformExtractTriangles4MumboJumbo(bigTriangles);
+
+    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(trianglesData, points);
+
+    return trianglesToDraw;
+}
+
+
+std::vector<Triangle> ExtractTriangles4_5(const std::vector<Point>& points) {
+    const auto bigTriangles = ExtractTriangles(points);
+
+    std::vector<TriangleData> smallerTriangles = {};
+
+    {
+        PROFILE_SCOPE("subdivision");
+
+        for (const auto& triangle : bigTriangles) {
+            const LineEq firstLine = GetPerpendicularLineFromCenter(triangle.pd1, triangle.pd2);
+            const LineEq secondLine = GetPerpendicularLineFromCenter(triangle.pd1, triangle.pd3);
+
+            // All three symmetrical lines in a triangle should intersect in one point
+
+            const auto intersectionPoint = GetIntersectionPoint(firstLine, secondLine);
+
+            smallerTriangles.push_back({ triangle.pd1, triangle.pd2, intersectionPoint });
+            smallerTriangles.push_back({ triangle.pd1, intersectionPoint, triangle.pd3 });
+            smallerTriangles.push_back({ intersectionPoint, triangle.pd2, triangle.pd3 });
+        }
+    }
+
+    const auto trianglesData = PerformExtractTriangles4MumboJumbo(smallerTriangles);
+
+    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(trianglesData, points);
+
+    return trianglesToDraw;
+}
+
+
+// Constrained Delaunay triangulation. Coordinates are kept in doubles, but the predicates are not
+// exact: a product of two coordinate differences can need more than the 53 bits of the mantissa,
+// and the Steiner vertices where walls cross are rounded doubles to begin with. Nearly collinear
+// or cocircular vertices can get the wrong sign, so edge recovery bounds its flips.
+enum class ConstraintKind : uint8_t {
+    None,
+    Segment,    // wall, blocks visibility between cells
+    Boundary    // polygon or hole outline, also separates the inside of the domain from the outside
+};
+
+
+struct DelaunayVertex {
+    double x;
+    double y;
+    int32_t site;   // index of the input point, -1 for the super triangle and constraint endpoints
+};
+
+
+struct DelaunayTriangle {
+    uint32_t vertices[3];           // counterclockwise
+    int32_t neighbours[3];          // neighbours[i] shares the edge opposite vertices[i], -1 outside
+    ConstraintKind constraints[3];  // kind of the edge opposite vertices[i]
+};
+
+
+struct Triangulation {
+    std::vector<DelaunayVertex> vertices;
+    std::vector<DelaunayTriangle> triangles;
+    std::vector<int32_t> vertexTriangles;   // any triangle using the vertex, rotations start there
+    int32_t lastTriangle = 0;
+    size_t flips = 0;
+};
+
+
+// The first three vertices form a super triangle around everything else
+const uint32_t superVertexCount = 3;
+
+
+struct ConstraintPolyline {
+    std::vector<PointData> points;
+    bool closed;
+    ConstraintKind kind;
+};
+
+
+double Orient2d(const DelaunayVertex& a, const DelaunayVertex& b, const DelaunayVertex& c) {
+    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+
+// Positive when d lies inside the circumcircle of the counterclockwise triangle abc. Results within
+// the rounding error are reported as 0 so that both diagonals of cocircular points count as legal
+// and flips cannot go round in circles.
+double InCircle(const DelaunayVertex& a, const DelaunayVertex& b, const DelaunayVertex& c, const DelaunayVertex& d) {
+    const double adx = a.x - d.x;
+    const double ady = a.y - d.y;
+    const double bdx = b.x - d.x;
+    const double bdy = b.y - d.y;
+    const double cdx = c.x - d.x;
+    const double cdy = c.y - d.y;
+
+    const double aLift = adx * adx + ady * ady;
+    const double bLift = bdx * bdx + bdy * bdy;
+    const double cLift = cdx * cdx + cdy * cdy;
+
+    const double determinant = aLift * (bdx * cdy - cdx * bdy) + bLift * (cdx * ady - adx * cdy) + cLift * (adx * bdy - bdx * ady);
+    const double permanent = aLift * (std::fabs(bdx * cdy) + std::fabs(cdx * bdy))
+        + bLift * (std::fabs(cdx * ady) + std::fabs(adx * cdy))
+        + cLift * (std::fabs(adx * bdy) + std::fabs(bdx * ady));
+
+    // Shewchuk's bound for the plain floating point evaluation
+    const double errorBound = (10.0 + 96.0 * std::numeric_limits<double>::epsilon()) * std::numeric_limits<double>::epsilon() * permanent;
+
+    return std::fabs(determinant) > errorBound ? determinant : 0.0;
+}
+
+
+DelaunayVertex GetCircumcenter(const DelaunayVertex& a, const DelaunayVertex& b, const DelaunayVertex& c) {
+    const double bx = b.x - a.x;
+    const double by = b.y - a.y;
+    const double cx = c.x - a.x;
+    const double cy = c.y - a.y;
+    const double d = 2.0 * (bx * cy - by * cx);
+
+    if (d == 0.0) return { (a.x + b.x + c.x) / 3.0, (a.y + b.y + c.y) / 3.0, -1 };
+
+    const double b2 = bx * bx + by * by;
+    const double c2 = cx * cx + cy * cy;
+
+    return { a.x + (cy * b2 - by * c2) / d, a.y + (bx * c2 - cx * b2) / d, -1 };
+}
+
+
+int GetVertexIndex(const DelaunayTriangle& triangle, const uint32_t vertex) {
+    for (int i = 0; i < 3; i++) {
+        if (triangle.vertices[i] == vertex) return i;
+    }
+
+    return -1;
+}
+
+
+int GetNeighbourIndex(const DelaunayTriangle& triangle, const int32_t neighbour) {
+    for (int i = 0; i < 3; i++) {
+        if (triangle.neighbours[i] == neighbour) return i;
+    }
+
+    return -1;
+}
+
+
+void ReplaceNeighbour(Triangulation& triangulation, const int32_t triangle, const int32_t oldNeighbour, const int32_t newNeighbour) {
+    if (triangle < 0) return;
+
+    const int i = GetNeighbourIndex(triangulation.triangles[triangle], oldNeighbour);
+    assert(i >= 0);
+
+    triangulation.triangles[triangle].neighbours[i] = newNeighbour;
+}
+
+
+void SetTriangle(Triangulation& triangulation, const int32_t index, const DelaunayTriangle& triangle) {
+    triangulation.triangles[index] = triangle;
+
+    for (const uint32_t vertex : triangle.vertices) {
+        triangulation.vertexTriangles[vertex] = index;
+    }
+}
+
+
+int32_t AddTriangle(Triangulation& triangulation, const DelaunayTriangle& triangle) {
+    triangulation.triangles.push_back({});
+    SetTriangle(triangulation, (int32_t)triangulation.triangles.size() - 1, triangle);
+
+    return (int32_t)triangulation.triangles.size() - 1;
+}
+
+
+// Turns the edge opposite vertices[edge] of the triangle into the other diagonal of its quad.
+// Afterwards the triangle is (a, b, d) and its neighbour (d, c, a) where a was vertices[edge].
+void FlipEdge(Triangulation& triangulation, const int32_t triangle, const int edge) {
+    const DelaunayTriangle t = triangulation.triangles[triangle];
+    const int32_t neighbour = t.neighbours[edge];
+    const DelaunayTriangle u = triangulation.triangles[neighbour];
+    const int j = GetNeighbourIndex(u, triangle);
+
+    const uint32_t a = t.vertices[edge];
+    const uint32_t b = t.vertices[(edge + 1) % 3];
+    const uint32_t c = t.vertices[(edge + 2) % 3];
+    const uint32_t d = u.vertices[j];
+
+    SetTriangle(triangulation, triangle, {
+        { a, b, d },
+        { u.neighbours[(j + 1) % 3], neighbour, t.neighbours[(edge + 2) % 3] },
+        { u.constraints[(j + 1) % 3], ConstraintKind::None, t.constraints[(edge + 2) % 3] }
+    });
+
+    SetTriangle(triangulation, neighbour, {
+        { d, c, a },
+        { t.neighbours[(edge + 1) % 3], triangle, u.neighbours[(j + 2) % 3] },
+        { t.constraints[(edge + 1) % 3], ConstraintKind::None, u.constraints[(j + 2) % 3] }
+    });
+
+    ReplaceNeighbour(triangulation, u.neighbours[(j + 1) % 3], neighbour, triangle);
+    ReplaceNeighbour(triangulation, t.neighbours[(edge + 1) % 3], triangle, neighbour);
+
+    triangulation.flips++;
+}
+
+
+// The super vertices stand in for points infinitely far away, each in its own direction from the
+// centre of the super triangle, and every incircle test is decided by its limit. A far point is
+// never inside a finite circumcircle, one with a far corner turns into the half plane beyond its
+// finite edge and one with two far corners into the half plane behind the tangent at its finite
+// corner. The limits describe an actual Delaunay triangulation, so the flips stay consistent, every
+// real triangle is Delaunay and the outline of the real ones is the convex hull.
+bool IsInsideCircumcircle(const Triangulation& triangulation, const DelaunayTriangle& t, const DelaunayVertex& p, const bool far) {
+    const auto& vertices = triangulation.vertices;
+
+    if (t.vertices[0] >= superVertexCount && t.vertices[1] >= superVertexCount && t.vertices[2] >= superVertexCount) {
+        if (far) return false;
+
+        return InCircle(vertices[t.vertices[0]], vertices[t.vertices[1]], vertices[t.vertices[2]], p) > 0.0;
+    }
+
+    int superCount = 0;
+    int corner = 0;     // the super corner of one, the finite corner of two
+
+    for (int i = 0; i < 3; i++) {
+        if (t.vertices[i] < superVertexCount) superCount++;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if ((t.vertices[i] < superVertexCount) == (superCount == 1)) corner = i;
+    }
+
+    const DelaunayVertex center = {
+        (vertices[0].x + vertices[1].x + vertices[2].x) / 3.0,
+        (vertices[0].y + vertices[1].y + vertices[2].y) / 3.0,
+        -1
+    };
+
+    const DelaunayVertex& v0 = vertices[t.vertices[corner]];
+    const DelaunayVertex& v1 = vertices[t.vertices[(corner + 1) % 3]];
+    const DelaunayVertex& v2 = vertices[t.vertices[(corner + 2) % 3]];
+
+    if (superCount == 1) {
+        if (!far) {
+            const double orientation = Orient2d(v1, v2, p);
+
+            if (orientation != 0.0) return orientation > 0.0;
+
+            // On the line of the finite edge only the edge itself is inside
+            const double along = (p.x - v1.x) * (v2.x - v1.x) + (p.y - v1.y) * (v2.y - v1.y);
+            const double length = (v2.x - v1.x) * (v2.x - v1.x) + (v2.y - v1.y) * (v2.y - v1.y);
+
+            return along > 0.0 && along < length;
+        }
+
+        // The circle touches the edge's line, a far point is inside when it is further out in
+        // proportion to its distance than the far corner
+        const double ex = v2.x - v1.x;
+        const double ey = v2.y - v1.y;
+        const double sx = v0.x - center.x;
+        const double sy = v0.y - center.y;
+        const double px = p.x - center.x;
+        const double py = p.y - center.y;
+
+        return (px * px + py * py) * (ex * sy - ey * sx) < (sx * sx + sy * sy) * (ex * py - ey * px);
+    }
+
+    if (superCount == 2) {
+        if (far) return InCircle(center, v1, v2, p) > 0.0;
+
+        // The circle through the finite corner and both far ones is the scaled circle through the
+        // centre and their directions, near the corner only the side towards its middle is inside
+        const DelaunayVertex middle = GetCircumcenter(center, v1, v2);
+
+        return (p.x - v0.x) * (middle.x - center.x) + (p.y - v0.y) * (middle.y - center.y) > 0.0;
+    }
+
+    return false;
+}
+
+
+bool IsEdgeLegal(const Triangulation& triangulation, const int32_t triangle, const int edge) {
+    const DelaunayTriangle& t = triangulation.triangles[triangle];
+
+    if (t.constraints[edge] != ConstraintKind::None || t.neighbours[edge] < 0) return true;
+
+    const DelaunayTriangle& u = triangulation.triangles[t.neighbours[edge]];
+    const uint32_t d = u.vertices[GetNeighbourIndex(u, triangle)];
+
+    return !IsInsideCircumcircle(triangulation, t, triangulation.vertices[d], d < superVertexCount);
+}
+
+
+// Lawson flips, every stack entry is an edge opposite a freshly inserted vertex
+void LegalizeEdges(Triangulation& triangulation, std::vector<std::pair<int32_t, int>>& stack) {
+    while (!stack.empty()) {
+        const auto [triangle, edge] = stack.back();
+        stack.pop_back();
+
+        if (IsEdgeLegal(triangulation, triangle, edge)) continue;
+
+        const int32_t neighbour = triangulation.triangles[triangle].neighbours[edge];
+
+        FlipEdge(triangulation, triangle, edge);
+
+        stack.push_back({ triangle, 0 });
+        stack.push_back({ neighbour, 2 });
+    }
+}
+
+
+struct TriangulationLocation {
+    int32_t triangle;
+    int edge;       // the point lies on the edge opposite vertices[edge], -1 when it is strictly inside
+    int32_t vertex; // an existing vertex at the same position, -1 otherwise
+};
+
+
+// Visibility walk from the given triangle, short for spatially sorted insertions and queries
+TriangulationLocation LocatePoint(const Triangulation& triangulation, const DelaunayVertex& point, int32_t triangle) {
+    for (size_t step = 0; ; step++) {
+        const DelaunayTriangle& t = triangulation.triangles[triangle];
+        int onEdges[3];
+        int onEdgeCount = 0;
+        bool moved = false;
+
+        // Rotating the first tested edge keeps the walk from cycling
+        for (int k = 0; k < 3; k++) {
+            const int i = (int)((k + step) % 3);
+            const double orientation = Orient2d(triangulation.vertices[t.vertices[(i + 1) % 3]], triangulation.vertices[t.vertices[(i + 2) % 3]], point);
+
+            if (orientation < 0.0) {
+                assert(t.neighbours[i] >= 0);
+                triangle = t.neighbours[i];
+                moved = true;
+                break;
+            }
+
+            if (orientation == 0.0) {
+                onEdges[onEdgeCount++] = i;
+            }
+        }
+
+        if (moved) continue;
+
+        if (onEdgeCount >= 2) {
+            return { triangle, -1, (int32_t)t.vertices[3 - onEdges[0] - onEdges[1]] };
+        }
+
+        return { triangle, onEdgeCount == 1 ? onEdges[0] : -1, -1 };
+    }
+}
+
+
+void InsertIntoTriangle(Triangulation& triangulation, const int32_t triangle, const uint32_t p, std::vector<std::pair<int32_t, int>>& stack) {
+    const DelaunayTriangle t = triangulation.triangles[triangle];
+    const uint32_t v0 = t.vertices[0];
+    const uint32_t v1 = t.vertices[1];
+    const uint32_t v2 = t.vertices[2];
+
+    const int32_t t1 = (int32_t)triangulation.triangles.size();
+    const int32_t t2 = t1 + 1;
+
+    SetTriangle(triangulation, triangle, { { p, v1, v2 }, { t.neighbours[0], t1, t2 }, { t.constraints[0], ConstraintKind::None, ConstraintKind::None } });
+    AddTriangle(triangulation, { { v0, p, v2 }, { triangle, t.neighbours[1], t2 }, { ConstraintKind::None, t.constraints[1], ConstraintKind::None } });
+    AddTriangle(triangulation, { { v0, v1, p }, { triangle, t1, t.neighbours[2] }, { ConstraintKind::None, ConstraintKind::None, t.constraints[2] } });
+
+    ReplaceNeighbour(triangulation, t.neighbours[1], triangle, t1);
+    ReplaceNeighbour(triangulation, t.neighbours[2], triangle, t2);
+
+    stack.push_back({ triangle, 0 });
+    stack.push_back({ t1, 1 });
+    stack.push_back({ t2, 2 });
+}
+
+
+// Splits the edge opposite vertices[edge] and both triangles sharing it, a constrained edge stays
+// constrained in both halves
+void InsertIntoEdge(Triangulation& triangulation, const int32_t triangle, const int edge, const uint32_t p, std::vector<std::pair<int32_t, int>>& stack) {
+    const DelaunayTriangle t = triangulation.triangles[triangle];
+    const int32_t neighbour = t.neighbours[edge];
+    assert(neighbour >= 0);
+
+    const DelaunayTriangle u = triangulation.triangles[neighbour];
+    const int j = GetNeighbourIndex(u, triangle);
+
+    const uint32_t a = t.vertices[edge];
+    const uint32_t b = t.vertices[(edge + 1) % 3];
+    const uint32_t c = t.vertices[(edge + 2) % 3];
+    const uint32_t d = u.vertices[j];
+    const ConstraintKind split = t.constraints[edge];
+
+    const int32_t t2 = (int32_t)triangulation.triangles.size();
+    const int32_t u2 = t2 + 1;
+
+    SetTriangle(triangulation, triangle, { { a, b, p }, { u2, t2, t.neighbours[(edge + 2) % 3] }, { split, ConstraintKind::None, t.constraints[(edge + 2) % 3] } });
+    AddTriangle(triangulation, { { a, p, c }, { neighbour, t.neighbours[(edge + 1) % 3], triangle }, { split, t.constraints[(edge + 1) % 3], ConstraintKind::None } });
+    SetTriangle(triangulation, neighbour, { { d, c, p }, { t2, u2, u.neighbours[(j + 2) % 3] }, { split, ConstraintKind::None, u.constraints[(j + 2) % 3] } });
+    AddTriangle(triangulation, { { d, p, b }, { triangle, u.neighbours[(j + 1) % 3], neighbour }, { split, u.constraints[(j + 1) % 3], ConstraintKind::None } });
+
+    ReplaceNeighbour(triangulation, t.neighbours[(edge + 1) % 3], triangle, t2);
+    ReplaceNeighbour(triangulation, u.neighbours[(j + 1) % 3], neighbour, u2);
+
+    stack.push_back({ triangle, 2 });
+    stack.push_back({ t2, 1 });
+    stack.push_back({ neighbour, 2 });
+    stack.push_back({ u2, 1 });
+}
+
+
+uint32_t AddDelaunayVertex(Triangulation& triangulation, const DelaunayVertex& vertex) {
+    triangulation.vertices.push_back(vertex);
+    triangulation.vertexTriangles.push_back(-1);
+
+    return (uint32_t)triangulation.vertices.size() - 1;
+}
+
+
+// Returns the vertex at the given position, which is an existing one for duplicates
+uint32_t InsertDelaunayVertex(Triangulation& triangulation, const DelaunayVertex& vertex, std::vector<std::pair<int32_t, int>>& stack) {
+    const auto location = LocatePoint(triangulation, vertex, triangulation.lastTriangle);
+
+    if (location.vertex >= 0) {
+        auto& existing = triangulation.vertices[location.vertex];
+
+        if (existing.site < 0) existing.site = vertex.site;
+
+        return (uint32_t)location.vertex;
+    }
+
+    const uint32_t p = AddDelaunayVertex(triangulation, vertex);
+
+    if (location.edge >= 0) {
+        InsertIntoEdge(triangulation, location.triangle, location.edge, p, stack);
+    }
+    else {
+        InsertIntoTriangle(triangulation, location.triangle, p, stack);
+    }
+
+    LegalizeEdges(triangulation, stack);
+
+    triangulation.lastTriangle = triangulation.vertexTriangles[p];
+
+    return p;
+}
+
+
+// The edge between the two vertices as (triangle, index of the opposite vertex), triangle is -1
+// when they are not connected
+std::pair<int32_t, int> FindEdge(const Triangulation& triangulation, const uint32_t from, const uint32_t to) {
+    const int32_t first = triangulation.vertexTriangles[from];
+
+    // Counterclockwise first, super triangle corners lie on the outer boundary and need the other way too
+    for (const int direction : { 1, 2 }) {
+        int32_t triangle = first;
+
+        do {
+            const DelaunayTriangle& t = triangulation.triangles[triangle];
+            const int k = GetVertexIndex(t, from);
+
+            if (t.vertices[(k + 1) % 3] == to) return { triangle, (k + 2) % 3 };
+            if (t.vertices[(k + 2) % 3] == to) return { triangle, (k + 1) % 3 };
+
+            triangle = t.neighbours[(k + direction) % 3];
+        } while (triangle != first && triangle >= 0);
+
+        if (triangle == first) break;
+    }
+
+    return { -1, -1 };
+}
+
+
+void MarkConstraint(Triangulation& triangulation, const int32_t triangle, const int edge, const ConstraintKind kind) {
+    DelaunayTriangle& t = triangulation.triangles[triangle];
+    t.constraints[edge] = std::max(t.constraints[edge], kind);
+
+    if (t.neighbours[edge] >= 0) {
+        DelaunayTriangle& u = triangulation.triangles[t.neighbours[edge]];
+        const int j = GetNeighbourIndex(u, triangle);
+        u.constraints[j] = std::max(u.constraints[j], kind);
+    }
+}
+
+
+bool DoSegmentsCross(const DelaunayVertex& a, const DelaunayVertex& b, const DelaunayVertex& c, const DelaunayVertex& d) {
+    return Orient2d(a, b, c) * Orient2d(a, b, d) < 0.0 && Orient2d(c, d, a) * Orient2d(c, d, b) < 0.0;
+}
+
+
+// Sloan's edge recovery: the edges crossing the segment are flipped away one by one (those in a
+// non-convex quad wait for their turn), then the new edges are made Delaunay again
+void RecoverConstraint(
+    Triangulation& triangulation,
+    const uint32_t a,
+    const uint32_t b,
+    const ConstraintKind kind,
+    std::vector<std::pair<uint32_t, uint32_t>>& crossed
+) {
+    const auto& vertices = triangulation.vertices;
+    std::vector<std::pair<uint32_t, uint32_t>> newEdges = {};
+
+    size_t head = 0;
+    size_t attempts = 0;
+    const size_t maxAttempts = crossed.size() * crossed.size() + 64;
+
+    while (head < crossed.size()) {
+        const auto edge = crossed[head++];
+        const auto [triangle, index] = FindEdge(triangulation, edge.first, edge.second);
+
+        if (triangle < 0) continue;
+
+        const DelaunayTriangle& t = triangulation.triangles[triangle];
+        const DelaunayTriangle& u = triangulation.triangles[t.neighbours[index]];
+        const uint32_t p = t.vertices[index];
+        const uint32_t q = u.vertices[GetNeighbourIndex(u, triangle)];
+
+        if (!DoSegmentsCross(vertices[p], vertices[q], vertices[edge.first], vertices[edge.second])) {
+            if (++attempts > maxAttempts) {
+                LOG_WARNING("constraint recovery gave up after %zu attempts", attempts);
+                break;
+            }
+
+            crossed.push_back(edge);
+            continue;
+        }
+
+        FlipEdge(triangulation, triangle, index);
+
+        if (p != a && p != b && q != a && q != b && DoSegmentsCross(vertices[a], vertices[b], vertices[p], vertices[q])) {
+            crossed.push_back({ p, q });
+        }
+        else {
+            newEdges.push_back({ p, q });
+        }
+    }
+
+    const auto [triangle, index] = FindEdge(triangulation, a, b);
+
+    if (triangle < 0) {
+        LOG_WARNING("constraint %u-%u could not be recovered", a, b);
+        return;
+    }
+
+    // Marked first, the flips below must leave it alone
+    MarkConstraint(triangulation, triangle, index, kind);
+
+    bool flipped = true;
+
+    while (flipped) {
+        flipped = false;
+
+        for (auto& edge : newEdges) {
+            const auto [t, i] = FindEdge(triangulation, edge.first, edge.second);
+
+            if (t < 0 || IsEdgeLegal(triangulation, t, i)) continue;
+
+            const uint32_t p = triangulation.triangles[t].vertices[i];
+            const int32_t neighbour = triangulation.triangles[t].neighbours[i];
+            const DelaunayTriangle& u = triangulation.triangles[neighbour];
+
+            edge = { p, u.vertices[GetNeighbourIndex(u, t)] };
+            FlipEdge(triangulation, t, i);
+            flipped = true;
+        }
+    }
+}
+
+
+DelaunayVertex GetSegmentIntersection(const DelaunayVertex& a, const DelaunayVertex& b, const DelaunayVertex& c, const DelaunayVertex& d) {
+    const double t = Orient2d(c, d, a) / (Orient2d(c, d, a) - Orient2d(c, d, b));
+
+    return { a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, -1 };
+}
+
+
+void InsertConstraint(Triangulation& triangulation, const uint32_t from, const uint32_t to, const ConstraintKind kind) {
+    std::vector<std::pair<uint32_t, uint32_t>> pending = { { from, to } };
+    std::vector<std::pair<uint32_t, uint32_t>> crossed = {};
+    std::vector<std::pair<int32_t, int>> stack = {};
+
+    while (!pending.empty()) {
+        auto [a, b] = pending.back();
+        pending.pop_back();
+
+        if (a == b) continue;
+
+        const auto existing = FindEdge(triangulation, a, b);
+
+        if (existing.first >= 0) {
+            MarkConstraint(triangulation, existing.first, existing.second, kind);
+            continue;
+        }
+
+        const auto& vertices = triangulation.vertices;
+
+        // Find the triangle around a that the segment leaves through, or a vertex lying on the segment
+        int32_t triangle = triangulation.vertexTriangles[a];
+        int edge = -1;
+        uint32_t collinear = a;
+
+        do {
+            const DelaunayTriangle& t = triangulation.triangles[triangle];
+            const int k = GetVertexIndex(t, a);
+            const uint32_t right = t.vertices[(k + 1) % 3];
+            const uint32_t left = t.vertices[(k + 2) % 3];
+
+            for (const uint32_t v : { right, left }) {
+                const double dot = (vertices[v].x - vertices[a].x) * (vertices[b].x - vertices[a].x) + (vertices[v].y - vertices[a].y) * (vertices[b].y - vertices[a].y);
+
+                if (Orient2d(vertices[a], vertices[b], vertices[v]) == 0.0 && dot > 0.0) collinear = v;
+            }
+
+            if (collinear != a) break;
+
+            if (Orient2d(vertices[a], vertices[right], vertices[b]) > 0.0 && Orient2d(vertices[a], vertices[left], vertices[b]) < 0.0) {
+                edge = k;
+                break;
+            }
+
+            triangle = t.neighbours[(k + 1) % 3];
+        } while (triangle != triangulation.vertexTriangles[a] && triangle >= 0);
+
+        if (collinear != a) {
+            pending.push_back({ collinear, b });
+            pending.push_back({ a, collinear });
+            continue;
+        }
+
+        if (edge < 0) {
+            LOG_WARNING("constraint %u-%u could not be inserted", a, b);
+            continue;
+        }
+
+        // Walk along the segment collecting the crossed edges, vertices[edge + 1] is always on the right
+        crossed.clear();
+        bool restarted = false;
+
+        while (true) {
+            const DelaunayTriangle& t = triangulation.triangles[triangle];
+            const uint32_t right = t.vertices[(edge + 1) % 3];
+            const uint32_t left = t.vertices[(edge + 2) % 3];
+
+            if (t.constraints[edge] != ConstraintKind::None) {
+                // Crossing constraints meet in a new vertex that splits both
+                const uint32_t p = AddDelaunayVertex(triangulation, GetSegmentIntersection(vertices[a], vertices[b], vertices[right], vertices[left]));
+
+                InsertIntoEdge(triangulation, triangle, edge, p, stack);
+                LegalizeEdges(triangulation, stack);
+
+                pending.push_back({ p, b });
+                pending.push_back({ a, p });
+                restarted = true;
+                break;
+            }
+
+            crossed.push_back({ right, left });
+
+            const int32_t neighbour = t.neighbours[edge];
+            const DelaunayTriangle& u = triangulation.triangles[neighbour];
+            const int j = GetNeighbourIndex(u, triangle);
+            const uint32_t d = u.vertices[j];
+
+            if (d == b) break;
+
+            const double orientation = Orient2d(vertices[a], vertices[b], vertices[d]);
+
+            if (orientation == 0.0) {
+                pending.push_back({ d, b });
+                b = d;
+                break;
+            }
+
+            triangle = neighbour;
+            edge = orientation > 0.0 ? (j + 1) % 3 : (j + 2) % 3;
+        }
+
+        if (restarted) continue;
+
+        RecoverConstraint(triangulation, a, b, kind, crossed);
+    }
+}
+
+
+uint32_t GetMortonCode(const uint32_t x, const uint32_t y) {
+    const auto spread = [](uint32_t value) {
+        value &= 0xFFFF;
+        value = (value | (value << 8)) & 0x00FF00FF;
+        value = (value | (value << 4)) & 0x0F0F0F0F;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+        return value;
+    };
+
+    return spread(x) | (spread(y) << 1);
+}
+
+
+// Position along the Hilbert curve through a 65536² grid. Unlike the Morton order the curve never
+// jumps, consecutive keys are always neighbouring cells. The rotations of all 16 levels are found
+// with a parallel prefix scan over the bits instead of a branch per level, which mispredicts half
+// the time on random input.
+uint32_t GetHilbertIndex(const uint32_t x, const uint32_t y) {
+    uint32_t a = x ^ y;
+    uint32_t b = 0xFFFF ^ a;
+    uint32_t c = 0xFFFF ^ (x | y);
+    uint32_t d = x & (y ^ 0xFFFF);
+
+    uint32_t A = a | (b >> 1);
+    uint32_t B = (a >> 1) ^ a;
+    uint32_t C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+    uint32_t D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+
+    for (int shift = 2; shift <= 4; shift *= 2) {
+        a = A;
+        b = B;
+        c = C;
+        d = D;
+
+        A = (a & (a >> shift)) ^ (b & (b >> shift));
+        B = (a & (b >> shift)) ^ (b & ((a ^ b) >> shift));
+        C ^= (a & (c >> shift)) ^ (b & (d >> shift));
+        D ^= (b & (c >> shift)) ^ ((a ^ b) & (d >> shift));
+    }
+
+    a = A;
+    b = B;
+    c = C;
+    d = D;
+
+    C ^= (a & (c >> 8)) ^ (b & (d >> 8));
+    D ^= (b & (c >> 8)) ^ ((a ^ b) & (d >> 8));
+
+    a = C ^ (C >> 1);
+    b = D ^ (D >> 1);
+
+    const uint32_t i0 = x ^ y;
+    const uint32_t i1 = b | (0xFFFF ^ (i0 | a));
+
+    return GetMortonCode(i0, i1);
+}
+
+
+// Stable parallel LSD radix sort of (key, value) pairs on the low keyBits bits of the keys, 8 bits a
+// pass. Every block counts its own digits, so the scatter needs no atomics, and passes where all keys
+// share the digit are skipped.
+void RadixSortPairs(std::vector<std::pair<uint64_t, uint32_t>>& pairs, const int keyBits) {
+    PROFILE_SCOPE("radix sort");
+
+    const size_t count = pairs.size();
+    const size_t blockCount = std::clamp<size_t>(count / 65536, 1, GetWorkerCount());
+    std::vector<std::pair<uint64_t, uint32_t>> sorted(count);
+    std::vector<std::array<size_t, 256>> offsets(blockCount);
+
+    for (int shift = 0; shift < keyBits; shift += 8) {
+        ParallelFor(blockCount, [&](size_t begin, size_t end, size_t) {
+            for (size_t block = begin; block < end; block++) {
+                offsets[block].fill(0);
+
+                for (size_t i = count * block / blockCount; i < count * (block + 1) / blockCount; i++) {
+                    offsets[block][(pairs[i].first >> shift) & 0xFF]++;
+                }
+            }
+        }, 1);
+
+        size_t total = 0;
+        bool oneDigit = false;
+
+        for (size_t digit = 0; digit < 256; digit++) {
+            size_t digitCount = 0;
+
+            for (size_t block = 0; block < blockCount; block++) {
+                const size_t blockDigitCount = offsets[block][digit];
+                offsets[block][digit] = total + digitCount;
+                digitCount += blockDigitCount;
+            }
+
+            oneDigit = oneDigit || digitCount == count;
+            total += digitCount;
+        }
+
+        if (oneDigit) continue;
+
+        ParallelFor(blockCount, [&](size_t begin, size_t end, size_t) {
+            for (size_t block = begin; block < end; block++) {
+                for (size_t i = count * block / blockCount; i < count * (block + 1) / blockCount; i++) {
+                    sorted[offsets[block][(pairs[i].first >> shift) & 0xFF]++] = pairs[i];
+                }
+            }
+        }, 1);
+
+        pairs.swap(sorted);
+    }
+}
+
+
+// Hilbert index of every site over the bounding box of the sites, paired with the site id
+std::vector<std::pair<uint64_t, uint32_t>> CreateHilbertKeys(const std::vector<Point>& points) {
+    GLfloat minX = std::numeric_limits<GLfloat>::max();
+    GLfloat minY = std::numeric_limits<GLfloat>::max();
+    GLfloat maxX = std::numeric_limits<GLfloat>::lowest();
+    GLfloat maxY = std::numeric_limits<GLfloat>::lowest();
+
+    for (const auto& point : points) {
+        minX = std::min(minX, point.pointData.x);
+        minY = std::min(minY, point.pointData.y);
+        maxX = std::max(maxX, point.pointData.x);
+        maxY = std::max(maxY, point.pointData.y);
+    }
+
+    const double scale = 65535.0 / std::max<double>({ (double)maxX - minX, (double)maxY - minY, 1e-30 });
+    std::vector<std::pair<uint64_t, uint32_t>> keys(points.size());
+
+    ParallelFor(points.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const uint32_t x = (uint32_t)std::clamp((points[i].pointData.x - minX) * scale, 0.0, 65535.0);
+            const uint32_t y = (uint32_t)std::clamp((points[i].pointData.y - minY) * scale, 0.0, 65535.0);
+            keys[i] = { GetHilbertIndex(x, y), (uint32_t)i };
+        }
+    }, 1 << 16);
+
+    return keys;
+}
+
+
+// Site ids along the Hilbert curve
+std::vector<uint32_t> CreateHilbertOrder(const std::vector<Point>& points) {
+    auto keys = CreateHilbertKeys(points);
+    RadixSortPairs(keys, 32);
+
+    std::vector<uint32_t> order(keys.size());
+
+    for (size_t i = 0; i < keys.size(); i++) order[i] = keys[i].second;
+
+    return order;
+}
+
+
+// Biased randomized insertion order (Amenta, Choi and Rote): a site lands in the last round with
+// probability 1/2, in the one before with 1/4 and so on, and every round is walked along the Hilbert
+// curve. The rounds keep the expected cavity sizes of a random order on clustered or gridded input,
+// the curve keeps the point location walks short. roundEnds receives the position after each round.
+std::vector<uint32_t> CreateBrioOrder(const std::vector<Point>& points, std::vector<size_t>* roundEnds = nullptr, const uint64_t seed = 0x5eed) {
+    auto keys = CreateHilbertKeys(points);
+
+    int rounds = 0;
+    while (((size_t)64 << rounds) < points.size()) rounds++;
+
+    ParallelFor(keys.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            uint64_t hash = MixBits(seed ^ MixBits(i + 0x9e3779b97f4a7c15ull));
+            int depth = 0;
+
+            while ((hash & 1) != 0 && depth < rounds) {
+                hash >>= 1;
+                depth++;
+            }
+
+            keys[i].first |= (uint64_t)(rounds - depth) << 32;
+        }
+    }, 1 << 16);
+
+    RadixSortPairs(keys, 40);
+
+    std::vector<uint32_t> order(keys.size());
+
+    for (size_t i = 0; i < keys.size(); i++) order[i] = keys[i].second;
+
+    if (roundEnds != nullptr) {
+        roundEnds->clear();
+
+        for (size_t i = 1; i <= keys.size(); i++) {
+            if (i == keys.size() || keys[i].first >> 32 != keys[i - 1].first >> 32) roundEnds->push_back(i);
+        }
+    }
+
+    return order;
+}
+
+
+// Reorders the sites into CreateBrioOrder so every later stage walks memory in space order. Within a
+// round the sites follow the curve, so only the prefixes ending at roundEnds are random samples, which
+// is where the progressive builds cut. Returns the original id of every site, for anything that has
+// to report ids of the input.
+std::vector<uint32_t> SortSitesSpatially(std::vector<Point>& points, std::vector<size_t>* roundEnds = nullptr) {
+    PROFILE_SCOPE("spatial sort");
+
+    const auto order = CreateBrioOrder(points, roundEnds);
+    std::vector<Point> sorted(points.size());
+
+    ParallelFor(points.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) sorted[i] = points[order[i]];
+    }, 1 << 16);
+
+    points.swap(sorted);
+
+    return order;
+}
+
+
+// Renumbers the triangles along the Hilbert curve through a 256² grid over the sites. The insertion
+// rounds leave neighbouring triangles scattered over the array and every stage walking the mesh
+// afterwards pays for that in cache misses. A few dozen triangles share a grid cell, which is all the
+// locality a cache line needs, and the 16 bit keys sort in two passes.
+void SortTrianglesSpatially(Triangulation& triangulation) {
+    PROFILE_SCOPE("triangle sort");
+
+    const size_t triangleCount = triangulation.triangles.size();
+
+    double minX = std::numeric_limits<double>::max();
+    double minY = std::numeric_limits<double>::max();
+    double maxX = std::numeric_limits<double>::lowest();
+    double maxY = std::numeric_limits<double>::lowest();
+
+    for (size_t i = superVertexCount; i < triangulation.vertices.size(); i++) {
+        minX = std::min(minX, triangulation.vertices[i].x);
+        minY = std::min(minY, triangulation.vertices[i].y);
+        maxX = std::max(maxX, triangulation.vertices[i].x);
+        maxY = std::max(maxY, triangulation.vertices[i].y);
+    }
+
+    const double scale = 255.0 / std::max({ maxX - minX, maxY - minY, 1e-30 });
+    std::vector<std::pair<uint64_t, uint32_t>> keys(triangleCount);
+
+    ParallelFor(triangleCount, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const DelaunayTriangle& t = triangulation.triangles[i];
+
+            // Any corner but one of the super triangle
+            const uint32_t corner = t.vertices[0] >= superVertexCount ? t.vertices[0] : t.vertices[1] >= superVertexCount ? t.vertices[1] : t.vertices[2];
+            const DelaunayVertex& v = triangulation.vertices[corner];
+
+            const uint32_t x = (uint32_t)std::clamp((v.x - minX) * scale, 0.0, 255.0);
+            const uint32_t y = (uint32_t)std::clamp((v.y - minY) * scale, 0.0, 255.0);
+            keys[i] = { GetHilbertIndex(x << 8, y << 8) >> 16, (uint32_t)i };
+        }
+    }, 1 << 16);
+
+    RadixSortPairs(keys, 16);
+
+    std::vector<int32_t> newIndices(triangleCount);
+
+    for (size_t i = 0; i < triangleCount; i++) newIndices[keys[i].second] = (int32_t)i;
+
+    std::vector<DelaunayTriangle> sorted(triangleCount);
+
+    ParallelFor(triangleCount, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            DelaunayTriangle t = triangulation.triangles[keys[i].second];
+
+            for (int k = 0; k < 3; k++) {
+                if (t.neighbours[k] >= 0) t.neighbours[k] = newIndices[t.neighbours[k]];
+            }
+
+            sorted[i] = t;
+        }
+    }, 1 << 16);
+
+    triangulation.triangles.swap(sorted);
+
+    for (auto& triangle : triangulation.vertexTriangles) {
+        if (triangle >= 0) triangle = newIndices[triangle];
+    }
+
+    triangulation.lastTriangle = newIndices[triangulation.lastTriangle];
+}
+
+
+// Sites are inserted in biased randomized Hilbert order, see CreateBrioOrder
+Triangulation CreateTriangulation(const std::vector<Point>& points, const std::vector<ConstraintPolyline>& constraints) {
+    PROFILE_SCOPE("triangulation");
+
+    Triangulation triangulation = {};
+
+    double minX = std::numeric_limits<double>::max();
+    double minY = std::numeric_limits<double>::max();
+    double maxX = std::numeric_limits<double>::lowest();
+    double maxY = std::numeric_limits<double>::lowest();
+
+    const auto extend = [&](const PointData& pointData) {
+        minX = std::min(minX, (double)pointData.x);
+        minY = std::min(minY, (double)pointData.y);
+        maxX = std::max(maxX, (double)pointData.x);
+        maxY = std::max(maxY, (double)pointData.y);
+    };
+
+    for (const auto& point : points) extend(point.pointData);
+    for (const auto& polyline : constraints) for (const auto& pointData : polyline.points) extend(pointData);
+
+    if (minX > maxX) {
+        minX = minY = -1.0;
+        maxX = maxY = 1.0;
+    }
+
+    const double centerX = (minX + maxX) / 2.0;
+    const double centerY = (minY + maxY) / 2.0;
+    const double radius = std::max({ maxX - minX, maxY - minY, 1e-6 }) * 64.0;
+
+    AddDelaunayVertex(triangulation, { centerX - radius * 2.0, centerY - radius, -1 });
+    AddDelaunayVertex(triangulation, { centerX + radius * 2.0, centerY - radius, -1 });
+    AddDelaunayVertex(triangulation, { centerX, centerY + radius * 2.0, -1 });
+    AddTriangle(triangulation, { { 0, 1, 2 }, { -1, -1, -1 }, { ConstraintKind::None, ConstraintKind::None, ConstraintKind::None } });
+
+    triangulation.vertices.reserve(points.size() + superVertexCount);
+    triangulation.triangles.reserve(points.size() * 2 + 1);
+
+    std::vector<std::pair<int32_t, int>> stack = {};
+
+    for (const uint32_t site : CreateBrioOrder(points)) {
+        InsertDelaunayVertex(triangulation, { points[site].pointData.x, points[site].pointData.y, (int32_t)site }, stack);
+    }
+
+    for (const auto& polyline : constraints) {
+        std::vector<uint32_t> polylineVertices = {};
+
+        for (const auto& pointData : polyline.points) {
+            polylineVertices.push_back(InsertDelaunayVertex(triangulation, { pointData.x, pointData.y, -1 }, stack));
+        }
+
+        for (size_t i = 0; i + 1 < polylineVertices.size(); i++) {
+            InsertConstraint(triangulation, polylineVertices[i], polylineVertices[i + 1], polyline.kind);
+        }
+
+        if (polyline.closed && polylineVertices.size() > 2) {
+            InsertConstraint(triangulation, polylineVertices.back(), polylineVertices.front(), polyline.kind);
+        }
+    }
+
+    SortTrianglesSpatially(triangulation);
+
+    return triangulation;
+}
+
+
+// Sites joined by a Delaunay edge have neighbouring cells, edges to the super triangle and to
+// constraint endpoints are skipped
+SiteAdjacency BuildTriangulationAdjacency(const Triangulation& triangulation, const size_t siteCount) {
+    std::vector<std::pair<uint32_t, uint32_t>> edges = {};
+    edges.reserve(triangulation.triangles.size() * 3 / 2);
+
+    for (const auto& t : triangulation.triangles) {
+        for (int k = 0; k < 3; k++) {
+            const int32_t a = triangulation.vertices[t.vertices[k]].site;
+            const int32_t b = triangulation.vertices[t.vertices[(k + 1) % 3]].site;
+
+            // Every inner edge is seen from both of its triangles, keep one of them
+            if (a >= 0 && b >= 0 && a < b) edges.push_back({ (uint32_t)a, (uint32_t)b });
+        }
+    }
+
+    return CreateSiteAdjacency(siteCount, edges);
+}
+
+
+// Triangles of the domain: inside an odd number of boundaries when there are any, otherwise
+// everything but the super triangle
+std::vector<uint8_t> ClassifyDomain(const Triangulation& triangulation, const bool hasBoundaries) {
+    const auto& triangles = triangulation.triangles;
+    std::vector<uint8_t> inside(triangles.size(), 0);
+
+    const auto touchesSuperTriangle = [&](const DelaunayTriangle& t) {
+        return t.vertices[0] < superVertexCount || t.vertices[1] < superVertexCount || t.vertices[2] < superVertexCount;
+    };
+
+    if (!hasBoundaries) {
+        for (size_t i = 0; i < triangles.size(); i++) {
+            inside[i] = !touchesSuperTriangle(triangles[i]);
+        }
+
+        return inside;
+    }
+
+    // Breadth first over unconstrained edges, crossing a boundary opens the next depth
+    std::vector<int32_t> depths(triangles.size(), -1);
+    std::vector<int32_t> current = { triangulation.vertexTriangles[0] };
+    std::vector<int32_t> next = {};
+
+    depths[current[0]] = 0;
+
+    for (int32_t depth = 0; !current.empty(); depth++) {
+        for (size_t head = 0; head < current.size(); head++) {
+            const DelaunayTriangle& t = triangles[current[head]];
+
+            for (int i = 0; i < 3; i++) {
+                const int32_t neighbour = t.neighbours[i];
+
+                if (neighbour < 0 || depths[neighbour] >= 0) continue;
+
+                if (t.constraints[i] == ConstraintKind::Boundary) {
+                    next.push_back(neighbour);
+                }
+                else {
+                    depths[neighbour] = depth;
+                    current.push_back(neighbour);
+                }
+            }
+        }
+
+        current.clear();
+
+        for (const int32_t triangle : next) {
+            if (depths[triangle] >= 0) continue;
+
+            depths[triangle] = depth + 1;
+            current.push_back(triangle);
+        }
+
+        next.clear();
+    }
+
+    for (size_t i = 0; i < triangles.size(); i++) {
+        inside[i] = depths[i] % 2 == 1 && !touchesSuperTriangle(triangles[i]);
+    }
+
+    return inside;
+}
+
+
+// Part of a triangle next to walls, halved depth times from the whole triangle
+struct VoronoiRegion {
+    std::array<DelaunayVertex, 3> corners;
+    int depth;
+};
+
+
+struct VoronoiScratch {
+    std::vector<int32_t> visitedBy;
+    std::vector<int32_t> triangles;
+    std::vector<uint32_t> candidates;
+    std::vector<double> polygon;
+    std::vector<double> clipped;
+
+    // Only used next to walls
+    int32_t walk = -1;   // mark of the last walk in visitedBy and candidateOf, counting down
+    std::vector<int32_t> candidateOf;
+    std::vector<std::pair<double, int32_t>> queue;
+    std::vector<std::pair<double, uint32_t>> pending;
+    std::vector<std::pair<uint32_t, uint32_t>> walls;
+    std::vector<uint32_t> blockers;
+    std::vector<size_t> blockerEnds;
+    std::vector<uint32_t> rays;
+    std::vector<size_t> rayEnds;
+    std::vector<std::pair<double, uint32_t>> order;
+    std::vector<std::array<size_t, 3>> stack;   // start in polygons, corner count, next bisector
+    std::vector<double> polygons;
+    std::vector<double> cells;
+    std::vector<size_t> cellEnds;
+    std::vector<double> nextCells;
+    std::vector<size_t> nextCellEnds;
+    std::vector<double> restCells;
+    std::vector<size_t> restCellEnds;
+    std::vector<VoronoiRegion> regions;
+};
+
+
+// Keeps the part of a convex polygon where nx * x + ny * y <= offset, points on the line only with
+// keepBoundary. Returns the new corner count, clipped needs room for one corner more.
+size_t ClipToHalfPlane(
+    const double* polygon,
+    const size_t cornerCount,
+    const double nx,
+    const double ny,
+    const double offset,
+    const bool keepBoundary,
+    double* clipped
+) {
+    size_t clippedCount = 0;
+
+    for (size_t i = 0; i < cornerCount; i++) {
+        const double* p1 = polygon + i * 2;
+        const double* p2 = polygon + (i + 1) % cornerCount * 2;
+        const double d1 = nx * p1[0] + ny * p1[1] - offset;
+        const double d2 = nx * p2[0] + ny * p2[1] - offset;
+
+        if (d1 < 0.0 || (keepBoundary && d1 == 0.0)) {
+            clipped[clippedCount * 2] = p1[0];
+            clipped[clippedCount * 2 + 1] = p1[1];
+            clippedCount++;
+        }
+
+        if ((d1 < 0.0 && d2 > 0.0) || (d1 > 0.0 && d2 < 0.0)) {
+            const double ratio = d1 / (d1 - d2);
+            clipped[clippedCount * 2] = p1[0] + (p2[0] - p1[0]) * ratio;
+            clipped[clippedCount * 2 + 1] = p1[1] + (p2[1] - p1[1]) * ratio;
+            clippedCount++;
+        }
+    }
+
+    return clippedCount;
+}
+
+
+// Fans a convex polygon out into triangles of one colour
+void AppendFan(const double* polygon, const size_t cornerCount, const Color& color, std::vector<Triangle>& output) {
+    for (size_t i = 1; i + 1 < cornerCount; i++) {
+        output.push_back({
+            {
+                { (GLfloat)polygon[0], (GLfloat)polygon[1] },
+                { (GLfloat)polygon[i * 2], (GLfloat)polygon[i * 2 + 1] },
+                { (GLfloat)polygon[(i + 1) * 2], (GLfloat)polygon[(i + 1) * 2 + 1] }
+            },
+            color
+        });
+    }
+}
+
+
+// Splits a convex polygon into the parts closest to each of the given sites
+void AppendClippedCell(
+    const double* corners,
+    const size_t cornerCount,
+    const std::vector<uint32_t>& sites,
+    const Triangulation& triangulation,
+    const std::vector<Point>& points,
+    VoronoiScratch& scratch,
+    std::vector<Triangle>& output
+) {
+    const auto& vertices = triangulation.vertices;
+
+    // Every clip adds at most one corner to the polygon
+    const size_t maxCorners = cornerCount + sites.size();
+
+    scratch.polygon.resize(maxCorners * 2);
+    scratch.clipped.resize(maxCorners * 2);
+
+    for (size_t c = 0; c < sites.size(); c++) {
+        const DelaunayVertex& site = vertices[sites[c]];
+
+        double* polygon = scratch.polygon.data();
+        double* clipped = scratch.clipped.data();
+        size_t count = cornerCount;
+
+        std::copy(corners, corners + cornerCount * 2, polygon);
+
+        for (size_t o = 0; o < sites.size() && count >= 3; o++) {
+            if (o == c) continue;
+
+            // Keep the half plane closer to the site than to the other one
+            const DelaunayVertex& other = vertices[sites[o]];
+            const double nx = other.x - site.x;
+            const double ny = other.y - site.y;
+            const double offset = nx * (site.x + other.x) / 2.0 + ny * (site.y + other.y) / 2.0;
+
+            count = ClipToHalfPlane(polygon, count, nx, ny, offset, true, clipped);
+            std::swap(polygon, clipped);
+        }
+
+        AppendFan(polygon, count, points[site.site].color, output);
+    }
+}
+
+
+// Whether a site could be closer than every site corner of the triangle somewhere in a region of it.
+// The corners see the whole triangle, so a site failing this is never the nearest one that is visible.
+bool CanBeatSiteCorners(
+    const Triangulation& triangulation,
+    const DelaunayTriangle& t,
+    const std::array<DelaunayVertex, 3>& region,
+    const DelaunayVertex& site
+) {
+    const auto& vertices = triangulation.vertices;
+
+    // The part of the region closer to the site than to every site corner has to have an area
+    double polygon[6 * 2];
+    double clipped[6 * 2];
+    size_t cornerCount = 3;
+
+    for (int i = 0; i < 3; i++) {
+        polygon[i * 2] = region[i].x;
+        polygon[i * 2 + 1] = region[i].y;
+    }
+
+    for (int o = 0; o < 3 && cornerCount >= 3; o++) {
+        const DelaunayVertex& corner = vertices[t.vertices[o]];
+
+        // Constraint endpoints are not sites, being closer than them does not matter
+        if (corner.site < 0) continue;
+
+        const double nx = corner.x - site.x;
+        const double ny = corner.y - site.y;
+        const double offset = nx * (site.x + corner.x) / 2.0 + ny * (site.y + corner.y) / 2.0;
+
+        cornerCount = ClipToHalfPlane(polygon, cornerCount, nx, ny, offset, false, clipped);
+        std::copy(clipped, clipped + cornerCount * 2, polygon);
+    }
+
+    return cornerCount >= 3;
+}
+
+
+// Cuts a triangle into the parts closest to each candidate site. A point of the triangle is nearest
+// to a vertex of some triangle whose circumcircle contains it, and those triangles are connected, so
+// the candidates come from a walk that stops at circumcircles missing the triangle. Next to the hull
+// the walk runs along chains of slivers that a fixed ring would miss. Sites that cannot beat all
+// three corners anywhere in the triangle are walked through but not clipped against, which keeps
+// cocircular fans from turning every triangle into a full clip.
+//
+// A site beating the corners somewhere in the triangle beats them on an edge, where it lies inside
+// the edge's diametral circle. With acute angles opposite the edge on both sides that circle is
+// covered by the two empty circumcircles, so the walk only follows circles crossing the other edges
+// and most triangles skip it entirely.
+//
+// All of this needs empty circumcircles and every vertex to be a site. In a triangulation with walls
+// that holds for the triangles no wall comes closer to than their nearest site corner does to any
+// of their points, the others go through AppendVisibleVoronoiPieces.
+void AppendVoronoiPieces(
+    const Triangulation& triangulation,
+    const int32_t triangle,
+    const std::vector<uint8_t>& inside,
+    const std::vector<Point>& points,
+    VoronoiScratch& scratch,
+    std::vector<Triangle>& output
+) {
+    const DelaunayTriangle& t = triangulation.triangles[triangle];
+    const auto& vertices = triangulation.vertices;
+
+    auto& visited = scratch.triangles;
+    auto& candidates = scratch.candidates;
+    const std::array<DelaunayVertex, 3> corners = { vertices[t.vertices[0]], vertices[t.vertices[1]], vertices[t.vertices[2]] };
+
+    visited.assign(1, triangle);
+    scratch.visitedBy[triangle] = triangle;
+    candidates.clear();
+
+    for (int i = 0; i < 3; i++) {
+        if (vertices[t.vertices[i]].site >= 0) candidates.push_back(t.vertices[i]);
+    }
+
+    const auto addCandidate = [&](const uint32_t vertex) {
+        if (vertices[vertex].site < 0) return;
+        if (std::find(candidates.begin(), candidates.end(), vertex) != candidates.end()) return;
+        if (CanBeatSiteCorners(triangulation, t, corners, vertices[vertex])) candidates.push_back(vertex);
+    };
+
+    const auto isAcute = [&](const uint32_t apex, const uint32_t from, const uint32_t to) {
+        const DelaunayVertex& c = vertices[apex];
+
+        return (vertices[from].x - c.x) * (vertices[to].x - c.x) + (vertices[from].y - c.y) * (vertices[to].y - c.y) > 0.0;
+    };
+
+    int openEdges[3];
+    int openEdgeCount = 0;
+
+    for (int i = 0; i < 3; i++) {
+        const uint32_t from = t.vertices[(i + 1) % 3];
+        const uint32_t to = t.vertices[(i + 2) % 3];
+        const int32_t neighbour = t.neighbours[i];
+        bool closed = isAcute(t.vertices[i], from, to);
+
+        // Walls and the hull leave only the near side of the circle
+        if (closed && t.constraints[i] == ConstraintKind::None && neighbour >= 0 && inside[neighbour]) {
+            const DelaunayTriangle& u = triangulation.triangles[neighbour];
+            const uint32_t apex = u.vertices[GetNeighbourIndex(u, triangle)];
+
+            closed = apex < superVertexCount || isAcute(apex, to, from);
+        }
+
+        if (!closed) openEdges[openEdgeCount++] = i;
+    }
+
+    if (openEdgeCount == 0) visited.clear();
+
+    for (size_t head = 0; head < visited.size(); head++) {
+        const DelaunayTriangle& current = triangulation.triangles[visited[head]];
+
+        for (int i = 0; i < 3; i++) {
+            const int32_t neighbour = current.neighbours[i];
+
+            if (current.constraints[i] != ConstraintKind::None || neighbour < 0 || !inside[neighbour]) continue;
+            if (scratch.visitedBy[neighbour] == triangle) continue;
+
+            const DelaunayTriangle& u = triangulation.triangles[neighbour];
+            const DelaunayVertex& a = vertices[u.vertices[0]];
+            const double bx = vertices[u.vertices[1]].x - a.x;
+            const double by = vertices[u.vertices[1]].y - a.y;
+            const double cx = vertices[u.vertices[2]].x - a.x;
+            const double cy = vertices[u.vertices[2]].y - a.y;
+            const double d = 2.0 * (bx * cy - by * cx);
+
+            // Degenerate triangles are simply walked through, an extra candidate only costs time
+            if (d != 0.0) {
+                const double b2 = bx * bx + by * by;
+                const double c2 = cx * cx + cy * cy;
+                const double centerX = a.x + (cy * b2 - by * c2) / d;
+                const double centerY = a.y + (bx * c2 - cx * b2) / d;
+                const double radius = (centerX - a.x) * (centerX - a.x) + (centerY - a.y) * (centerY - a.y);
+                bool crossesOpenEdge = false;
+
+                // Strictly inside, circles through an end of the edge that just touch it are left out
+                for (int k = 0; k < openEdgeCount && !crossesOpenEdge; k++) {
+                    const DelaunayVertex& from = vertices[t.vertices[(openEdges[k] + 1) % 3]];
+                    const DelaunayVertex& to = vertices[t.vertices[(openEdges[k] + 2) % 3]];
+                    const double ex = to.x - from.x;
+                    const double ey = to.y - from.y;
+                    const double along = std::clamp(((centerX - from.x) * ex + (centerY - from.y) * ey) / (ex * ex + ey * ey), 0.0, 1.0);
+                    const double dx = from.x + ex * along - centerX;
+                    const double dy = from.y + ey * along - centerY;
+
+                    crossesOpenEdge = dx * dx + dy * dy < radius * (1.0 - 1e-9);
+                }
+
+                if (!crossesOpenEdge) continue;
+            }
+
+            scratch.visitedBy[neighbour] = triangle;
+            visited.push_back(neighbour);
+            addCandidate(u.vertices[GetNeighbourIndex(u, visited[head])]);
+        }
+    }
+
+    double polygon[3 * 2];
+
+    for (int i = 0; i < 3; i++) {
+        polygon[i * 2] = corners[i].x;
+        polygon[i * 2 + 1] = corners[i].y;
+    }
+
+    AppendClippedCell(polygon, 3, candidates, triangulation, points, scratch, output);
+}
+
+
+double GetSegmentDistanceSquared(const DelaunayVertex& point, const DelaunayVertex& from, const DelaunayVertex& to) {
+    const double ex = to.x - from.x;
+    const double ey = to.y - from.y;
+    const double length = ex * ex + ey * ey;
+    const double along = length > 0.0 ? std::clamp(((point.x - from.x) * ex + (point.y - from.y) * ey) / length, 0.0, 1.0) : 0.0;
+    const double dx = from.x + ex * along - point.x;
+    const double dy = from.y + ey * along - point.y;
+
+    return dx * dx + dy * dy;
+}
+
+
+// Squared distance between two triangles that never overlap
+double GetTriangleDistanceSquared(const std::array<DelaunayVertex, 3>& t, const std::array<DelaunayVertex, 3>& u) {
+    // Walks start next to the triangle, where most neighbours touch it at a corner
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 3; k++) {
+            if (t[i].x == u[k].x && t[i].y == u[k].y) return 0.0;
+        }
+    }
+
+    double best = std::numeric_limits<double>::max();
+
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 3; k++) {
+            best = std::min(best, GetSegmentDistanceSquared(t[i], u[k], u[(k + 1) % 3]));
+            best = std::min(best, GetSegmentDistanceSquared(u[i], t[k], t[(k + 1) % 3]));
+        }
+    }
+
+    return best;
+}
+
+
+// Farthest a point of the triangle gets from its nearest site corner, infinite without any. That
+// is at a corner, where the bisector of two site corners leaves through an edge, or at the
+// circumcentre of three.
+double GetCornerReachSquared(const Triangulation& triangulation, const DelaunayTriangle& t) {
+    const auto& vertices = triangulation.vertices;
+
+    uint32_t sites[3];
+    int siteCount = 0;
+
+    for (int i = 0; i < 3; i++) {
+        if (vertices[t.vertices[i]].site >= 0) sites[siteCount++] = t.vertices[i];
+    }
+
+    if (siteCount == 0) return std::numeric_limits<double>::max();
+
+    const auto getNearestSquared = [&](const double x, const double y) {
+        double nearest = std::numeric_limits<double>::max();
+
+        for (int i = 0; i < siteCount; i++) {
+            nearest = std::min(nearest, (vertices[sites[i]].x - x) * (vertices[sites[i]].x - x) + (vertices[sites[i]].y - y) * (vertices[sites[i]].y - y));
+        }
+
+        return nearest;
+    };
+
+    double reach = 0.0;
+
+    for (int i = 0; i < 3; i++) {
+        reach = std::max(reach, getNearestSquared(vertices[t.vertices[i]].x, vertices[t.vertices[i]].y));
+    }
+
+    for (int a = 0; a < siteCount; a++) {
+        for (int b = a + 1; b < siteCount; b++) {
+            const DelaunayVertex& p = vertices[sites[a]];
+            const DelaunayVertex& q = vertices[sites[b]];
+            const double nx = q.x - p.x;
+            const double ny = q.y - p.y;
+            const double offset = nx * (p.x + q.x) / 2.0 + ny * (p.y + q.y) / 2.0;
+
+            for (int i = 0; i < 3; i++) {
+                const DelaunayVertex& from = vertices[t.vertices[i]];
+                const DelaunayVertex& to = vertices[t.vertices[(i + 1) % 3]];
+                const double d1 = nx * from.x + ny * from.y - offset;
+                const double d2 = nx * to.x + ny * to.y - offset;
+
+                if ((d1 < 0.0 && d2 > 0.0) || (d1 > 0.0 && d2 < 0.0)) {
+                    const double ratio = d1 / (d1 - d2);
+
+                    reach = std::max(reach, getNearestSquared(from.x + (to.x - from.x) * ratio, from.y + (to.y - from.y) * ratio));
+                }
+            }
+        }
+    }
+
+    if (siteCount == 3) {
+        const DelaunayVertex& a = vertices[t.vertices[0]];
+        const double bx = vertices[t.vertices[1]].x - a.x;
+        const double by = vertices[t.vertices[1]].y - a.y;
+        const double cx = vertices[t.vertices[2]].x - a.x;
+        const double cy = vertices[t.vertices[2]].y - a.y;
+        const double d = 2.0 * (bx * cy - by * cx);
+
+        // Outside the triangle the circumcentre is not a point of it, the edges had the maximum
+        if (d != 0.0) {
+            const DelaunayVertex center = { a.x + (cy * (bx * bx + by * by) - by * (cx * cx + cy * cy)) / d, a.y + (bx * (cx * cx + cy * cy) - cx * (bx * bx + by * by)) / d, -1 };
+            const bool isInside = Orient2d(vertices[t.vertices[0]], vertices[t.vertices[1]], center) >= 0.0
+                && Orient2d(vertices[t.vertices[1]], vertices[t.vertices[2]], center) >= 0.0
+                && Orient2d(vertices[t.vertices[2]], vertices[t.vertices[0]], center) >= 0.0;
+
+            if (isInside) reach = std::max(reach, getNearestSquared(center.x, center.y));
+        }
+    }
+
+    return reach;
+}
+
+
+// Whether a wall may hide the site from some point of a region of a triangle: it crosses a line of
+// sight to a corner or ends in the hull of the region and the site. Walls sharing the site never
+// block it, and neither do walls ending at a corner, which cannot run through the triangle. A side
+// of the triangle only hides sites behind it, the corners of halved regions lie on it just up to
+// rounding. Unsure cases count as blocking, which only costs extra splits.
+bool CanBlockView(
+    const Triangulation& triangulation,
+    const DelaunayTriangle& t,
+    const std::array<DelaunayVertex, 3>& region,
+    const uint32_t site,
+    const std::pair<uint32_t, uint32_t>& wall
+) {
+    const auto& vertices = triangulation.vertices;
+    const DelaunayVertex& s = vertices[site];
+    const auto [a, b] = wall;
+
+    if (a == site || b == site) return false;
+
+    // Walls clear of the bounding box of the site and the region miss their hull as well
+    if (std::max(vertices[a].x, vertices[b].x) < std::min({ s.x, region[0].x, region[1].x, region[2].x })) return false;
+    if (std::min(vertices[a].x, vertices[b].x) > std::max({ s.x, region[0].x, region[1].x, region[2].x })) return false;
+    if (std::max(vertices[a].y, vertices[b].y) < std::min({ s.y, region[0].y, region[1].y, region[2].y })) return false;
+    if (std::min(vertices[a].y, vertices[b].y) > std::max({ s.y, region[0].y, region[1].y, region[2].y })) return false;
+
+    for (int i = 0; i < 3; i++) {
+        const uint32_t from = t.vertices[(i + 1) % 3];
+        const uint32_t to = t.vertices[(i + 2) % 3];
+
+        if ((a == from && b == to) || (a == to && b == from)) {
+            return Orient2d(vertices[from], vertices[to], s) * Orient2d(vertices[from], vertices[to], vertices[t.vertices[i]]) < 0.0;
+        }
+    }
+
+    const auto isInFan = [&](const uint32_t vertex) {
+        const DelaunayVertex& p = vertices[vertex];
+
+        for (int i = 0; i < 3; i++) {
+            if (p.x == region[i].x && p.y == region[i].y) return false;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            const double o1 = Orient2d(s, region[i], p);
+            const double o2 = Orient2d(region[i], region[(i + 1) % 3], p);
+            const double o3 = Orient2d(region[(i + 1) % 3], s, p);
+
+            if ((o1 >= 0.0 && o2 >= 0.0 && o3 >= 0.0) || (o1 <= 0.0 && o2 <= 0.0 && o3 <= 0.0)) return true;
+        }
+
+        return false;
+    };
+
+    if (isInFan(a) || isInFan(b)) return true;
+
+    for (int i = 0; i < 3; i++) {
+        if (DoSegmentsCross(s, region[i], vertices[a], vertices[b])) return true;
+    }
+
+    return false;
+}
+
+
+// Replaces every cell the ray from origin along direction runs through by its two halves
+void SplitCellsAlongRay(
+    const DelaunayVertex& origin,
+    const double dx,
+    const double dy,
+    std::vector<double>& cells,
+    std::vector<size_t>& cellEnds,
+    VoronoiScratch& scratch
+) {
+    const double nx = -dy;
+    const double ny = dx;
+    const double offset = nx * origin.x + ny * origin.y;
+
+    scratch.nextCells.clear();
+    scratch.nextCellEnds.clear();
+
+    size_t begin = 0;
+
+    for (const size_t end : cellEnds) {
+        const double* corners = cells.data() + begin;
+        const size_t cornerCount = (end - begin) / 2;
+
+        // The origin is a vertex and never inside a cell, so the line crosses a cell either in
+        // front of the origin or behind it, where it is no shadow border
+        bool inFront = false;
+
+        for (size_t i = 0; i < cornerCount && !inFront; i++) {
+            const double* p1 = corners + i * 2;
+            const double* p2 = corners + (i + 1) % cornerCount * 2;
+            const double d1 = nx * p1[0] + ny * p1[1] - offset;
+            const double d2 = nx * p2[0] + ny * p2[1] - offset;
+
+            if ((d1 < 0.0 && d2 > 0.0) || (d1 > 0.0 && d2 < 0.0)) {
+                const double ratio = d1 / (d1 - d2);
+
+                inFront = dx * (p1[0] + (p2[0] - p1[0]) * ratio - origin.x) + dy * (p1[1] + (p2[1] - p1[1]) * ratio - origin.y) > 0.0;
+            }
+        }
+
+        const size_t start = scratch.nextCells.size();
+
+        if (inFront) {
+            scratch.nextCells.resize(start + (cornerCount + 1) * 4);
+
+            const size_t below = ClipToHalfPlane(corners, cornerCount, nx, ny, offset, true, scratch.nextCells.data() + start);
+            scratch.nextCellEnds.push_back(start + below * 2);
+
+            const size_t above = ClipToHalfPlane(corners, cornerCount, -nx, -ny, -offset, true, scratch.nextCells.data() + start + below * 2);
+            scratch.nextCells.resize(start + (below + above) * 2);
+            scratch.nextCellEnds.push_back(scratch.nextCells.size());
+        }
+        else {
+            scratch.nextCells.insert(scratch.nextCells.end(), corners, corners + cornerCount * 2);
+            scratch.nextCellEnds.push_back(scratch.nextCells.size());
+        }
+
+        begin = end;
+    }
+
+    std::swap(cells, scratch.nextCells);
+    std::swap(cellEnds, scratch.nextCellEnds);
+}
+
+
+DelaunayVertex GetCellCenter(const double* corners, const size_t cornerCount) {
+    DelaunayVertex center = { 0.0, 0.0, -1 };
+
+    for (size_t i = 0; i < cornerCount; i++) {
+        center.x += corners[i * 2] / cornerCount;
+        center.y += corners[i * 2 + 1] / cornerCount;
+    }
+
+    return center;
+}
+
+
+// Constraint edges bucketed into square cells, a wall is listed in every cell it passes through
+struct WallGrid {
+    size_t columns;
+    size_t rows;
+    double minX;
+    double minY;
+    double cellSize;
+    std::vector<uint32_t> cellOffsets;  // walls of cell c are [cellOffsets[c], cellOffsets[c + 1])
+    std::vector<std::pair<uint32_t, uint32_t>> walls;
+};
+
+
+WallGrid BuildWallGrid(const Triangulation& triangulation) {
+    const auto& vertices = triangulation.vertices;
+    WallGrid grid = {};
+
+    std::vector<std::pair<uint32_t, uint32_t>> walls = {};
+
+    for (size_t i = 0; i < triangulation.triangles.size(); i++) {
+        const DelaunayTriangle& t = triangulation.triangles[i];
+
+        for (int k = 0; k < 3; k++) {
+            // Walls between two triangles are seen from both, keep one of them
+            if (t.constraints[k] != ConstraintKind::None && (t.neighbours[k] < 0 || (size_t)t.neighbours[k] > i)) {
+                walls.push_back({ t.vertices[(k + 1) % 3], t.vertices[(k + 2) % 3] });
+            }
+        }
+    }
+
+    double maxX = std::numeric_limits<double>::lowest();
+    double maxY = std::numeric_limits<double>::lowest();
+    grid.minX = std::numeric_limits<double>::max();
+    grid.minY = std::numeric_limits<double>::max();
+
+    for (size_t i = superVertexCount; i < vertices.size(); i++) {
+        grid.minX = std::min(grid.minX, vertices[i].x);
+        grid.minY = std::min(grid.minY, vertices[i].y);
+        maxX = std::max(maxX, vertices[i].x);
+        maxY = std::max(maxY, vertices[i].y);
+    }
+
+    if (vertices.size() <= superVertexCount) {
+        grid.minX = grid.minY = maxX = maxY = 0.0;
+    }
+
+    // A few triangles per cell
+    const double width = std::max(maxX - grid.minX, 1e-6);
+    const double height = std::max(maxY - grid.minY, 1e-6);
+    const double cellSize = std::sqrt(width * height * 8.0 / std::max<size_t>(triangulation.triangles.size(), 1));
+
+    grid.columns = std::clamp<size_t>((size_t)(width / cellSize) + 1, 1, 1 << 12);
+    grid.rows = std::clamp<size_t>((size_t)(height / cellSize) + 1, 1, 1 << 12);
+    grid.cellSize = std::max(width / grid.columns, height / grid.rows) * 1.0001;
+
+    const auto getCell = [&](const double x, const double y) {
+        const size_t column = std::min((size_t)std::max((x - grid.minX) / grid.cellSize, 0.0), grid.columns - 1);
+        const size_t row = std::min((size_t)std::max((y - grid.minY) / grid.cellSize, 0.0), grid.rows - 1);
+
+        return (uint32_t)(row * grid.columns + column);
+    };
+
+    // Pieces no longer than a cell touch at most the four cells around their bounding box
+    std::vector<std::pair<uint32_t, uint32_t>> entries = {};
+    std::vector<uint32_t> cells = {};
+
+    for (uint32_t w = 0; w < walls.size(); w++) {
+        const DelaunayVertex& a = vertices[walls[w].first];
+        const DelaunayVertex& b = vertices[walls[w].second];
+        const size_t pieces = (size_t)(std::hypot(b.x - a.x, b.y - a.y) / grid.cellSize) + 1;
+
+        cells.clear();
+
+        for (size_t i = 0; i < pieces; i++) {
+            const double x1 = a.x + (b.x - a.x) * i / pieces;
+            const double y1 = a.y + (b.y - a.y) * i / pieces;
+            const double x2 = a.x + (b.x - a.x) * (i + 1) / pieces;
+            const double y2 = a.y + (b.y - a.y) * (i + 1) / pieces;
+
+            cells.push_back(getCell(x1, y1));
+            cells.push_back(getCell(x1, y2));
+            cells.push_back(getCell(x2, y1));
+            cells.push_back(getCell(x2, y2));
+        }
+
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+
+        for (const uint32_t cell : cells) {
+            entries.push_back({ cell, w });
+        }
+    }
+
+    grid.cellOffsets.assign(grid.columns * grid.rows + 1, 0);
+
+    for (const auto& entry : entries) {
+        grid.cellOffsets[entry.first + 1]++;
+    }
+
+    for (size_t i = 0; i + 1 < grid.cellOffsets.size(); i++) {
+        grid.cellOffsets[i + 1] += grid.cellOffsets[i];
+    }
+
+    grid.walls.resize(entries.size());
+
+    std::vector<uint32_t> fill(grid.cellOffsets.begin(), grid.cellOffsets.end() - 1);
+
+    for (const auto& entry : entries) {
+        grid.walls[fill[entry.first]++] = walls[entry.second];
+    }
+
+    return grid;
+}
+
+
+// Whether a wall comes within the given distance of the triangle
+bool IsNearWall(const WallGrid& grid, const Triangulation& triangulation, const DelaunayTriangle& t, const double distanceSquared) {
+    const auto& vertices = triangulation.vertices;
+
+    if (distanceSquared == std::numeric_limits<double>::max()) return true;
+
+    const double distance = std::sqrt(distanceSquared);
+
+    double minX = vertices[t.vertices[0]].x, maxX = minX, minY = vertices[t.vertices[0]].y, maxY = minY;
+
+    for (int i = 1; i < 3; i++) {
+        minX = std::min(minX, vertices[t.vertices[i]].x);
+        maxX = std::max(maxX, vertices[t.vertices[i]].x);
+        minY = std::min(minY, vertices[t.vertices[i]].y);
+        maxY = std::max(maxY, vertices[t.vertices[i]].y);
+    }
+
+    const auto getIndex = [&](const double value, const double origin, const size_t count) {
+        return (size_t)std::clamp((value - origin) / grid.cellSize, 0.0, (double)(count - 1));
+    };
+
+    const size_t firstColumn = getIndex(minX - distance, grid.minX, grid.columns);
+    const size_t lastColumn = getIndex(maxX + distance, grid.minX, grid.columns);
+    const size_t firstRow = getIndex(minY - distance, grid.minY, grid.rows);
+    const size_t lastRow = getIndex(maxY + distance, grid.minY, grid.rows);
+
+    for (size_t row = firstRow; row <= lastRow; row++) {
+        for (size_t column = firstColumn; column <= lastColumn; column++) {
+            const size_t cell = row * grid.columns + column;
+
+            for (uint32_t i = grid.cellOffsets[cell]; i < grid.cellOffsets[cell + 1]; i++) {
+                const DelaunayVertex& a = vertices[grid.walls[i].first];
+                const DelaunayVertex& b = vertices[grid.walls[i].second];
+
+                // Walls never cross the inside of a triangle, the closest points lie on the outlines
+                for (int k = 0; k < 3; k++) {
+                    const DelaunayVertex& from = vertices[t.vertices[k]];
+                    const DelaunayVertex& to = vertices[t.vertices[(k + 1) % 3]];
+
+                    if (GetSegmentDistanceSquared(from, a, b) <= distanceSquared
+                        || GetSegmentDistanceSquared(a, from, to) <= distanceSquared
+                        || GetSegmentDistanceSquared(b, from, to) <= distanceSquared) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+
+// Cells of one region of a triangle next to walls, every point gets the nearest site it can see.
+// Sites behind a wall may still be reached around its end, so the walk alone proves nothing about
+// visibility. Returns false without any output when the region has too many candidates to clip
+// among each other and should be halved first.
+//
+// The site corners see the whole triangle and bound how far the nearest visible sites of the
+// region can be, a closer site seen from all of the triangle tightens the bound. The walk goes out
+// by distance from the region over unconstrained edges until it passes the bound. A wall hiding a
+// closer site crosses the line of sight before the site, so the walk finds it as an edge of the
+// triangles it visits.
+//
+// Visibility only changes along the rays from each candidate past the ends of the walls. Each
+// candidate keeps the parts of the region it sees and cuts them down by its bisectors, splitting
+// along another candidate's rays only where that one is closer, so a cell never splits for rays
+// that change nothing in it.
+bool AppendVisibleRegionPieces(
+    const Triangulation& triangulation,
+    const int32_t triangle,
+    const VoronoiRegion& region,
+    const std::vector<uint8_t>& inside,
+    const std::vector<Point>& points,
+    VoronoiScratch& scratch,
+    std::vector<Triangle>& output
+) {
+    // Past this many candidates halving the region and walking again is cheaper than going on
+    constexpr size_t maxCandidates = 48;
+    constexpr int maxDepth = 12;
+
+    const DelaunayTriangle& t = triangulation.triangles[triangle];
+    const auto& vertices = triangulation.vertices;
+    const auto& corners = region.corners;
+
+    auto& candidates = scratch.candidates;
+    auto& queue = scratch.queue;
+    auto& pending = scratch.pending;
+    auto& walls = scratch.walls;
+
+    // Every region walks again, so these walks mark with their own negative numbers
+    const int32_t walk = --scratch.walk;
+
+    candidates.clear();
+    queue.assign(1, { 0.0, triangle });
+    pending.clear();
+    walls.clear();
+    scratch.visitedBy[triangle] = walk;
+
+    // Farthest any point of the region can be from a site seen from all of it
+    const auto getReach = [&](const DelaunayVertex& site) {
+        double reach = 0.0;
+
+        for (const DelaunayVertex& corner : corners) {
+            reach = std::max(reach, (corner.x - site.x) * (corner.x - site.x) + (corner.y - site.y) * (corner.y - site.y));
+        }
+
+        return reach;
+    };
+
+    double reach = GetCornerReachSquared(triangulation, t);
+
+    for (int i = 0; i < 3; i++) {
+        if (vertices[t.vertices[i]].site < 0) continue;
+
+        candidates.push_back(t.vertices[i]);
+        scratch.candidateOf[t.vertices[i]] = walk;
+        reach = std::min(reach, getReach(vertices[t.vertices[i]]));
+    }
+
+    const double minX = std::min({ corners[0].x, corners[1].x, corners[2].x });
+    const double minY = std::min({ corners[0].y, corners[1].y, corners[2].y });
+    const double maxX = std::max({ corners[0].x, corners[1].x, corners[2].x });
+    const double maxY = std::max({ corners[0].y, corners[1].y, corners[2].y });
+
+    const auto byDistance = [](const std::pair<double, int32_t>& a, const std::pair<double, int32_t>& b) {
+        return a.first > b.first;
+    };
+
+    const auto byReach = [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b) {
+        return a.first > b.first;
+    };
+
+    // Sites whose reach the walk has covered are checked against the walls found so far
+    const auto settlePending = [&](const double distance) {
+        while (!pending.empty() && pending.front().first <= distance) {
+            std::pop_heap(pending.begin(), pending.end(), byReach);
+            const auto [siteReach, site] = pending.back();
+            pending.pop_back();
+
+            const bool seenFromAll = std::none_of(walls.begin(), walls.end(), [&](const std::pair<uint32_t, uint32_t>& wall) {
+                return CanBlockView(triangulation, t, corners, site, wall);
+            });
+
+            if (seenFromAll) reach = std::min(reach, siteReach);
+        }
+    };
+
+    while (!queue.empty()) {
+        std::pop_heap(queue.begin(), queue.end(), byDistance);
+        const auto [distance, current] = queue.back();
+        queue.pop_back();
+
+        settlePending(distance);
+
+        if (distance > reach) break;
+
+        const DelaunayTriangle& u = triangulation.triangles[current];
+
+        for (int i = 0; i < 3; i++) {
+            const int32_t neighbour = u.neighbours[i];
+
+            if (u.constraints[i] != ConstraintKind::None) {
+                walls.push_back(std::minmax(u.vertices[(i + 1) % 3], u.vertices[(i + 2) % 3]));
+                continue;
+            }
+
+            if (neighbour < 0 || !inside[neighbour] || scratch.visitedBy[neighbour] == walk) continue;
+
+            const DelaunayTriangle& next = triangulation.triangles[neighbour];
+            const uint32_t apex = next.vertices[GetNeighbourIndex(next, current)];
+            const std::array<DelaunayVertex, 3> nextCorners = { vertices[next.vertices[0]], vertices[next.vertices[1]], vertices[next.vertices[2]] };
+
+            scratch.visitedBy[neighbour] = walk;
+
+            // Bounding boxes are never farther apart than the triangles, most misses end here
+            const double gapX = std::max({ 0.0, std::min({ nextCorners[0].x, nextCorners[1].x, nextCorners[2].x }) - maxX, minX - std::max({ nextCorners[0].x, nextCorners[1].x, nextCorners[2].x }) });
+            const double gapY = std::max({ 0.0, std::min({ nextCorners[0].y, nextCorners[1].y, nextCorners[2].y }) - maxY, minY - std::max({ nextCorners[0].y, nextCorners[1].y, nextCorners[2].y }) });
+
+            if (gapX * gapX + gapY * gapY > reach) continue;
+
+            const double nextDistance = GetTriangleDistanceSquared(corners, nextCorners);
+
+            if (nextDistance > reach) continue;
+
+            queue.push_back({ nextDistance, neighbour });
+            std::push_heap(queue.begin(), queue.end(), byDistance);
+
+            const DelaunayVertex& site = vertices[apex];
+
+            if (site.site < 0 || scratch.candidateOf[apex] == walk) continue;
+
+            scratch.candidateOf[apex] = walk;
+
+            if (!CanBeatSiteCorners(triangulation, t, corners, site)) continue;
+
+            candidates.push_back(apex);
+
+            // Without a site seen from all of it the halves would be no better off
+            if (candidates.size() > maxCandidates && region.depth < maxDepth && reach < std::numeric_limits<double>::max()) return false;
+
+            // Only a site that could still tighten the reach waits for its walls
+            const double siteReach = getReach(site);
+
+            if (siteReach < reach) {
+                pending.push_back({ siteReach, apex });
+                std::push_heap(pending.begin(), pending.end(), byReach);
+            }
+        }
+    }
+
+    // Sites farther from the whole region than the bound are never the nearest visible one
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](const uint32_t candidate) {
+        const DelaunayVertex& site = vertices[candidate];
+
+        const bool isInside = (Orient2d(corners[0], corners[1], site) >= 0.0 && Orient2d(corners[1], corners[2], site) >= 0.0 && Orient2d(corners[2], corners[0], site) >= 0.0)
+            || (Orient2d(corners[0], corners[1], site) <= 0.0 && Orient2d(corners[1], corners[2], site) <= 0.0 && Orient2d(corners[2], corners[0], site) <= 0.0);
+
+        return !isInside && std::min({
+            GetSegmentDistanceSquared(site, corners[0], corners[1]),
+            GetSegmentDistanceSquared(site, corners[1], corners[2]),
+            GetSegmentDistanceSquared(site, corners[2], corners[0])
+        }) > reach;
+    }), candidates.end());
+
+    if (candidates.empty()) return true;
+
+    // The walk meets most walls from both sides
+    std::sort(walls.begin(), walls.end());
+    walls.erase(std::unique(walls.begin(), walls.end()), walls.end());
+
+    auto& blockers = scratch.blockers;
+    auto& blockerEnds = scratch.blockerEnds;
+    auto& rays = scratch.rays;
+    auto& rayEnds = scratch.rayEnds;
+
+    blockers.clear();
+    blockerEnds.clear();
+    rays.clear();
+    rayEnds.clear();
+
+    const auto resetCells = [&](std::vector<double>& cells, std::vector<size_t>& cellEnds) {
+        cells.resize(3 * 2);
+        cellEnds.assign(1, 3 * 2);
+
+        for (int i = 0; i < 3; i++) {
+            cells[i * 2] = corners[i].x;
+            cells[i * 2 + 1] = corners[i].y;
+        }
+    };
+
+    const auto isHidden = [&](const double* cell, const size_t cornerCount, const uint32_t site, const size_t firstBlocker, const size_t lastBlocker) {
+        const DelaunayVertex center = GetCellCenter(cell, cornerCount);
+
+        for (size_t i = firstBlocker; i < lastBlocker; i++) {
+            if (DoSegmentsCross(center, vertices[site], vertices[walls[blockers[i]].first], vertices[walls[blockers[i]].second])) return true;
+        }
+
+        return false;
+    };
+
+    // The part of the region a candidate sees comes from splitting it along the candidate's own
+    // shadow rays. Candidates seeing none of it are dropped, those seeing all of it keep no walls.
+    size_t keptCount = 0;
+
+    for (size_t c = 0; c < candidates.size(); c++) {
+        const uint32_t site = candidates[c];
+        const size_t firstBlocker = blockers.size();
+        const size_t firstRay = rays.size();
+
+        // Only the walls cutting into the hull of the triangle and the site can hide it
+        for (size_t w = 0; w < walls.size(); w++) {
+            const auto [a, b] = walls[w];
+
+            // Walls in line with the site cast no shadow
+            if (Orient2d(vertices[site], vertices[a], vertices[b]) == 0.0 || !CanBlockView(triangulation, t, corners, site, walls[w])) continue;
+
+            blockers.push_back((uint32_t)w);
+            rays.push_back(a);
+            rays.push_back(b);
+        }
+
+        // Walls meeting at a corner share its ray, splitting twice would leave slivers
+        std::sort(rays.begin() + firstRay, rays.end());
+        rays.erase(std::unique(rays.begin() + firstRay, rays.end()), rays.end());
+
+        resetCells(scratch.cells, scratch.cellEnds);
+
+        for (size_t i = firstRay; i < rays.size(); i++) {
+            SplitCellsAlongRay(vertices[rays[i]], vertices[rays[i]].x - vertices[site].x, vertices[rays[i]].y - vertices[site].y, scratch.cells, scratch.cellEnds, scratch);
+        }
+
+        size_t cellCount = 0;
+        size_t visibleCount = 0;
+        size_t begin = 0;
+
+        for (const size_t end : scratch.cellEnds) {
+            if (end - begin >= 3 * 2) {
+                cellCount++;
+                if (!isHidden(scratch.cells.data() + begin, (end - begin) / 2, site, firstBlocker, blockers.size())) visibleCount++;
+            }
+
+            begin = end;
+        }
+
+        if (visibleCount == 0 || visibleCount == cellCount) {
+            blockers.resize(firstBlocker);
+            rays.resize(firstRay);
+        }
+
+        if (visibleCount == 0) continue;
+
+        candidates[keptCount++] = site;
+        blockerEnds.push_back(blockers.size());
+        rayEnds.push_back(rays.size());
+    }
+
+    candidates.resize(keptCount);
+
+    // With every wall out of the way this is the same cell as away from walls
+    if (rays.empty()) {
+        resetCells(scratch.cells, scratch.cellEnds);
+        AppendClippedCell(scratch.cells.data(), 3, candidates, triangulation, points, scratch, output);
+        return true;
+    }
+
+    auto& order = scratch.order;
+    auto& stack = scratch.stack;
+    auto& polygons = scratch.polygons;
+
+    const auto getFirstBlocker = [&](const size_t c) {
+        return c > 0 ? blockerEnds[c - 1] : 0;
+    };
+
+    const auto splitAlongRays = [&](const size_t c, std::vector<double>& cells, std::vector<size_t>& cellEnds) {
+        const DelaunayVertex& site = vertices[candidates[c]];
+
+        for (size_t i = c > 0 ? rayEnds[c - 1] : 0; i < rayEnds[c]; i++) {
+            SplitCellsAlongRay(vertices[rays[i]], vertices[rays[i]].x - site.x, vertices[rays[i]].y - site.y, cells, cellEnds, scratch);
+        }
+    };
+
+    const auto pushCell = [&](const double* cell, const size_t cornerCount, const size_t next) {
+        stack.push_back({ polygons.size(), cornerCount, next });
+        polygons.insert(polygons.end(), cell, cell + cornerCount * 2);
+    };
+
+    // Every candidate cuts the parts it sees by its bisectors with the others, nearest first. Where
+    // another one would be closer the cut away side is split along that one's shadow rays, and the
+    // parts hidden from it come back.
+    for (size_t c = 0; c < candidates.size(); c++) {
+        const DelaunayVertex& site = vertices[candidates[c]];
+
+        order.clear();
+
+        for (size_t o = 0; o < candidates.size(); o++) {
+            const DelaunayVertex& other = vertices[candidates[o]];
+            if (o != c) order.push_back({ (other.x - site.x) * (other.x - site.x) + (other.y - site.y) * (other.y - site.y), (uint32_t)o });
+        }
+
+        std::sort(order.begin(), order.end());
+
+        stack.clear();
+        polygons.clear();
+
+        resetCells(scratch.cells, scratch.cellEnds);
+        splitAlongRays(c, scratch.cells, scratch.cellEnds);
+
+        size_t begin = 0;
+
+        for (const size_t end : scratch.cellEnds) {
+            const double* cell = scratch.cells.data() + begin;
+            const size_t cornerCount = (end - begin) / 2;
+
+            if (cornerCount >= 3 && !isHidden(cell, cornerCount, candidates[c], getFirstBlocker(c), blockerEnds[c])) pushCell(cell, cornerCount, 0);
+
+            begin = end;
+        }
+
+        const Color& color = points[site.site].color;
+
+        while (!stack.empty()) {
+            const auto [start, cornerCount, next] = stack.back();
+            stack.pop_back();
+
+            scratch.polygon.assign(polygons.begin() + start, polygons.begin() + start + cornerCount * 2);
+            polygons.resize(start);
+
+            if (next == order.size()) {
+                AppendFan(scratch.polygon.data(), cornerCount, color, output);
+                continue;
+            }
+
+            const size_t o = order[next].second;
+            const DelaunayVertex& other = vertices[candidates[o]];
+            const double nx = other.x - site.x;
+            const double ny = other.y - site.y;
+            const double offset = nx * (site.x + other.x) / 2.0 + ny * (site.y + other.y) / 2.0;
+
+            scratch.clipped.resize((cornerCount + 1) * 2);
+
+            const size_t closer = ClipToHalfPlane(scratch.polygon.data(), cornerCount, nx, ny, offset, true, scratch.clipped.data());
+            if (closer >= 3) pushCell(scratch.clipped.data(), closer, next + 1);
+
+            // Only a candidate hidden from some of the region can leave anything on its side
+            if (blockerEnds[o] == getFirstBlocker(o)) continue;
+
+            const size_t farther = ClipToHalfPlane(scratch.polygon.data(), cornerCount, -nx, -ny, -offset, false, scratch.clipped.data());
+            if (farther < 3) continue;
+
+            scratch.restCells.assign(scratch.clipped.begin(), scratch.clipped.begin() + farther * 2);
+            scratch.restCellEnds.assign(1, farther * 2);
+            splitAlongRays(o, scratch.restCells, scratch.restCellEnds);
+
+            size_t restBegin = 0;
+
+            for (const size_t end : scratch.restCellEnds) {
+                const double* cell = scratch.restCells.data() + restBegin;
+                const size_t count = (end - restBegin) / 2;
+
+                if (count >= 3 && isHidden(cell, count, candidates[o], getFirstBlocker(o), blockerEnds[o])) pushCell(cell, count, next + 1);
+
+                restBegin = end;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+// Cells of a triangle with walls nearby. Long triangles by a wall see sites from far along it, and
+// every candidate cuts every other one, so those are halved along their longest edge until each
+// part has few enough candidates of its own.
+void AppendVisibleVoronoiPieces(
+    const Triangulation& triangulation,
+    const int32_t triangle,
+    const std::vector<uint8_t>& inside,
+    const std::vector<Point>& points,
+    VoronoiScratch& scratch,
+    std::vector<Triangle>& output
+) {
+    const DelaunayTriangle& t = triangulation.triangles[triangle];
+    const auto& vertices = triangulation.vertices;
+
+    auto& regions = scratch.regions;
+
+    regions.assign(1, { { vertices[t.vertices[0]], vertices[t.vertices[1]], vertices[t.vertices[2]] }, 0 });
+
+    while (!regions.empty()) {
+        const VoronoiRegion region = regions.back();
+        regions.pop_back();
+
+        if (AppendVisibleRegionPieces(triangulation, triangle, region, inside, points, scratch, output)) continue;
+
+        const auto& corners = region.corners;
+
+        const auto getEdgeLengthSquared = [&](const int i) {
+            const DelaunayVertex& from = corners[i];
+            const DelaunayVertex& to = corners[(i + 1) % 3];
+
+            return (to.x - from.x) * (to.x - from.x) + (to.y - from.y) * (to.y - from.y);
+        };
+
+        int longest = 0;
+
+        for (int i = 1; i < 3; i++) {
+            if (getEdgeLengthSquared(i) > getEdgeLengthSquared(longest)) longest = i;
+        }
+
+        const DelaunayVertex middle = {
+            (corners[longest].x + corners[(longest + 1) % 3].x) / 2.0,
+            (corners[longest].y + corners[(longest + 1) % 3].y) / 2.0,
+            -1
+        };
+
+        for (int half = 0; half < 2; half++) {
+            VoronoiRegion part = { corners, region.depth + 1 };
+
+            part.corners[(longest + half) % 3] = middle;
+            regions.push_back(part);
+        }
+    }
+}
+
+
+std::vector<Triangle> ExtractVoronoiPieces(const Triangulation& triangulation, const std::vector<uint8_t>& inside, const std::vector<Point>& points) {
+    PROFILE_SCOPE("subdivision");
+
+    const WallGrid walls = BuildWallGrid(triangulation);
+    const bool hasWalls = !walls.walls.empty();
+
+    std::vector<std::vector<Triangle>> piecesPerWorker(GetWorkerCount());
+
+    ParallelFor(triangulation.triangles.size(), [&](size_t begin, size_t end, size_t worker) {
+        // About seven pieces per triangle, growing the vector would copy hundreds of megabytes
+        piecesPerWorker[worker].reserve((end - begin) * 15 / 2);
+
+        VoronoiScratch scratch = {};
+        scratch.visitedBy.assign(triangulation.triangles.size(), -1);
+        if (hasWalls) scratch.candidateOf.assign(triangulation.vertices.size(), -1);
+
+        for (size_t i = begin; i < end; i++) {
+            if (!inside[i]) continue;
+
+            const bool nearWall = hasWalls && IsNearWall(walls, triangulation, triangulation.triangles[i], GetCornerReachSquared(triangulation, triangulation.triangles[i]));
+
+            if (nearWall) AppendVisibleVoronoiPieces(triangulation, (int32_t)i, inside, points, scratch, piecesPerWorker[worker]);
+            else AppendVoronoiPieces(triangulation, (int32_t)i, inside, points, scratch, piecesPerWorker[worker]);
+        }
+    });
+
+    std::vector<Triangle> pieces = std::move(piecesPerWorker[0]);
+
+    for (size_t worker = 1; worker < piecesPerWorker.size(); worker++) {
+        pieces.insert(pieces.end(), piecesPerWorker[worker].begin(), piecesPerWorker[worker].end());
+    }
+
+    return pieces;
+}
+
+
+bool HasBoundaryConstraints(const std::vector<ConstraintPolyline>& constraints) {
+    return std::any_of(constraints.begin(), constraints.end(), [](const ConstraintPolyline& polyline) {
+        return polyline.kind == ConstraintKind::Boundary;
+    });
+}
+
+
+// Voronoi cells clipped by walls and polygon domains. Cells only reach as far as the triangulation,
+// so without boundaries they end at the convex hull of the sites.
+std::vector<Triangle> ExtractConstrainedTriangles(const std::vector<Point>& points, const std::vector<ConstraintPolyline>& constraints) {
+    const auto start = std::chrono::steady_clock::now();
+
+    const auto triangulation = CreateTriangulation(points, constraints);
+
+    const auto trianglesToDraw = ExtractVoronoiPieces(triangulation, ClassifyDomain(triangulation, HasBoundaryConstraints(constraints)), points);
+
+    LOG_INFO(
+        "triangulated %zu sites and %zu constraints into %zu triangles (%zu flips) in %.1f ms",
+        points.size(),
+        constraints.size(),
+        triangulation.triangles.size(),
+        triangulation.flips,
+        GetSecondsSince(start) * 1e3
+    );
+
+    return trianglesToDraw;
+}
+
+
+std::vector<Triangle> ExtractTriangles5(const std::vector<Point>& points) {
+    return ExtractConstrainedTriangles(points, {});
+}
+
+
+// Text file with one constraint per line, coordinates go through the same transform as the sites:
+//   segment x1 y1 x2 y2 ...   open polyline of walls
+//   polygon x1 y1 x2 y2 ...   closed outline of the domain
+//   hole x1 y1 x2 y2 ...      closed outline cut out of the domain
+std::optional<std::vector<ConstraintPolyline>> LoadConstraints(const char * fileName, const SiteTransform& transform) {
+    std::ifstream ifs(fileName, std::ifstream::in);
+
+    if (!ifs.is_open()) {
+        LOG_ERROR("failed to open constraint file: %s", fileName);
+        return std::nullopt;
+    }
+
+    std::vector<ConstraintPolyline> constraints = {};
+    size_t lineNumber = 0;
+
+    for (std::string line; std::getline(ifs, line);) {
+        lineNumber++;
+
+        const char * c = SkipSiteSeparators(line.data(), line.data() + line.size());
+        const char * end = line.data() + line.size();
+
+        if (c == end || *c == '#') continue;
+
+        const char * keywordEnd = c;
+        while (keywordEnd < end && std::isalpha((unsigned char)*keywordEnd)) keywordEnd++;
+
+        const std::string keyword(c, keywordEnd);
+        ConstraintPolyline polyline = {};
+
+        if (keyword == "segment") polyline = { {}, false, ConstraintKind::Segment };
+        else if (keyword == "polygon" || keyword == "hole") polyline = { {}, true, ConstraintKind::Boundary };
+        else {
+            LOG_ERROR("%s:%zu: unknown constraint '%s'", fileName, lineNumber, keyword.c_str());
+            return std::nullopt;
+        }
+
+        c = keywordEnd;
+
+        while (true) {
+            c = SkipSiteSeparators(c, end);
+
+            if (c == end) break;
+
+            const auto x = ParseSiteCoordinate(c, end);
+            c = SkipSiteSeparators(c, end);
+            const auto y = ParseSiteCoordinate(c, end);
+
+            if (!x.has_value() || !y.has_value()) {
+                LOG_ERROR("%s:%zu: expected a coordinate pair", fileName, lineNumber);
+                return std::nullopt;
+            }
+
+            polyline.points.push_back({
+                (GLfloat)((x.value() - transform.centerX) * transform.scale),
+                (GLfloat)((y.value() - transform.centerY) * transform.scale)
+            });
+        }
+
+        if (polyline.points.size() < (polyline.closed ? 3u : 2u)) {
+            LOG_ERROR("%s:%zu: too few points for a %s", fileName, lineNumber, keyword.c_str());
+            return std::nullopt;
+        }
+
+        constraints.push_back(std::move(polyline));
+    }
+
+    LOG_INFO("loaded %zu constraints from %s", constraints.size(), fileName);
+
+    return constraints;
+}
+
+
+// Sites bucketed into square cells, stored by cell as structure of arrays for the distance kernels
+struct SiteGrid {
+    size_t columns;
+    size_t rows;
+    GLfloat minX;
+    GLfloat minY;
+    GLfloat cellSize;
+    std::vector<uint32_t> cellOffsets;  // sites of cell c are [cellOffsets[c], cellOffsets[c + 1])
+    std::vector<GLfloat> xs;
+    std::vector<GLfloat> ys;
+    std::vector<uint32_t> ids;
+};
+
+
+SiteGrid BuildSiteGrid(const std::vector<Point>& points, const double sitesPerCell = 2.0) {
+    SiteGrid grid = {};
+
+    GLfloat maxX = std::numeric_limits<GLfloat>::lowest();
+    GLfloat maxY = std::numeric_limits<GLfloat>::lowest();
+    grid.minX = std::numeric_limits<GLfloat>::max();
+    grid.minY = std::numeric_limits<GLfloat>::max();
+
+    for (const auto& point : points) {
+        grid.minX = std::min(grid.minX, point.pointData.x);
+        grid.minY = std::min(grid.minY, point.pointData.y);
+        maxX = std::max(maxX, point.pointData.x);
+        maxY = std::max(maxY, point.pointData.y);
+    }
+
+    if (points.empty()) {
+        grid.minX = grid.minY = maxX = maxY = 0.0f;
+    }
+
+    const double width = std::max((double)maxX - grid.minX, 1e-6);
+    const double height = std::max((double)maxY - grid.minY, 1e-6);
+    const double cellSize = std::sqrt(width * height * sitesPerCell / std::max<size_t>(points.size(), 1));
+
+    grid.columns = std::clamp<size_t>((size_t)(width / cellSize) + 1, 1, 1 << 14);
+    grid.rows = std::clamp<size_t>((size_t)(height / cellSize) + 1, 1, 1 << 14);
+    grid.cellSize = (GLfloat)std::max(width / grid.columns, height / grid.rows) * 1.0001f;
+
+    std::vector<uint32_t> cells(points.size());
+
+    ParallelFor(points.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const size_t column = std::min((size_t)((points[i].pointData.x - grid.minX) / grid.cellSize), grid.columns - 1);
+            const size_t row = std::min((size_t)((points[i].pointData.y - grid.minY) / grid.cellSize), grid.rows - 1);
+            cells[i] = (uint32_t)(row * grid.columns + column);
+        }
+    });
+
+    grid.cellOffsets.assign(grid.columns * grid.rows + 1, 0);
+
+    for (const uint32_t cell : cells) {
+        grid.cellOffsets[cell + 1]++;
+    }
+
+    for (size_t i = 0; i + 1 < grid.cellOffsets.size(); i++) {
+        grid.cellOffsets[i + 1] += grid.cellOffsets[i];
+    }
+
+    grid.xs.resize(points.size());
+    grid.ys.resize(points.size());
+    grid.ids.resize(points.size());
+
+    std::vector<uint32_t> fill(grid.cellOffsets.begin(), grid.cellOffsets.end() - 1);
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const uint32_t slot = fill[cells[i]]++;
+
+        grid.xs[slot] = points[i].pointData.x;
+        grid.ys[slot] = points[i].pointData.y;
+        grid.ids[slot] = (uint32_t)i;
+    }
+
+    return grid;
+}
+
+
+const uint32_t noSite = std::numeric_limits<uint32_t>::max();
+
+
+// Four horizontally adjacent pixels share one search, every lane keeps its own nearest site
+struct PixelQuad {
+    GLfloat x[4];
+    GLfloat y;
+    GLfloat distances[4];   // as compared by the metric, squared for Euclidean
+    uint32_t slots[4];      // positions in the grid arrays, stay close in memory unlike site ids
+};
+
+
+template <typename Metric>
+void ScanGridCell(const SiteGrid& grid, const size_t cell, PixelQuad& quad, const Metric& metric) {
+    const uint32_t begin = grid.cellOffsets[cell];
+    const uint32_t end = grid.cellOffsets[cell + 1];
+
+#ifdef VORONOIABLE_SSE2
+    const __m128 x = _mm_loadu_ps(quad.x);
+    const __m128 y = _mm_set1_ps(quad.y);
+    __m128 distances = _mm_loadu_ps(quad.distances);
+    __m128i slots = _mm_loadu_si128((const __m128i*)quad.slots);
+
+    for (uint32_t i = begin; i < end; i++) {
+        const __m128 dx = _mm_sub_ps(x, _mm_set1_ps(grid.xs[i]));
+        const __m128 dy = _mm_sub_ps(y, _mm_set1_ps(grid.ys[i]));
+        const __m128 distance = metric.Compare(dx, dy);
+        const __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, distances));
+
+        distances = _mm_min_ps(distance, distances);
+        slots = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32((int)i)), _mm_andnot_si128(closer, slots));
+    }
+
+    _mm_storeu_ps(quad.distances, distances);
+    _mm_storeu_si128((__m128i*)quad.slots, slots);
+#else
+    for (uint32_t i = begin; i < end; i++) {
+        for (int lane = 0; lane < 4; lane++) {
+            const GLfloat dx = quad.x[lane] - grid.xs[i];
+            const GLfloat dy = quad.y - grid.ys[i];
+            const GLfloat distance = metric.Compare(dx, dy);
+
+            if (distance < quad.distances[lane]) {
+                quad.distances[lane] = distance;
+                quad.slots[lane] = i;
+            }
+        }
+    }
+#endif
+}
+
+
+// Not clamped to the grid: for a pixel outside of it the rings keep their distance guarantee and
+// the ones missing the grid cost nothing
+long long GetGridIndex(const GLfloat value, const GLfloat minValue, const GLfloat cellSize) {
+    return (long long)std::clamp(std::floor((value - minValue) / cellSize), -1e9f, 1e9f);
+}
+
+
+// Rings of cells around the quad until the nearest unscanned cell is farther than the worst lane's
+// current best, so the result is exact. The distances seeded from the previous quad's sites make
+// that happen after one or two rings.
+template <typename Metric>
+void FindNearestSites(const SiteGrid& grid, PixelQuad& quad, const Metric& metric) {
+    const long long firstColumn = GetGridIndex(quad.x[0], grid.minX, grid.cellSize);
+    const long long lastColumn = GetGridIndex(quad.x[3], grid.minX, grid.cellSize);
+    const long long row = GetGridIndex(quad.y, grid.minY, grid.cellSize);
+    const long long columns = (long long)grid.columns;
+    const long long rows = (long long)grid.rows;
+
+    const auto scanRow = [&](const long long y, const long long x1, const long long x2) {
+        if (y < 0 || y >= rows) return;
+
+        for (long long x = std::max(x1, 0ll); x <= std::min(x2, columns - 1); x++) {
+            ScanGridCell(grid, (size_t)(y * columns + x), quad, metric);
+        }
+    };
+
+    const auto scanColumn = [&](const long long x, const long long y1, const long long y2) {
+        if (x < 0 || x >= columns) return;
+
+        for (long long y = std::max(y1, 0ll); y <= std::min(y2, rows - 1); y++) {
+            ScanGridCell(grid, (size_t)(y * columns + x), quad, metric);
+        }
+    };
+
+    scanRow(row, firstColumn, lastColumn);
+
+    // Rings that miss the grid are empty, a quad far outside a tiny grid would walk millions of them
+    const long long firstHit = std::max({ 1ll, -lastColumn, firstColumn - (columns - 1), -row, row - (rows - 1) });
+
+    for (long long ring = firstHit; ; ring++) {
+        const GLfloat worst = *std::max_element(quad.distances, quad.distances + 4);
+
+        // Distance from the quad to the outside of the cells scanned so far
+        const GLfloat gap = std::min({
+            quad.x[0] - (grid.minX + (firstColumn - ring + 1) * grid.cellSize),
+            grid.minX + (lastColumn + ring) * grid.cellSize - quad.x[3],
+            quad.y - (grid.minY + (row - ring + 1) * grid.cellSize),
+            grid.minY + (row + ring) * grid.cellSize - quad.y
+        });
+
+        if (gap > 0.0f && metric.Bound(gap) > worst) break;
+
+        const bool coversGrid = firstColumn - ring <= 0 && lastColumn + ring >= columns - 1 && row - ring <= 0 && row + ring >= rows - 1;
+
+        scanRow(row - ring, firstColumn - ring, lastColumn + ring);
+        scanRow(row + ring, firstColumn - ring, lastColumn + ring);
+        scanColumn(firstColumn - ring, row - ring + 1, row + ring - 1);
+        scanColumn(lastColumn + ring, row - ring + 1, row + ring - 1);
+
+        if (coversGrid) break;
+    }
+}
+
+
+// Per pixel nearest site ids, row 0 is the top of the view
+struct LabelMap {
+    size_t width;
+    size_t height;
+    std::vector<uint32_t> labels;
+};
+
+
+template <typename Metric = EuclideanMetric>
+LabelMap RasterizeNearestSites(
+    const std::vector<Point>& points,
+    const SiteGrid& grid,
+    const size_t width,
+    const size_t height,
+    const ViewRect& view,
+    const Metric& metric = {}
+) {
+    PROFILE_SCOPE("rasterization");
+
+    LabelMap map = { width, height, std::vector<uint32_t>(width * height, noSite) };
+
+    if (points.empty()) return map;
+
+    const GLfloat pixelWidth = (view.maxX - view.minX) / width;
+    const GLfloat pixelHeight = (view.maxY - view.minY) / height;
+
+    // Bands of rows per worker, each row walks left to right seeding every quad with the site of the previous one
+    ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+        for (size_t row = begin; row < end; row++) {
+            uint32_t hint = noSite;
+
+            for (size_t column = 0; column < width; column += 4) {
+                PixelQuad quad = {};
+                quad.y = view.maxY - (row + 0.5f) * pixelHeight;
+
+                for (size_t lane = 0; lane < 4; lane++) {
+                    quad.x[lane] = view.minX + (std::min(column + lane, width - 1) + 0.5f) * pixelWidth;
+                    quad.distances[lane] = std::numeric_limits<GLfloat>::infinity();
+                    quad.slots[lane] = noSite;
+
+                    if (hint != noSite) {
+                        const GLfloat dx = quad.x[lane] - grid.xs[hint];
+                        const GLfloat dy = quad.y - grid.ys[hint];
+
+                        quad.distances[lane] = metric.Compare(dx, dy);
+                        quad.slots[lane] = hint;
+                    }
+                }
+
+                FindNearestSites(grid, quad, metric);
+
+                for (size_t lane = 0; lane < 4 && column + lane < width; lane++) {
+                    map.labels[row * width + column + lane] = grid.ids[quad.slots[lane]];
+                }
+
+                hint = quad.slots[3];
+            }
+        }
+    }, 8);
+
+    return map;
+}
+
+
+// Binary PPM with the site colours for .ppm files, raw little endian uint32 site ids otherwise
+// siteIds maps the labels back to input ids when the sites were reordered, empty otherwise
+bool WriteLabelMap(const char * fileName, const LabelMap& map, const std::vector<Point>& points, const std::vector<uint32_t>& siteIds = {}) {
+    FILE* file = fopen(fileName, "wb");
+
+    if (file == nullptr) {
+        LOG_ERROR("failed to open label map file: %s", fileName);
+        return false;
+    }
+
+    if (std::filesystem::path(fileName).extension() == ".ppm") {
+        std::vector<uint8_t> pixels(map.labels.size() * 3, 0);
+
+        ParallelFor(map.labels.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                if (map.labels[i] == noSite) continue;
+
+                const Color& color = points[map.labels[i]].color;
+
+                pixels[i * 3 + 0] = (uint8_t)std::clamp(color.r * 255.0f + 0.5f, 0.0f, 255.0f);
+                pixels[i * 3 + 1] = (uint8_t)std::clamp(color.g * 255.0f + 0.5f, 0.0f, 255.0f);
+                pixels[i * 3 + 2] = (uint8_t)std::clamp(color.b * 255.0f + 0.5f, 0.0f, 255.0f);
+            }
+        });
+
+        fprintf(file, "P6\n%zu %zu\n255\n", map.width, map.height);
+        fwrite(pixels.data(), 1, pixels.size(), file);
+    }
+    else if (!siteIds.empty()) {
+        std::vector<uint32_t> labels(map.labels.size());
+
+        ParallelFor(map.labels.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                labels[i] = map.labels[i] == noSite ? noSite : siteIds[map.labels[i]];
+            }
+        });
+
+        fwrite(labels.data(), sizeof(uint32_t), labels.size(), file);
+    }
+    else {
+        fwrite(map.labels.data(), sizeof(uint32_t), map.labels.size(), file);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+
+// The k best candidates of one query as a max-heap on (distance, grid slot), the root is the one a
+// new site has to beat. Kept per worker and reused, so queries do not allocate.
+struct NearestSiteHeap {
+    size_t k = 1;
+    std::vector<std::pair<GLfloat, uint32_t>> entries;
+};
+
+
+void PushNearestSite(NearestSiteHeap& heap, const GLfloat distance, const uint32_t slot) {
+    if (heap.entries.size() < heap.k) {
+        heap.entries.push_back({ distance, slot });
+        std::push_heap(heap.entries.begin(), heap.entries.end());
+    }
+    else if (std::make_pair(distance, slot) < heap.entries.front()) {
+        std::pop_heap(heap.entries.begin(), heap.entries.end());
+        heap.entries.back() = { distance, slot };
+        std::push_heap(heap.entries.begin(), heap.entries.end());
+    }
+}
+
+
+GLfloat GetNearestSiteLimit(const NearestSiteHeap& heap) {
+    return heap.entries.size() < heap.k ? std::numeric_limits<GLfloat>::infinity() : heap.entries.front().first;
+}
+
+
+// Four sites per step, only the lanes closer than the current k-th best reach the heap. Cells of a
+// grid row are contiguous, so a ring row is one range and fills the lanes despite two sites per cell.
+template <typename Metric>
+void ScanGridSlotsForHeap(const SiteGrid& grid, uint32_t i, const uint32_t end, const PointData& query, NearestSiteHeap& heap, const Metric& metric) {
+#ifdef VORONOIABLE_SSE2
+    const __m128 x = _mm_set1_ps(query.x);
+    const __m128 y = _mm_set1_ps(query.y);
+
+    for (; i + 4 <= end; i += 4) {
+        const __m128 distance = metric.Compare(_mm_sub_ps(x, _mm_loadu_ps(&grid.xs[i])), _mm_sub_ps(y, _mm_loadu_ps(&grid.ys[i])));
+        const int closer = _mm_movemask_ps(_mm_cmple_ps(distance, _mm_set1_ps(GetNearestSiteLimit(heap))));
+
+        if (closer == 0) continue;
+
+        alignas(16) GLfloat distances[4];
+        _mm_store_ps(distances, distance);
+
+        for (int lane = 0; lane < 4; lane++) {
+            if (closer & (1 << lane)) PushNearestSite(heap, distances[lane], i + lane);
+        }
+    }
+#endif
+
+    for (; i < end; i++) {
+        const GLfloat distance = metric.Compare(query.x - grid.xs[i], query.y - grid.ys[i]);
+
+        if (distance <= GetNearestSiteLimit(heap)) PushNearestSite(heap, distance, i);
+    }
+}
+
+
+// Rings of cells around the query as in FindNearestSites, until the nearest unscanned cell is
+// farther than the k-th best site. Leaves heap.entries sorted nearest first, fewer than k of them
+// only when the grid has fewer sites.
+template <typename Metric>
+void FindKNearestSites(const SiteGrid& grid, const PointData& query, NearestSiteHeap& heap, const Metric& metric) {
+    heap.entries.clear();
+
+    const long long column = GetGridIndex(query.x, grid.minX, grid.cellSize);
+    const long long row = GetGridIndex(query.y, grid.minY, grid.cellSize);
+    const long long columns = (long long)grid.columns;
+    const long long rows = (long long)grid.rows;
+
+    const auto scanRow = [&](const long long y, const long long x1, const long long x2) {
+        if (y < 0 || y >= rows || x2 < 0 || x1 >= columns) return;
+
+        const size_t first = (size_t)(y * columns + std::max(x1, 0ll));
+        const size_t last = (size_t)(y * columns + std::min(x2, columns - 1));
+
+        ScanGridSlotsForHeap(grid, grid.cellOffsets[first], grid.cellOffsets[last + 1], query, heap, metric);
+    };
+
+    const auto scanColumn = [&](const long long x, const long long y1, const long long y2) {
+        if (x < 0 || x >= columns) return;
+
+        for (long long y = std::max(y1, 0ll); y <= std::min(y2, rows - 1); y++) {
+            const size_t cell = (size_t)(y * columns + x);
+            ScanGridSlotsForHeap(grid, grid.cellOffsets[cell], grid.cellOffsets[cell + 1], query, heap, metric);
+        }
+    };
+
+    scanRow(row, column, column);
+
+    const long long firstHit = std::max({ 1ll, -column, column - (columns - 1), -row, row - (rows - 1) });
+
+    for (long long ring = firstHit; ; ring++) {
+        const GLfloat gap = std::min({
+            query.x - (grid.minX + (column - ring + 1) * grid.cellSize),
+            grid.minX + (column + ring) * grid.cellSize - query.x,
+            query.y - (grid.minY + (row - ring + 1) * grid.cellSize),
+            grid.minY + (row + ring) * grid.cellSize - query.y
+        });
+
+        if (gap > 0.0f && metric.Bound(gap) > GetNearestSiteLimit(heap)) break;
+
+        const bool coversGrid = column - ring <= 0 && column + ring >= columns - 1 && row - ring <= 0 && row + ring >= rows - 1;
+
+        scanRow(row - ring, column - ring, column + ring);
+        scanRow(row + ring, column - ring, column + ring);
+        scanColumn(column - ring, row - ring + 1, row + ring - 1);
+        scanColumn(column + ring, row - ring + 1, row + ring - 1);
+
+        if (coversGrid) break;
+    }
+
+    std::sort_heap(heap.entries.begin(), heap.entries.end());
+}
+
+
+// k sites per query, nearest first, padded with noSite when there are fewer sites than k
+struct NearestSitesBatch {
+    size_t k;
+    std::vector<uint32_t> sites;
+    std::vector<GLfloat> distances;
+};
+
+
+template <typename Metric = EuclideanMetric>
+NearestSitesBatch QueryNearestSites(const SiteGrid& grid, const std::vector<PointData>& queries, const size_t k, const Metric& metric = {}) {
+    PROFILE_SCOPE("k nearest queries");
+
+    NearestSitesBatch batch = { k, std::vector<uint32_t>(queries.size() * k, noSite), std::vector<GLfloat>(queries.size() * k, std::numeric_limits<GLfloat>::infinity()) };
+
+    // Queries are answered cell by cell, scattered ones would miss the cache on every site they read
+    std::vector<uint32_t> cells(queries.size());
+
+    ParallelFor(queries.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const long long column = std::clamp<long long>(GetGridIndex(queries[i].x, grid.minX, grid.cellSize), 0, (long long)grid.columns - 1);
+            const long long row = std::clamp<long long>(GetGridIndex(queries[i].y, grid.minY, grid.cellSize), 0, (long long)grid.rows - 1);
+            cells[i] = (uint32_t)(row * (long long)grid.columns + column);
+        }
+    });
+
+    std::vector<uint32_t> order(queries.size());
+    std::vector<uint32_t> fill(grid.columns * grid.rows + 1, 0);
+
+    for (const uint32_t cell : cells) {
+        fill[cell + 1]++;
+    }
+
+    for (size_t i = 0; i + 1 < fill.size(); i++) {
+        fill[i + 1] += fill[i];
+    }
+
+    for (size_t i = 0; i < queries.size(); i++) {
+        order[fill[cells[i]]++] = (uint32_t)i;
+    }
+
+    ParallelFor(queries.size(), [&](size_t begin, size_t end, size_t) {
+        NearestSiteHeap heap = { k, {} };
+        heap.entries.reserve(k);
+
+        for (size_t o = begin; o < end; o++) {
+            const size_t i = order[o];
+
+            FindKNearestSites(grid, queries[i], heap, metric);
+
+            for (size_t j = 0; j < heap.entries.size(); j++) {
+                batch.sites[i * k + j] = grid.ids[heap.entries[j].second];
+                batch.distances[i * k + j] = metric.Distance(heap.entries[j].first);
+            }
+        }
+    }, 256);
+
+    return batch;
+}
+
+
+// Order-k Voronoi regions on a pixel grid: pixels whose k nearest sites are the same set, in any
+// order, share a region. Row 0 is the top of the view like in LabelMap.
+struct OrderKMap {
+    size_t width;
+    size_t height;
+    size_t k;
+    std::vector<uint32_t> nearest;      // k sites per pixel, nearest first
+    std::vector<uint32_t> regions;      // region per pixel
+    std::vector<uint32_t> regionSites;  // k ascending site ids per region
+};
+
+
+template <typename Metric = EuclideanMetric>
+OrderKMap RasterizeOrderKRegions(
+    const SiteGrid& grid,
+    const size_t width,
+    const size_t height,
+    const ViewRect& view,
+    const size_t k,
+    const Metric& metric = {}
+) {
+    PROFILE_SCOPE("order-k rasterization");
+
+    OrderKMap map = { width, height, k, std::vector<uint32_t>(width * height * k, noSite), std::vector<uint32_t>(width * height, noSite), {} };
+
+    const GLfloat pixelWidth = (view.maxX - view.minX) / width;
+    const GLfloat pixelHeight = (view.maxY - view.minY) / height;
+
+    // Sorted copies of the sets and their hashes, so the sequential numbering below only compares
+    std::vector<uint32_t> sets(width * height * k);
+    std::vector<uint64_t> hashes(width * height);
+
+    ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+        NearestSiteHeap heap = { k, {} };
+        heap.entries.reserve(k);
+
+        for (size_t row = begin; row < end; row++) {
+            const GLfloat y = view.maxY - (row + 0.5f) * pixelHeight;
+
+            for (size_t column = 0; column < width; column++) {
+                const size_t pixel = row * width + column;
+
+                FindKNearestSites(grid, { view.minX + (column + 0.5f) * pixelWidth, y }, heap, metric);
+
+                uint32_t* nearest = &map.nearest[pixel * k];
+                uint32_t* set = &sets[pixel * k];
+
+                for (size_t j = 0; j < heap.entries.size(); j++) {
+                    nearest[j] = grid.ids[heap.entries[j].second];
+                }
+
+                std::copy(nearest, nearest + k, set);
+                std::sort(set, set + k);
+
+                uint64_t hash = k;
+
+                for (size_t j = 0; j < k; j++) {
+                    hash = MixBits(hash ^ set[j]);
+                }
+
+                hashes[pixel] = hash;
+            }
+        }
+    }, 8);
+
+    // Neighbouring pixels nearly always share their set, the table is only asked at region borders.
+    // Open addressing on the set hashes, slots hold region ids and the table doubles at half full.
+    std::vector<uint64_t> regionHashes = {};
+    std::vector<uint32_t> table(1024, noSite);
+
+    for (size_t pixel = 0; pixel < width * height; pixel++) {
+        const uint32_t* set = &sets[pixel * k];
+        const uint64_t hash = hashes[pixel];
+
+        if (pixel % width != 0 && hash == hashes[pixel - 1] && std::equal(set, set + k, &sets[(pixel - 1) * k])) {
+            map.regions[pixel] = map.regions[pixel - 1];
+            continue;
+        }
+
+        if (pixel >= width && hash == hashes[pixel - width] && std::equal(set, set + k, &sets[(pixel - width) * k])) {
+            map.regions[pixel] = map.regions[pixel - width];
+            continue;
+        }
+
+        const size_t mask = table.size() - 1;
+        size_t slot = hash & mask;
+
+        while (table[slot] != noSite) {
+            const uint32_t region = table[slot];
+
+            if (regionHashes[region] == hash && std::equal(set, set + k, &map.regionSites[(size_t)region * k])) break;
+
+            slot = (slot + 1) & mask;
+        }
+
+        if (table[slot] == noSite) {
+            table[slot] = (uint32_t)regionHashes.size();
+            regionHashes.push_back(hash);
+            map.regionSites.insert(map.regionSites.end(), set, set + k);
+        }
+
+        map.regions[pixel] = table[slot];
+
+        if (regionHashes.size() * 2 > table.size()) {
+            table.assign(table.size() * 2, noSite);
+
+            for (uint32_t region = 0; region < regionHashes.size(); region++) {
+                size_t free = regionHashes[region] & (table.size() - 1);
+
+                while (table[free] != noSite) free = (free + 1) & (table.size() - 1);
+
+                table[free] = region;
+            }
+        }
+    }
+
+    return map;
+}
+
+
+// Binary PPM with the mean colour of each region's sites for .ppm files, raw little endian uint32 site
+// ids otherwise, k per pixel nearest first. siteIds as in WriteLabelMap.
+bool WriteOrderKMap(const char * fileName, const OrderKMap& map, const std::vector<Point>& points, const std::vector<uint32_t>& siteIds = {}) {
+    FILE* file = fopen(fileName, "wb");
+
+    if (file == nullptr) {
+        LOG_ERROR("failed to open label map file: %s", fileName);
+        return false;
+    }
+
+    if (std::filesystem::path(fileName).extension() == ".ppm") {
+        const size_t regionCount = map.regionSites.size() / std::max<size_t>(map.k, 1);
+        std::vector<uint8_t> regionColors(regionCount * 3, 0);
+
+        for (size_t region = 0; region < regionCount; region++) {
+            Color sum = { 0.0f, 0.0f, 0.0f };
+            size_t count = 0;
+
+            for (size_t j = 0; j < map.k; j++) {
+                const uint32_t site = map.regionSites[region * map.k + j];
+
+                if (site == noSite) continue;
+
+                sum.r += points[site].color.r;
+                sum.g += points[site].color.g;
+                sum.b += points[site].color.b;
+                count++;
+            }
+
+            const GLfloat scale = 255.0f / std::max<size_t>(count, 1);
+
+            regionColors[region * 3 + 0] = (uint8_t)std::clamp(sum.r * scale + 0.5f, 0.0f, 255.0f);
+            regionColors[region * 3 + 1] = (uint8_t)std::clamp(sum.g * scale + 0.5f, 0.0f, 255.0f);
+            regionColors[region * 3 + 2] = (uint8_t)std::clamp(sum.b * scale + 0.5f, 0.0f, 255.0f);
+        }
+
+        std::vector<uint8_t> pixels(map.regions.size() * 3, 0);
+
+        ParallelFor(map.regions.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                if (map.regions[i] == noSite) continue;
+
+                memcpy(&pixels[i * 3], &regionColors[(size_t)map.regions[i] * 3], 3);
+            }
+        });
+
+        fprintf(file, "P6\n%zu %zu\n255\n", map.width, map.height);
+        fwrite(pixels.data(), 1, pixels.size(), file);
+    }
+    else if (!siteIds.empty()) {
+        std::vector<uint32_t> nearest(map.nearest.size());
+
+        ParallelFor(map.nearest.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                nearest[i] = map.nearest[i] == noSite ? noSite : siteIds[map.nearest[i]];
+            }
+        });
+
+        fwrite(nearest.data(), sizeof(uint32_t), nearest.size(), file);
+    }
+    else {
+        fwrite(map.nearest.data(), sizeof(uint32_t), map.nearest.size(), file);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+
+// Label map over the bounds of the sites, about sixteen pixels across an average cell
+LabelMap RasterizeMetricCells(const std::vector<Point>& points, const DistanceMetric metric, const PointData& weights, ViewRect& view) {
+    view = { std::numeric_limits<GLfloat>::max(), std::numeric_limits<GLfloat>::max(), std::numeric_limits<GLfloat>::lowest(), std::numeric_limits<GLfloat>::lowest() };
+
+    for (const auto& point : points) {
+        view.minX = std::min(view.minX, point.pointData.x);
+        view.minY = std::min(view.minY, point.pointData.y);
+        view.maxX = std::max(view.maxX, point.pointData.x);
+        view.maxY = std::max(view.maxY, point.pointData.y);
+    }
+
+    if (points.empty()) view = { -1.0f, -1.0f, 1.0f, 1.0f };
+
+    const GLfloat side = std::max({ view.maxX - view.minX, view.maxY - view.minY, 1e-6f });
+    const double pixels = std::clamp(16.0 * std::sqrt((double)points.size()), 256.0, 4096.0);
+    const size_t width = std::max<size_t>((size_t)(pixels * (view.maxX - view.minX) / side), 1);
+    const size_t height = std::max<size_t>((size_t)(pixels * (view.maxY - view.minY) / side), 1);
+    const SiteGrid grid = BuildSiteGrid(points);
+
+    return WithDistanceMetric(metric, weights, [&](const auto& policy) {
+        return RasterizeNearestSites(points, grid, width, height, view, policy);
+    });
+}
+
+
+// Bisectors under L1 and L∞ bend and can run along an axis, so their cells come from a label map: each
+// run of equal labels in a row becomes a quad, the outlines are exact to a pixel of the map
+std::vector<Triangle> ExtractLabelMapCells(const LabelMap& map, const ViewRect& view, const std::vector<Point>& points) {
+    PROFILE_SCOPE("label map cells");
+
+    const GLfloat pixelWidth = (view.maxX - view.minX) / map.width;
+    const GLfloat pixelHeight = (view.maxY - view.minY) / map.height;
+
+    std::vector<std::vector<Triangle>> cellsPerWorker(GetWorkerCount());
+
+    ParallelFor(map.height, [&](size_t begin, size_t end, size_t worker) {
+        for (size_t row = begin; row < end; row++) {
+            const uint32_t* labels = &map.labels[row * map.width];
+            const GLfloat top = view.maxY - row * pixelHeight;
+            const GLfloat bottom = view.maxY - (row + 1) * pixelHeight;
+
+            for (size_t first = 0; first < map.width;) {
+                size_t last = first + 1;
+
+                while (last < map.width && labels[last] == labels[first]) last++;
+
+                if (labels[first] != noSite) {
+                    const GLfloat left = view.minX + first * pixelWidth;
+                    const GLfloat right = view.minX + last * pixelWidth;
+                    const Color& color = points[labels[first]].color;
+
+                    cellsPerWorker[worker].push_back({ { { left, bottom }, { right, bottom }, { right, top } }, color });
+                    cellsPerWorker[worker].push_back({ { { left, bottom }, { right, top }, { left, top } }, color });
+                }
+
+                first = last;
+            }
+        }
+    }, 64);
+
+    std::vector<Triangle> cells = std::move(cellsPerWorker[0]);
+
+    for (size_t worker = 1; worker < cellsPerWorker.size(); worker++) {
+        cells.insert(cells.end(), cellsPerWorker[worker].begin(), cellsPerWorker[worker].end());
+    }
+
+    return cells;
+}
+
+
+// Sites whose labels touch along a row or a column
+SiteAdjacency BuildLabelMapAdjacency(const LabelMap& map, const size_t siteCount) {
+    std::vector<std::pair<uint32_t, uint32_t>> edges = {};
+
+    for (size_t row = 0; row < map.height; row++) {
+        for (size_t column = 0; column < map.width; column++) {
+            const uint32_t label = map.labels[row * map.width + column];
+            const uint32_t right = column + 1 < map.width ? map.labels[row * map.width + column + 1] : label;
+            const uint32_t below = row + 1 < map.height ? map.labels[(row + 1) * map.width + column] : label;
+
+            if (right != label && right != noSite && label != noSite) edges.push_back({ label, right });
+            if (below != label && below != noSite && label != noSite) edges.push_back({ label, below });
+        }
+    }
+
+    return CreateSiteAdjacency(siteCount, edges);
+}
+
+
+// A weighted Euclidean metric is the plain one after scaling the axes by the square roots of the
+// weights, so these cells are exact: the Delaunay cells of the scaled sites, scaled back
+std::vector<Triangle> ExtractAnisotropicTriangles(const std::vector<Point>& points, const AnisotropicMetric& metric) {
+    const GLfloat scaleX = std::sqrt(metric.weightX);
+    const GLfloat scaleY = std::sqrt(metric.weightY);
+
+    std::vector<Point> scaled = points;
+
+    for (auto& point : scaled) {
+        point.pointData.x *= scaleX;
+        point.pointData.y *= scaleY;
+    }
+
+    std::vector<Triangle> triangles = ExtractTriangles5(scaled);
+
+    ParallelFor(triangles.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            for (PointData* corner : { &triangles[i].triangleData.pd1, &triangles[i].triangleData.pd2, &triangles[i].triangleData.pd3 }) {
+                corner->x /= scaleX;
+                corner->y /= scaleY;
+            }
+        }
+    });
+
+    return triangles;
+}
+
+
+std::vector<Triangle> ExtractMetricTriangles(const std::vector<Point>& points, const DistanceMetric metric, const PointData& weights) {
+    if (metric == DistanceMetric::Euclidean) return ExtractTriangles5(points);
+    if (metric == DistanceMetric::Anisotropic) return ExtractAnisotropicTriangles(points, { weights.x, weights.y });
+
+    ViewRect view = {};
+    const LabelMap map = RasterizeMetricCells(points, metric, weights, view);
+
+    return ExtractLabelMapCells(map, view, points);
+}
+
+
+// Kinetic Delaunay: sites move on straight lines between bounces off the [-1,1]² walls and every
+// edge has a certificate, the first time its incircle test fails. Only failing certificates and
+// bounces are processed, so the work per frame follows the number of topology events. Dense fast
+// sites flip so many edges per frame that triangulating the positions from scratch is cheaper, the
+// diagram then stops keeping certificates and rebuilds every frame.
+const GLfloat kineticFrameSize = 3.0f;
+
+
+struct KineticVertex {
+    double x;           // position at time
+    double y;
+    double vx;
+    double vy;
+    double time;
+    double bounceTime;  // next wall hit, infinity for the super triangle and the frame
+};
+
+
+struct KineticEvent {
+    double time;
+    int32_t triangle;       // the vertex for bounces
+    int edge;               // -1 for bounces
+    uint32_t version;
+    uint32_t neighbourVersion;
+
+    bool operator>(const KineticEvent& other) const {
+        return time > other.time;
+    }
+};
+
+
+struct KineticDiagram {
+    Triangulation triangulation;
+    std::vector<KineticVertex> motion;
+    std::vector<uint32_t> triangleVersions;
+    std::vector<uint32_t> vertexVersions;
+    std::vector<KineticEvent> events;   // min-heap on time, empty while rebuilding
+    double time = 0.0;
+    bool rebuilding = false;
+    size_t processedEvents = 0;
+    size_t flips = 0;
+    size_t bounces = 0;
+    size_t rebuilds = 0;
+};
+
+
+// Coefficients of c[0] + c[1]·τ + ... + c[4]·τ⁴
+struct Polynomial {
+    double c[5] = {};
+};
+
+
+Polynomial MultiplyPolynomials(const Polynomial& p1, const Polynomial& p2) {
+    Polynomial result = {};
+
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; i + j < 5; j++) {
+            result.c[i + j] += p1.c[i] * p2.c[j];
+        }
+    }
+
+    return result;
+}
+
+
+Polynomial AddPolynomials(const Polynomial& p1, const Polynomial& p2, const double factor = 1.0) {
+    Polynomial result = p1;
+
+    for (int i = 0; i < 5; i++) {
+        result.c[i] += p2.c[i] * factor;
+    }
+
+    return result;
+}
+
+
+double EvaluatePolynomial(const Polynomial& p, const double t) {
+    return (((p.c[4] * t + p.c[3]) * t + p.c[2]) * t + p.c[1]) * t + p.c[0];
+}
+
+
+Polynomial GetDerivative(const Polynomial& p) {
+    Polynomial derivative = {};
+
+    for (int i = 1; i < 5; i++) {
+        derivative.c[i - 1] = p.c[i] * i;
+    }
+
+    return derivative;
+}
+
+
+// Root inside a piece where the polynomial is monotone, returns the end on the positive side. Illinois
+// false position converges much faster than bisection on these smooth pieces and keeps the bracket.
+double RefinePolynomialRoot(const Polynomial& p, double low, double high) {
+    double lowValue = EvaluatePolynomial(p, low);
+    double highValue = EvaluatePolynomial(p, high);
+    const bool rising = highValue > 0.0;
+    int side = 0;
+
+    for (int iteration = 0; iteration < 64 && high - low > 1e-14 * high + 1e-300; iteration++) {
+        double middle = (low * highValue - high * lowValue) / (highValue - lowValue);
+
+        if (!(middle > low && middle < high)) middle = (low + high) / 2.0;
+
+        const double value = EvaluatePolynomial(p, middle);
+
+        if ((value > 0.0) == rising) {
+            high = middle;
+            highValue = value;
+
+            if (side == 1) lowValue /= 2.0;
+            side = 1;
+        }
+        else {
+            low = middle;
+            lowValue = value;
+
+            if (side == -1) highValue /= 2.0;
+            side = -1;
+        }
+    }
+
+    return rising ? high : low;
+}
+
+
+// Real roots inside [low, high] in increasing order. The roots of the derivative split the interval
+// into monotone pieces, so each piece holds at most one root and no crossing can be stepped over.
+int FindPolynomialRoots(const Polynomial& p, int degree, const double low, const double high, double * roots) {
+    while (degree > 0 && p.c[degree] == 0.0) degree--;
+
+    if (degree == 0) return 0;
+
+    if (degree == 1) {
+        const double root = -p.c[0] / p.c[1];
+
+        if (root < low || root > high) return 0;
+
+        roots[0] = root;
+        return 1;
+    }
+
+    double bounds[6] = { low };
+    int boundCount = 1 + FindPolynomialRoots(GetDerivative(p), degree - 1, low, high, bounds + 1);
+    bounds[boundCount++] = high;
+
+    int count = 0;
+
+    for (int i = 0; i + 1 < boundCount; i++) {
+        if ((EvaluatePolynomial(p, bounds[i]) > 0.0) != (EvaluatePolynomial(p, bounds[i + 1]) > 0.0)) {
+            roots[count++] = RefinePolynomialRoot(p, bounds[i], bounds[i + 1]);
+        }
+    }
+
+    return count;
+}
+
+
+// First τ in (0, horizon] where a polynomial that is negative at 0 turns positive, -1 if it never does
+double FindFirstPositive(const Polynomial& p, const int degree, const double horizon) {
+    // Most certificates stay negative, the positive terms alone at the horizon often prove it
+    double bound = p.c[0];
+    double power = 1.0;
+
+    for (int i = 1; i <= degree; i++) {
+        power *= horizon;
+        bound += std::max(p.c[i], 0.0) * power;
+    }
+
+    if (bound <= 0.0) return -1.0;
+
+    double bounds[6] = { 0.0 };
+    int boundCount = 1 + FindPolynomialRoots(GetDerivative(p), degree - 1, 0.0, horizon, bounds + 1);
+    bounds[boundCount++] = horizon;
+
+    for (int i = 0; i + 1 < boundCount; i++) {
+        if (EvaluatePolynomial(p, bounds[i + 1]) > 0.0) {
+            return EvaluatePolynomial(p, bounds[i]) > 0.0 ? bounds[i] : RefinePolynomialRoot(p, bounds[i], bounds[i + 1]);
+        }
+    }
+
+    return -1.0;
+}
+
+
+DelaunayVertex GetKineticPosition(const KineticDiagram& diagram, const uint32_t vertex, const double time) {
+    const KineticVertex& m = diagram.motion[vertex];
+
+    return { m.x + m.vx * (time - m.time), m.y + m.vy * (time - m.time), diagram.triangulation.vertices[vertex].site };
+}
+
+
+// When a coordinate moving from position at the given time reaches the wall ahead of it
+double GetWallTime(const double position, const double velocity, const double time) {
+    if (velocity == 0.0) return std::numeric_limits<double>::infinity();
+
+    return std::max(time + ((velocity > 0.0 ? 1.0 : -1.0) - position) / velocity, time);
+}
+
+
+double GetBounceTime(const KineticVertex& m) {
+    return std::min(GetWallTime(m.x, m.vx, m.time), GetWallTime(m.y, m.vy, m.time));
+}
+
+
+// Reflects the motion off the walls it reaches at the given time
+void BounceKineticVertex(KineticVertex& m, const double time) {
+    // The axis decides by its wall time, the rounded position can stop a hair short of the wall
+    const bool bounceX = GetWallTime(m.x, m.vx, m.time) <= time;
+    const bool bounceY = GetWallTime(m.y, m.vy, m.time) <= time;
+
+    m.x = bounceX ? (m.vx > 0.0 ? 1.0 : -1.0) : m.x + m.vx * (time - m.time);
+    m.y = bounceY ? (m.vy > 0.0 ? 1.0 : -1.0) : m.y + m.vy * (time - m.time);
+    m.time = time;
+
+    if (bounceX) m.vx = -m.vx;
+    if (bounceY) m.vy = -m.vy;
+
+    m.bounceTime = GetBounceTime(m);
+}
+
+
+void PushKineticEvent(KineticDiagram& diagram, const KineticEvent& event) {
+    diagram.events.push_back(event);
+    std::push_heap(diagram.events.begin(), diagram.events.end(), std::greater<>());
+}
+
+
+// Edges touching the super triangle never flip: the static frame around the walls keeps the convex
+// hull fixed, so only quads of sites and frame corners carry certificates
+void ScheduleEdge(KineticDiagram& diagram, int32_t triangle, int edge) {
+    const auto& triangles = diagram.triangulation.triangles;
+    const int32_t neighbour = triangles[triangle].neighbours[edge];
+
+    if (neighbour < 0 || triangles[triangle].constraints[edge] != ConstraintKind::None) return;
+
+    const uint32_t opposite = triangles[neighbour].vertices[GetNeighbourIndex(triangles[neighbour], triangle)];
+
+    if (opposite < superVertexCount) return;
+
+    for (const uint32_t vertex : triangles[triangle].vertices) {
+        if (vertex < superVertexCount) return;
+    }
+
+    // The certificate holds until the first bounce of one of its vertices changes the motion
+    double horizon = diagram.motion[opposite].bounceTime;
+
+    for (const uint32_t vertex : triangles[triangle].vertices) {
+        horizon = std::min(horizon, diagram.motion[vertex].bounceTime);
+    }
+
+    horizon -= diagram.time;
+
+    // Incircle determinant of the moving points relative to the opposite one, a quartic in τ
+    const DelaunayVertex reference = GetKineticPosition(diagram, opposite, diagram.time);
+    const KineticVertex& referenceMotion = diagram.motion[opposite];
+
+    Polynomial rows[3][3] = {};
+    double extent = 0.0;
+
+    for (int k = 0; k < 3; k++) {
+        const uint32_t vertex = triangles[triangle].vertices[k];
+        const DelaunayVertex position = GetKineticPosition(diagram, vertex, diagram.time);
+
+        rows[k][0].c[0] = position.x - reference.x;
+        rows[k][0].c[1] = diagram.motion[vertex].vx - referenceMotion.vx;
+        rows[k][1].c[0] = position.y - reference.y;
+        rows[k][1].c[1] = diagram.motion[vertex].vy - referenceMotion.vy;
+        rows[k][2] = AddPolynomials(MultiplyPolynomials(rows[k][0], rows[k][0]), MultiplyPolynomials(rows[k][1], rows[k][1]));
+
+        extent = std::max({ extent, std::fabs(rows[k][0].c[0]), std::fabs(rows[k][1].c[0]) });
+    }
+
+    const auto cross = [&](const int r1, const int r2) {
+        return AddPolynomials(MultiplyPolynomials(rows[r1][0], rows[r2][1]), MultiplyPolynomials(rows[r2][0], rows[r1][1]), -1.0);
+    };
+
+    Polynomial certificate = MultiplyPolynomials(rows[0][2], cross(1, 2));
+    certificate = AddPolynomials(certificate, MultiplyPolynomials(rows[1][2], cross(2, 0)));
+    certificate = AddPolynomials(certificate, MultiplyPolynomials(rows[2][2], cross(0, 1)));
+
+    double failure = -1.0;
+
+    const DelaunayTriangle& t = triangles[triangle];
+    const DelaunayVertex corners[3] = {
+        GetKineticPosition(diagram, t.vertices[0], diagram.time),
+        GetKineticPosition(diagram, t.vertices[1], diagram.time),
+        GetKineticPosition(diagram, t.vertices[2], diagram.time)
+    };
+
+    // The filtered test decides the present and the future failure has to clear the same kind of error
+    // bound, otherwise a quad that only touches cocircularity flips back and forth at one instant
+    const double present = InCircle(corners[0], corners[1], corners[2], reference);
+    const double tolerance = 128.0 * std::numeric_limits<double>::epsilon() * extent * extent * extent * extent;
+
+    certificate.c[0] = std::min(present, 0.0) - tolerance;
+
+    if (present > 0.0) {
+        failure = 0.0;
+    }
+    else if (horizon > 0.0) {
+        failure = FindFirstPositive(certificate, 4, horizon);
+    }
+
+    if (failure < 0.0) return;
+
+    // A future failure lands at least one representable instant later, rounding it back to now would let
+    // a quad sweeping through cocircularity flip back and forth without time moving on
+    const double failureTime = failure > 0.0
+        ? std::max(diagram.time + failure, std::nextafter(diagram.time, std::numeric_limits<double>::infinity()))
+        : diagram.time;
+
+    PushKineticEvent(diagram, { failureTime, triangle, edge, diagram.triangleVersions[triangle], diagram.triangleVersions[neighbour] });
+}
+
+
+// New certificates for every edge of the triangles, the versions invalidate the old events on both sides
+void RescheduleTriangles(KineticDiagram& diagram, const std::vector<int32_t>& changed) {
+    for (const int32_t triangle : changed) {
+        diagram.triangleVersions[triangle]++;
+    }
+
+    for (const int32_t triangle : changed) {
+        for (int i = 0; i < 3; i++) {
+            const int32_t neighbour = diagram.triangulation.triangles[triangle].neighbours[i];
+            const bool shared = std::find(changed.begin(), changed.end(), neighbour) != changed.end();
+
+            if (!shared || triangle < neighbour) ScheduleEdge(diagram, triangle, i);
+        }
+    }
+}
+
+
+// Positions of the triangulation at the given time for drawing
+void UpdateKineticPositions(KineticDiagram& diagram, const double time) {
+    ParallelFor(diagram.motion.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const DelaunayVertex position = GetKineticPosition(diagram, (uint32_t)i, time);
+
+            diagram.triangulation.vertices[i].x = position.x;
+            diagram.triangulation.vertices[i].y = position.y;
+        }
+    });
+}
+
+
+KineticDiagram CreateKineticDiagram(const std::vector<Point>& points, const std::vector<PointData>& velocities) {
+    // Four static corners well outside the walls, the sites never leave their hull
+    std::vector<Point> framed = points;
+
+    for (const GLfloat x : { -kineticFrameSize, kineticFrameSize }) {
+        for (const GLfloat y : { -kineticFrameSize, kineticFrameSize }) {
+            framed.push_back({ { x, y }, {} });
+        }
+    }
+
+    KineticDiagram diagram = {};
+    diagram.triangulation = CreateTriangulation(framed, {});
+
+    const size_t vertexCount = diagram.triangulation.vertices.size();
+    diagram.motion.resize(vertexCount);
+    diagram.vertexVersions.assign(vertexCount, 0);
+    diagram.triangleVersions.assign(diagram.triangulation.triangles.size(), 0);
+
+    for (size_t i = 0; i < vertexCount; i++) {
+        const DelaunayVertex& vertex = diagram.triangulation.vertices[i];
+        KineticVertex& m = diagram.motion[i];
+
+        m = { vertex.x, vertex.y, 0.0, 0.0, 0.0, std::numeric_limits<double>::infinity() };
+
+        if (vertex.site >= (int32_t)points.size()) {
+            diagram.triangulation.vertices[i].site = -1;
+        }
+        else if (vertex.site >= 0) {
+            m.vx = velocities[vertex.site].x;
+            m.vy = velocities[vertex.site].y;
+            m.bounceTime = GetBounceTime(m);
+
+            PushKineticEvent(diagram, { m.bounceTime, (int32_t)i, -1, 0, 0 });
+        }
+    }
+
+    for (size_t i = 0; i < diagram.triangulation.triangles.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            if ((int32_t)i < diagram.triangulation.triangles[i].neighbours[k]) ScheduleEdge(diagram, (int32_t)i, k);
+        }
+    }
+
+    return diagram;
+}
+
+
+// Events outlive the certificates they came from, a flip or a bounce only bumps the versions
+bool IsKineticEventLive(const KineticDiagram& diagram, const KineticEvent& event) {
+    if (event.edge < 0) return event.version == diagram.vertexVersions[event.triangle];
+
+    const int32_t neighbour = diagram.triangulation.triangles[event.triangle].neighbours[event.edge];
+
+    return event.version == diagram.triangleVersions[event.triangle] && neighbour >= 0 && event.neighbourVersion == diagram.triangleVersions[neighbour];
+}
+
+
+void ProcessKineticEvent(KineticDiagram& diagram, const KineticEvent& event) {
+    auto& triangulation = diagram.triangulation;
+
+    if (event.edge < 0) {
+        const uint32_t vertex = (uint32_t)event.triangle;
+
+        if (!IsKineticEventLive(diagram, event)) return;
+
+        KineticVertex& m = diagram.motion[vertex];
+
+        BounceKineticVertex(m, event.time);
+        diagram.vertexVersions[vertex]++;
+        diagram.bounces++;
+
+        PushKineticEvent(diagram, { m.bounceTime, (int32_t)vertex, -1, diagram.vertexVersions[vertex], 0 });
+
+        // Every certificate around the vertex assumed the old velocity
+        std::vector<int32_t> around = {};
+        const int32_t first = triangulation.vertexTriangles[vertex];
+        int32_t triangle = first;
+
+        do {
+            around.push_back(triangle);
+            const DelaunayTriangle& t = triangulation.triangles[triangle];
+            triangle = t.neighbours[(GetVertexIndex(t, vertex) + 1) % 3];
+        } while (triangle != first && triangle >= 0);
+
+        RescheduleTriangles(diagram, around);
+
+        return;
+    }
+
+    if (!IsKineticEventLive(diagram, event)) return;
+
+    const int32_t triangle = event.triangle;
+    const int32_t neighbour = triangulation.triangles[triangle].neighbours[event.edge];
+
+    const DelaunayTriangle& t = triangulation.triangles[triangle];
+    const DelaunayTriangle& u = triangulation.triangles[neighbour];
+
+    // A flip needs a convex quad, which only degenerate motion can break
+    const bool convex = DoSegmentsCross(
+        GetKineticPosition(diagram, t.vertices[event.edge], event.time),
+        GetKineticPosition(diagram, u.vertices[GetNeighbourIndex(u, triangle)], event.time),
+        GetKineticPosition(diagram, t.vertices[(event.edge + 1) % 3], event.time),
+        GetKineticPosition(diagram, t.vertices[(event.edge + 2) % 3], event.time)
+    );
+
+    if (!convex) return;
+
+    FlipEdge(triangulation, triangle, event.edge);
+    diagram.flips++;
+
+    RescheduleTriangles(diagram, { triangle, neighbour });
+}
+
+
+// Moves every vertex to the given time and triangulates the positions from scratch. The positions
+// are rounded to floats first, so the triangulation is exact for the positions it is drawn at.
+void RebuildKineticDiagram(KineticDiagram& diagram, const double time) {
+    PROFILE_SCOPE("kinetic rebuild");
+
+    const auto& vertices = diagram.triangulation.vertices;
+    std::vector<Point> points(vertices.size() - superVertexCount);
+
+    for (size_t i = superVertexCount; i < vertices.size(); i++) {
+        KineticVertex& m = diagram.motion[i];
+
+        while (m.bounceTime <= time) {
+            BounceKineticVertex(m, m.bounceTime);
+            diagram.bounces++;
+        }
+
+        m.x = (GLfloat)(m.x + m.vx * (time - m.time));
+        m.y = (GLfloat)(m.y + m.vy * (time - m.time));
+        m.time = time;
+        m.bounceTime = GetBounceTime(m);
+
+        points[i - superVertexCount] = { { (GLfloat)m.x, (GLfloat)m.y }, {} };
+    }
+
+    // The new vertices are in insertion order and carry the index of the old one as their site
+    Triangulation triangulation = CreateTriangulation(points, {});
+    std::vector<KineticVertex> motion(triangulation.vertices.size());
+
+    for (size_t i = 0; i < triangulation.vertices.size(); i++) {
+        DelaunayVertex& vertex = triangulation.vertices[i];
+
+        if (vertex.site < 0) {
+            motion[i] = { vertex.x, vertex.y, 0.0, 0.0, time, std::numeric_limits<double>::infinity() };
+            continue;
+        }
+
+        const size_t old = vertex.site + superVertexCount;
+
+        motion[i] = diagram.motion[old];
+        vertex.site = vertices[old].site;
+    }
+
+    diagram.triangulation = std::move(triangulation);
+    diagram.motion = std::move(motion);
+    diagram.triangleVersions.assign(diagram.triangulation.triangles.size(), 0);
+    diagram.vertexVersions.assign(diagram.triangulation.vertices.size(), 0);
+    diagram.events.clear();
+    diagram.rebuilds++;
+}
+
+
+// Processes every event up to the given time in order, then moves all positions there. A frame with
+// more events than half the vertices costs more than a rebuild, and the motion of the sites keeps
+// its speed, so every later frame rebuilds instead.
+size_t AdvanceKineticDiagram(KineticDiagram& diagram, const double time) {
+    if (diagram.rebuilding) {
+        RebuildKineticDiagram(diagram, time);
+        diagram.time = time;
+
+        return 0;
+    }
+
+    PROFILE_SCOPE("kinetic repair");
+
+    size_t processed = 0;
+    const size_t maxEvents = diagram.motion.size() * 16 + 1024;
+
+    // Every flip leaves up to five stale events behind, popping them one by one from a heap several
+    // times the live size costs more than sweeping them out at once
+    const size_t liveBound = diagram.triangulation.triangles.size() * 3 / 2 + diagram.motion.size();
+
+    if (diagram.events.size() > liveBound * 2) {
+        diagram.events.erase(std::remove_if(diagram.events.begin(), diagram.events.end(), [&](const KineticEvent& event) {
+            return !IsKineticEventLive(diagram, event);
+        }), diagram.events.end());
+
+        std::make_heap(diagram.events.begin(), diagram.events.end(), std::greater<>());
+    }
+
+    while (!diagram.events.empty() && diagram.events.front().time <= time) {
+        std::pop_heap(diagram.events.begin(), diagram.events.end(), std::greater<>());
+        const KineticEvent event = diagram.events.back();
+        diagram.events.pop_back();
+
+        diagram.time = std::max(diagram.time, event.time);
+        ProcessKineticEvent(diagram, event);
+
+        if (++processed > maxEvents) {
+            LOG_WARNING("kinetic step stopped after %zu events", processed);
+            break;
+        }
+    }
+
+    diagram.time = time;
+    diagram.processedEvents += processed;
+
+    UpdateKineticPositions(diagram, time);
+
+    if (processed > diagram.motion.size() / 2) {
+        LOG_INFO("kinetic step took %zu events for %zu vertices, rebuilding every frame from now on", processed, diagram.motion.size());
+        diagram.rebuilding = true;
+    }
+
+    return processed;
+}
+
+
+// Three fan triangles per Delaunay triangle, one per corner: the site and the circumcentres on both
+// sides of the edge to the next corner. Flips and rebuilds keep the triangle count, so the buffer never
+// grows, a rebuild only loses triangles when two sites meet at the same float position.
+void WriteKineticVertices(const KineticDiagram& diagram, const std::vector<Point>& points, std::vector<Point>& vertices) {
+    const auto& triangulation = diagram.triangulation;
+    const size_t triangleCount = triangulation.triangles.size();
+
+    std::vector<PointData> circumcenters(triangleCount);
+    vertices.resize(triangleCount * 9);
+
+    ParallelFor(triangleCount, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const DelaunayTriangle& t = triangulation.triangles[i];
+            const DelaunayVertex center = GetCircumcenter(triangulation.vertices[t.vertices[0]], triangulation.vertices[t.vertices[1]], triangulation.vertices[t.vertices[2]]);
+
+            circumcenters[i] = { (GLfloat)center.x, (GLfloat)center.y };
+        }
+    });
+
+    ParallelFor(triangleCount, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const DelaunayTriangle& t = triangulation.triangles[i];
+
+            for (int k = 0; k < 3; k++) {
+                const DelaunayVertex& site = triangulation.vertices[t.vertices[k]];
+                const int32_t neighbour = t.neighbours[(k + 2) % 3];
+                Point* corner = &vertices[i * 9 + k * 3];
+
+                if (site.site < 0 || neighbour < 0) {
+                    corner[0] = corner[1] = corner[2] = {};
+                    continue;
+                }
+
+                const Color& color = points[site.site].color;
+
+                corner[0] = { { (GLfloat)site.x, (GLfloat)site.y }, color };
+                corner[1] = { circumcenters[i], color };
+                corner[2] = { circumcenters[neighbour], color };
+            }
+        }
+    });
+}
+
+
+std::vector<PointData> CreateSiteVelocities(const size_t count, const double speed, const uint64_t seed) {
+    std::mt19937_64 gen(seed);
+    std::uniform_real_distribution<double> angle(0.0, 2.0 * 3.14159265358979323846);
+    std::uniform_real_distribution<double> factor(0.5, 1.0);
+
+    std::vector<PointData> velocities(count);
+
+    for (auto& velocity : velocities) {
+        const double a = angle(gen);
+        const double s = speed * factor(gen);
+
+        velocity = { (GLfloat)(std::cos(a) * s), (GLfloat)(std::sin(a) * s) };
+    }
+
+    return velocities;
+}
+
+
+// Natural neighbour interpolation of per-site values. A query is only virtually inserted: the
+// triangles whose circumcircle contains it form its cavity, the cavity corners are its natural
+// neighbours and the circumcentres around the cavity give their weights, so the triangulation is
+// built once and shared read-only between the workers.
+enum class InterpolationMethod {
+    Sibson,     // area the query's cell takes from each neighbour
+    Laplace     // length of the cell edge shared with each neighbour over the distance to it
+};
+
+
+struct NaturalNeighbourInterpolator {
+    Triangulation triangulation;
+    std::vector<GLfloat> values;    // by site index
+};
+
+
+struct InterpolationScratch {
+    std::vector<int32_t> cavity;
+    std::vector<uint32_t> neighbours;
+    std::vector<double> areas;
+    std::vector<DelaunayVertex> edgeStarts;   // circumcentre of the query and the cavity edge leaving the neighbour
+    std::vector<DelaunayVertex> edgeEnds;     // same for the cavity edge arriving at the neighbour
+    int32_t hint = -1;
+};
+
+
+NaturalNeighbourInterpolator CreateNaturalNeighbourInterpolator(const std::vector<Point>& points, const std::vector<GLfloat>& values) {
+    PROFILE_SCOPE("interpolator");
+
+    NaturalNeighbourInterpolator interpolator = { CreateTriangulation(points, {}), values };
+    interpolator.values.resize(points.size(), 0.0f);
+
+    return interpolator;
+}
+
+
+// Signed area of the quadrilateral apex, p1, p2, p3
+double GetQuadArea(const DelaunayVertex& apex, const DelaunayVertex& p1, const DelaunayVertex& p2, const DelaunayVertex& p3) {
+    return (Orient2d(apex, p1, p2) + Orient2d(apex, p2, p3)) / 2.0;
+}
+
+
+// NaN on and outside the convex hull of the sites, where the query's cell would be unbounded
+double InterpolateNaturalNeighbours(
+    const NaturalNeighbourInterpolator& interpolator,
+    const double x,
+    const double y,
+    const InterpolationMethod method,
+    InterpolationScratch& scratch
+) {
+    const Triangulation& triangulation = interpolator.triangulation;
+    const auto& vertices = triangulation.vertices;
+    const DelaunayVertex query = { x, y, -1 };
+    const double outside = std::numeric_limits<double>::quiet_NaN();
+
+    for (uint32_t i = 0; i < superVertexCount; i++) {
+        if (Orient2d(vertices[i], vertices[(i + 1) % superVertexCount], query) <= 0.0) return outside;
+    }
+
+    const auto location = LocatePoint(triangulation, query, scratch.hint >= 0 ? scratch.hint : triangulation.lastTriangle);
+    scratch.hint = location.triangle;
+
+    if (location.vertex >= 0) {
+        const int32_t site = vertices[location.vertex].site;
+
+        return site >= 0 ? interpolator.values[site] : outside;
+    }
+
+    auto& cavity = scratch.cavity;
+    cavity.assign(1, location.triangle);
+
+    // The containing triangle is taken even when the rounded incircle test calls the query cocircular.
+    // Triangles at the super vertices use the same limits as the builder, so only a query beyond a
+    // hull edge reaches one of them.
+    for (size_t head = 0; head < cavity.size(); head++) {
+        const DelaunayTriangle& t = triangulation.triangles[cavity[head]];
+
+        for (int i = 0; i < 3; i++) {
+            if (t.vertices[i] < superVertexCount) return outside;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            const int32_t neighbour = t.neighbours[i];
+
+            if (neighbour < 0 || std::find(cavity.begin(), cavity.end(), neighbour) != cavity.end()) continue;
+
+            if (IsInsideCircumcircle(triangulation, triangulation.triangles[neighbour], query, false)) {
+                cavity.push_back(neighbour);
+            }
+        }
+    }
+
+    scratch.neighbours.clear();
+    scratch.areas.clear();
+    scratch.edgeStarts.clear();
+    scratch.edgeEnds.clear();
+
+    const auto getNeighbour = [&](const uint32_t vertex) {
+        const auto found = std::find(scratch.neighbours.begin(), scratch.neighbours.end(), vertex);
+
+        if (found != scratch.neighbours.end()) return (size_t)(found - scratch.neighbours.begin());
+
+        scratch.neighbours.push_back(vertex);
+        scratch.areas.push_back(0.0);
+        scratch.edgeStarts.push_back({});
+        scratch.edgeEnds.push_back({});
+
+        return scratch.neighbours.size() - 1;
+    };
+
+    // Every corner of the cavity is a neighbour. The part of its old cell inside the triangle is
+    // the quadrilateral corner, edge point, circumcentre, edge point, where the edge points may be any
+    // points on the bisectors of the two edges: midpoints inside the cavity and the new circumcentres
+    // with the query on its boundary, which makes the quadrilaterals add up to the stolen area.
+    for (const int32_t triangle : cavity) {
+        const DelaunayTriangle& t = triangulation.triangles[triangle];
+        const DelaunayVertex& a = vertices[t.vertices[0]];
+        const DelaunayVertex& b = vertices[t.vertices[1]];
+        const DelaunayVertex& c = vertices[t.vertices[2]];
+        const DelaunayVertex center = GetCircumcenter(a, b, c);
+
+        DelaunayVertex edgePoints[3];
+        size_t corners[3];
+
+        for (int i = 0; i < 3; i++) {
+            corners[i] = getNeighbour(t.vertices[i]);
+        }
+
+        for (int i = 0; i < 3; i++) {
+            const DelaunayVertex& from = vertices[t.vertices[(i + 1) % 3]];
+            const DelaunayVertex& to = vertices[t.vertices[(i + 2) % 3]];
+            const int32_t neighbour = t.neighbours[i];
+
+            if (neighbour >= 0 && std::find(cavity.begin(), cavity.end(), neighbour) != cavity.end()) {
+                edgePoints[i] = { (from.x + to.x) / 2.0, (from.y + to.y) / 2.0, -1 };
+                continue;
+            }
+
+            edgePoints[i] = GetCircumcenter(from, to, query);
+            scratch.edgeStarts[corners[(i + 1) % 3]] = edgePoints[i];
+            scratch.edgeEnds[corners[(i + 2) % 3]] = edgePoints[i];
+        }
+
+        for (int i = 0; i < 3; i++) {
+            scratch.areas[corners[i]] += GetQuadArea(vertices[t.vertices[i]], edgePoints[(i + 2) % 3], center, edgePoints[(i + 1) % 3]);
+        }
+    }
+
+    double weightSum = 0.0;
+    double valueSum = 0.0;
+
+    for (size_t i = 0; i < scratch.neighbours.size(); i++) {
+        const DelaunayVertex& site = vertices[scratch.neighbours[i]];
+        double weight = 0.0;
+
+        if (method == InterpolationMethod::Sibson) {
+            // What is left of the old cell inside the cavity is the triangle to the new cell edge
+            weight = scratch.areas[i] - Orient2d(site, scratch.edgeStarts[i], scratch.edgeEnds[i]) / 2.0;
+        }
+        else {
+            const double ex = scratch.edgeStarts[i].x - scratch.edgeEnds[i].x;
+            const double ey = scratch.edgeStarts[i].y - scratch.edgeEnds[i].y;
+
+            weight = std::sqrt((ex * ex + ey * ey) / ((site.x - x) * (site.x - x) + (site.y - y) * (site.y - y)));
+        }
+
+        weightSum += weight;
+        valueSum += weight * interpolator.values[site.site];
+    }
+
+    return weightSum > 0.0 ? valueSum / weightSum : outside;
+}
+
+
+std::vector<GLfloat> InterpolateQueries(
+    const NaturalNeighbourInterpolator& interpolator,
+    const std::vector<PointData>& queries,
+    const InterpolationMethod method
+) {
+    PROFILE_SCOPE("interpolation");
+
+    std::vector<GLfloat> samples(queries.size());
+
+    ParallelFor(queries.size(), [&](size_t begin, size_t end, size_t) {
+        InterpolationScratch scratch = {};
+
+        for (size_t i = begin; i < end; i++) {
+            samples[i] = (GLfloat)InterpolateNaturalNeighbours(interpolator, queries[i].x, queries[i].y, method, scratch);
+        }
+    }, 256);
+
+    return samples;
+}
+
+
+// Pixel centres of view, rows from the top, every row walks on from the previous sample's triangle
+std::vector<GLfloat> InterpolateGrid(
+    const NaturalNeighbourInterpolator& interpolator,
+    const size_t width,
+    const size_t height,
+    const ViewRect& view,
+    const InterpolationMethod method
+) {
+    PROFILE_SCOPE("interpolation");
+
+    std::vector<GLfloat> samples(width * height);
+
+    const double pixelWidth = ((double)view.maxX - view.minX) / width;
+    const double pixelHeight = ((double)view.maxY - view.minY) / height;
+
+    ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+        InterpolationScratch scratch = {};
+
+        for (size_t row = begin; row < end; row++) {
+            const double y = view.maxY - (row + 0.5) * pixelHeight;
+
+            for (size_t column = 0; column < width; column++) {
+                const double x = view.minX + (column + 0.5) * pixelWidth;
+
+                samples[row * width + column] = (GLfloat)InterpolateNaturalNeighbours(interpolator, x, y, method, scratch);
+            }
+        }
+    }, 8);
+
+    return samples;
+}
+
+
+// Binary PGM stretched between the smallest and largest sample for .pgm files, raw little endian
+// float32 samples otherwise. Samples outside the hull are black or NaN.
+bool WriteValueGrid(const char * fileName, const size_t width, const size_t height, const std::vector<GLfloat>& samples) {
+    FILE* file = fopen(fileName, "wb");
+
+    if (file == nullptr) {
+        LOG_ERROR("failed to open value grid file: %s", fileName);
+        return false;
+    }
+
+    if (std::filesystem::path(fileName).extension() == ".pgm") {
+        GLfloat minValue = std::numeric_limits<GLfloat>::max();
+        GLfloat maxValue = std::numeric_limits<GLfloat>::lowest();
+
+        for (const GLfloat sample : samples) {
+            if (!std::isfinite(sample)) continue;
+
+            minValue = std::min(minValue, sample);
+            maxValue = std::max(maxValue, sample);
+        }
+
+        const GLfloat range = maxValue > minValue ? maxValue - minValue : 1.0f;
+        std::vector<uint8_t> pixels(samples.size(), 0);
+
+        ParallelFor(samples.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                if (std::isfinite(samples[i])) {
+                    pixels[i] = (uint8_t)std::clamp((samples[i] - minValue) / range * 254.0f + 1.5f, 1.0f, 255.0f);
+                }
+            }
+        });
+
+        fprintf(file, "P5\n%zu %zu\n255\n", width, height);
+        fwrite(pixels.data(), 1, pixels.size(), file);
+    }
+    else {
+        fwrite(samples.data(), sizeof(GLfloat), samples.size(), file);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+
+// Spherical Voronoi diagrams of longitude/latitude sites in degrees. The Delaunay triangulation of
+// points on a sphere is their convex hull, and the stereographic projection from one of the sites
+// turns it into the planar Delaunay triangulation of the others plus one face per edge of their
+// planar hull, so the incremental planar builder computes the hull. Cell corners are the outward
+// circumcentres of the faces and cell edges are great circle arcs.
+enum class SphereProjection {
+    Equirectangular,
+    Orthographic
+};
+
+
+struct SphereVector {
+    double x;
+    double y;
+    double z;
+};
+
+
+struct SphericalFace {
+    uint32_t sites[3];  // counterclockwise seen from outside
+};
+
+
+struct SphericalDiagram {
+    std::vector<SphereVector> sites;
+    std::vector<SphericalFace> faces;
+    std::vector<SphereVector> centers;      // Voronoi vertex of every face
+    std::vector<uint32_t> cellOffsets;      // cell of site i is cellFaces[cellOffsets[i], cellOffsets[i + 1])
+    std::vector<uint32_t> cellFaces;        // counterclockwise, empty for duplicates
+};
+
+
+const double degreesToRadians = 3.14159265358979323846 / 180.0;
+
+
+SphereVector CrossProduct(const SphereVector& a, const SphereVector& b) {
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+
+double DotProduct(const SphereVector& a, const SphereVector& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+
+SphereVector Normalize(const SphereVector& v) {
+    const double length = std::sqrt(DotProduct(v, v));
+
+    return length > 0.0 ? SphereVector{ v.x / length, v.y / length, v.z / length } : v;
+}
+
+
+SphereVector GetSphereVector(const PointData& lonLat) {
+    const double lon = lonLat.x * degreesToRadians;
+    const double lat = std::clamp((double)lonLat.y, -90.0, 90.0) * degreesToRadians;
+
+    return { std::cos(lat) * std::cos(lon), std::cos(lat) * std::sin(lon), std::sin(lat) };
+}
+
+
+// Uniform on the sphere, the colours are left for FillMissingSiteColors
+std::vector<Point> CreateSphereSites(const size_t count, const uint64_t seed) {
+    std::mt19937_64 gen(seed);
+    std::uniform_real_distribution<double> lon(-180.0, 180.0);
+    std::uniform_real_distribution<double> z(-1.0, 1.0);
+
+    std::vector<Point> points(count);
+
+    for (auto& point : points) {
+        point.pointData = { (GLfloat)lon(gen), (GLfloat)(std::asin(z(gen)) / degreesToRadians) };
+        point.color = { missingColorComponent, missingColorComponent, missingColorComponent };
+    }
+
+    return points;
+}
+
+
+SphericalDiagram CreateSphericalDiagram(const std::vector<Point>& points) {
+    PROFILE_SCOPE("spherical diagram");
+
+    SphericalDiagram diagram = {};
+    diagram.sites.resize(points.size());
+    diagram.cellOffsets.assign(points.size() + 1, 0);
+
+    ParallelFor(points.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            diagram.sites[i] = GetSphereVector(points[i].pointData);
+        }
+    });
+
+    if (points.size() < 4) return diagram;
+
+    // Projecting from site 0 turned to the north pole, its duplicates are dropped
+    const SphereVector pole = diagram.sites[0];
+    const SphereVector helper = std::fabs(pole.z) < 0.9 ? SphereVector{ 0.0, 0.0, 1.0 } : SphereVector{ 1.0, 0.0, 0.0 };
+    const SphereVector east = Normalize(CrossProduct(helper, pole));
+    const SphereVector north = CrossProduct(pole, east);
+
+    std::vector<Point> projected = {};
+    std::vector<uint32_t> projectedSites = {};
+    projected.reserve(points.size());
+    projectedSites.reserve(points.size());
+
+    for (size_t i = 1; i < points.size(); i++) {
+        const SphereVector& s = diagram.sites[i];
+        const double denominator = 1.0 - DotProduct(s, pole);
+
+        if (denominator < 1e-12) continue;
+
+        projected.push_back({ { (GLfloat)(DotProduct(s, east) / denominator), (GLfloat)(DotProduct(s, north) / denominator) }, {} });
+        projectedSites.push_back((uint32_t)i);
+    }
+
+    const Triangulation triangulation = CreateTriangulation(projected, {});
+    const auto& vertices = triangulation.vertices;
+
+    // The plane is seen from the pole while the faces are seen from outside, so the projection
+    // mirrors every face and the counterclockwise planar triangles are added backwards. Hull normals
+    // cannot tell the orientation when all sites lie in one hemisphere or barely span a tetrahedron.
+    for (const auto& t : triangulation.triangles) {
+        const int32_t a = vertices[t.vertices[0]].site;
+        const int32_t b = vertices[t.vertices[1]].site;
+        const int32_t c = vertices[t.vertices[2]].site;
+
+        if (a >= 0 && b >= 0 && c >= 0) {
+            diagram.faces.push_back({ { projectedSites[a], projectedSites[c], projectedSites[b] } });
+            continue;
+        }
+
+        // Edges between the projected sites and the super triangle close the sphere at the pole, which
+        // takes the place of the super vertex in the mirrored face
+        for (int i = 0; i < 3; i++) {
+            const int32_t neighbour = t.neighbours[i];
+            const int32_t from = vertices[t.vertices[(i + 1) % 3]].site;
+            const int32_t to = vertices[t.vertices[(i + 2) % 3]].site;
+
+            if (vertices[t.vertices[i]].site >= 0 || from < 0 || to < 0 || neighbour < 0) continue;
+
+            const DelaunayTriangle& n = triangulation.triangles[neighbour];
+
+            if (vertices[n.vertices[0]].site >= 0 && vertices[n.vertices[1]].site >= 0 && vertices[n.vertices[2]].site >= 0) {
+                diagram.faces.push_back({ { 0, projectedSites[to], projectedSites[from] } });
+            }
+        }
+    }
+
+    diagram.centers.resize(diagram.faces.size());
+
+    ParallelFor(diagram.faces.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const SphereVector& a = diagram.sites[diagram.faces[i].sites[0]];
+            const SphereVector& b = diagram.sites[diagram.faces[i].sites[1]];
+            const SphereVector& c = diagram.sites[diagram.faces[i].sites[2]];
+
+            diagram.centers[i] = Normalize(CrossProduct({ b.x - a.x, b.y - a.y, b.z - a.z }, { c.x - a.x, c.y - a.y, c.z - a.z }));
+        }
+    });
+
+    // Directed edges sorted by (from, to), the face after f = (a, b, c) around a holds the edge a -> c
+    std::vector<std::pair<uint64_t, uint32_t>> edges(diagram.faces.size() * 3);
+    std::vector<uint32_t> firstFaces(points.size(), std::numeric_limits<uint32_t>::max());
+
+    for (size_t i = 0; i < diagram.faces.size(); i++) {
+        const uint32_t* s = diagram.faces[i].sites;
+
+        for (int k = 0; k < 3; k++) {
+            edges[i * 3 + k] = { (uint64_t)s[k] << 32 | s[(k + 1) % 3], (uint32_t)i };
+            firstFaces[s[k]] = (uint32_t)i;
+        }
+    }
+
+    std::sort(edges.begin(), edges.end());
+
+    const auto findFace = [&](const uint32_t from, const uint32_t to) {
+        const uint64_t key = (uint64_t)from << 32 | to;
+        const auto found = std::lower_bound(edges.begin(), edges.end(), std::make_pair(key, (uint32_t)0));
+
+        return found != edges.end() && found->first == key ? found->second : std::numeric_limits<uint32_t>::max();
+    };
+
+    for (size_t site = 0; site < points.size(); site++) {
+        diagram.cellOffsets[site] = (uint32_t)diagram.cellFaces.size();
+
+        if (firstFaces[site] == std::numeric_limits<uint32_t>::max()) continue;
+
+        uint32_t face = firstFaces[site];
+
+        for (size_t step = 0; step < diagram.faces.size(); step++) {
+            diagram.cellFaces.push_back(face);
+
+            const uint32_t* s = diagram.faces[face].sites;
+            const int k = s[0] == site ? 0 : (s[1] == site ? 1 : 2);
+
+            face = findFace((uint32_t)site, s[(k + 2) % 3]);
+
+            if (face == firstFaces[site] || face == std::numeric_limits<uint32_t>::max()) break;
+        }
+    }
+
+    diagram.cellOffsets[points.size()] = (uint32_t)diagram.cellFaces.size();
+
+    return diagram;
+}
+
+
+SiteAdjacency BuildSphericalAdjacency(const SphericalDiagram& diagram) {
+    std::vector<std::pair<uint32_t, uint32_t>> edges(diagram.faces.size() * 3);
+
+    for (size_t i = 0; i < diagram.faces.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            edges[i * 3 + k] = { diagram.faces[i].sites[k], diagram.faces[i].sites[(k + 1) % 3] };
+        }
+    }
+
+    return CreateSiteAdjacency(diagram.sites.size(), edges);
+}
+
+
+struct SphereView {
+    SphereProjection projection;
+    SphereVector forward;   // orthographic: towards the viewer
+    SphereVector east;
+    SphereVector north;
+};
+
+
+SphereView CreateSphereView(const SphereProjection projection, const double centerLon, const double centerLat) {
+    const SphereVector forward = GetSphereVector({ (GLfloat)centerLon, (GLfloat)centerLat });
+    const SphereVector east = { -std::sin(centerLon * degreesToRadians), std::cos(centerLon * degreesToRadians), 0.0 };
+
+    return { projection, forward, east, CrossProduct(forward, east) };
+}
+
+
+double WrapLongitude(const double lon) {
+    if (lon > 3.14159265358979323846) return lon - 2.0 * 3.14159265358979323846;
+    if (lon < -3.14159265358979323846) return lon + 2.0 * 3.14159265358979323846;
+
+    return lon;
+}
+
+
+// Longitude and latitude scaled into [-1,1]², wrapped next to the first corner. Triangles over the
+// antimeridian are emitted once more on the other side and triangles around a pole are fanned out
+// from it, since the pole is a whole row of the map.
+void AppendEquirectangularTriangle(const SphereVector corners[3], const Color& color, std::vector<Triangle>& output) {
+    const double pi = 3.14159265358979323846;
+    double lons[3];
+    double lats[3];
+
+    for (int i = 0; i < 3; i++) {
+        lons[i] = std::atan2(corners[i].y, corners[i].x);
+        lats[i] = std::asin(std::clamp(corners[i].z, -1.0, 1.0));
+    }
+
+    const auto emit = [&](const double l1, const double b1, const double l2, const double b2, const double l3, const double b3) {
+        const double shifts[] = { 0.0, 2.0 * pi, -2.0 * pi };
+
+        for (const double shift : shifts) {
+            const double minLon = std::min({ l1, l2, l3 }) + shift;
+            const double maxLon = std::max({ l1, l2, l3 }) + shift;
+
+            if (shift != 0.0 && (maxLon < -pi || minLon > pi)) continue;
+
+            output.push_back({
+                {
+                    { (GLfloat)((l1 + shift) / pi), (GLfloat)(b1 / (pi / 2.0)) },
+                    { (GLfloat)((l2 + shift) / pi), (GLfloat)(b2 / (pi / 2.0)) },
+                    { (GLfloat)((l3 + shift) / pi), (GLfloat)(b3 / (pi / 2.0)) }
+                },
+                color
+            });
+        }
+    };
+
+    for (const double poleZ : { 1.0, -1.0 }) {
+        const SphereVector pole = { 0.0, 0.0, poleZ };
+        bool containsPole = true;
+
+        for (int i = 0; i < 3; i++) {
+            if (DotProduct(pole, CrossProduct(corners[i], corners[(i + 1) % 3])) < 0.0) containsPole = false;
+        }
+
+        if (!containsPole) continue;
+
+        for (int i = 0; i < 3; i++) {
+            const double from = lons[i];
+            const double to = from + WrapLongitude(lons[(i + 1) % 3] - from);
+            const double poleLat = poleZ * pi / 2.0;
+
+            emit(from, lats[i], to, lats[(i + 1) % 3], to, poleLat);
+            emit(from, lats[i], to, poleLat, from, poleLat);
+        }
+
+        return;
+    }
+
+    emit(lons[0], lats[0], lons[0] + WrapLongitude(lons[1] - lons[0]), lats[1], lons[0] + WrapLongitude(lons[2] - lons[0]), lats[2]);
+}
+
+
+// The hemisphere facing the viewer, corners behind the limb are pulled onto it
+void AppendOrthographicTriangle(const SphereView& view, const SphereVector corners[3], const Color& color, std::vector<Triangle>& output) {
+    PointData projected[3];
+    bool visible = false;
+
+    for (int i = 0; i < 3; i++) {
+        double x = DotProduct(corners[i], view.east);
+        double y = DotProduct(corners[i], view.north);
+
+        if (DotProduct(corners[i], view.forward) >= 0.0) {
+            visible = true;
+        }
+        else {
+            const double length = std::max(std::sqrt(x * x + y * y), 1e-12);
+            x /= length;
+            y /= length;
+        }
+
+        projected[i] = { (GLfloat)x, (GLfloat)y };
+    }
+
+    if (visible) output.push_back({ { projected[0], projected[1], projected[2] }, color });
+}
+
+
+// Fans from every site to its cell corners, split until no edge spans more than maxAngle so the
+// projected edges follow the great circle arcs
+std::vector<Triangle> ProjectSphericalDiagram(
+    const SphericalDiagram& diagram,
+    const std::vector<Point>& points,
+    const SphereView& view,
+    const double maxAngle = 2.0 * degreesToRadians
+) {
+    PROFILE_SCOPE("spherical projection");
+
+    std::vector<std::vector<Triangle>> trianglesPerWorker(GetWorkerCount());
+
+    ParallelFor(diagram.sites.size(), [&](size_t begin, size_t end, size_t worker) {
+        auto& output = trianglesPerWorker[worker];
+
+        for (size_t site = begin; site < end; site++) {
+            const uint32_t first = diagram.cellOffsets[site];
+            const uint32_t count = diagram.cellOffsets[site + 1] - first;
+            const Color& color = points[site].color;
+
+            for (uint32_t k = 0; k < count; k++) {
+                const SphereVector& a = diagram.sites[site];
+                const SphereVector& b = diagram.centers[diagram.cellFaces[first + k]];
+                const SphereVector& c = diagram.centers[diagram.cellFaces[first + (k + 1) % count]];
+
+                const double longest = std::max({
+                    std::acos(std::clamp(DotProduct(a, b), -1.0, 1.0)),
+                    std::acos(std::clamp(DotProduct(b, c), -1.0, 1.0)),
+                    std::acos(std::clamp(DotProduct(c, a), -1.0, 1.0))
+                });
+                const int steps = std::clamp((int)std::ceil(longest / maxAngle), 1, 64);
+
+                // Barycentric grid on the flat triangle, every grid point pushed out to the sphere
+                const auto gridPoint = [&](const int i, const int j) {
+                    const double u = (double)i / steps;
+                    const double v = (double)j / steps;
+                    const double w = 1.0 - u - v;
+
+                    return Normalize({ a.x * w + b.x * u + c.x * v, a.y * w + b.y * u + c.y * v, a.z * w + b.z * u + c.z * v });
+                };
+
+                for (int i = 0; i < steps; i++) {
+                    for (int j = 0; i + j < steps; j++) {
+                        const SphereVector lower[3] = { gridPoint(i, j), gridPoint(i + 1, j), gridPoint(i, j + 1) };
+
+                        if (view.projection == SphereProjection::Equirectangular) AppendEquirectangularTriangle(lower, color, output);
+                        else AppendOrthographicTriangle(view, lower, color, output);
+
+                        if (i + j + 2 > steps) continue;
+
+                        const SphereVector upper[3] = { gridPoint(i + 1, j), gridPoint(i + 1, j + 1), gridPoint(i, j + 1) };
+
+                        if (view.projection == SphereProjection::Equirectangular) AppendEquirectangularTriangle(upper, color, output);
+                        else AppendOrthographicTriangle(view, upper, color, output);
+                    }
+                }
+            }
+        }
+    }, 256);
+
+    std::vector<Triangle> triangles = {};
+
+    for (auto& workerTriangles : trianglesPerWorker) {
+        triangles.insert(triangles.end(), workerTriangles.begin(), workerTriangles.end());
+    }
+
+    return triangles;
+}
+
+
+// Site markers in the same map coordinates, the far side of the orthographic view is left out
+std::vector<Point> ProjectSphereSites(const std::vector<Point>& points, const SphereView& view) {
+    std::vector<Point> projected = {};
+    projected.reserve(points.size());
+
+    for (const auto& point : points) {
+        const SphereVector site = GetSphereVector(point.pointData);
+
+        if (view.projection == SphereProjection::Equirectangular) {
+            projected.push_back({ { (GLfloat)(std::atan2(site.y, site.x) / 3.14159265358979323846), (GLfloat)(std::asin(std::clamp(site.z, -1.0, 1.0)) * 2.0 / 3.14159265358979323846) }, point.color });
+        }
+        else if (DotProduct(site, view.forward) >= 0.0) {
+            projected.push_back({ { (GLfloat)DotProduct(site, view.east), (GLfloat)DotProduct(site, view.north) }, point.color });
+        }
+    }
+
+    return projected;
+}
+
+
+// Periodic diagrams on the torus [-1,1)². Sites closer than a margin to an edge get ghost copies on
+// the far side, so the triangulation sees every wrap-around neighbour without copying the whole set
+// eight times. The margin starts at a few site spacings and doubles until no empty circle of a site
+// reaches past the ghosts.
+struct PeriodicSites {
+    std::vector<Point> points;          // the sites wrapped into the square, followed by the ghosts
+    std::vector<uint32_t> originals;    // site behind every point
+    size_t siteCount;
+    double margin;
+};
+
+
+struct PeriodicDiagram {
+    PeriodicSites sites;
+    Triangulation triangulation;
+};
+
+
+double WrapPeriodic(const double value) {
+    const double wrapped = value - 2.0 * std::floor((value + 1.0) / 2.0);
+
+    return wrapped >= 1.0 ? wrapped - 2.0 : wrapped;
+}
+
+
+// Beyond a margin of 2 every site is copied into all eight neighbouring squares and a second ring is
+// needed, which only happens for a handful of sites
+const double maxPeriodicMargin = 4.0;
+
+
+PeriodicSites CreatePeriodicSites(const std::vector<Point>& points, const double margin) {
+    PeriodicSites periodic = { {}, {}, points.size(), margin };
+    periodic.points.reserve(points.size() * 2);
+    periodic.originals.reserve(points.size() * 2);
+
+    for (size_t i = 0; i < points.size(); i++) {
+        periodic.points.push_back({ { (GLfloat)WrapPeriodic(points[i].pointData.x), (GLfloat)WrapPeriodic(points[i].pointData.y) }, points[i].color });
+        periodic.originals.push_back((uint32_t)i);
+    }
+
+    const double limit = 1.0 + margin;
+    const int rings = margin > 2.0 ? 2 : 1;
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const Point site = periodic.points[i];
+
+        for (int dx = -rings; dx <= rings; dx++) {
+            for (int dy = -rings; dy <= rings; dy++) {
+                const double x = site.pointData.x + dx * 2.0;
+                const double y = site.pointData.y + dy * 2.0;
+
+                if ((dx == 0 && dy == 0) || std::fabs(x) > limit || std::fabs(y) > limit) continue;
+
+                periodic.points.push_back({ { (GLfloat)x, (GLfloat)y }, site.color });
+                periodic.originals.push_back((uint32_t)i);
+            }
+        }
+    }
+
+    return periodic;
+}
+
+
+// Every triangle at a site must have an empty circle inside the ghost band, anything reaching further
+// could be missing a ghost and is not a triangle of the torus
+std::optional<PeriodicDiagram> CreatePeriodicDiagram(const std::vector<Point>& points) {
+    PROFILE_SCOPE("periodic triangulation");
+
+    if (points.empty()) {
+        LOG_ERROR("a periodic diagram needs at least one site");
+        return std::nullopt;
+    }
+
+    double margin = std::min(3.0 * std::sqrt(4.0 / points.size()), maxPeriodicMargin);
+
+    while (true) {
+        PeriodicDiagram diagram = { CreatePeriodicSites(points, margin), {} };
+        diagram.triangulation = CreateTriangulation(diagram.sites.points, {});
+
+        const auto& triangulation = diagram.triangulation;
+        const double limit = 1.0 + margin;
+        std::atomic<bool> covered = true;
+
+        ParallelFor(triangulation.triangles.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end && covered.load(std::memory_order_relaxed); i++) {
+                const DelaunayTriangle& t = triangulation.triangles[i];
+                const DelaunayVertex& a = triangulation.vertices[t.vertices[0]];
+                const DelaunayVertex& b = triangulation.vertices[t.vertices[1]];
+                const DelaunayVertex& c = triangulation.vertices[t.vertices[2]];
+
+                const auto isSite = [&](const DelaunayVertex& v) { return v.site >= 0 && (size_t)v.site < points.size(); };
+
+                if (!isSite(a) && !isSite(b) && !isSite(c)) continue;
+
+                if (a.site < 0 || b.site < 0 || c.site < 0) {
+                    covered = false;
+                    break;
+                }
+
+                const DelaunayVertex center = GetCircumcenter(a, b, c);
+                const double radius = std::sqrt((center.x - a.x) * (center.x - a.x) + (center.y - a.y) * (center.y - a.y));
+
+                if (std::fabs(center.x) + radius > limit || std::fabs(center.y) + radius > limit) covered = false;
+            }
+        }, 4096);
+
+        if (covered) return diagram;
+
+        if (margin >= maxPeriodicMargin) {
+            LOG_ERROR("the periodic triangulation of %zu sites does not close", points.size());
+            return std::nullopt;
+        }
+
+        LOG_DEBUG("periodic margin %.4f is too narrow for %zu sites", margin, points.size());
+        margin = std::min(margin * 2.0, maxPeriodicMargin);
+    }
+}
+
+
+SiteAdjacency BuildPeriodicAdjacency(const PeriodicDiagram& diagram) {
+    const auto& triangulation = diagram.triangulation;
+    const size_t siteCount = diagram.sites.siteCount;
+    std::vector<std::pair<uint32_t, uint32_t>> edges = {};
+
+    for (const auto& t : triangulation.triangles) {
+        for (int k = 0; k < 3; k++) {
+            const int32_t a = triangulation.vertices[t.vertices[k]].site;
+            const int32_t b = triangulation.vertices[t.vertices[(k + 1) % 3]].site;
+
+            if (a < 0 || b < 0 || ((size_t)a >= siteCount && (size_t)b >= siteCount)) continue;
+
+            const uint32_t first = diagram.sites.originals[a];
+            const uint32_t second = diagram.sites.originals[b];
+
+            if (first != second) edges.push_back({ first, second });
+        }
+    }
+
+    return CreateSiteAdjacency(siteCount, edges);
+}
+
+
+// Fan triangle cut into the parts it leaves in each copy of the square, every part moved back into
+// [-1,1]² so the cells tile it exactly
+void AppendPeriodicPiece(const double corners[6], const Color& color, std::vector<Triangle>& output) {
+    const double minX = std::min({ corners[0], corners[2], corners[4] });
+    const double maxX = std::max({ corners[0], corners[2], corners[4] });
+    const double minY = std::min({ corners[1], corners[3], corners[5] });
+    const double maxY = std::max({ corners[1], corners[3], corners[5] });
+
+    if (minX >= -1.0 && maxX <= 1.0 && minY >= -1.0 && maxY <= 1.0) {
+        output.push_back({ { { (GLfloat)corners[0], (GLfloat)corners[1] }, { (GLfloat)corners[2], (GLfloat)corners[3] }, { (GLfloat)corners[4], (GLfloat)corners[5] } }, color });
+        return;
+    }
+
+    for (const double dx : { -2.0, 0.0, 2.0 }) {
+        for (const double dy : { -2.0, 0.0, 2.0 }) {
+            if (maxX + dx <= -1.0 || minX + dx >= 1.0 || maxY + dy <= -1.0 || minY + dy >= 1.0) continue;
+
+            // Sutherland-Hodgman against the four sides, a triangle gains at most one corner per side
+            double polygon[14];
+            double clipped[14];
+            size_t cornerCount = 3;
+
+            for (size_t i = 0; i < 3; i++) {
+                polygon[i * 2] = corners[i * 2] + dx;
+                polygon[i * 2 + 1] = corners[i * 2 + 1] + dy;
+            }
+
+            for (int side = 0; side < 4 && cornerCount >= 3; side++) {
+                const int axis = side & 1;
+                const double sign = side < 2 ? 1.0 : -1.0;
+                size_t clippedCount = 0;
+
+                for (size_t i = 0; i < cornerCount; i++) {
+                    const double* from = &polygon[i * 2];
+                    const double* to = &polygon[((i + 1) % cornerCount) * 2];
+                    const double fromDistance = 1.0 - sign * from[axis];
+                    const double toDistance = 1.0 - sign * to[axis];
+
+                    if (fromDistance >= 0.0) {
+                        clipped[clippedCount * 2] = from[0];
+                        clipped[clippedCount * 2 + 1] = from[1];
+                        clippedCount++;
+                    }
+
+                    if ((fromDistance >= 0.0) != (toDistance >= 0.0)) {
+                        const double t = fromDistance / (fromDistance - toDistance);
+
+                        clipped[clippedCount * 2] = from[0] + (to[0] - from[0]) * t;
+                        clipped[clippedCount * 2 + 1] = from[1] + (to[1] - from[1]) * t;
+                        clippedCount++;
+                    }
+                }
+
+                std::copy(clipped, clipped + clippedCount * 2, polygon);
+                cornerCount = clippedCount;
+            }
+
+            for (size_t i = 1; i + 1 < cornerCount; i++) {
+                output.push_back({
+                    {
+                        { (GLfloat)polygon[0], (GLfloat)polygon[1] },
+                        { (GLfloat)polygon[i * 2], (GLfloat)polygon[i * 2 + 1] },
+                        { (GLfloat)polygon[(i + 1) * 2], (GLfloat)polygon[(i + 1) * 2 + 1] }
+                    },
+                    color
+                });
+            }
+        }
+    }
+}
+
+
+// Fans from every site through the circumcentres on both sides of each of its edges, as in
+// WriteKineticVertices, only for the corners that are sites and not ghosts
+std::vector<Triangle> ExtractPeriodicTriangles(const std::vector<Point>& points) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto diagram = CreatePeriodicDiagram(points);
+
+    if (!diagram.has_value()) return {};
+
+    PROFILE_SCOPE("periodic cells");
+
+    const auto& triangulation = diagram->triangulation;
+    const size_t triangleCount = triangulation.triangles.size();
+    std::vector<DelaunayVertex> circumcenters(triangleCount);
+
+    ParallelFor(triangleCount, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const DelaunayTriangle& t = triangulation.triangles[i];
+
+            circumcenters[i] = GetCircumcenter(triangulation.vertices[t.vertices[0]], triangulation.vertices[t.vertices[1]], triangulation.vertices[t.vertices[2]]);
+        }
+    });
+
+    std::vector<std::vector<Triangle>> piecesPerWorker(GetWorkerCount());
+
+    ParallelFor(triangleCount, [&](size_t begin, size_t end, size_t worker) {
+        auto& output = piecesPerWorker[worker];
+
+        for (size_t i = begin; i < end; i++) {
+            const DelaunayTriangle& t = triangulation.triangles[i];
+
+            for (int k = 0; k < 3; k++) {
+                const DelaunayVertex& site = triangulation.vertices[t.vertices[k]];
+                const int32_t neighbour = t.neighbours[(k + 2) % 3];
+
+                if (site.site < 0 || (size_t)site.site >= points.size() || neighbour < 0) continue;
+
+                const double corners[6] = { site.x, site.y, circumcenters[i].x, circumcenters[i].y, circumcenters[neighbour].x, circumcenters[neighbour].y };
+
+                AppendPeriodicPiece(corners, points[site.site].color, output);
+            }
+        }
+    });
+
+    std::vector<Triangle> pieces = std::move(piecesPerWorker[0]);
+
+    for (size_t worker = 1; worker < piecesPerWorker.size(); worker++) {
+        pieces.insert(pieces.end(), piecesPerWorker[worker].begin(), piecesPerWorker[worker].end());
+    }
+
+    LOG_INFO(
+        "triangulated %zu periodic sites with %zu ghosts (margin %.3f) into %zu triangles in %.1f ms",
+        points.size(),
+        diagram->sites.points.size() - points.size(),
+        diagram->sites.margin,
+        triangleCount,
+        GetSecondsSince(start) * 1e3
+    );
+
+    return pieces;
+}
+
+
+// Label map of the whole torus. A pixel whose nearest site among sites and ghosts is no further away
+// than the margin has its true nearest copy among them, the margin doubles until all pixels do.
+LabelMap RasterizePeriodicSites(const std::vector<Point>& points, const size_t width, const size_t height) {
+    const ViewRect view = { -1.0f, -1.0f, 1.0f, 1.0f };
+
+    if (points.empty()) return RasterizeNearestSites(points, BuildSiteGrid(points), width, height, view);
+
+    double margin = std::min(3.0 * std::sqrt(4.0 / points.size()), maxPeriodicMargin);
+
+    while (true) {
+        const auto periodic = CreatePeriodicSites(points, margin);
+        LabelMap map = RasterizeNearestSites(periodic.points, BuildSiteGrid(periodic.points), width, height, view);
+
+        const GLfloat pixelWidth = (view.maxX - view.minX) / width;
+        const GLfloat pixelHeight = (view.maxY - view.minY) / height;
+        std::atomic<bool> covered = true;
+
+        ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+            for (size_t row = begin; row < end; row++) {
+                const GLfloat y = view.maxY - (row + 0.5f) * pixelHeight;
+
+                for (size_t column = 0; column < width; column++) {
+                    uint32_t& label = map.labels[row * width + column];
+                    const PointData& site = periodic.points[label].pointData;
+                    const double dx = site.x - (view.minX + (column + 0.5f) * pixelWidth);
+                    const double dy = site.y - y;
+
+                    if (dx * dx + dy * dy > margin * margin) covered = false;
+
+                    label = periodic.originals[label];
+                }
+            }
+        }, 8);
+
+        if (covered || margin >= maxPeriodicMargin) return map;
+
+        margin = std::min(margin * 2.0, maxPeriodicMargin);
+    }
+}
+
+
+// In-process job API: independent site sets are built on one shared pool of threads instead of each
+// caller blocking in its own extraction. Waiting jobs start by priority, first come first served within
+// a priority. Cancellation and deadlines stop a job before it starts and between triangulation and
+// cell extraction, a single triangulation cannot be interrupted.
+enum class DiagramJobStatus {
+    Done,
+    Cancelled,
+    DeadlineExceeded
+};
+
+
+struct DiagramJobRequest {
+    std::vector<Point> sites;
+    std::vector<ConstraintPolyline> constraints;
+    bool periodic = false;
+    int priority = 0;   // higher starts first
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+};
+
+
+struct DiagramJobResult {
+    DiagramJobStatus status = DiagramJobStatus::Done;
+    std::vector<Triangle> triangles;
+    double waitSeconds = 0.0;
+    double buildSeconds = 0.0;
+};
+
+
+struct DiagramJob {
+    DiagramJobRequest request;
+    std::promise<DiagramJobResult> promise;
+    std::shared_ptr<std::atomic<bool>> cancelled;
+    std::chrono::steady_clock::time_point submitted;
+    uint64_t sequence = 0;
+};
+
+
+// Dropping the handle does not cancel the job, its result is then just never read
+struct DiagramJobHandle {
+    std::future<DiagramJobResult> result;
+    std::shared_ptr<std::atomic<bool>> cancelled;
+};
+
+
+// Small jobs run one per thread with ParallelFor inline, so hundreds of them keep every thread busy
+// without splitting into tiny ranges. A job of at least largeJobSites sites spreads over ParallelFor
+// workers of its own, but only one at a time: further large jobs meanwhile run inline like small ones,
+// so the pool never has more than its own threads plus one set of workers.
+struct DiagramBuilder {
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::vector<std::unique_ptr<DiagramJob>> queue;     // heap ordered by IsDiagramJobLater
+    std::vector<std::thread> threads;
+    size_t largeJobSites = 16384;
+    uint64_t submitted = 0;
+    bool running = false;
+    bool spreadJobRunning = false;
+};
+
+
+// Heap comparison, true when job1 starts after job2
+bool IsDiagramJobLater(const std::unique_ptr<DiagramJob>& job1, const std::unique_ptr<DiagramJob>& job2) {
+    if (job1->request.priority != job2->request.priority) return job1->request.priority < job2->request.priority;
+
+    return job1->sequence > job2->sequence;
+}
+
+
+std::optional<DiagramJobStatus> GetDiagramJobStop(const DiagramJob& job) {
+    if (job.cancelled->load(std::memory_order_acquire)) return DiagramJobStatus::Cancelled;
+
+    if (job.request.deadline.has_value() && std::chrono::steady_clock::now() >= job.request.deadline.value()) {
+        return DiagramJobStatus::DeadlineExceeded;
+    }
+
+    return std::nullopt;
+}
+
+
+// A job that finishes after its deadline is still delivered, the deadline only saves work not yet done
+DiagramJobResult RunDiagramJob(const DiagramJob& job) {
+    DiagramJobResult result = {};
+    result.waitSeconds = GetSecondsSince(job.submitted);
+
+    const auto start = std::chrono::steady_clock::now();
+    const DiagramJobRequest& request = job.request;
+
+    if (const auto stop = GetDiagramJobStop(job)) {
+        result.status = stop.value();
+        return result;
+    }
+
+    if (request.periodic) {
+        result.triangles = ExtractPeriodicTriangles(request.sites);
+    }
+    else {
+        const auto triangulation = CreateTriangulation(request.sites, request.constraints);
+
+        if (const auto stop = GetDiagramJobStop(job)) {
+            result.status = stop.value();
+            return result;
+        }
+
+        const auto inside = ClassifyDomain(triangulation, HasBoundaryConstraints(request.constraints));
+        result.triangles = ExtractVoronoiPieces(triangulation, inside, request.sites);
+    }
+
+    result.buildSeconds = GetSecondsSince(start);
+
+    return result;
+}
+
+
+void RunDiagramBuilderThread(DiagramBuilder* builder) {
+    while (true) {
+        std::unique_ptr<DiagramJob> job = nullptr;
+        bool spread = false;
+
+        {
+            std::unique_lock<std::mutex> lock(builder->mutex);
+            builder->queued.wait(lock, [&]() { return !builder->queue.empty() || !builder->running; });
+
+            if (builder->queue.empty()) return;
+
+            std::pop_heap(builder->queue.begin(), builder->queue.end(), IsDiagramJobLater);
+            job = std::move(builder->queue.back());
+            builder->queue.pop_back();
+
+            spread = job->request.sites.size() >= builder->largeJobSites && !builder->spreadJobRunning;
+            builder->spreadJobRunning |= spread;
+        }
+
+        PROFILE_SCOPE("diagram job");
+
+        insideParallelFor = !spread;
+
+        try {
+            job->promise.set_value(RunDiagramJob(*job));
+        }
+        catch (...) {
+            job->promise.set_exception(std::current_exception());
+        }
+
+        insideParallelFor = false;
+
+        if (spread) {
+            std::lock_guard<std::mutex> lock(builder->mutex);
+            builder->spreadJobRunning = false;
+        }
+    }
+}
+
+
+void StartDiagramBuilder(DiagramBuilder& builder, const size_t threadCount, const size_t largeJobSites) {
+    builder.largeJobSites = largeJobSites;
+    builder.running = true;
+
+    for (size_t i = 0; i < std::max<size_t>(1, threadCount); i++) {
+        builder.threads.emplace_back(RunDiagramBuilderThread, &builder);
+    }
+}
+
+
+DiagramJobHandle SubmitDiagramJob(DiagramBuilder& builder, DiagramJobRequest request) {
+    auto job = std::make_unique<DiagramJob>();
+    job->request = std::move(request);
+    job->cancelled = std::make_shared<std::atomic<bool>>(false);
+    job->submitted = std::chrono::steady_clock::now();
+
+    DiagramJobHandle handle = { job->promise.get_future(), job->cancelled };
+
+    {
+        std::lock_guard<std::mutex> lock(builder.mutex);
+
+        if (!builder.running) {
+            job->promise.set_value({ DiagramJobStatus::Cancelled, {}, 0.0, 0.0 });
+            return handle;
+        }
+
+        job->sequence = builder.submitted++;
+        builder.queue.push_back(std::move(job));
+        std::push_heap(builder.queue.begin(), builder.queue.end(), IsDiagramJobLater);
+    }
+
+    builder.queued.notify_one();
+
+    return handle;
+}
+
+
+// A waiting job is answered right away, a running one stops at its next check
+void CancelDiagramJob(DiagramBuilder& builder, const DiagramJobHandle& handle) {
+    handle.cancelled->store(true, std::memory_order_release);
+
+    std::unique_ptr<DiagramJob> job = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(builder.mutex);
+
+        const auto waiting = std::find_if(builder.queue.begin(), builder.queue.end(), [&](const std::unique_ptr<DiagramJob>& queuedJob) {
+            return queuedJob->cancelled == handle.cancelled;
+        });
+
+        if (waiting == builder.queue.end()) return;
+
+        job = std::move(*waiting);
+        builder.queue.erase(waiting);
+        std::make_heap(builder.queue.begin(), builder.queue.end(), IsDiagramJobLater);
+    }
+
+    job->promise.set_value({ DiagramJobStatus::Cancelled, {}, GetSecondsSince(job->submitted), 0.0 });
+}
+
+
+// Running jobs finish, waiting ones are answered as cancelled
+void StopDiagramBuilder(DiagramBuilder& builder) {
+    std::vector<std::unique_ptr<DiagramJob>> waiting = {};
+
+    {
+        std::lock_guard<std::mutex> lock(builder.mutex);
+        builder.running = false;
+        waiting.swap(builder.queue);
+    }
+
+    builder.queued.notify_all();
+
+    for (auto& job : waiting) {
+        job->promise.set_value({ DiagramJobStatus::Cancelled, {}, GetSecondsSince(job->submitted), 0.0 });
+    }
+
+    for (auto& thread : builder.threads) {
+        thread.join();
+    }
+
+    builder.threads.clear();
+}
+
+
+struct Options {
+    std::optional<std::string> sitesFile;
+    SiteFileFormat sitesFormat = SiteFileFormat::Auto;
+    bool normalizeSites = true;
+    bool spatialSort = true;
+    std::optional<std::string> constraintsFile;
+    bool delaunay = false;
+    ColorOptions colors = {};
+    bool benchmark = false;
+    size_t benchmarkSites = 1000000;
+    std::string traceFile = "voronoiable_trace.json";
+    size_t triangleBudget = 1 << 20;
+    bool compactVertices = false;
+    bool offscreen = false;
+    size_t frameLimit = 0;
+    bool zoomSweep = false;
+    std::optional<std::string> screenshotFile;
+    size_t rasterWidth = 0;
+    size_t rasterHeight = 0;
+    std::string rasterFile = "voronoiable_labels.ppm";
+    size_t orderK = 1;
+    size_t kineticSites = 0;
+    double kineticSpeed = 0.1;
+    std::optional<SphereProjection> sphere;
+    double sphereCenterLon = 0.0;
+    double sphereCenterLat = 0.0;
+    size_t sphereSites = 10000;
+    bool periodic = false;
+    DistanceMetric metric = DistanceMetric::Euclidean;
+    PointData metricWeights = { 1.0f, 1.0f };
+    size_t interpolateWidth = 0;
+    size_t interpolateHeight = 0;
+    std::string interpolateFile = "voronoiable_values.pgm";
+    InterpolationMethod interpolationMethod = InterpolationMethod::Sibson;
+    bool verify = false;
+    size_t verifySites = 200;
+    size_t verifySize = 256;
+    std::vector<std::string> verifyStrategies;
+    double verifyMaxError = 0.1;
+    double verifyMaxMs = 0.0;
+    std::optional<std::string> serveSocket;
+    size_t serveBatchSites = 16384;
+    std::optional<std::string> shaderDirectory;
+    std::optional<std::string> shaderCacheDirectory = "voronoiable_shader_cache";
+};
+
+
+void PrintUsage(const char * programName) {
+    printf(
+        "usage: %s [options]\n"
+        "  --sites <file>            load sites from a CSV (x,y[,#RRGGBB]) or raw float32 x,y file\n"
+        "  --format <auto|csv|f32>   site file format, auto picks f32 for .bin/.f32/.raw files\n"
+        "  --no-normalize            keep loaded coordinates as they are instead of fitting them into [-1,1]\n"
+        "  --no-spatial-sort         keep the sites in input order instead of sorting them along a Hilbert curve\n"
+        "  --constraints <file>      walls (segment), domain outlines (polygon) and holes (hole), one per line\n"
+        "  --delaunay                build the cells from a Delaunay triangulation, implied by --constraints\n"
+        "  --colors <mode>           hashed (default), palette or graph (neighbouring cells never match)\n"
+        "  --seed <n>                seed of the site colours\n"
+        "  --threads <n>             worker threads for parallel stages\n"
+        "  --log-level <level>       error, warning, info, debug or trace\n"
+        "  --benchmark               run the benchmark suite instead of opening a window\n"
+        "  --benchmark-sites <n>     number of sites in generated benchmark inputs\n"
+        "  --trace <file>            Chrome trace output of profiling builds\n"
+        "  --triangle-budget <n>     most triangles drawn per frame before switching to a coarser level\n"
+        "  --compact-vertices        keep the cells as 16 bit positions and 8 bit colours, 2.5x less memory\n"
+        "  --offscreen               render into a hidden window without vsync\n"
+        "  --frames <n>              exit after n frames and log frame time statistics\n"
+        "  --zoom-sweep              zoom in and out over the frames instead of following the input\n"
+        "  --screenshot <file>       write the last frame as a binary PPM image\n"
+        "  --raster <W>x<H>          write a nearest-site label map of [-1,1]² instead of opening a window\n"
+        "  --raster-output <file>    label map file, a .ppm gets the site colours, anything else raw uint32 ids\n"
+        "  --order-k <k>             label the raster with the k nearest sites of each pixel, a .ppm shows the\n"
+        "                            order-k regions in the mean colour of their sites, raw files get k ids per pixel\n"
+        "  --kinetic <n>             animate the sites bouncing inside [-1,1]², n random sites unless --sites is given\n"
+        "  --kinetic-speed <s>       largest site speed in units per second for --kinetic\n"
+        "  --sphere <projection>     read the sites as longitude,latitude degrees and draw their spherical cells,\n"
+        "                            equirectangular or orthographic\n"
+        "  --sphere-center <lon,lat> point of the globe facing the orthographic view\n"
+        "  --sphere-sites <n>        random sites on the sphere when no --sites are given\n"
+        "  --periodic                wrap the sites around the edges of [-1,1]², the cells tile it like a torus\n"
+        "  --metric <name>           euclidean (default), manhattan, chebyshev or anisotropic distance to the sites\n"
+        "  --metric-weights <wx,wy>  axis weights of the anisotropic metric, sqrt(wx dx² + wy dy²)\n"
+        "  --interpolate <W>x<H>     write natural neighbour interpolated site values (the CSV column after the colour)\n"
+        "  --interpolate-output <f>  value grid file, a .pgm gets a grey ramp, anything else raw float32 samples\n"
+        "  --interpolation <method>  sibson (default) or laplace weights\n"
+        "  --verify                  compare the cells of every strategy with a brute force nearest-site oracle\n"
+        "  --verify-sites <n>        sites per generated case, the line based strategies get slow quickly\n"
+        "  --verify-size <pixels>    width and height of the compared label maps\n"
+        "  --verify-strategies <a,b> only verify these ExtractTriangles* variants\n"
+        "  --verify-max-error <pct>  most wrong or uncovered pixels before a case fails, in percent\n"
+        "  --verify-max-ms <ms>      fail cases that take longer, 0 for no limit\n"
+        "  --serve <socket>          build diagrams for clients of a Unix domain socket instead of opening a window\n"
+        "  --serve-batch-sites <n>   jobs with fewer sites run one per worker, larger ones use all workers\n"
+        "  --shaders <dir>           read the shaders from a directory instead of the copies built into the binary\n"
+        "  --shader-cache <dir>      where linked shader programs are kept between launches\n"
+        "  --no-shader-cache         compile the shaders on every launch\n",
+        programName
+    );
+}
+
+
+std::optional<Options> ParseOptions(const int argc, char ** argv) {
+    Options options = {};
+
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        const char * value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        const auto requireValue = [&]() {
+            if (value == nullptr) {
+                fprintf(stderr, "%s requires a value\n", argument.c_str());
+                return false;
+            }
+
+            i++;
+            return true;
+        };
+
+        if (argument == "--help" || argument == "-h") {
+            PrintUsage(argv[0]);
+            exit(0);
+        }
+        else if (argument == "--sites") {
+            if (!requireValue()) return std::nullopt;
+            options.sitesFile = value;
+        }
+        else if (argument == "--format") {
+            if (!requireValue()) return std::nullopt;
+
+            if (strcmp(value, "auto") == 0) options.sitesFormat = SiteFileFormat::Auto;
+            else if (strcmp(value, "csv") == 0) options.sitesFormat = SiteFileFormat::Csv;
+            else if (strcmp(value, "f32") == 0) options.sitesFormat = SiteFileFormat::Float32;
+            else {
+                fprintf(stderr, "unknown site file format: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--no-spatial-sort") {
+            options.spatialSort = false;
+        }
+        else if (argument == "--no-normalize") {
+            options.normalizeSites = false;
+        }
+        else if (argument == "--constraints") {
+            if (!requireValue()) return std::nullopt;
+            options.constraintsFile = value;
+        }
+        else if (argument == "--delaunay") {
+            options.delaunay = true;
+        }
+        else if (argument == "--colors") {
+            if (!requireValue()) return std::nullopt;
+
+            if (strcmp(value, "hashed") == 0) options.colors.mode = ColorMode::Hashed;
+            else if (strcmp(value, "palette") == 0) options.colors.mode = ColorMode::Palette;
+            else if (strcmp(value, "graph") == 0) options.colors.mode = ColorMode::GraphColored;
+            else {
+                fprintf(stderr, "unknown color mode: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--seed") {
+            if (!requireValue()) return std::nullopt;
+            options.colors.seed = strtoull(value, nullptr, 0);
+        }
+        else if (argument == "--threads") {
+            if (!requireValue()) return std::nullopt;
+            SetWorkerCount((unsigned)strtoul(value, nullptr, 10));
+        }
+        else if (argument == "--log-level") {
+            if (!requireValue()) return std::nullopt;
+
+            const auto level = ParseLogLevel(value);
+
+            if (!level.has_value()) {
+                fprintf(stderr, "unknown log level: %s\n", value);
+                return std::nullopt;
+            }
+
+            SetLogLevel(level.value());
+        }
+        else if (argument == "--benchmark") {
+            options.benchmark = true;
+        }
+        else if (argument == "--benchmark-sites") {
+            if (!requireValue()) return std::nullopt;
+            options.benchmarkSites = (size_t)strtoull(value, nullptr, 10);
+        }
+        else if (argument == "--trace") {
+            if (!requireValue()) return std::nullopt;
+            options.traceFile = value;
+        }
+        else if (argument == "--triangle-budget") {
+            if (!requireValue()) return std::nullopt;
+            options.triangleBudget = std::max<size_t>((size_t)strtoull(value, nullptr, 10), 1);
+        }
+        else if (argument == "--compact-vertices") {
+            options.compactVertices = true;
+        }
+        else if (argument == "--offscreen") {
+            options.offscreen = true;
+        }
+        else if (argument == "--frames") {
+            if (!requireValue()) return std::nullopt;
+            options.frameLimit = (size_t)strtoull(value, nullptr, 10);
+        }
+        else if (argument == "--zoom-sweep") {
+            options.zoomSweep = true;
+        }
+        else if (argument == "--screenshot") {
+            if (!requireValue()) return std::nullopt;
+            options.screenshotFile = value;
+        }
+        else if (argument == "--raster") {
+            if (!requireValue()) return std::nullopt;
+
+            if (sscanf(value, "%zux%zu", &options.rasterWidth, &options.rasterHeight) != 2 || options.rasterWidth == 0 || options.rasterHeight == 0) {
+                fprintf(stderr, "expected a raster size like 3840x2160: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--raster-output") {
+            if (!requireValue()) return std::nullopt;
+            options.rasterFile = value;
+        }
+        else if (argument == "--order-k") {
+            if (!requireValue()) return std::nullopt;
+            options.orderK = std::max<size_t>((size_t)strtoull(value, nullptr, 10), 1);
+        }
+        else if (argument == "--kinetic") {
+            if (!requireValue()) return std::nullopt;
+            options.kineticSites = std::max<size_t>((size_t)strtoull(value, nullptr, 10), 1);
+        }
+        else if (argument == "--kinetic-speed") {
+            if (!requireValue()) return std::nullopt;
+            options.kineticSpeed = strtod(value, nullptr);
+        }
+        else if (argument == "--sphere") {
+            if (!requireValue()) return std::nullopt;
+
+            if (strcmp(value, "equirectangular") == 0) options.sphere = SphereProjection::Equirectangular;
+            else if (strcmp(value, "orthographic") == 0) options.sphere = SphereProjection::Orthographic;
+            else {
+                fprintf(stderr, "unknown sphere projection: %s\n", value);
+                return std::nullopt;
+            }
+
+            // Degrees are not rescaled into the view
+            options.normalizeSites = false;
+        }
+        else if (argument == "--sphere-center") {
+            if (!requireValue()) return std::nullopt;
+
+            if (sscanf(value, "%lf,%lf", &options.sphereCenterLon, &options.sphereCenterLat) != 2) {
+                fprintf(stderr, "expected a longitude and latitude like 15,50: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--sphere-sites") {
+            if (!requireValue()) return std::nullopt;
+            options.sphereSites = std::max<size_t>((size_t)strtoull(value, nullptr, 10), 4);
+        }
+        else if (argument == "--periodic") {
+            options.periodic = true;
+        }
+        else if (argument == "--metric") {
+            if (!requireValue()) return std::nullopt;
+
+            if (strcmp(value, "euclidean") == 0) options.metric = DistanceMetric::Euclidean;
+            else if (strcmp(value, "manhattan") == 0) options.metric = DistanceMetric::Manhattan;
+            else if (strcmp(value, "chebyshev") == 0) options.metric = DistanceMetric::Chebyshev;
+            else if (strcmp(value, "anisotropic") == 0) options.metric = DistanceMetric::Anisotropic;
+            else {
+                fprintf(stderr, "unknown metric: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--metric-weights") {
+            if (!requireValue()) return std::nullopt;
+
+            if (sscanf(value, "%f,%f", &options.metricWeights.x, &options.metricWeights.y) != 2 || !(options.metricWeights.x > 0.0f) || !(options.metricWeights.y > 0.0f)) {
+                fprintf(stderr, "expected two positive weights like 1,4: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--interpolate") {
+            if (!requireValue()) return std::nullopt;
+
+            if (sscanf(value, "%zux%zu", &options.interpolateWidth, &options.interpolateHeight) != 2 || options.interpolateWidth == 0 || options.interpolateHeight == 0) {
+                fprintf(stderr, "expected a grid size like 1024x1024: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--interpolate-output") {
+            if (!requireValue()) return std::nullopt;
+            options.interpolateFile = value;
+        }
+        else if (argument == "--interpolation") {
+            if (!requireValue()) return std::nullopt;
+
+            if (strcmp(value, "sibson") == 0) options.interpolationMethod = InterpolationMethod::Sibson;
+            else if (strcmp(value, "laplace") == 0) options.interpolationMethod = InterpolationMethod::Laplace;
+            else {
+                fprintf(stderr, "unknown interpolation method: %s\n", value);
+                return std::nullopt;
+            }
+        }
+        else if (argument == "--verify") {
+            options.verify = true;
+        }
+        else if (argument == "--verify-sites") {
+            if (!requireValue()) return std::nullopt;
+            options.verifySites = std::max<size_t>((size_t)strtoull(value, nullptr, 10), 4);
+        }
+        else if (argument == "--verify-size") {
+            if (!requireValue()) return std::nullopt;
+            options.verifySize = std::max<size_t>((size_t)strtoull(value, nullptr, 10), 1);
+        }
+        else if (argument == "--verify-strategies") {
+            if (!requireValue()) return std::nullopt;
+
+            std::string names = value;
+            size_t begin = 0;
+
+            while (begin <= names.size()) {
+                const size_t end = std::min(names.find(',', begin), names.size());
+
+                if (end > begin) options.verifyStrategies.push_back(names.substr(begin, end - begin));
+                begin = end + 1;
+            }
+        }
+        else if (argument == "--verify-max-error") {
+            if (!requireValue()) return std::nullopt;
+            options.verifyMaxError = strtod(value, nullptr);
+        }
+        else if (argument == "--verify-max-ms") {
+            if (!requireValue()) return std::nullopt;
+            options.verifyMaxMs = strtod(value, nullptr);
+        }
+        else if (argument == "--serve") {
+            if (!requireValue()) return std::nullopt;
+            options.serveSocket = value;
+        }
+        else if (argument == "--serve-batch-sites") {
+            if (!requireValue()) return std::nullopt;
+            options.serveBatchSites = (size_t)strtoull(value, nullptr, 10);
+        }
+        else if (argument == "--shaders") {
+            if (!requireValue()) return std::nullopt;
+            options.shaderDirectory = value;
+        }
+        else if (argument == "--shader-cache") {
+            if (!requireValue()) return std::nullopt;
+            options.shaderCacheDirectory = value;
+        }
+        else if (argument == "--no-shader-cache") {
+            options.shaderCacheDirectory = std::nullopt;
+        }
+        else {
+            fprintf(stderr, "unknown option: %s\n", argument.c_str());
+            PrintUsage(argv[0]);
+            return std::nullopt;
+        }
+    }
+
+    return options;
+}
+
+
+struct BenchmarkResult {
+    std::string name;
+    size_t items;
+    size_t bytes;
+    double seconds;
+};
+
+
+// Best of a few runs, the first one usually pays for page faults and cold caches
+template <typename F>
+BenchmarkResult RunBenchmark(const std::string& name, const size_t items, const size_t bytes, const F& body, const int repetitions = 3) {
+    double bestSeconds = std::numeric_limits<double>::max();
+
+    for (int i = 0; i < repetitions; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        bestSeconds = std::min(bestSeconds, GetSecondsSince(start));
+    }
+
+    LOG_INFO("benchmark %s: %.3f ms", name.c_str(), bestSeconds * 1e3);
+
+    return { name, items, bytes, bestSeconds };
+}
+
+
+void PrintBenchmarkResults(const std::vector<BenchmarkResult>& results) {
+    printf("%-40s %12s %10s %12s %12s %10s\n", "benchmark", "items", "MB", "best ms", "M items/s", "MB/s");
+
+    for (const auto& result : results) {
+        printf(
+            "%-40s %12zu %10.1f %12.3f %12.2f %10.1f\n",
+            result.name.c_str(),
+            result.items,
+            result.bytes / 1e6,
+            result.seconds * 1e3,
+            result.items / 1e6 / std::max(result.seconds, 1e-9),
+            result.bytes / 1e6 / std::max(result.seconds, 1e-9)
+        );
+    }
+}
+
+
+std::vector<Point> CreateBenchmarkSites(const size_t count, const uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution dist(-1.0f, 1.0f);
+
+    std::vector<Point> points(count);
+
+    for (auto& point : points) {
+        point.pointData.x = dist(gen);
+        point.pointData.y = dist(gen);
+    }
+
+    return points;
+}
+
+
+void BenchmarkSiteLoading(const Options& options, const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto csvFile = (directory / "voronoiable_benchmark_sites.csv").string();
+    const auto binaryFile = (directory / "voronoiable_benchmark_sites.f32").string();
+
+    {
+        FILE* csv = fopen(csvFile.c_str(), "wb");
+        FILE* binary = fopen(binaryFile.c_str(), "wb");
+
+        if (csv == nullptr || binary == nullptr) {
+            LOG_ERROR("failed to create benchmark inputs in %s", directory.string().c_str());
+            if (csv != nullptr) fclose(csv);
+            if (binary != nullptr) fclose(binary);
+            return;
+        }
+
+        fprintf(csv, "x,y,color\n");
+
+        for (size_t i = 0; i < sites.size(); i++) {
+            fprintf(csv, "%.7f,%.7f,#%06zx\n", sites[i].pointData.x, sites[i].pointData.y, (i * 2654435761u) & 0xFFFFFF);
+            fwrite(&sites[i].pointData, sizeof(float), 2, binary);
+        }
+
+        fclose(csv);
+        fclose(binary);
+    }
+
+    std::vector<std::pair<std::string, std::string>> inputs = {
+        { "site loading csv", csvFile },
+        { "site loading f32", binaryFile },
+    };
+
+    if (options.sitesFile.has_value()) {
+        inputs.push_back({ "site loading " + options.sitesFile.value(), options.sitesFile.value() });
+    }
+
+    for (const auto& [name, fileName] : inputs) {
+        const auto format = fileName == options.sitesFile ? options.sitesFormat : SiteFileFormat::Auto;
+        std::vector<Point> loaded = {};
+        SiteLoadStats stats = {};
+
+        results.push_back(RunBenchmark(name, 0, 0, [&]() {
+            loaded.clear();
+            stats = LoadSites(fileName.c_str(), format, options.normalizeSites, loaded).value_or(SiteLoadStats{});
+        }));
+
+        results.back().items = stats.sites;
+        results.back().bytes = stats.bytes;
+    }
+
+    std::filesystem::remove(csvFile);
+    std::filesystem::remove(binaryFile);
+}
+
+
+void BenchmarkSiteColors(const Options& options, const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    std::vector<Point> colored = sites;
+
+    results.push_back(RunBenchmark("site colours hashed", sites.size(), 0, [&]() {
+        for (auto& point : colored) point.color.r = missingColorComponent;
+        FillMissingSiteColors(colored, { options.colors.seed, ColorMode::Hashed });
+    }));
+
+    const auto triangulation = CreateTriangulation(sites, {});
+    SiteAdjacency adjacency = {};
+
+    results.push_back(RunBenchmark("delaunay adjacency", sites.size(), 0, [&]() {
+        adjacency = BuildTriangulationAdjacency(triangulation, sites.size());
+    }));
+
+    results.push_back(RunBenchmark("site colours graph", sites.size(), 0, [&]() {
+        ApplyGraphColoring(colored, adjacency, options.colors);
+    }));
+}
+
+
+void BenchmarkTriangulation(const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    results.push_back(RunBenchmark("delaunay cells", sites.size(), 0, [&]() {
+        ExtractTriangles5(sites);
+    }));
+
+    // A floor plan: outer wall, a grid of interior walls with door gaps and a pillar
+    std::vector<ConstraintPolyline> constraints = {
+        { { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f } }, true, ConstraintKind::Boundary },
+        { { { -0.05f, -0.05f }, { 0.05f, -0.05f }, { 0.05f, 0.05f }, { -0.05f, 0.05f } }, true, ConstraintKind::Boundary }
+    };
+
+    for (int i = -3; i <= 3; i++) {
+        const GLfloat wall = i * 0.25f + 0.01f;
+
+        constraints.push_back({ { { -0.95f, wall }, { 0.9f, wall } }, false, ConstraintKind::Segment });
+        constraints.push_back({ { { wall, -0.9f }, { wall, 0.95f } }, false, ConstraintKind::Segment });
+    }
+
+    results.push_back(RunBenchmark("constrained delaunay cells", sites.size(), 0, [&]() {
+        ExtractConstrainedTriangles(sites, constraints);
+    }));
+}
 
-        const auto center23 = GetCenterOfLine(triangle.pd2, triangle.pd3);
-        output.push_back({triangle.pd2, center23, center});
-        output.push_back({center23, triangle.pd3, center});
 
-        const auto center31 = GetCenterOfLine(triangle.pd3, triangle.pd1);
-        output.push_back({triangle.pd3, center31, center});
-        output.push_back({center31, triangle.pd1, center});
+// The benchmark sites are in random order, the sorted copy shows what the pre-pass buys later stages
+void BenchmarkSpatialSort(const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    results.push_back(RunBenchmark("hilbert order", sites.size(), sites.size() * sizeof(PointData), [&]() {
+        CreateHilbertOrder(sites);
+    }));
+
+    results.push_back(RunBenchmark("brio order", sites.size(), sites.size() * sizeof(PointData), [&]() {
+        CreateBrioOrder(sites);
+    }));
+
+    std::vector<Point> sorted = {};
+
+    results.push_back(RunBenchmark("spatial sort", sites.size(), sites.size() * sizeof(Point) * 2, [&]() {
+        sorted = sites;
+        SortSitesSpatially(sorted);
+    }));
+
+    results.push_back(RunBenchmark("delaunay cells sorted sites", sorted.size(), 0, [&]() {
+        ExtractTriangles5(sorted);
+    }));
+
+    results.push_back(RunBenchmark("site grid sorted sites", sorted.size(), 0, [&]() {
+        BuildSiteGrid(sorted);
+    }));
+}
+
+
+void BenchmarkRenderMesh(const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    const auto triangles = ExtractTriangles5(sites);
+    RenderMesh mesh = {};
+
+    results.push_back(RunBenchmark("render mesh", triangles.size(), 0, [&]() {
+        mesh = BuildRenderMesh(triangles);
+    }, 1));
+
+    const size_t vertexCount = mesh.vertices.size();
+
+    results.push_back(RunBenchmark("compact render mesh", vertexCount, vertexCount * (sizeof(Point) + sizeof(CompactPoint)), [&]() {
+        CompactRenderMesh(mesh);
+    }, 1));
+}
+
+
+void BenchmarkRasterization(const Options& options, const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    SiteGrid grid = {};
+
+    results.push_back(RunBenchmark("site grid", sites.size(), 0, [&]() {
+        grid = BuildSiteGrid(sites);
+    }));
+
+    const size_t width = options.rasterWidth != 0 ? options.rasterWidth : 3840;
+    const size_t height = options.rasterHeight != 0 ? options.rasterHeight : 2160;
+
+    results.push_back(RunBenchmark("label map " + std::to_string(width) + "x" + std::to_string(height), width * height, width * height * sizeof(uint32_t), [&]() {
+        RasterizeNearestSites(sites, grid, width, height, { -1.0f, -1.0f, 1.0f, 1.0f });
+    }));
+}
+
+
+// Label maps and cells under every metric, the non-Euclidean kernels should match the Euclidean one
+void BenchmarkMetrics(const Options& options, const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    const SiteGrid grid = BuildSiteGrid(sites);
+    const size_t width = options.rasterWidth != 0 ? options.rasterWidth : 3840;
+    const size_t height = options.rasterHeight != 0 ? options.rasterHeight : 2160;
+    const PointData weights = { 1.0f, 4.0f };
+
+    const std::pair<const char *, DistanceMetric> metrics[] = {
+        { "euclidean", DistanceMetric::Euclidean },
+        { "manhattan", DistanceMetric::Manhattan },
+        { "chebyshev", DistanceMetric::Chebyshev },
+        { "anisotropic", DistanceMetric::Anisotropic }
+    };
+
+    for (const auto& [name, metric] : metrics) {
+        results.push_back(RunBenchmark(std::string(name) + " label map", width * height, width * height * sizeof(uint32_t), [&]() {
+            WithDistanceMetric(metric, weights, [&](const auto& policy) {
+                return RasterizeNearestSites(sites, grid, width, height, { -1.0f, -1.0f, 1.0f, 1.0f }, policy);
+            });
+        }));
+
+        results.push_back(RunBenchmark(std::string(name) + " cells", sites.size(), 0, [&]() {
+            ExtractMetricTriangles(sites, metric, weights);
+        }, 1));
     }
+}
 
-    return output;
+
+void BenchmarkNearestSites(const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    const SiteGrid grid = BuildSiteGrid(sites);
+    const auto queryPoints = CreateBenchmarkSites(1 << 20, 4321);
+
+    std::vector<PointData> queries(queryPoints.size());
+
+    for (size_t i = 0; i < queries.size(); i++) {
+        queries[i] = queryPoints[i].pointData;
+    }
+
+    for (const size_t k : { 1, 4, 16 }) {
+        results.push_back(RunBenchmark(std::to_string(k) + " nearest sites queries", queries.size(), queries.size() * k * sizeof(uint32_t), [&]() {
+            QueryNearestSites(grid, queries, k);
+        }));
+    }
+
+    results.push_back(RunBenchmark("order-4 regions 1920x1080", 1920 * 1080, 1920 * 1080 * 4 * sizeof(uint32_t), [&]() {
+        RasterizeOrderKRegions(grid, 1920, 1080, { -1.0f, -1.0f, 1.0f, 1.0f }, 4);
+    }));
 }
 
 
-void ProcessInput(GLFWwindow* window)
-{
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+void BenchmarkInterpolation(const Options& options, const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    std::vector<GLfloat> values(sites.size());
+
+    for (size_t i = 0; i < sites.size(); i++) {
+        values[i] = std::sin(sites[i].pointData.x * 3.0f) * std::cos(sites[i].pointData.y * 2.0f);
+    }
+
+    NaturalNeighbourInterpolator interpolator = {};
+
+    results.push_back(RunBenchmark("interpolator", sites.size(), 0, [&]() {
+        interpolator = CreateNaturalNeighbourInterpolator(sites, values);
+    }, 1));
+
+    const size_t width = options.interpolateWidth != 0 ? options.interpolateWidth : 1024;
+    const size_t height = options.interpolateHeight != 0 ? options.interpolateHeight : 1024;
+    const std::string size = std::to_string(width) + "x" + std::to_string(height);
+
+    results.push_back(RunBenchmark("sibson grid " + size, width * height, width * height * sizeof(GLfloat), [&]() {
+        InterpolateGrid(interpolator, width, height, { -1.0f, -1.0f, 1.0f, 1.0f }, InterpolationMethod::Sibson);
+    }));
+
+    results.push_back(RunBenchmark("laplace grid " + size, width * height, width * height * sizeof(GLfloat), [&]() {
+        InterpolateGrid(interpolator, width, height, { -1.0f, -1.0f, 1.0f, 1.0f }, InterpolationMethod::Laplace);
+    }));
 }
 
 
-Color CreateRandomColor() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
+void BenchmarkSphere(const Options& options, std::vector<BenchmarkResult>& results) {
+    const auto sites = CreateSphereSites(options.benchmarkSites, 1234);
+    SphericalDiagram diagram = {};
 
-    std::uniform_real_distribution dist(0.0f, 1.0f);
+    results.push_back(RunBenchmark("spherical diagram", sites.size(), 0, [&]() {
+        diagram = CreateSphericalDiagram(sites);
+    }, 1));
 
-    return {
-        dist(gen),
-        dist(gen),
-        dist(gen)
+    results.push_back(RunBenchmark("equirectangular projection", sites.size(), 0, [&]() {
+        ProjectSphericalDiagram(diagram, sites, CreateSphereView(SphereProjection::Equirectangular, 0.0, 0.0));
+    }, 1));
+}
+
+
+void BenchmarkPeriodic(const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    results.push_back(RunBenchmark("periodic diagram", sites.size(), 0, [&]() {
+        ExtractPeriodicTriangles(sites);
+    }, 1));
+
+    results.push_back(RunBenchmark("periodic raster 1024x1024", 1024 * 1024, 1024 * 1024 * sizeof(uint32_t), [&]() {
+        RasterizePeriodicSites(sites, 1024, 1024);
+    }));
+}
+
+
+// Hundreds of independent requests as a service sees them, mostly small with a few large ones among
+// them. The sequential run builds them one after another with ParallelFor inside each build.
+void BenchmarkDiagramJobs(const Options& options, std::vector<BenchmarkResult>& results) {
+    std::vector<std::vector<Point>> jobSites = {};
+    size_t totalSites = 0;
+
+    for (uint32_t i = 0; i < 400; i++) {
+        jobSites.push_back(CreateBenchmarkSites(i % 25 == 0 ? 32768 : 1000, 1234 + i));
+        FillMissingSiteColors(jobSites.back(), options.colors);
+        totalSites += jobSites.back().size();
+    }
+
+    results.push_back(RunBenchmark("diagram jobs sequential", totalSites, 0, [&]() {
+        for (const auto& sites : jobSites) {
+            ExtractTriangles5(sites);
+        }
+    }));
+
+    DiagramBuilder builder = {};
+    StartDiagramBuilder(builder, GetWorkerCount(), options.serveBatchSites);
+
+    results.push_back(RunBenchmark("diagram jobs pooled", totalSites, 0, [&]() {
+        std::vector<DiagramJobHandle> handles = {};
+
+        for (size_t i = 0; i < jobSites.size(); i++) {
+            DiagramJobRequest request = {};
+            request.sites = jobSites[i];
+            request.priority = jobSites[i].size() < options.serveBatchSites ? 1 : 0;
+            handles.push_back(SubmitDiagramJob(builder, std::move(request)));
+        }
+
+        double longestWait = 0.0;
+
+        for (auto& handle : handles) {
+            longestWait = std::max(longestWait, handle.result.get().waitSeconds);
+        }
+
+        LOG_INFO("longest wait of %zu pooled jobs: %.1f ms", handles.size(), longestWait * 1e3);
+    }));
+
+    StopDiagramBuilder(builder);
+}
+
+
+void BenchmarkKinetic(const Options& options, const std::vector<Point>& sites, std::vector<BenchmarkResult>& results) {
+    const auto velocities = CreateSiteVelocities(sites.size(), options.kineticSpeed, 1234);
+    KineticDiagram diagram = {};
+
+    results.push_back(RunBenchmark("kinetic diagram", sites.size(), 0, [&]() {
+        diagram = CreateKineticDiagram(sites, velocities);
+    }, 1));
+
+    // One simulated second at 60 frames per second, the repair alone and then with the vertex upload
+    // data. The repair switches to rebuilds by itself when the events get too many, the same second
+    // rebuilt on every frame is the baseline it has to beat.
+    const size_t frames = 60;
+    size_t events = 0;
+    KineticDiagram rebuilt = diagram;
+    rebuilt.rebuilding = true;
+
+    results.push_back(RunBenchmark("kinetic repair " + std::to_string(frames) + " frames", frames, 0, [&]() {
+        for (size_t frame = 1; frame <= frames; frame++) {
+            events += AdvanceKineticDiagram(diagram, diagram.time + 1.0 / frames);
+        }
+    }, 1));
+
+    results.push_back(RunBenchmark("kinetic rebuild " + std::to_string(frames) + " frames", frames, 0, [&]() {
+        for (size_t frame = 1; frame <= frames; frame++) {
+            AdvanceKineticDiagram(rebuilt, rebuilt.time + 1.0 / frames);
+        }
+    }, 1));
+
+    std::vector<Point> vertices = {};
+
+    results.push_back(RunBenchmark("kinetic vertices", diagram.triangulation.triangles.size(), diagram.triangulation.triangles.size() * 9 * sizeof(Point), [&]() {
+        WriteKineticVertices(diagram, sites, vertices);
+    }));
+
+    LOG_INFO("kinetic: %.1f events per frame, %zu flips, %zu bounces, %zu rebuilds", (double)events / frames, diagram.flips, diagram.bounces, diagram.rebuilds);
+}
+
+
+int RunBenchmarks(const Options& options) {
+    LOG_INFO("running benchmarks with %zu sites on %u threads", options.benchmarkSites, GetWorkerCount());
+
+    const auto sites = CreateBenchmarkSites(options.benchmarkSites, 1234);
+
+    std::vector<BenchmarkResult> results = {};
+
+    BenchmarkSiteLoading(options, sites, results);
+    BenchmarkSiteColors(options, sites, results);
+    BenchmarkTriangulation(sites, results);
+    BenchmarkSpatialSort(sites, results);
+    BenchmarkRenderMesh(sites, results);
+    BenchmarkRasterization(options, sites, results);
+    BenchmarkMetrics(options, sites, results);
+    BenchmarkNearestSites(sites, results);
+    BenchmarkInterpolation(options, sites, results);
+    BenchmarkSphere(options, results);
+    BenchmarkPeriodic(sites, results);
+    BenchmarkDiagramJobs(options, results);
+    BenchmarkKinetic(options, sites, results);
+
+    PrintBenchmarkResults(results);
+
+    return 0;
+}
+
+
+// Differential verification: every strategy's cells are rasterized on the CPU and each pixel label is
+// checked against a brute force nearest-site search, so a faster builder can be gated on being right.
+struct VerifyCase {
+    std::string name;
+    std::vector<Point> sites;
+    std::vector<ConstraintPolyline> constraints;
+};
+
+
+// Cases with constraints only run the strategies that take them
+struct VerifyStrategy {
+    const char * name;
+    std::vector<Triangle> (*build)(const std::vector<Point>&);
+    std::vector<Triangle> (*buildConstrained)(const std::vector<Point>&, const std::vector<ConstraintPolyline>&);
+};
+
+
+const VerifyStrategy verifyStrategies[] = {
+    { "ExtractTriangles1", ExtractTriangles1, nullptr },
+    { "ExtractTriangles2", ExtractTriangles2, nullptr },
+    { "ExtractTriangles3", ExtractTriangles3, nullptr },
+    { "ExtractTriangles4", ExtractTriangles4, nullptr },
+    { "ExtractTriangles4_5", ExtractTriangles4_5, nullptr },
+    { "ExtractTriangles5", ExtractTriangles5, ExtractConstrainedTriangles }
+};
+
+
+// Even-odd rule over the polygon and hole outlines, the domain of ClassifyDomain
+bool IsInsideBoundaries(const std::vector<ConstraintPolyline>& constraints, const double x, const double y) {
+    bool inside = false;
+
+    for (const auto& polyline : constraints) {
+        if (polyline.kind != ConstraintKind::Boundary) continue;
+
+        for (size_t i = 0; i < polyline.points.size(); i++) {
+            const PointData& a = polyline.points[i];
+            const PointData& b = polyline.points[(i + 1) % polyline.points.size()];
+
+            if ((a.y > y) != (b.y > y) && x < a.x + (y - a.y) * ((double)b.x - a.x) / ((double)b.y - a.y)) inside = !inside;
+        }
+    }
+
+    return inside;
+}
+
+
+// Whether a wall or outline properly crosses the segment, touching an endpoint does not block
+bool IsSightBlocked(const std::vector<ConstraintPolyline>& constraints, const DelaunayVertex& from, const DelaunayVertex& to) {
+    for (const auto& polyline : constraints) {
+        const size_t segmentCount = polyline.closed ? polyline.points.size() : polyline.points.size() - 1;
+
+        for (size_t i = 0; i < segmentCount; i++) {
+            const PointData& a = polyline.points[i];
+            const PointData& b = polyline.points[(i + 1) % polyline.points.size()];
+
+            if (DoSegmentsCross(from, to, { a.x, a.y, -1 }, { b.x, b.y, -1 })) return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Random sets next to the inputs the line based builders struggle with: parallel and vertical
+// bisectors, cocircular quads, points on top of each other and clusters at float resolution
+std::vector<VerifyCase> CreateVerifyCases(const size_t count, const uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution dist(-0.95f, 0.95f);
+
+    std::vector<VerifyCase> cases = {};
+
+    cases.push_back({ "uniform", {} });
+    for (size_t i = 0; i < count; i++) AddPoint(cases.back().sites, dist(gen), dist(gen));
+
+    cases.push_back({ "grid", {} });
+    const size_t side = std::max<size_t>(2, (size_t)std::sqrt((double)count));
+    for (size_t i = 0; i < side * side; i++) {
+        AddPoint(cases.back().sites, -0.9f + 1.8f * (i % side) / (side - 1), -0.9f + 1.8f * (i / side) / (side - 1));
+    }
+
+    cases.push_back({ "cocircular", {} });
+    AddPoint(cases.back().sites, 0.0f, 0.0f);
+    for (size_t i = 1; i < count; i++) {
+        const double angle = 2.0 * 3.14159265358979323846 * i / (count - 1);
+        AddPoint(cases.back().sites, (GLfloat)(0.8 * std::cos(angle)), (GLfloat)(0.8 * std::sin(angle)));
+    }
+
+    cases.push_back({ "collinear", {} });
+    for (size_t i = 0; i < count; i++) {
+        const GLfloat t = dist(gen);
+        AddPoint(cases.back().sites, t, 0.5f * t + 0.1f);
+    }
+
+    cases.push_back({ "duplicates", {} });
+    for (size_t i = 0; i < count; i++) {
+        auto& sites = cases.back().sites;
+
+        if (i % 4 == 3) sites.push_back(sites[gen() % sites.size()]);
+        else AddPoint(sites, dist(gen), dist(gen));
+    }
+
+    cases.push_back({ "near-vertical", {} });
+    for (size_t i = 0; i + 1 < count; i += 2) {
+        const GLfloat x = dist(gen);
+        const GLfloat y = dist(gen);
+
+        AddPoint(cases.back().sites, x, y);
+        AddPoint(cases.back().sites, std::nextafter(x, 1.0f), y + 0.01f + 0.04f * std::fabs(dist(gen)));
+    }
+
+    cases.push_back({ "clustered", {} });
+    std::normal_distribution<float> spread(0.0f, 1e-4f);
+    for (size_t i = 0; i < count; i++) {
+        const size_t cluster = i % 5;
+        AddPoint(cases.back().sites, -0.6f + 0.3f * cluster + spread(gen), 0.2f * (cluster % 2) + spread(gen));
+    }
+
+    // One bent wall, its corners are vertices without a site
+    cases.push_back({ "wall", {}, { { { { -0.8f, -0.1f }, { -0.2f, 0.05f }, { 0.3f, -0.05f }, { 0.75f, 0.2f } }, false, ConstraintKind::Segment } } });
+    for (size_t i = 0; i < count; i++) AddPoint(cases.back().sites, dist(gen), dist(gen));
+
+    // Short walls at random, some of them crossing each other
+    cases.push_back({ "walls", {} });
+    for (size_t i = 0; i < std::max<size_t>(2, count / 10); i++) {
+        const GLfloat x = dist(gen);
+        const GLfloat y = dist(gen);
+        const double angle = 3.14159265358979323846 * std::fabs(dist(gen));
+
+        cases.back().constraints.push_back({
+            { { x, y }, { x + 0.3f * (GLfloat)std::cos(angle), y + 0.3f * (GLfloat)std::sin(angle) } },
+            false,
+            ConstraintKind::Segment
+        });
+    }
+    for (size_t i = 0; i < count; i++) AddPoint(cases.back().sites, dist(gen), dist(gen));
+
+    // A U shaped floor with a hole in its bottom, sites only inside
+    cases.push_back({ "polygon", {}, {
+        { { { -0.9f, -0.9f }, { 0.9f, -0.9f }, { 0.9f, 0.9f }, { 0.3f, 0.9f }, { 0.3f, -0.3f }, { -0.3f, -0.3f }, { -0.3f, 0.9f }, { -0.9f, 0.9f } }, true, ConstraintKind::Boundary },
+        { { { -0.1f, -0.75f }, { -0.1f, -0.5f }, { 0.15f, -0.5f }, { 0.15f, -0.75f } }, true, ConstraintKind::Boundary }
+    } });
+    while (cases.back().sites.size() < count) {
+        const GLfloat x = dist(gen);
+        const GLfloat y = dist(gen);
+
+        if (IsInsideBoundaries(cases.back().constraints, x, y)) AddPoint(cases.back().sites, x, y);
+    }
+
+    return cases;
+}
+
+
+// Site indices survive the builders as colours, eight bits per channel round-trip exactly
+Color EncodeSiteIndex(const size_t index) {
+    return { (index & 0xff) / 255.0f, ((index >> 8) & 0xff) / 255.0f, ((index >> 16) & 0xff) / 255.0f };
+}
+
+
+uint32_t DecodeSiteIndex(const Color& color) {
+    const auto channel = [](const GLfloat value) {
+        return (uint32_t)std::lround(std::clamp(value, 0.0f, 1.0f) * 255.0f);
     };
+
+    return channel(color.r) | (channel(color.g) << 8) | (channel(color.b) << 16);
 }
 
 
-GLuint CompileShader(const char * fileName, GLenum shaderType) {
-    std::ifstream ifs;
-    ifs.open(fileName, std::ifstream::in);
-    std::string content = "";
+// Pixel centres inside a triangle (either winding) get its label, later triangles win overlaps
+LabelMap RasterizeTriangleLabels(const std::vector<Triangle>& triangles, const size_t width, const size_t height, const ViewRect& view) {
+    LabelMap map = { width, height, std::vector<uint32_t>(width * height, noSite) };
 
-    if(!ifs.is_open()) {
-        printf("failed to open shader file :( path: %s\n", fileName);
-        exit(1);
+    const double pixelWidth = (view.maxX - view.minX) / (double)width;
+    const double pixelHeight = (view.maxY - view.minY) / (double)height;
+
+    ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+        for (const Triangle& triangle : triangles) {
+            const PointData corners[3] = { triangle.triangleData.pd1, triangle.triangleData.pd2, triangle.triangleData.pd3 };
+
+            double minX = corners[0].x, maxX = corners[0].x, minY = corners[0].y, maxY = corners[0].y;
+
+            for (const PointData& corner : corners) {
+                minX = std::min(minX, (double)corner.x);
+                maxX = std::max(maxX, (double)corner.x);
+                minY = std::min(minY, (double)corner.y);
+                maxY = std::max(maxY, (double)corner.y);
+            }
+
+            if (!(minX <= maxX && minY <= maxY)) continue;
+
+            const double firstColumn = std::max(0.0, std::ceil((minX - view.minX) / pixelWidth - 0.5));
+            const double lastColumn = std::min((double)width - 1.0, std::floor((maxX - view.minX) / pixelWidth - 0.5));
+            const double firstRow = std::max((double)begin, std::ceil((view.maxY - maxY) / pixelHeight - 0.5));
+            const double lastRow = std::min((double)end - 1.0, std::floor((view.maxY - minY) / pixelHeight - 0.5));
+
+            if (firstColumn > lastColumn || firstRow > lastRow) continue;
+
+            const double area = ((double)corners[1].x - corners[0].x) * ((double)corners[2].y - corners[0].y)
+                - ((double)corners[1].y - corners[0].y) * ((double)corners[2].x - corners[0].x);
+
+            if (area == 0.0) continue;
+
+            const uint32_t label = DecodeSiteIndex(triangle.color);
+
+            for (size_t row = (size_t)firstRow; row <= (size_t)lastRow; row++) {
+                const double y = view.maxY - (row + 0.5) * pixelHeight;
+
+                for (size_t column = (size_t)firstColumn; column <= (size_t)lastColumn; column++) {
+                    const double x = view.minX + (column + 0.5) * pixelWidth;
+                    bool inside = true;
+
+                    for (int k = 0; k < 3 && inside; k++) {
+                        const PointData& a = corners[k];
+                        const PointData& b = corners[(k + 1) % 3];
+                        const double edge = ((double)b.x - a.x) * (y - a.y) - ((double)b.y - a.y) * (x - a.x);
+
+                        inside = area > 0.0 ? edge >= 0.0 : edge <= 0.0;
+                    }
+
+                    if (inside) map.labels[row * width + column] = label;
+                }
+            }
+        }
+    }, 1);
+
+    return map;
+}
+
+
+// Brute force over all sites in doubles, the nearest distance of every pixel centre. Walls and
+// outlines hide the sites behind them, pixels that see no site at all get infinity.
+std::vector<double> ComputeOracleDistances(
+    const std::vector<Point>& sites,
+    const std::vector<ConstraintPolyline>& constraints,
+    const size_t width,
+    const size_t height,
+    const ViewRect& view
+) {
+    std::vector<double> distances(width * height);
+
+    const double pixelWidth = (view.maxX - view.minX) / (double)width;
+    const double pixelHeight = (view.maxY - view.minY) / (double)height;
+
+    ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+        for (size_t row = begin; row < end; row++) {
+            const double y = view.maxY - (row + 0.5) * pixelHeight;
+
+            for (size_t column = 0; column < width; column++) {
+                const double x = view.minX + (column + 0.5) * pixelWidth;
+                double best = std::numeric_limits<double>::max();
+
+                for (const Point& site : sites) {
+                    const double dx = x - site.pointData.x;
+                    const double dy = y - site.pointData.y;
+
+                    if (dx * dx + dy * dy >= best) continue;
+                    if (IsSightBlocked(constraints, { x, y, -1 }, { site.pointData.x, site.pointData.y, -1 })) continue;
+
+                    best = dx * dx + dy * dy;
+                }
+
+                distances[row * width + column] = best == std::numeric_limits<double>::max() ? best : std::sqrt(best);
+            }
+        }
+    }, 1);
+
+    return distances;
+}
+
+
+// Counterclockwise hull by the monotone chain, collinear sites leave fewer than three corners
+std::vector<DelaunayVertex> GetConvexHull(const std::vector<Point>& sites) {
+    std::vector<DelaunayVertex> sorted(sites.size());
+
+    for (size_t i = 0; i < sites.size(); i++) {
+        sorted[i] = { sites[i].pointData.x, sites[i].pointData.y, (int32_t)i };
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const DelaunayVertex& a, const DelaunayVertex& b) {
+        return a.x < b.x || (a.x == b.x && a.y < b.y);
+    });
+
+    std::vector<DelaunayVertex> hull(sorted.size() * 2);
+    size_t count = 0;
+
+    for (size_t i = 0; i < sorted.size(); i++) {
+        while (count >= 2 && Orient2d(hull[count - 2], hull[count - 1], sorted[i]) <= 0.0) count--;
+        hull[count++] = sorted[i];
+    }
+
+    for (size_t i = sorted.size() - 1, lower = count + 1; i-- > 0;) {
+        while (count >= lower && Orient2d(hull[count - 2], hull[count - 1], sorted[i]) <= 0.0) count--;
+        hull[count++] = sorted[i];
+    }
+
+    hull.resize(count > 1 ? count - 1 : count);
+
+    return hull;
+}
+
+
+// Pixels the strategies have to cover, cells without boundaries end at the convex hull
+std::vector<uint8_t> GetPixelsInsideHull(const std::vector<Point>& sites, const size_t width, const size_t height, const ViewRect& view) {
+    const auto hull = GetConvexHull(sites);
+    std::vector<uint8_t> inside(width * height, 0);
+
+    if (hull.size() < 3) return inside;
+
+    const double pixelWidth = (view.maxX - view.minX) / (double)width;
+    const double pixelHeight = (view.maxY - view.minY) / (double)height;
+
+    ParallelFor(height, [&](size_t begin, size_t end, size_t) {
+        for (size_t row = begin; row < end; row++) {
+            for (size_t column = 0; column < width; column++) {
+                const DelaunayVertex pixel = { view.minX + (column + 0.5) * pixelWidth, view.maxY - (row + 0.5) * pixelHeight, -1 };
+                bool isInside = true;
+
+                for (size_t i = 0; i < hull.size() && isInside; i++) {
+                    isInside = Orient2d(hull[i], hull[(i + 1) % hull.size()], pixel) >= 0.0;
+                }
+
+                inside[row * width + column] = isInside;
+            }
+        }
+    }, 1);
+
+    return inside;
+}
+
+
+// Pixels the strategies have to cover: the hull, or the polygon domain when there is one, minus
+// the pixels no site can see
+std::vector<uint8_t> GetPixelsToCover(
+    const std::vector<Point>& sites,
+    const std::vector<ConstraintPolyline>& constraints,
+    const std::vector<double>& oracle,
+    const size_t width,
+    const size_t height,
+    const ViewRect& view
+) {
+    std::vector<uint8_t> inside = {};
+
+    if (HasBoundaryConstraints(constraints)) {
+        inside.assign(width * height, 0);
+
+        const double pixelWidth = (view.maxX - view.minX) / (double)width;
+        const double pixelHeight = (view.maxY - view.minY) / (double)height;
+
+        for (size_t i = 0; i < inside.size(); i++) {
+            inside[i] = IsInsideBoundaries(constraints, view.minX + (i % width + 0.5) * pixelWidth, view.maxY - (i / width + 0.5) * pixelHeight);
+        }
+    }
+    else {
+        inside = GetPixelsInsideHull(sites, width, height, view);
+    }
+
+    for (size_t i = 0; i < inside.size(); i++) {
+        if (oracle[i] == std::numeric_limits<double>::max()) inside[i] = 0;
+    }
+
+    return inside;
+}
+
+
+struct VerifyResult {
+    std::string caseName;
+    std::string strategy;
+    size_t sites = 0;
+    size_t triangles = 0;
+    double seconds = 0.0;
+    double wrongFraction = 0.0;     // labelled with a site that is not among the nearest
+    double uncoveredFraction = 0.0; // inside the hull or domain but no cell drawn
+    bool passed = false;
+};
+
+
+// Ties within a small fraction of a pixel count for every tied site: duplicates, cocircular
+// points and the float rounding of cell corners all land exactly on shared borders
+void CompareWithOracle(
+    const std::vector<Point>& sites,
+    const LabelMap& map,
+    const std::vector<double>& oracle,
+    const std::vector<uint8_t>& toCover,
+    const ViewRect& view,
+    VerifyResult& result
+) {
+    const double pixelWidth = (view.maxX - view.minX) / (double)map.width;
+    const double pixelHeight = (view.maxY - view.minY) / (double)map.height;
+    const double tolerance = 1e-3 * std::min(pixelWidth, pixelHeight);
+
+    size_t wrong = 0;
+    size_t uncovered = 0;
+
+    for (size_t row = 0; row < map.height; row++) {
+        const double y = view.maxY - (row + 0.5) * pixelHeight;
+
+        for (size_t column = 0; column < map.width; column++) {
+            const size_t i = row * map.width + column;
+            const uint32_t label = map.labels[i];
+
+            if (label == noSite) {
+                if (toCover[i]) uncovered++;
+                continue;
+            }
+
+            if (label >= sites.size()) {
+                wrong++;
+                continue;
+            }
+
+            const double x = view.minX + (column + 0.5) * pixelWidth;
+            const double distance = std::hypot(x - sites[label].pointData.x, y - sites[label].pointData.y);
+
+            // Pixels that see no site must not get a cell either
+            if (distance > oracle[i] + tolerance || oracle[i] == std::numeric_limits<double>::max()) wrong++;
+        }
     }
 
-    for(std::string line; std::getline(ifs, line);) {
-        content += line;
-        content.push_back('\n');
+    result.wrongFraction = (double)wrong / map.labels.size();
+    result.uncoveredFraction = (double)uncovered / map.labels.size();
+}
+
+
+int RunVerification(const Options& options) {
+    const ViewRect view = { -1.0f, -1.0f, 1.0f, 1.0f };
+    const size_t size = options.verifySize;
+
+    for (const auto& name : options.verifyStrategies) {
+        const bool known = std::any_of(std::begin(verifyStrategies), std::end(verifyStrategies), [&](const VerifyStrategy& strategy) {
+            return name == strategy.name;
+        });
+
+        if (!known) {
+            LOG_ERROR("unknown strategy to verify: %s", name.c_str());
+            return 1;
+        }
     }
 
-    ifs.close();
+    LOG_INFO("verifying with %zu sites per case at %zux%zu pixels", options.verifySites, size, size);
+
+    std::vector<VerifyResult> results = {};
+
+    for (auto& verifyCase : CreateVerifyCases(options.verifySites, (uint32_t)options.colors.seed)) {
+        for (size_t i = 0; i < verifyCase.sites.size(); i++) {
+            verifyCase.sites[i].color = EncodeSiteIndex(i);
+        }
 
-    const char * contentRaw = content.c_str();
+        const auto oracle = ComputeOracleDistances(verifyCase.sites, verifyCase.constraints, size, size, view);
+        const auto toCover = GetPixelsToCover(verifyCase.sites, verifyCase.constraints, oracle, size, size, view);
 
-    GLuint shader = glCreateShader(shaderType);
-    glShaderSource(shader, 1, &contentRaw, NULL);
-    glCompileShader(shader);
+        for (const VerifyStrategy& strategy : verifyStrategies) {
+            const auto& selected = options.verifyStrategies;
+            const bool constrained = !verifyCase.constraints.empty();
 
-    GLint compiledSuccessfully;
-    char infoLog[512];
+            if (!selected.empty() && std::find(selected.begin(), selected.end(), strategy.name) == selected.end()) continue;
+            if (constrained && strategy.buildConstrained == nullptr) continue;
 
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiledSuccessfully);
+            VerifyResult result = {};
+            result.caseName = verifyCase.name;
+            result.strategy = strategy.name;
+            result.sites = verifyCase.sites.size();
 
-    if (compiledSuccessfully != GL_TRUE) {
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        fprintf(stderr, "Shader: %s compilation failed, details: %s\n", fileName, infoLog);
-        exit(1);
-    }
+            const auto start = std::chrono::steady_clock::now();
+            const auto triangles = constrained ? strategy.buildConstrained(verifyCase.sites, verifyCase.constraints) : strategy.build(verifyCase.sites);
+            result.seconds = GetSecondsSince(start);
+            result.triangles = triangles.size();
 
-    return shader;
-}
+            CompareWithOracle(verifyCase.sites, RasterizeTriangleLabels(triangles, size, size, view), oracle, toCover, view, result);
 
+            result.passed = (result.wrongFraction + result.uncoveredFraction) * 100.0 <= options.verifyMaxError
+                && (options.verifyMaxMs <= 0.0 || result.seconds * 1e3 <= options.verifyMaxMs);
 
-GLuint CreateShaderProgram(const std::vector<GLuint>& shaders) {
-    GLuint shaderProgram = glCreateProgram();
+            LOG_DEBUG("verified %s on %s", strategy.name, verifyCase.name.c_str());
 
-    for (const auto shader : shaders) {
-		glAttachShader(shaderProgram, shader);
+            results.push_back(result);
+        }
     }
 
-	glLinkProgram(shaderProgram);
+    printf("%-14s %-20s %8s %10s %12s %10s %12s %6s\n", "case", "strategy", "sites", "triangles", "ms", "wrong %", "uncovered %", "");
 
-	int compiledSuccessfully;
-	char infoLog[512];
+    size_t failures = 0;
 
-	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &compiledSuccessfully);
-	if (!compiledSuccessfully) {
-		glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-		fprintf(stderr, "Program linking failed, info: %s\n", infoLog);
-		exit(1);
-	}
+    for (const auto& result : results) {
+        printf(
+            "%-14s %-20s %8zu %10zu %12.3f %10.4f %12.4f %6s\n",
+            result.caseName.c_str(),
+            result.strategy.c_str(),
+            result.sites,
+            result.triangles,
+            result.seconds * 1e3,
+            result.wrongFraction * 100.0,
+            result.uncoveredFraction * 100.0,
+            result.passed ? "ok" : "FAIL"
+        );
 
-    for (const auto shader : shaders) {
-		glDeleteShader(shader);
+        if (!result.passed) failures++;
     }
 
-    return shaderProgram;
-}
-
+    if (failures > 0) {
+        LOG_ERROR("%zu of %zu verifications failed (at most %g%% bad pixels%s)", failures, results.size(), options.verifyMaxError, options.verifyMaxMs > 0.0 ? " within the time limit" : "");
+    }
 
-void AddPoint(std::vector<Point>& points, const GLfloat x, const GLfloat y) {
-    points.push_back({x, y, CreateRandomColor()});
+    return failures == 0 ? 0 : 1;
 }
 
 
-std::vector<Triangle> CreateTrianglesFromPoints(const std::vector<Point> & points) {
-    std::vector<Triangle> triangles = {};
+// A diagram handed from the build worker to the render loop. Progressive builds publish the cells of
+// a growing prefix of the sites, the last one of a request has the complete set.
+struct DiagramBuild {
+    uint64_t request = 0;
+    std::shared_ptr<const std::vector<Point>> sites;    // shared by the builds of a request until the sites get graph colours
+    RenderMesh mesh;
+    size_t builtSites = 0;
+    size_t totalSites = 0;
+    double seconds = 0.0;
+    bool complete = false;
+};
 
-    for (const Point & point : points) {
-        Triangle triangle1 = {};
 
-        triangle1.triangleData.pd1.x = point.pointData.x - 0.05;
-        triangle1.triangleData.pd1.y = point.pointData.y;
-        triangle1.triangleData.pd2.x = point.pointData.x - 0.1;
-        triangle1.triangleData.pd2.y = point.pointData.y;
-        triangle1.triangleData.pd3.x = point.pointData.x - 0.075;
-        triangle1.triangleData.pd3.y = point.pointData.y - 0.05;
+// Builds run on their own thread so the window keeps drawing the last finished diagram. The result
+// slot is a single atomic pointer: publishing swaps the new build in and drops an unclaimed older
+// one, the render loop swaps it out with nullptr once per frame and never waits.
+struct BuildWorker {
+    std::atomic<uint64_t> requested = 0;
+    std::atomic<bool> running = false;
+    std::atomic<DiagramBuild*> published = nullptr;
+    std::thread thread;
+};
 
-        triangle1.color = CreateRandomColor();
-        triangles.push_back(triangle1);
-    }
 
-    return triangles;
+void PublishDiagramBuild(BuildWorker& worker, std::unique_ptr<DiagramBuild> build) {
+    delete worker.published.exchange(build.release(), std::memory_order_acq_rel);
 }
 
 
-void InitializePointsAttribPointers() {
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Point), (void *)0);
+std::unique_ptr<DiagramBuild> TakeDiagramBuild(BuildWorker& worker) {
+    return std::unique_ptr<DiagramBuild>(worker.published.exchange(nullptr, std::memory_order_acq_rel));
+}
 
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Point), (void *)sizeof(PointData));
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+void RequestDiagramBuild(BuildWorker& worker) {
+    worker.requested.fetch_add(1, std::memory_order_release);
 }
 
 
-std::vector<Point> TransformTrianglesIntoPoints(const std::vector<Triangle> & triangles) {
-    std::vector<Point> output;
+// Prefixes grow by a factor of four, so all partial builds together cost a third of the final one.
+// Spatially sorted sites are only cut at the ends of their insertion rounds, see SortSitesSpatially.
+void RunDiagramBuilds(
+    BuildWorker* worker,
+    const Options* options,
+    std::vector<Point> points,
+    std::vector<size_t> roundEnds,
+    const std::vector<ConstraintPolyline>* constraints
+) {
+    const size_t firstPrefix = 4096;
+    uint64_t built = 0;
+    bool hasGraphColors = false;
 
-    for (const auto & triangle : triangles) {
-        Point point1 = {};
-        Point point2 = {};
-        Point point3 = {};
+    while (worker->running.load(std::memory_order_acquire)) {
+        const uint64_t request = worker->requested.load(std::memory_order_acquire);
 
-        point1.pointData = triangle.triangleData.pd1;
-        point1.color = triangle.color;
+        if (request == built) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            continue;
+        }
 
-        point2.pointData = triangle.triangleData.pd2;
-        point2.color = triangle.color;
+        // Rebuilds re-read the site file, the constraints keep the transform of the first load
+        if (built != 0 && options->sitesFile.has_value()) {
+            std::vector<Point> reloaded = {};
 
-        point3.pointData = triangle.triangleData.pd3;
-        point3.color = triangle.color;
+            if (LoadSites(options->sitesFile->c_str(), options->sitesFormat, options->normalizeSites, reloaded).has_value()) {
+                points = std::move(reloaded);
+                FillMissingSiteColors(points, options->colors);
 
-        output.push_back(point1);
-        output.push_back(point2);
-        output.push_back(point3);
-    }
+                roundEnds.clear();
+                hasGraphColors = false;
 
-    return output;
-}
+                if (options->spatialSort) SortSitesSpatially(points, &roundEnds);
+            }
+            else {
+                LOG_WARNING("keeping the previous sites, %s could not be reloaded", options->sitesFile->c_str());
+            }
+        }
 
+        built = request;
 
-Point GetNearestPoint(const std::vector<Point>& points, const PointData& ref) {
-    assert(points.size() > 0);
+        // The adjacency of all the sites costs about as much as the complete build, so the prefixes
+        // before it keep the hashed palette colours and the complete one brings the graph colours
+        const auto applyGraphColors = [&]() {
+            SiteAdjacency adjacency = {};
 
-    Point best = points[0];
+            if (options->sphere.has_value()) {
+                adjacency = BuildSphericalAdjacency(CreateSphericalDiagram(points));
+            }
+            else if (options->periodic) {
+                const auto diagram = CreatePeriodicDiagram(points);
+                if (diagram.has_value()) adjacency = BuildPeriodicAdjacency(diagram.value());
+            }
+            else if (options->metric != DistanceMetric::Euclidean) {
+                ViewRect view = {};
+                adjacency = BuildLabelMapAdjacency(RasterizeMetricCells(points, options->metric, options->metricWeights, view), points.size());
+            }
+            else {
+                adjacency = BuildTriangulationAdjacency(CreateTriangulation(points, *constraints), points.size());
+            }
 
-    for (const auto& point : points) {
-        const auto curDistance = CalculateDistance(point.pointData, ref);
-        const auto curBestDistance = CalculateDistance(best.pointData, ref);
+            ApplyGraphColoring(points, adjacency, options->colors);
+            hasGraphColors = true;
+        };
 
-        if (FloatsLessOrEqual(curDistance, curBestDistance)) {
-            best = point;
-        }
+        const bool constrained = options->delaunay || options->constraintsFile.has_value();
 
-    }
+        const auto snapPrefix = [&](const size_t size) {
+            const auto end = std::lower_bound(roundEnds.begin(), roundEnds.end(), size);
 
-    return best;
-}
+            return end != roundEnds.end() ? *end : std::min(size, points.size());
+        };
 
+        size_t prefix = snapPrefix(firstPrefix);
 
-std::vector<Triangle> AddColorsToTriangles(const std::vector<TriangleData>& trianglesData, const std::vector<Point>& points) {
-    std::vector<Triangle> output = {};
+        // Every build carries the sites, an unclaimed one may be dropped when the next is published
+        const auto getShownSites = [&]() {
+            return std::make_shared<const std::vector<Point>>(options->sphere.has_value()
+                ? ProjectSphereSites(points, CreateSphereView(options->sphere.value(), options->sphereCenterLon, options->sphereCenterLat))
+                : points);
+        };
 
-    for (const auto& triangleData : trianglesData) {
-        const auto centerOfGravity = CalculateCenterOfGravity({ triangleData.pd1, triangleData.pd2, triangleData.pd3 });
+        auto shownSites = getShownSites();
 
-        const auto point = GetNearestPoint(points, centerOfGravity);
+        // A newer request abandons the remaining prefixes of this one
+        while (worker->running.load(std::memory_order_acquire) && worker->requested.load(std::memory_order_acquire) == request) {
+            PROFILE_SCOPE("diagram build");
 
-        output.push_back({ triangleData, point.color });
-    }
+            const auto start = std::chrono::steady_clock::now();
 
-    return output;
-}
+            if (prefix == points.size() && options->colors.mode == ColorMode::GraphColored && !hasGraphColors) {
+                applyGraphColors();
+                shownSites = getShownSites();
+            }
 
+            const std::vector<Point> sites(points.begin(), points.begin() + prefix);
 
-LineEq GetPerpendicularLineFromCenter(const PointData& firstPoint, const PointData& secondPoint) {
-    const auto lineEq = GetLineEquation(firstPoint, secondPoint);
+            std::vector<Triangle> triangles = {};
 
-    const PointData middlePoint = GetCenterOfLine(firstPoint, secondPoint);
+            if (options->sphere.has_value()) {
+                const auto view = CreateSphereView(options->sphere.value(), options->sphereCenterLon, options->sphereCenterLat);
+                triangles = ProjectSphericalDiagram(CreateSphericalDiagram(sites), sites, view);
+            }
+            else if (options->periodic) {
+                triangles = ExtractPeriodicTriangles(sites);
+            }
+            else if (options->metric != DistanceMetric::Euclidean) {
+                triangles = ExtractMetricTriangles(sites, options->metric, options->metricWeights);
+            }
+            else {
+                triangles = constrained ? ExtractConstrainedTriangles(sites, *constraints) : ExtractTriangles4_5(sites);
+            }
 
-    return GetPerpendicularLine(lineEq, middlePoint);
-}
+            auto build = std::make_unique<DiagramBuild>();
+            build->request = request;
+            build->mesh = BuildRenderMesh(triangles);
 
+            if (options->compactVertices) {
+                CompactRenderMesh(build->mesh);
+            }
+            build->builtSites = prefix;
+            build->totalSites = points.size();
+            build->seconds = GetSecondsSince(start);
+            build->complete = prefix == points.size();
+            build->sites = shownSites;
 
-std::vector<LineEq> GetLinesBetween(const std::vector<Point>& points) {
-    std::vector<LineEq> linesBetween = {};
+            LOG_INFO("built %zu triangles for %zu of %zu sites in %.1f ms", triangles.size(), prefix, points.size(), build->seconds * 1e3);
 
-    for (size_t i = 0; i < points.size(); i++) {
-        const auto& firstPoint = points[i];
+            if (build->complete) {
+                LogTriangles(LogLevel::Trace, "triangle to draw", triangles);
+            }
 
-        for (size_t j = i + 1; j < points.size(); j++) {
-			const auto& secondPoint = points[j];
+            PublishDiagramBuild(*worker, std::move(build));
 
-            linesBetween.push_back(GetPerpendicularLineFromCenter(firstPoint.pointData, secondPoint.pointData));
+            if (prefix == points.size()) break;
+
+            // A prefix of more than half the sites would cost nearly as much as the complete build
+            prefix = prefix * 8 > points.size() ? points.size() : snapPrefix(prefix * 4);
         }
     }
-
-    return linesBetween;
 }
 
 
-std::vector<PointData> GetAllCentersOfLines(const std::vector<Point>& points) {
-    std::vector<PointData> output = {};
-
-    for (size_t i = 0; i < points.size(); i++) {
-        const auto& firstPoint = points[i];
-
-        for (size_t j = 0; j < points.size(); j++) {
-            if (j == i) continue;
+void StartBuildWorker(
+    BuildWorker& worker,
+    const Options& options,
+    const std::vector<Point>& points,
+    const std::vector<size_t>& roundEnds,
+    const std::vector<ConstraintPolyline>& constraints
+) {
+    worker.running.store(true, std::memory_order_release);
+    worker.thread = std::thread(RunDiagramBuilds, &worker, &options, points, roundEnds, &constraints);
+}
 
-			const auto& secondPoint = points[j];
 
-            output.push_back(GetCenterOfLine(firstPoint.pointData, secondPoint.pointData));
-        }
+// Waits for the step in progress, a single triangulation cannot be interrupted
+void StopBuildWorker(BuildWorker& worker) {
+    if (worker.running.exchange(false)) {
+        worker.thread.join();
     }
 
-    return output;
+    TakeDiagramBuild(worker);
 }
 
 
-std::vector<PointData> GetAllIntersectionPoints(const std::vector<LineEq>& lines) {
-    std::vector<PointData> intersectionPoints = {};
+// Daemon mode: a long running process that builds diagrams for other programs over a Unix domain
+// socket, so they pay for neither process startup nor the window. Each request is a header and the
+// sites as float32 x,y pairs:
+//   uint32 magic 'VRNQ', uint32 version 1, uint32 site count, uint32 flags (0)
+// The answer is a header and, attached with SCM_RIGHTS, a shared memory descriptor holding the
+// triangles in the layout of Triangle (three float32 x,y corners and an r,g,b colour):
+//   uint32 magic 'VRNR', int32 status, uint32 triangle count, uint32 bytes per triangle
+// The memory belongs to the connection and is rewritten by its next request, so a client maps and
+// reads it before asking again. Requests are answered in order per connection.
+#ifndef _WIN32
+
+const uint32_t serveRequestMagic = 0x514e5256;     // "VRNQ" little endian
+const uint32_t serveResponseMagic = 0x524e5256;    // "VRNR"
+const uint32_t serveVersion = 1;
+const uint32_t serveMaxSites = 1 << 26;
+
+
+enum class ServeStatus : int32_t {
+    Ok = 0,
+    BadRequest = 1,
+    TooManySites = 2,
+    OutOfMemory = 3,
+    Cancelled = 4       // the daemon is shutting down, no triangles are attached
+};
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        const auto& firstLine = lines[i];
 
-        for (size_t j = i + 1; j < lines.size(); j++) {
-			const auto& secondLine = lines[j];
+struct ServeRequestHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t siteCount;
+    uint32_t flags;
+};
 
-            intersectionPoints.push_back(GetIntersectionPoint(firstLine, secondLine));
-        }
-    }
 
-    return intersectionPoints;
-}
+struct ServeResponseHeader {
+    uint32_t magic;
+    int32_t status;
+    uint32_t triangleCount;
+    uint32_t triangleSize;
+};
 
 
-bool CouldVoronoiTriangleBeAdded(
-    const TriangleData& triangle,
-    const std::vector<Point>& points,
-    const std::vector<PointData>& intersectionPoints,
-    const std::vector<Triangle>& triangles
-) {
-    for (const auto& point : points) {
-        if (IsPointInsideTriangleOrOnTheEdge(triangle, point.pointData)) return false;
-    }
+// Connections submit their requests to a shared DiagramBuilder, so a burst of small requests is
+// spread over the workers instead of each one splitting into tiny ranges
+struct BuildServer {
+    const Options* options = nullptr;
+    DiagramBuilder builder;
+};
 
-    for (const auto& point : intersectionPoints) {
-        if (IsPointInsideTriangleOrOnTheEdge(triangle, point)) return false;
-    }
 
-    for (const auto& curTriangle : triangles) {
-        if (DoTrianglesIntersect(triangle, curTriangle.triangleData)) return false;
-    }
+// Grown on demand and kept for the connection, the client gets a new descriptor of it every answer
+struct SharedTriangles {
+    int descriptor = -1;
+    void* data = nullptr;
+    size_t capacity = 0;
+};
 
-    return true;
-}
 
+std::atomic<bool> serveStopRequested = false;
 
-template <typename T, typename F>
-bool DoesVectorContainElement(
-    const std::vector<T>& elements,
-    const T& element,
-    const F&& areElementsEqual
-) {
-    for (const T& curElement : elements) {
-        if (areElementsEqual(curElement, element)) return true;
-    }
 
-    return false;
-}
+bool ReadFully(const int socket, void* data, size_t size) {
+    char* bytes = (char *)data;
 
+    while (size > 0) {
+        const ssize_t received = recv(socket, bytes, size, 0);
 
-std::vector<PointData> FilterBadIntersectionPoints(
-    const std::vector<PointData>& intersectionPoints,
-    const std::vector<PointData>& points
-) {
-    std::vector<PointData> output = {};
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
 
-    for (const auto& intersectionPoint : intersectionPoints) {
-        if (
-            !DoesVectorContainElement(output, intersectionPoint, PointsDataEqual) &&
-            !DoesVectorContainElement(points, intersectionPoint, PointsDataEqual) &&
-            FloatsBiggerOrEqual(intersectionPoint.x, -1.0f) &&
-            FloatsLessOrEqual(intersectionPoint.x, 1.0f) &&
-            FloatsBiggerOrEqual(intersectionPoint.y, -1.0f) &&
-            FloatsLessOrEqual(intersectionPoint.y, 1.0f)
-        ) {
-            output.push_back(intersectionPoint);
-        }
+        bytes += received;
+        size -= (size_t)received;
     }
 
-    return output;
+    return true;
 }
 
 
-std::vector<PointData> ExtractPointDatas(const std::vector<Point>& points) {
-    std::vector<PointData> output = {};
+bool SendServeResponse(const int socket, const ServeResponseHeader& header, const int descriptor) {
+    iovec part = { (void *)&header, sizeof(header) };
+    msghdr message = {};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
 
-    for (const auto& point : points) {
-        output.push_back(point.pointData);
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+    if (descriptor >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        cmsghdr* attached = CMSG_FIRSTHDR(&message);
+        attached->cmsg_level = SOL_SOCKET;
+        attached->cmsg_type = SCM_RIGHTS;
+        attached->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(attached), &descriptor, sizeof(int));
     }
 
-    return output;
-}
+    ssize_t sent = 0;
 
+    do {
+        sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
 
-std::vector<Triangle> ExtractTriangles1(const std::vector<Point>& points) {
-    const auto triangles = ExtractTriangles(points);
+    return sent == (ssize_t)sizeof(header);
+}
 
-    std::cout << triangles.size() << '\n';
 
-    //PrintTriangles(triangles);
+bool ReserveSharedTriangles(SharedTriangles& shared, const size_t size) {
+    if (shared.descriptor < 0) {
+        static std::atomic<uint32_t> segmentCount = 0;
+        const std::string name = "/voronoiable-" + std::to_string(getpid()) + "-" + std::to_string(segmentCount.fetch_add(1));
 
-    const auto smallerTriangles = ExtractSmallerTriangles(triangles);
+        // Only the descriptor keeps the segment alive, nothing is left behind in /dev/shm
+        shared.descriptor = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
 
-    std::cout << smallerTriangles.size() << '\n';
+        if (shared.descriptor < 0) return false;
 
-    //PrintTrianglesData(smallerTriangles);
+        shm_unlink(name.c_str());
+    }
 
-    // const std::vector<Triangle> trianglesToDraw = CreateTrianglesFromPoints(points);
+    if (size <= shared.capacity) return true;
 
-    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(smallerTriangles, points);
+    const size_t capacity = std::max<size_t>(size, shared.capacity * 2);
 
-    return trianglesToDraw;
-}
+    if (shared.data != nullptr) munmap(shared.data, shared.capacity);
 
+    shared.data = nullptr;
+    shared.capacity = 0;
 
-std::vector<Triangle> ExtractTriangles2(const std::vector<Point>& points) {
-    const auto linesBetween = GetLinesBetween(points);
+    if (ftruncate(shared.descriptor, (off_t)capacity) != 0) return false;
 
-    std::cout << "lines between" << '\n';
+    void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, shared.descriptor, 0);
 
-    for (const auto& line : linesBetween) {
-        std::cout << "a: " << line.a << " b: " << line.b << '\n';
-    }
+    if (data == MAP_FAILED) return false;
 
-    const auto allIntersectionPoints = GetAllIntersectionPoints(linesBetween);
+    shared.data = data;
+    shared.capacity = capacity;
 
-    const auto centersOfLines = GetAllCentersOfLines(points);
+    return true;
+}
 
-    const auto pointsData = ExtractPointDatas(points);
 
-    const auto intersectionPoints = FilterBadIntersectionPoints(allIntersectionPoints, pointsData);
+void ReleaseSharedTriangles(SharedTriangles& shared) {
+    if (shared.data != nullptr) munmap(shared.data, shared.capacity);
+    if (shared.descriptor >= 0) close(shared.descriptor);
 
-    std::cout << "intersection points" << '\n';
+    shared = {};
+}
 
-    for (const auto& p : intersectionPoints) {
-        std::cout << "x: " << p.x << " y: " << p.y << '\n';
-    }
 
-    std::vector<PointData> allPoints = {};
-    allPoints.insert(allPoints.end(), allIntersectionPoints.begin(), allIntersectionPoints.end());
-    allPoints.insert(allPoints.end(), centersOfLines.begin(), centersOfLines.end());
+void ServeConnection(BuildServer* server, const int socket, std::atomic<bool>* closed) {
+    SharedTriangles shared = {};
 
-    std::vector<Triangle> triangles = {};
+    while (true) {
+        ServeRequestHeader request = {};
 
-    for (const auto& point : points) {
-        for (const auto& intersectionPoint : intersectionPoints) {
-			for (const auto& centerPoint : centersOfLines) {
-                const Triangle triangle = {point.pointData, intersectionPoint, centerPoint, point.color};
+        if (!ReadFully(socket, &request, sizeof(request))) break;
 
-                if (CouldVoronoiTriangleBeAdded(triangle.triangleData, points, allPoints, triangles)) {
-                    triangles.push_back(triangle);
-                }
-			}
+        ServeResponseHeader response = { serveResponseMagic, (int32_t)ServeStatus::Ok, 0, (uint32_t)sizeof(Triangle) };
+
+        if (request.magic != serveRequestMagic || request.version != serveVersion || request.flags != 0) {
+            LOG_WARNING("dropping a connection after a malformed request");
+            response.status = (int32_t)ServeStatus::BadRequest;
+            SendServeResponse(socket, response, -1);
+            break;
         }
-    }
 
-    return triangles;
-}
+        if (request.siteCount > serveMaxSites) {
+            LOG_WARNING("dropping a connection after a request for %u sites", request.siteCount);
+            response.status = (int32_t)ServeStatus::TooManySites;
+            SendServeResponse(socket, response, -1);
+            break;
+        }
 
+        std::vector<PointData> coordinates(request.siteCount);
 
-std::pair<PointData, PointData> GetSmallerPair(
-    const std::pair<PointData, PointData>&& firstPair,
-    const std::pair<PointData, PointData>&& secondPair
-) {
-    const auto firstSize = CalculateDistance(firstPair.first, firstPair.second);
-    const auto secondSize = CalculateDistance(secondPair.first, secondPair.second);
+        if (!ReadFully(socket, coordinates.data(), coordinates.size() * sizeof(PointData))) break;
 
-    if (firstSize < secondSize) return firstPair;
+        DiagramJobRequest job = {};
+        job.sites.resize(coordinates.size());
 
-    return secondPair;
-}
+        for (size_t i = 0; i < coordinates.size(); i++) {
+            job.sites[i] = { coordinates[i], { missingColorComponent, missingColorComponent, missingColorComponent } };
+        }
 
+        FillMissingSiteColors(job.sites, server->options->colors);
 
-std::pair<PointData, PointData> GetLongestLine(
-    const std::vector<std::pair<PointData, PointData>>& lines
-) {
-    assert(lines.size() > 0);
+        const DiagramJobResult built = SubmitDiagramJob(server->builder, std::move(job)).result.get();
 
-    GLfloat currentBestDistance = 0.0f;
-    auto currentBest = lines[0];
+        if (built.status != DiagramJobStatus::Done) {
+            LOG_INFO("dropping a connection, its request was cancelled by the shutdown");
+            response.status = (int32_t)ServeStatus::Cancelled;
+            SendServeResponse(socket, response, -1);
+            break;
+        }
 
-    for (const auto& line : lines) {
-        const auto distance = CalculateDistance(line.first, line.second);
+        const size_t bytes = built.triangles.size() * sizeof(Triangle);
 
-        if (distance > currentBestDistance) {
-            currentBestDistance = distance;
-            currentBest = line;
+        if (!ReserveSharedTriangles(shared, std::max<size_t>(bytes, 1))) {
+            LOG_ERROR("could not allocate %zu bytes of shared memory: %s", bytes, strerror(errno));
+            response.status = (int32_t)ServeStatus::OutOfMemory;
+            SendServeResponse(socket, response, -1);
+            continue;
         }
+
+        memcpy(shared.data, built.triangles.data(), bytes);
+        response.triangleCount = (uint32_t)built.triangles.size();
+
+        if (!SendServeResponse(socket, response, shared.descriptor)) break;
     }
 
-    return currentBest;
+    ReleaseSharedTriangles(shared);
+    close(socket);
+    closed->store(true, std::memory_order_release);
 }
 
 
-size_t GetLongestLineIndex(
-    const std::vector<std::pair<PointData, PointData>>& lines
-) {
-    assert(lines.size() > 0);
+struct ServeClient {
+    int socket = -1;
+    std::thread thread;
+    std::unique_ptr<std::atomic<bool>> closed;
+};
 
-    GLfloat currentBestDistance = 0.0f;
-    size_t currentBest = 0;
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        const auto line = lines[i];
+int RunBuildServer(const Options& options) {
+    const std::string& path = options.serveSocket.value();
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
 
-        const auto distance = CalculateDistance(line.first, line.second);
+    if (path.size() >= sizeof(address.sun_path)) {
+        LOG_ERROR("socket path is too long: %s", path.c_str());
+        return 1;
+    }
 
-        if (distance > currentBestDistance) {
-            currentBestDistance = distance;
-            currentBest = i;
-        }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    // A socket file left by a daemon that did not shut down would make bind fail
+    unlink(path.c_str());
+
+    if (listener < 0 || bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        LOG_ERROR("could not listen on %s: %s", path.c_str(), strerror(errno));
+        if (listener >= 0) close(listener);
+        return 1;
     }
 
-    return currentBest;
-}
+    signal(SIGINT, [](int) { serveStopRequested.store(true); });
+    signal(SIGTERM, [](int) { serveStopRequested.store(true); });
 
+    BuildServer server = {};
+    server.options = &options;
+    StartDiagramBuilder(server.builder, GetWorkerCount(), options.serveBatchSites);
 
-std::vector<Triangle> ExtractTriangles3(const std::vector<Point>& points) {
-    const auto bigTriangles = ExtractTriangles(points);
+    std::vector<ServeClient> clients = {};
 
-    std::vector<TriangleData> trianglesData = {};
+    LOG_INFO("serving diagram builds on %s with %u threads", path.c_str(), GetWorkerCount());
 
-    for (const auto& bigTriangle : bigTriangles) {
-        const auto p1p2Center = GetCenterOfLine(bigTriangle.pd1, bigTriangle.pd2);
-        const auto p2p3Center = GetCenterOfLine(bigTriangle.pd2, bigTriangle.pd3);
-        const auto p3p1Center = GetCenterOfLine(bigTriangle.pd3, bigTriangle.pd1);
+    while (!serveStopRequested.load()) {
+        // Wakes up now and then to notice the stop request and to join finished connections
+        pollfd waiting = { listener, POLLIN, 0 };
 
-        trianglesData.push_back({bigTriangle.pd1, p1p2Center, p3p1Center});
+        for (size_t i = 0; i < clients.size();) {
+            if (clients[i].closed->load(std::memory_order_acquire)) {
+                clients[i].thread.join();
+                clients[i] = std::move(clients.back());
+                clients.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
 
-        trianglesData.push_back({bigTriangle.pd2, p1p2Center, p2p3Center});
+        if (poll(&waiting, 1, 100) <= 0) continue;
 
-        trianglesData.push_back({bigTriangle.pd3, p2p3Center, p3p1Center});
+        const int client = accept(listener, nullptr, nullptr);
+
+        if (client < 0) continue;
+
+        clients.push_back({ client, {}, std::make_unique<std::atomic<bool>>(false) });
+        clients.back().thread = std::thread(ServeConnection, &server, client, clients.back().closed.get());
     }
 
-    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(trianglesData, points);
+    LOG_INFO("stopping the build server");
 
-    return trianglesToDraw;
-}
+    close(listener);
+    unlink(path.c_str());
 
+    // Jobs in flight still finish, their connections then see the shutdown and end
+    for (auto& client : clients) {
+        shutdown(client.socket, SHUT_RDWR);
+        client.thread.join();
+    }
 
-std::vector<TriangleData> PerformExtractTriangles4MumboJumbo(const std::vector<TriangleData>& bigTriangles) {
-    std::vector<TriangleData> trianglesData = {};
+    StopDiagramBuilder(server.builder);
 
-    for (const auto& bigTriangle : bigTriangles) {
-        const auto p1p2Center = GetCenterOfLine(bigTriangle.pd1, bigTriangle.pd2);
-        const auto p2p3Center = GetCenterOfLine(bigTriangle.pd2, bigTriangle.pd3);
-        const auto p3p1Center = GetCenterOfLine(bigTriangle.pd3, bigTriangle.pd1);
+    return 0;
+}
 
-        const auto p1p2Line = GetLineEquation(bigTriangle.pd1, bigTriangle.pd2);
-        const auto p2p3Line = GetLineEquation(bigTriangle.pd2, bigTriangle.pd3);
-        const auto p3p1Line = GetLineEquation(bigTriangle.pd3, bigTriangle.pd1);
+#else
 
-        const auto p1p2PerpendicularLine = GetPerpendicularLineFromCenter(bigTriangle.pd1, bigTriangle.pd2);
-        const auto p2p3PerpendicularLine = GetPerpendicularLineFromCenter(bigTriangle.pd2, bigTriangle.pd3);
-        const auto p3p1PerpendicularLine = GetPerpendicularLineFromCenter(bigTriangle.pd3, bigTriangle.pd1);
+int RunBuildServer(const Options&) {
+    LOG_ERROR("--serve needs Unix domain sockets and is not available on Windows");
+    return 1;
+}
 
-        const auto p1IntersectionPoint = GetIntersectionPoint(p1p2PerpendicularLine, p3p1PerpendicularLine);
-        const auto p2IntersectionPoint = GetIntersectionPoint(p1p2PerpendicularLine, p2p3PerpendicularLine);
-        const auto p3IntersectionPoint = GetIntersectionPoint(p2p3PerpendicularLine, p3p1PerpendicularLine);
+#endif
 
-        /*
-        assert(PointsDataEqual(p1IntersectionPoint, p2IntersectionPoint));
-        assert(PointsDataEqual(p2IntersectionPoint, p3IntersectionPoint));
-        assert(PointsDataEqual(p3IntersectionPoint, p1IntersectionPoint));
-        */
 
-        const auto triangleCircleCenter = p1IntersectionPoint;
+int main(int argc, char ** argv)
+{
+    const auto launchTime = std::chrono::steady_clock::now();
+    const auto parsedOptions = ParseOptions(argc, argv);
 
-        // variant 1 -> acute triangle
-        // variant 2 -> right triangle triangle
-        // variant 3 -> obtuse triangle
-        if (IsPointInsideTriangle(bigTriangle, triangleCircleCenter)) {
-			trianglesData.push_back({bigTriangle.pd1, p1p2Center, triangleCircleCenter});
-			trianglesData.push_back({bigTriangle.pd1, triangleCircleCenter, p3p1Center});
+    if (!parsedOptions.has_value()) {
+        return 1;
+    }
 
-			trianglesData.push_back({bigTriangle.pd2, p1p2Center, triangleCircleCenter});
-			trianglesData.push_back({bigTriangle.pd2, triangleCircleCenter, p2p3Center});
+    const Options& options = parsedOptions.value();
 
-			trianglesData.push_back({bigTriangle.pd3, p2p3Center, triangleCircleCenter});
-			trianglesData.push_back({bigTriangle.pd3, triangleCircleCenter, p3p1Center});
-        }
-        else if (IsPointInsideTriangleOrOnTheEdge(bigTriangle, triangleCircleCenter)) {
-            const std::vector<std::pair<PointData, PointData>> lines = {
-                {bigTriangle.pd1, bigTriangle.pd2},
-                {bigTriangle.pd2, bigTriangle.pd3},
-                {bigTriangle.pd3, bigTriangle.pd1}
-            };
+    PROFILE_REPORT_ON_EXIT(options.traceFile.c_str());
 
-            const auto longestLineIndex = GetLongestLineIndex(lines);
+    if (options.benchmark) {
+        return RunBenchmarks(options);
+    }
 
-            switch (longestLineIndex) {
-            case 0:
-                trianglesData.push_back({bigTriangle.pd3, p2p3Center, triangleCircleCenter});
-                trianglesData.push_back({bigTriangle.pd3, p3p1Center, triangleCircleCenter});
+    if (options.verify) {
+        return RunVerification(options);
+    }
 
-                trianglesData.push_back({bigTriangle.pd1, p3p1Center, triangleCircleCenter});
-                trianglesData.push_back({bigTriangle.pd2, p2p3Center, triangleCircleCenter});
-                break;
-            case 1:
-                trianglesData.push_back({bigTriangle.pd1, p1p2Center, triangleCircleCenter});
-                trianglesData.push_back({bigTriangle.pd1, p3p1Center, triangleCircleCenter});
+    if (options.serveSocket.has_value()) {
+        return RunBuildServer(options);
+    }
 
-                trianglesData.push_back({bigTriangle.pd3, p3p1Center, triangleCircleCenter});
-                trianglesData.push_back({bigTriangle.pd2, p1p2Center, triangleCircleCenter});
-                break;
-            case 2:
-                trianglesData.push_back({bigTriangle.pd2, p1p2Center, triangleCircleCenter});
-                trianglesData.push_back({bigTriangle.pd2, p2p3Center, triangleCircleCenter});
+    std::vector<Point> points = {};
+    std::vector<GLfloat> siteValues = {};
+    SiteTransform siteTransform = {};
 
-                trianglesData.push_back({bigTriangle.pd1, p1p2Center, triangleCircleCenter});
-                trianglesData.push_back({bigTriangle.pd3, p2p3Center, triangleCircleCenter});
-                break;
-            default:
-                exit(1);
-            }
+    if (options.sitesFile.has_value()) {
+        const auto stats = LoadSites(options.sitesFile->c_str(), options.sitesFormat, options.normalizeSites, points, &siteValues);
+
+        if (!stats.has_value()) {
+            return 1;
         }
-        else {
-            const std::vector<std::pair<PointData, PointData>> lines = {
-                {bigTriangle.pd1, bigTriangle.pd2},
-                {bigTriangle.pd2, bigTriangle.pd3},
-                {bigTriangle.pd3, bigTriangle.pd1}
-            };
 
-            const auto longestLineIndex = GetLongestLineIndex(lines);
+        siteTransform = stats->transform;
+    }
+    else if (options.kineticSites != 0) {
+        points = CreateBenchmarkSites(options.kineticSites, (uint32_t)options.colors.seed);
+    }
+    else if (options.sphere.has_value()) {
+        points = CreateSphereSites(options.sphereSites, options.colors.seed);
+    }
+    else {
+        //AddPoint(points, -0.9, -0.9);
+        AddPoint(points, -0.7, -0.9);
+        //AddPoint(points, -0.9, -0.8);
+        AddPoint(points, -0.7, -0.7);
+        //AddPoint(points, -0.5, -0.7);
+        //AddPoint(points, -0.7, -0.5);
+        AddPoint(points, -0.6, -0.5);
+        //AddPoint(points, -0.9, -0.5);
+        AddPoint(points, -0.5, -0.8);
+    }
 
-            switch (longestLineIndex) {
-            case 0:
-                const auto p1p2IntersectionWithp2p3CenterLine = GetIntersectionPoint(p1p2Line, p2p3PerpendicularLine);
-                const auto p1p2IntersectionWithp3p1CenterLine = GetIntersectionPoint(p1p2Line, p3p1PerpendicularLine);
+    std::vector<ConstraintPolyline> constraints = {};
 
-                trianglesData.push_back({ bigTriangle.pd1, p1p2IntersectionWithp3p1CenterLine, p3p1Center });
-                trianglesData.push_back({ bigTriangle.pd2, p1p2IntersectionWithp2p3CenterLine, p2p3Center });
+    if (options.constraintsFile.has_value()) {
+        auto loadedConstraints = LoadConstraints(options.constraintsFile->c_str(), siteTransform);
 
-                trianglesData.push_back({bigTriangle.pd3, p2p3Center, p1p2IntersectionWithp2p3CenterLine});
-                trianglesData.push_back({bigTriangle.pd3, p3p1Center, p1p2IntersectionWithp3p1CenterLine});
+        if (!loadedConstraints.has_value()) {
+            return 1;
+        }
 
-                trianglesData.push_back({bigTriangle.pd3, p1p2IntersectionWithp2p3CenterLine, p1p2IntersectionWithp3p1CenterLine});
-                break;
-            case 1:
-                const auto p2p3IntersectionWithp1p2CenterLine = GetIntersectionPoint(p2p3Line, p1p2PerpendicularLine);
-                const auto p2p3IntersectionWithp3p1CenterLine = GetIntersectionPoint(p2p3Line, p3p1PerpendicularLine);
+        constraints = std::move(loadedConstraints.value());
+    }
 
-                trianglesData.push_back({ bigTriangle.pd2, p2p3IntersectionWithp1p2CenterLine, p1p2Center });
-                trianglesData.push_back({ bigTriangle.pd3, p2p3IntersectionWithp3p1CenterLine, p3p1Center });
+    if (options.kineticSites != 0 && (!options.normalizeSites || !constraints.empty())) {
+        LOG_ERROR("--kinetic needs sites inside [-1,1]² and cannot be combined with --constraints or --no-normalize");
+        return 1;
+    }
 
-                trianglesData.push_back({bigTriangle.pd1, p1p2Center, p2p3IntersectionWithp1p2CenterLine});
-                trianglesData.push_back({bigTriangle.pd1, p3p1Center, p2p3IntersectionWithp3p1CenterLine});
+    if (options.sphere.has_value() && (options.kineticSites != 0 || options.delaunay || !constraints.empty() || options.rasterWidth != 0 || options.interpolateWidth != 0)) {
+        LOG_ERROR("--sphere cannot be combined with --kinetic, --delaunay, --constraints, --raster or --interpolate");
+        return 1;
+    }
 
-                trianglesData.push_back({bigTriangle.pd1, p2p3IntersectionWithp1p2CenterLine, p2p3IntersectionWithp3p1CenterLine});
-                break;
-            case 2:
-                const auto p3p1IntersectionWithp1p2CenterLine = GetIntersectionPoint(p3p1Line, p1p2PerpendicularLine);
-                const auto p3p1IntersectionWithp2p3CenterLine = GetIntersectionPoint(p3p1Line, p2p3PerpendicularLine);
+    if (options.periodic && (options.sphere.has_value() || options.kineticSites != 0 || options.delaunay || !constraints.empty() || options.interpolateWidth != 0)) {
+        LOG_ERROR("--periodic cannot be combined with --sphere, --kinetic, --delaunay, --constraints or --interpolate");
+        return 1;
+    }
 
-                trianglesData.push_back({ bigTriangle.pd1, p3p1IntersectionWithp1p2CenterLine, p1p2Center });
-                trianglesData.push_back({ bigTriangle.pd3, p3p1IntersectionWithp2p3CenterLine, p2p3Center });
+    if (options.orderK > 1 && (options.rasterWidth == 0 || options.periodic)) {
+        LOG_ERROR("--order-k needs --raster and cannot be combined with --periodic");
+        return 1;
+    }
 
-                trianglesData.push_back({bigTriangle.pd2, p1p2Center, p3p1IntersectionWithp1p2CenterLine});
-                trianglesData.push_back({bigTriangle.pd2, p2p3Center, p3p1IntersectionWithp2p3CenterLine});
+    const bool otherMetric = options.metric != DistanceMetric::Euclidean;
 
-                trianglesData.push_back({bigTriangle.pd2, p3p1IntersectionWithp1p2CenterLine, p3p1IntersectionWithp2p3CenterLine});
-                break;
-            default:
-                exit(1);
-            }
-        }
+    if (otherMetric && (options.sphere.has_value() || options.periodic || options.kineticSites != 0 || options.delaunay || !constraints.empty() || options.interpolateWidth != 0)) {
+        LOG_ERROR("--metric cannot be combined with --sphere, --periodic, --kinetic, --delaunay, --constraints or --interpolate");
+        return 1;
     }
 
-    return trianglesData;
-}
+    FillMissingSiteColors(points, options.colors);
 
+    // After the colours, which follow the input ids
+    std::vector<uint32_t> siteIds = {};
+    std::vector<size_t> roundEnds = {};
 
-std::vector<Triangle> ExtractTriangles4(const std::vector<Point>& points) {
-    const auto bigTriangles = ExtractTriangles(points);
+    if (options.spatialSort) {
+        siteIds = SortSitesSpatially(points, &roundEnds);
 
-    const auto trianglesData = PerformExtractTriangles4MumboJumbo(bigTriangles);
+        if (siteValues.size() == siteIds.size()) {
+            std::vector<GLfloat> sortedValues(siteIds.size());
 
-    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(trianglesData, points);
+            for (size_t i = 0; i < siteIds.size(); i++) sortedValues[i] = siteValues[siteIds[i]];
 
-    return trianglesToDraw;
-}
+            siteValues.swap(sortedValues);
+        }
+    }
 
+    // The window colours the graph on its build thread instead
+    if (options.colors.mode == ColorMode::GraphColored && (options.rasterWidth != 0 || options.kineticSites != 0)) {
+        const auto diagram = options.periodic ? CreatePeriodicDiagram(points) : std::nullopt;
+        SiteAdjacency adjacency = {};
 
-std::vector<Triangle> ExtractTriangles4_5(const std::vector<Point>& points) {
-    const auto bigTriangles = ExtractTriangles(points);
+        if (diagram.has_value()) {
+            adjacency = BuildPeriodicAdjacency(diagram.value());
+        }
+        else if (otherMetric) {
+            ViewRect view = {};
+            adjacency = BuildLabelMapAdjacency(RasterizeMetricCells(points, options.metric, options.metricWeights, view), points.size());
+        }
+        else {
+            adjacency = BuildTriangulationAdjacency(CreateTriangulation(points, {}), points.size());
+        }
 
-    std::vector<TriangleData> smallerTriangles = {};
+        ApplyGraphColoring(points, adjacency, options.colors);
+    }
+
+    if (options.rasterWidth != 0 && options.orderK > 1) {
+        const auto start = std::chrono::steady_clock::now();
+        const SiteGrid grid = BuildSiteGrid(points);
+        const auto map = WithDistanceMetric(options.metric, options.metricWeights, [&](const auto& metric) {
+            return RasterizeOrderKRegions(grid, options.rasterWidth, options.rasterHeight, { -1.0f, -1.0f, 1.0f, 1.0f }, options.orderK, metric);
+        });
 
-    for (const auto& triangle : bigTriangles) {
-        const LineEq firstLine = GetPerpendicularLineFromCenter(triangle.pd1, triangle.pd2);
-        const LineEq secondLine = GetPerpendicularLineFromCenter(triangle.pd1, triangle.pd3);
+        LOG_INFO(
+            "rasterized %zux%zu order-%zu labels of %zu sites into %zu regions in %.1f ms",
+            map.width,
+            map.height,
+            map.k,
+            points.size(),
+            map.regionSites.size() / map.k,
+            GetSecondsSince(start) * 1e3
+        );
+
+        return WriteOrderKMap(options.rasterFile.c_str(), map, points, siteIds) ? 0 : 1;
+    }
 
-        // All three symmetrical lines in a triangle should intersect in one point
+    if (options.rasterWidth != 0) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto map = options.periodic
+            ? RasterizePeriodicSites(points, options.rasterWidth, options.rasterHeight)
+            : WithDistanceMetric(options.metric, options.metricWeights, [&](const auto& metric) {
+                return RasterizeNearestSites(points, BuildSiteGrid(points), options.rasterWidth, options.rasterHeight, { -1.0f, -1.0f, 1.0f, 1.0f }, metric);
+            });
 
-        const auto intersectionPoint = GetIntersectionPoint(firstLine, secondLine);
+        LOG_INFO("rasterized %zux%zu labels of %zu sites in %.1f ms", map.width, map.height, points.size(), GetSecondsSince(start) * 1e3);
 
-        smallerTriangles.push_back({ triangle.pd1, triangle.pd2, intersectionPoint });
-        smallerTriangles.push_back({ triangle.pd1, intersectionPoint, triangle.pd3 });
-        smallerTriangles.push_back({ intersectionPoint, triangle.pd2, triangle.pd3 });
+        return WriteLabelMap(options.rasterFile.c_str(), map, points, siteIds) ? 0 : 1;
     }
 
-    const auto trianglesData = PerformExtractTriangles4MumboJumbo(smallerTriangles);
+    if (options.interpolateWidth != 0) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto interpolator = CreateNaturalNeighbourInterpolator(points, siteValues);
+        const auto samples = InterpolateGrid(interpolator, options.interpolateWidth, options.interpolateHeight, { -1.0f, -1.0f, 1.0f, 1.0f }, options.interpolationMethod);
 
-    const std::vector<Triangle> trianglesToDraw = AddColorsToTriangles(trianglesData, points);
+        LOG_INFO("interpolated %zux%zu samples of %zu sites in %.1f ms", options.interpolateWidth, options.interpolateHeight, points.size(), GetSecondsSince(start) * 1e3);
 
-    return trianglesToDraw;
-}
+        return WriteValueGrid(options.interpolateFile.c_str(), options.interpolateWidth, options.interpolateHeight, samples) ? 0 : 1;
+    }
 
+    // Everything before is loading sites and building, the window part of the startup begins here
+    const auto windowStart = std::chrono::steady_clock::now();
 
-int main()
-{
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+    if (options.offscreen) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    }
+
     GLFWwindow* window = glfwCreateWindow(800, 600, "Voronoiable", nullptr, nullptr);
     if (!window)
     {
-        std::cout << "Failed to create the GLFW window\n";
+        LOG_ERROR("Failed to create the GLFW window");
         glfwTerminate();
+        return -1;
     }
 
     glfwMakeContextCurrent(window);
 
+    if (options.offscreen) {
+        glfwSwapInterval(0);
+    }
+
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     {
-        std::cout << "Failed to initialize GLAD\n";
+        LOG_ERROR("Failed to initialize GLAD");
         return -1;
     }
 
@@ -1079,75 +10524,245 @@ int main()
         glViewport(0, 0, width, height);
     });
 
+    ViewerState viewerState = {};
+
+    glfwSetWindowUserPointer(window, &viewerState);
+    glfwSetScrollCallback(window, [](GLFWwindow* window, double, double yOffset)
+    {
+        static_cast<ViewerState*>(glfwGetWindowUserPointer(window))->pendingScroll += yOffset;
+    });
+
     glDisable(GL_PROGRAM_POINT_SIZE);
 
     glPointSize(10);
 
-    std::vector<Point> points = {};
+    //const auto trianglesToDraw = ExtractVoronoiTriangles(points);
 
-    //AddPoint(points, -0.9, -0.9);
-    AddPoint(points, -0.7, -0.9);
-    //AddPoint(points, -0.9, -0.8);
-    AddPoint(points, -0.7, -0.7);
-    //AddPoint(points, -0.5, -0.7);
-    //AddPoint(points, -0.7, -0.5);
-    AddPoint(points, -0.6, -0.5);
-    //AddPoint(points, -0.9, -0.5);
-    AddPoint(points, -0.5, -0.8);
+    const bool kinetic = options.kineticSites != 0;
 
-    //const auto trianglesToDraw = ExtractVoronoiTriangles(points);
+    const double windowSeconds = GetSecondsSince(windowStart);
 
-    const auto trianglesToDraw = ExtractTriangles4_5(points);
+    ShaderCache shaderCache = CreateShaderCache(options.shaderDirectory, options.shaderCacheDirectory);
 
-    //PrintTriangles(trianglesToDraw);
+    GLuint pointsShaderProgram = GetShaderProgram(shaderCache, { "shader.vert", "shader.frag", {} });
 
-    const auto test = CalculateCenterOfGravity({ {3, 5}, {4, 1}, {1, 0} });
+	glUseProgram(pointsShaderProgram);
 
-    std::cout << "test123 x: " << test.x << " y: " << test.y << '\n';
+    const GLint viewCenterLocation = glGetUniformLocation(pointsShaderProgram, "viewCenter");
+    const GLint viewScaleLocation = glGetUniformLocation(pointsShaderProgram, "viewScale");
 
-    GLuint pointsVertexShader = CompileShader("shaders/shader.vert", GL_VERTEX_SHADER);
-    GLuint pointsFragmentShader = CompileShader("shaders/shader.frag", GL_FRAGMENT_SHADER);
+    // The cells arrive from the build worker, the kinetic ones are rewritten every frame instead
+    BuildWorker buildWorker = {};
+    std::shared_ptr<const std::vector<Point>> shownSites = nullptr;
+    RenderMesh mesh = {};
+    bool diagramComplete = kinetic;
 
-    GLuint pointsShaderProgram = CreateShaderProgram({pointsVertexShader, pointsFragmentShader});
+    if (!kinetic) {
+        StartBuildWorker(buildWorker, options, points, roundEnds, constraints);
+        RequestDiagramBuild(buildWorker);
 
-	glUseProgram(pointsShaderProgram);
+        // The worker keeps the longitudes and latitudes, the window only draws the sites as markers
+        if (options.sphere.has_value()) {
+            points = ProjectSphereSites(points, CreateSphereView(options.sphere.value(), options.sphereCenterLon, options.sphereCenterLat));
+        }
+    }
 
-    GLuint vbo;
+    KineticDiagram kineticDiagram = {};
+    std::vector<Point> kineticVertices = {};
+
+    if (kinetic) {
+        kineticDiagram = CreateKineticDiagram(points, CreateSiteVelocities(points.size(), options.kineticSpeed, options.colors.seed));
+        WriteKineticVertices(kineticDiagram, points, kineticVertices);
+    }
 
-    glGenBuffers(1, &vbo);
+    // The buffers only change when a build arrives or in kinetic mode, the camera only changes uniforms and the drawn ranges
+    GLuint vbos[2];
+    GLuint vaos[2];
 
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glGenBuffers(2, vbos);
+    glGenVertexArrays(2, vaos);
 
-    GLuint vao;
+    {
+        PROFILE_SCOPE("buffer upload");
 
-    glGenVertexArrays(1, &vao);
+        glBindVertexArray(vaos[0]);
+        glBindBuffer(GL_ARRAY_BUFFER, vbos[0]);
+        glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(Point), points.data(), GL_STATIC_DRAW);
+        InitializePointsAttribPointers();
 
-    glBindVertexArray(vao);
+        glBindVertexArray(vaos[1]);
+        glBindBuffer(GL_ARRAY_BUFFER, vbos[1]);
 
-	InitializePointsAttribPointers();
+        if (kinetic) {
+            glBufferData(GL_ARRAY_BUFFER, kineticVertices.size() * sizeof(Point), kineticVertices.data(), GL_DYNAMIC_DRAW);
+            InitializePointsAttribPointers();
+        }
+        else if (options.compactVertices) {
+            InitializeCompactPointsAttribPointers();
+        }
+        else {
+            InitializePointsAttribPointers();
+        }
+    }
 
-	const auto trianglesPoints = TransformTrianglesIntoPoints(trianglesToDraw);
+    std::vector<GLint> drawFirsts = {};
+    std::vector<GLsizei> drawCounts = {};
+    FrameStats frameStats = {};
+    bool screenshotWritten = false;
+    size_t lastLevel = mesh.levels.size();
 
+    auto lastFrame = std::chrono::steady_clock::now();
 
     while (!glfwWindowShouldClose(window))
     {
-        ProcessInput(window);
+        PROFILE_SCOPE("frame");
+
+        const auto frameStart = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(frameStart - lastFrame).count();
+        lastFrame = frameStart;
+
+        ProcessInput(window, viewerState, elapsed);
+
+        if (viewerState.rebuildRequested) {
+            viewerState.rebuildRequested = false;
+
+            if (!kinetic) RequestDiagramBuild(buildWorker);
+        }
+
+        if (auto build = TakeDiagramBuild(buildWorker)) {
+            PROFILE_SCOPE("buffer upload");
+
+            if (build->sites != shownSites) {
+                shownSites = build->sites;
+                points = *shownSites;
+
+                glBindBuffer(GL_ARRAY_BUFFER, vbos[0]);
+                glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(Point), points.data(), GL_STATIC_DRAW);
+            }
+
+            mesh = std::move(build->mesh);
+            lastLevel = mesh.levels.size();
+            diagramComplete = build->complete;
+
+            glBindBuffer(GL_ARRAY_BUFFER, vbos[1]);
+            UploadRenderMesh(mesh);
+
+            LOG_DEBUG("showing the cells of %zu of %zu sites after %zu frames", build->builtSites, build->totalSites, frameStats.count);
+        }
+
+        if (options.zoomSweep && options.frameLimit > 1) {
+            // Zoom from the whole diagram down to 1/1024 of its width and back out
+            const double progress = (double)frameStats.count / (options.frameLimit - 1);
+            viewerState.camera.centerX = 0.25f;
+            viewerState.camera.centerY = 0.25f;
+            viewerState.camera.zoom = (GLfloat)std::pow(1024.0, 1.0 - std::fabs(progress * 2.0 - 1.0));
+        }
+
+        const Camera& camera = viewerState.camera;
+        const ViewRect view = GetVisibleRect(camera);
+
+        glUniform2f(viewCenterLocation, camera.centerX, camera.centerY);
+        glUniform2f(viewScaleLocation, camera.zoom, camera.zoom);
 
         glClearColor(1.00f, 0.49f, 0.04f, 1.00f);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(Point), points.data(), GL_DYNAMIC_DRAW);
+        if (kinetic) {
+            // Fixed steps keep offscreen runs reproducible, long stalls do not turn into one huge jump
+            const double step = options.offscreen || options.frameLimit != 0 ? 1.0 / 60.0 : std::min(elapsed, 0.1);
+
+            AdvanceKineticDiagram(kineticDiagram, kineticDiagram.time + step);
+            WriteKineticVertices(kineticDiagram, points, kineticVertices);
+
+            glBindVertexArray(vaos[1]);
+            glBindBuffer(GL_ARRAY_BUFFER, vbos[1]);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, kineticVertices.size() * sizeof(Point), kineticVertices.data());
+            glDrawArrays(GL_TRIANGLES, 0, kineticVertices.size());
+        }
+        else {
+            // Site markers are hidden by their cells anyway once the diagram is big, before the first
+            // build arrives they are all there is to see
+            if (points.size() <= options.triangleBudget || mesh.levels.empty()) {
+                glBindVertexArray(vaos[0]);
+                glDrawArrays(GL_POINTS, 0, points.size());
+            }
+
+            if (!mesh.levels.empty()) {
+                const size_t level = SelectMeshLevel(mesh, view, options.triangleBudget);
+
+                if (level != lastLevel) {
+                    LOG_DEBUG("drawing mesh level %zu at zoom %g", level, camera.zoom);
+                    lastLevel = level;
+                }
+
+                if (!mesh.compactVertices.empty()) {
+                    GLfloat center[2];
+                    GLfloat scale[2];
+                    GetCompactViewUniforms(mesh, camera, center, scale);
 
-        glDrawArrays(GL_POINTS, 0, points.size());
+                    glUniform2f(viewCenterLocation, center[0], center[1]);
+                    glUniform2f(viewScaleLocation, scale[0], scale[1]);
+                }
+
+                glBindVertexArray(vaos[1]);
+                DrawMeshLevel(mesh.levels[level], view, drawFirsts, drawCounts);
+            }
+        }
 
-        glBufferData(GL_ARRAY_BUFFER, trianglesPoints.size() * sizeof(Point), trianglesPoints.data(), GL_DYNAMIC_DRAW);
+        // Counted runs keep going until the complete diagram has been on screen
+        const bool lastFrameReached = options.frameLimit != 0 && diagramComplete && frameStats.count + 1 >= options.frameLimit;
 
-        glDrawArrays(GL_TRIANGLES, 0, trianglesPoints.size());
+        // Counted runs capture their last frame, open ended ones the first with the complete diagram
+        const bool screenshotDue = options.frameLimit != 0 ? lastFrameReached : diagramComplete && !screenshotWritten;
+
+        if (options.screenshotFile.has_value() && screenshotDue) {
+            int width = 0;
+            int height = 0;
+            glfwGetFramebufferSize(window, &width, &height);
+            WriteScreenshot(options.screenshotFile->c_str(), width, height);
+            screenshotWritten = true;
+        }
 
         glfwSwapBuffers(window);
         glfwPollEvents();
+
+        AddFrameTime(frameStats, GetSecondsSince(frameStart));
+
+        if (frameStats.count == 1) {
+            LOG_INFO(
+                "first frame %.1f ms after launch: window %.1f ms, %zu shader programs %.1f ms (%zu from the binary cache)",
+                GetSecondsSince(launchTime) * 1e3,
+                windowSeconds * 1e3,
+                shaderCache.compiledPrograms + shaderCache.loadedPrograms,
+                shaderCache.seconds * 1e3,
+                shaderCache.loadedPrograms
+            );
+        }
+
+        if (lastFrameReached) {
+            glfwSetWindowShouldClose(window, true);
+        }
+    }
+
+    LogFrameStats(frameStats);
+
+    if (kinetic && frameStats.count != 0) {
+        LOG_INFO(
+            "kinetic: %zu events (%.1f per frame), %zu flips, %zu bounces",
+            kineticDiagram.processedEvents,
+            (double)kineticDiagram.processedEvents / frameStats.count,
+            kineticDiagram.flips,
+            kineticDiagram.bounces
+        );
     }
 
+    StopBuildWorker(buildWorker);
+
+    glDeleteVertexArrays(2, vaos);
+    glDeleteBuffers(2, vbos);
+    DeleteShaderCache(shaderCache);
+
     glfwTerminate();
+
     return 0;
 }
\ No newline at end of file